@@ -0,0 +1,1037 @@
+/*============================================================================
+
+    cache.cpp
+
+    Render cache for Sonic/C++ programs.
+
+    When run with --cache, each wave assignment first builds a key from
+    a hash of its generated code, the identity of every wave it reads,
+    and the values of the variables it reads.  If the cache directory
+    holds a result for that key, the result is copied into place instead
+    of running the assignment's loop; otherwise the loop runs and its
+    result is added to the cache.  The least recently used results are
+    deleted when the directory grows past --cache-limit megabytes.
+
+    Each result is one file, "<hash>.sc", holding the full key text
+    followed by the wave's float data, so that a hash collision is
+    noticed instead of returning the wrong data.
+
+============================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include "sonic.h"
+
+
+static const char CacheEntryTag[] = "sonic-cache-entry";
+static const char CacheEntryExtension[] = ".sc";
+
+
+struct SonicCacheKey::Source
+{
+    SonicWave       *wave;
+    unsigned long   *block;     // fingerprint of each SONIC_SILENCE_BLOCK frames, or NULL
+    long            numBlocks;
+};
+
+
+SonicCacheKey::SonicCacheKey(const char *_codeHash):
+    text(0),
+    length(0),
+    capacity(0),
+    valid(Sonic_CacheDirectory != 0),
+    reuseAllowed(false),
+    reuseStateful(false),
+    numSources(0),
+    sourceList(0),
+    numReads(0)
+{
+    hash[0] = '\0';
+    sprintf(codeHash, "%.16s", _codeHash);
+    append("sonic-cache 1\ncode ");
+    append(codeHash);
+    append("\n");
+}
+
+
+SonicCacheKey::~SonicCacheKey()
+{
+    for (int k=0; k < numSources; ++k)
+        free(sourceList[k].block);
+
+    free(sourceList);
+    sourceList = 0;
+    free(text);
+    text = 0;
+}
+
+
+void SonicCacheKey::append(const char *s)
+{
+    if (!valid)
+        return;
+
+    size_t n = strlen(s);
+    if (length + n + 1 > capacity)
+    {
+        size_t newCapacity = 2*capacity + n + 256;
+        char *newText = (char *) realloc(text, newCapacity);
+        if (!newText)
+        {
+            valid = false;      // no cache is better than no program
+            return;
+        }
+
+        text = newText;
+        capacity = newCapacity;
+    }
+
+    memcpy(text + length, s, n + 1);
+    length += n;
+}
+
+
+void SonicCacheKey::addInteger(const char *name, long value)
+{
+    char line [128];
+    sprintf(line, "integer %.64s %ld\n", name, value);
+    append(line);
+}
+
+
+void SonicCacheKey::addReal(const char *name, double value)
+{
+    char line [128];
+    sprintf(line, "real %.64s %.17g\n", name, value);
+    append(line);
+}
+
+
+void SonicCacheKey::addBoolean(const char *name, int value)
+{
+    char line [128];
+    sprintf(line, "boolean %.64s %d\n", name, value);
+    append(line);
+}
+
+
+void SonicCacheKey::addArray(const char *name, const void *data, size_t numBytes)
+{
+    char line [128];
+    sprintf(line, "array %.64s ", name);
+    append(line);
+
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t k=0; k < numBytes; ++k)
+    {
+        sprintf(line, "%02x", unsigned(p[k]));
+        append(line);
+    }
+
+    append("\n");
+}
+
+
+void SonicCacheKey::addWave(SonicWave &wave)
+{
+    if (!valid)
+        return;
+
+    const char *identity = wave.queryCacheIdentity();
+    if (!identity)
+    {
+        valid = false;      // its data did not come from anything we can name
+        return;
+    }
+
+    append("wave ");
+    append(wave.queryVarName());
+    append(" ");
+    append(identity);
+    append("\n");
+}
+
+
+static void HashText(const char *text, char hash[])
+{
+    // Two 32-bit FNV-1a hashes with different starting points; the full
+    // key is stored with the result, so this only has to spread keys out.
+
+    unsigned long a = 2166136261UL;
+    unsigned long b = 0x84222325UL;
+    for (; *text; ++text)
+    {
+        const unsigned char x = (unsigned char) *text;
+        a = ((a ^ x) * 16777619UL) & 0xffffffffUL;
+        b = ((b ^ x) * 16777619UL) & 0xffffffffUL;
+        b ^= (b >> 15);
+    }
+
+    sprintf(hash, "%08lx%08lx", a, b);
+}
+
+
+const char *SonicCacheKey::queryHash() const
+{
+    if (!hash[0] && text)
+        HashText(text, hash);
+
+    return hash;
+}
+
+
+static bool MakeEntryFilename(const SonicCacheKey &key, char *path, size_t size)
+{
+    if (strlen(Sonic_CacheDirectory) + 32 > size)
+        return false;
+
+    sprintf(path, "%s/%s%s", Sonic_CacheDirectory, key.queryHash(), CacheEntryExtension);
+    return true;
+}
+
+
+static bool CopyRest(FILE *source, FILE *dest)
+{
+    char buffer [64 * 1024];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), source)) > 0)
+    {
+        if (fwrite(buffer, 1, n, dest) != n)
+            return false;
+    }
+
+    return !ferror(source);
+}
+
+
+bool SonicCacheKey::Fetch(const SonicCacheKey &key, const char *filename)
+{
+    if (!key.isValid())
+        return false;
+
+    char path [1024];
+    if (!MakeEntryFilename(key, path, sizeof(path)))
+        return false;
+
+    FILE *entry = fopen(path, "rb");
+    if (!entry)
+        return false;
+
+    char tag [32];
+    unsigned long keyLength = 0;
+    bool match = false;
+    if (fscanf(entry, "%31s %lu", tag, &keyLength) == 2 &&
+            strcmp(tag, CacheEntryTag) == 0 &&
+            keyLength == key.length &&
+            fgetc(entry) == '\n')
+    {
+        match = true;
+        const char *p = key.text;
+        for (unsigned long k=0; match && k < keyLength; ++k)
+            match = (fgetc(entry) == (unsigned char) p[k]);
+    }
+
+    bool ok = false;
+    if (match)
+    {
+        FILE *dest = fopen(filename, "wb");
+        if (dest)
+        {
+            ok = CopyRest(entry, dest);
+            if (fclose(dest) != 0)
+                ok = false;
+
+            if (!ok)
+                remove(filename);
+        }
+    }
+
+    fclose(entry);
+
+    if (ok)
+        utime(path, 0);     // it was just used; evict it last
+
+    return ok;
+}
+
+
+struct SonicCacheEntry
+{
+    char    *path;
+    long    size;
+    time_t  lastUse;
+};
+
+
+static int CompareLastUse(const void *a, const void *b)
+{
+    time_t x = ((const SonicCacheEntry *)a)->lastUse;
+    time_t y = ((const SonicCacheEntry *)b)->lastUse;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+
+static bool AddEntry(SonicCacheEntry * &list, int &count, int &capacity, const char *name)
+{
+    size_t nameLength = strlen(name);
+    size_t extLength = strlen(CacheEntryExtension);
+    if (nameLength <= extLength || strcmp(name + nameLength - extLength, CacheEntryExtension) != 0)
+        return true;
+
+    char *path = (char *) malloc(strlen(Sonic_CacheDirectory) + nameLength + 2);
+    if (!path)
+        return false;
+
+    sprintf(path, "%s/%s", Sonic_CacheDirectory, name);
+    struct stat info;
+    if (stat(path, &info) != 0)
+    {
+        free(path);
+        return true;
+    }
+
+    if (count == capacity)
+    {
+        int newCapacity = 2*capacity + 64;
+        SonicCacheEntry *newList = (SonicCacheEntry *) realloc(list, newCapacity * sizeof(SonicCacheEntry));
+        if (!newList)
+        {
+            free(path);
+            return false;
+        }
+
+        list = newList;
+        capacity = newCapacity;
+    }
+
+    list[count].path = path;
+    list[count].size = long(info.st_size);
+    list[count].lastUse = info.st_mtime;
+    ++count;
+    return true;
+}
+
+
+static void EvictLeastRecentlyUsed()
+{
+    SonicCacheEntry *list = 0;
+    int count = 0;
+    int capacity = 0;
+    bool ok = true;
+
+#if defined(_WIN32)
+    char pattern [1024];
+    sprintf(pattern, "%.1000s/*%s", Sonic_CacheDirectory, CacheEntryExtension);
+    struct _finddata_t found;
+    intptr_t handle = _findfirst(pattern, &found);
+    if (handle != -1)
+    {
+        do
+            ok = AddEntry(list, count, capacity, found.name);
+        while (ok && _findnext(handle, &found) == 0);
+
+        _findclose(handle);
+    }
+#else
+    DIR *dir = opendir(Sonic_CacheDirectory);
+    if (dir)
+    {
+        struct dirent *de;
+        while (ok && (de = readdir(dir)) != 0)
+            ok = AddEntry(list, count, capacity, de->d_name);
+
+        closedir(dir);
+    }
+#endif
+
+    double total = 0;
+    for (int k=0; k < count; ++k)
+        total += list[k].size;
+
+    const double limit = 1048576.0 * Sonic_CacheLimitMegabytes;
+    if (ok && total > limit)
+    {
+        qsort(list, count, sizeof(SonicCacheEntry), CompareLastUse);
+        for (int k=0; k < count && total > limit; ++k)
+        {
+            if (remove(list[k].path) == 0)
+                total -= list[k].size;
+        }
+    }
+
+    for (int k=0; k < count; ++k)
+        free(list[k].path);
+
+    free(list);
+}
+
+
+void SonicCacheKey::Store(const SonicCacheKey &key, const char *filename)
+{
+    if (!key.isValid())
+        return;
+
+    char path [1024];
+    char newPath [1100];
+    if (!MakeEntryFilename(key, path, sizeof(path)))
+        return;
+
+#if defined(_WIN32)
+    _mkdir(Sonic_CacheDirectory);
+    sprintf(newPath, "%s.%d.new", path, int(_getpid()));
+#else
+    mkdir(Sonic_CacheDirectory, 0777);
+    sprintf(newPath, "%s.%d.new", path, int(getpid()));
+#endif
+
+    FILE *source = fopen(filename, "rb");
+    if (!source)
+        return;
+
+    FILE *entry = fopen(newPath, "wb");
+    if (!entry)
+    {
+        fprintf(stderr, "Warning:  cannot write to cache directory '%s'\n", Sonic_CacheDirectory);
+        fclose(source);
+        return;
+    }
+
+    fprintf(entry, "%s %lu\n", CacheEntryTag, (unsigned long) key.length);
+    bool ok = (fwrite(key.text, 1, key.length, entry) == key.length) && CopyRest(source, entry);
+    fclose(source);
+    if (fclose(entry) != 0)
+        ok = false;
+
+#if defined(_WIN32)
+    if (ok)
+        remove(path);       // rename() does not replace files here
+#endif
+
+    // Renaming means other programs sharing the cache never see half an entry.
+    if (!ok || rename(newPath, path) != 0)
+    {
+        remove(newPath);
+        return;
+    }
+
+    EvictLeastRecentlyUsed();
+}
+
+
+//------------------------------------------------------------------------------
+//  Incremental rendering.
+//
+//  With --incremental, a wave assignment that misses the cache looks for
+//  what the same statement rendered into the same variable last time.  A
+//  "slot" file next to the cache entries records the entry it stored, the
+//  variables it read, and a fingerprint of every SONIC_SILENCE_BLOCK
+//  frames of each wave it read.  If the variables are the same and the
+//  waves differ only in some blocks, then only the output frames that
+//  read those blocks (found from the constant offsets in the wave
+//  expressions) need computing; the rest are copied from the old entry.
+//  Statements with filters start computing Sonic_WarmupSeconds early,
+//  and keep going that long after a change, so the filters can settle.
+
+
+void SonicCacheKey::allowReuse(bool stateful)
+{
+    reuseAllowed = true;
+    reuseStateful = stateful;
+}
+
+
+int SonicCacheKey::addSource(SonicWave &wave)
+{
+    for (int k=0; k < numSources; ++k)
+        if (sourceList[k].wave == &wave)
+            return k;
+
+    Source *newList = (Source *) realloc(sourceList, (numSources + 1) * sizeof(Source));
+    if (!newList)
+        return -1;
+
+    sourceList = newList;
+    sourceList[numSources].wave = &wave;
+    sourceList[numSources].block = 0;
+    sourceList[numSources].numBlocks = 0;
+    return numSources++;
+}
+
+
+void SonicCacheKey::addRead(SonicWave &wave, double offset)
+{
+    const int source = addSource(wave);
+    if (source < 0 || numReads >= MAX_READS)
+    {
+        reuseAllowed = false;
+        return;
+    }
+
+    readSource[numReads] = source;
+    readOffset[numReads] = offset;
+    readAnywhere[numReads] = false;
+    ++numReads;
+}
+
+
+void SonicCacheKey::addReadAnywhere(SonicWave &wave)
+{
+    addRead(wave, 0);
+    if (reuseAllowed)
+        readAnywhere[numReads - 1] = true;
+}
+
+
+static unsigned long HashFloats(unsigned long h, const float *data, int count)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t k=0; k < count * sizeof(float); ++k)
+        h = ((h ^ p[k]) * 16777619UL) & 0xffffffffUL;
+
+    return h;
+}
+
+
+// The same wave is usually read by several statements in a row, so the
+// last few waves' fingerprints are remembered by their identity.
+struct SonicFingerprintMemo
+{
+    char            *identity;
+    unsigned long   *block;
+    long            numBlocks;
+};
+
+const int NUM_FINGERPRINT_MEMOS = 8;
+static SonicFingerprintMemo FingerprintMemo [NUM_FINGERPRINT_MEMOS];
+static int NextFingerprintMemo = 0;
+
+
+static bool RecallFingerprints(const char *identity, unsigned long * &block, long &numBlocks)
+{
+    for (int k=0; k < NUM_FINGERPRINT_MEMOS; ++k)
+    {
+        const SonicFingerprintMemo &memo = FingerprintMemo[k];
+        if (memo.identity && strcmp(memo.identity, identity) == 0)
+        {
+            block = (unsigned long *) malloc((memo.numBlocks + 1) * sizeof(unsigned long));
+            if (!block)
+                return false;
+
+            memcpy(block, memo.block, memo.numBlocks * sizeof(unsigned long));
+            numBlocks = memo.numBlocks;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static void MemorizeFingerprints(const char *identity, const unsigned long *block, long numBlocks)
+{
+    SonicFingerprintMemo &memo = FingerprintMemo[NextFingerprintMemo];
+    NextFingerprintMemo = (NextFingerprintMemo + 1) % NUM_FINGERPRINT_MEMOS;
+
+    free(memo.identity);
+    free(memo.block);
+    memo.identity = (char *) malloc(strlen(identity) + 1);
+    memo.block = (unsigned long *) malloc((numBlocks + 1) * sizeof(unsigned long));
+    if (!memo.identity || !memo.block)
+    {
+        free(memo.identity);
+        free(memo.block);
+        memo.identity = 0;
+        memo.block = 0;
+        return;
+    }
+
+    strcpy(memo.identity, identity);
+    memcpy(memo.block, block, numBlocks * sizeof(unsigned long));
+    memo.numBlocks = numBlocks;
+}
+
+
+bool SonicCacheKey::takeFingerprints()
+{
+    for (int k=0; k < numSources; ++k)
+    {
+        Source &source = sourceList[k];
+        if (source.block)
+            continue;
+
+        SonicWave &wave = *source.wave;
+        const char *identity = wave.queryCacheIdentity();
+        if (!identity)
+            return false;
+
+        if (RecallFingerprints(identity, source.block, source.numBlocks))
+            continue;
+
+        wave.openForRead();
+        const long numFrames = wave.queryNumSamples();
+        source.numBlocks = (numFrames + SONIC_SILENCE_BLOCK - 1) / SONIC_SILENCE_BLOCK;
+        source.block = (unsigned long *) malloc((source.numBlocks + 1) * sizeof(unsigned long));
+        if (!source.block)
+        {
+            wave.close();
+            return false;
+        }
+
+        double sample [MAX_SONIC_CHANNELS];
+        float frame [MAX_SONIC_CHANNELS];
+        unsigned long h = 0;
+        for (long i=0; i < numFrames; ++i)
+        {
+            if (i % SONIC_SILENCE_BLOCK == 0)
+                h = 2166136261UL;
+
+            wave.read(sample);
+            for (int c=0; c < wave.requiredNumChannels; ++c)
+                frame[c] = float(sample[c]);
+
+            h = HashFloats(h, frame, wave.requiredNumChannels);
+            if ((i + 1) % SONIC_SILENCE_BLOCK == 0 || i + 1 == numFrames)
+                source.block[i / SONIC_SILENCE_BLOCK] = h;
+        }
+
+        wave.close();
+        MemorizeFingerprints(identity, source.block, source.numBlocks);
+    }
+
+    return true;
+}
+
+
+void SonicCacheKey::makeSlotFilename(SonicWave &target, char *path, size_t size) const
+{
+    char slot [256];
+    char slotHash [20];
+    sprintf(slot, "slot %s %.200s", codeHash, target.queryVarName());
+    HashText(slot, slotHash);
+
+    path[0] = '\0';
+    if (strlen(Sonic_CacheDirectory) + 32 <= size)
+        sprintf(path, "%s/%s.sl", Sonic_CacheDirectory, slotHash);
+}
+
+
+static char *ScalarLines(const char *text)
+{
+    // The lines of a key giving the values of variables, as opposed to
+    // the identities of waves.
+
+    char *lines = (char *) malloc(strlen(text) + 1);
+    if (!lines)
+        return 0;
+
+    char *q = lines;
+    while (*text)
+    {
+        const char *eol = strchr(text, '\n');
+        const size_t n = eol ? size_t(eol + 1 - text) : strlen(text);
+        if (strncmp(text, "integer ", 8) == 0 ||
+                strncmp(text, "real ", 5) == 0 ||
+                strncmp(text, "boolean ", 8) == 0 ||
+                strncmp(text, "array ", 6) == 0)
+        {
+            memcpy(q, text, n);
+            q += n;
+        }
+
+        text += n;
+    }
+
+    *q = '\0';
+    return lines;
+}
+
+
+void SonicCacheKey::recordReuse(SonicWave &target)
+{
+    if (!valid || !reuseAllowed || !takeFingerprints())
+        return;
+
+    char path [1024];
+    char newPath [1100];
+    makeSlotFilename(target, path, sizeof(path));
+    if (!path[0])
+        return;
+
+    char *scalars = ScalarLines(text);
+    if (!scalars)
+        return;
+
+    sprintf(newPath, "%s.new", path);
+    FILE *slot = fopen(newPath, "wt");
+    if (!slot)
+    {
+        free(scalars);
+        return;
+    }
+
+    fprintf(slot, "sonic-reuse 1\nentry %s\nscalars %lu\n%s", queryHash(), (unsigned long) strlen(scalars), scalars);
+    fprintf(slot, "sources %d\n", numSources);
+    for (int k=0; k < numSources; ++k)
+    {
+        const Source &source = sourceList[k];
+        fprintf(slot, "source %s %ld\n", source.wave->queryVarName(), source.numBlocks);
+        for (long b=0; b < source.numBlocks; ++b)
+            fprintf(slot, "%08lx", source.block[b]);
+
+        fprintf(slot, "\n");
+    }
+
+    free(scalars);
+    bool ok = !ferror(slot);
+    if (fclose(slot) != 0)
+        ok = false;
+
+#if defined(_WIN32)
+    if (ok)
+        remove(path);
+#endif
+
+    if (!ok || rename(newPath, path) != 0)
+        remove(newPath);
+}
+
+
+SonicReusePlan *SonicCacheKey::planReuse(SonicWave &target)
+{
+    if (!valid || !reuseAllowed || !takeFingerprints())
+        return 0;
+
+    char path [1024];
+    makeSlotFilename(target, path, sizeof(path));
+    FILE *slot = path[0] ? fopen(path, "rt") : 0;
+    if (!slot)
+        return 0;       // never rendered before
+
+    // The variables read must have the same values as last time.
+    char entryHash [20];
+    unsigned long scalarLength = 0;
+    int recordedSources = -1;
+    char *scalars = ScalarLines(text);
+    char *oldScalars = 0;
+    bool ok = scalars &&
+        fscanf(slot, "sonic-reuse 1 entry %19s scalars %lu", entryHash, &scalarLength) == 2 &&
+        fgetc(slot) == '\n' &&
+        scalarLength == strlen(scalars) &&
+        (oldScalars = (char *) malloc(scalarLength + 1)) != 0 &&
+        fread(oldScalars, 1, scalarLength, slot) == scalarLength &&
+        memcmp(oldScalars, scalars, scalarLength) == 0 &&
+        fscanf(slot, " sources %d", &recordedSources) == 1 &&
+        recordedSources == numSources;
+
+    free(scalars);
+    free(oldScalars);
+
+    // Compare each wave read against its fingerprints from last time,
+    // marking the output frames that read any block which changed.
+    struct Change
+    {
+        long start;
+        long end;
+    };
+
+    Change *changeList = 0;
+    int numChanges = 0;
+    int changeCapacity = 0;
+    unsigned long *oldBlock = 0;
+    for (int k=0; ok && k < recordedSources; ++k)
+    {
+        char name [256];
+        long oldNumBlocks = 0;
+        int s;
+        ok = fscanf(slot, " source %255s %ld", name, &oldNumBlocks) == 2 && oldNumBlocks >= 0;
+        for (s=0; ok && s < numSources; ++s)
+            if (strcmp(sourceList[s].wave->queryVarName(), name) == 0)
+                break;
+
+        if (!ok || s == numSources)
+        {
+            ok = false;
+            break;
+        }
+
+        free(oldBlock);
+        oldBlock = (unsigned long *) malloc((oldNumBlocks + 1) * sizeof(unsigned long));
+        if (!oldBlock)
+        {
+            ok = false;
+            break;
+        }
+
+        for (long b=0; ok && b < oldNumBlocks; ++b)
+            ok = (fscanf(slot, "%8lx", &oldBlock[b]) == 1);
+
+        const Source &source = sourceList[s];
+        const long numBlocks = (source.numBlocks > oldNumBlocks) ? source.numBlocks : oldNumBlocks;
+        for (long b=0; ok && b < numBlocks; )
+        {
+            if (b < source.numBlocks && b < oldNumBlocks && source.block[b] == oldBlock[b])
+            {
+                ++b;
+                continue;
+            }
+
+            long runEnd = b + 1;
+            while (runEnd < numBlocks &&
+                    !(runEnd < source.numBlocks && runEnd < oldNumBlocks && source.block[runEnd] == oldBlock[runEnd]))
+                ++runEnd;
+
+            for (int r=0; ok && r < numReads; ++r)
+            {
+                if (readSource[r] != s)
+                    continue;
+
+                if (readAnywhere[r])
+                {
+                    ok = false;     // everything depends on it
+                    break;
+                }
+
+                if (numChanges == changeCapacity)
+                {
+                    changeCapacity = 2*changeCapacity + 16;
+                    Change *newList = (Change *) realloc(changeList, changeCapacity * sizeof(Change));
+                    if (!newList)
+                    {
+                        ok = false;
+                        break;
+                    }
+
+                    changeList = newList;
+                }
+
+                // Output frame j reads input frame j + offset, give or take
+                // one for interpolation.
+                changeList[numChanges].start = b * SONIC_SILENCE_BLOCK - long(ceil(readOffset[r])) - 1;
+                changeList[numChanges].end = runEnd * SONIC_SILENCE_BLOCK - long(floor(readOffset[r])) + 1;
+                ++numChanges;
+            }
+
+            b = runEnd;
+        }
+    }
+
+    free(oldBlock);
+    fclose(slot);
+
+    // Find the last run's result in its cache entry.
+    SonicReusePlan *plan = 0;
+    FILE *entry = 0;
+    if (ok && strlen(Sonic_CacheDirectory) + 32 <= sizeof(path))
+    {
+        sprintf(path, "%s/%s%s", Sonic_CacheDirectory, entryHash, CacheEntryExtension);
+        entry = fopen(path, "rb");
+    }
+
+    char tag [32];
+    unsigned long keyLength = 0;
+    if (entry &&
+            fscanf(entry, "%31s %lu", tag, &keyLength) == 2 &&
+            strcmp(tag, CacheEntryTag) == 0 &&
+            fgetc(entry) == '\n' &&
+            fseek(entry, 0, SEEK_END) == 0)
+    {
+        const long fileSize = ftell(entry);
+        char header [64];
+        sprintf(header, "%s %lu\n", CacheEntryTag, keyLength);
+        const long start = long(strlen(header) + keyLength);
+        const long numFrames = (fileSize - start) / long(sizeof(float));
+        if (numFrames >= 1)
+        {
+            plan = new SonicReusePlan(entry, start, (numFrames - 1) / target.requiredNumChannels, target.requiredNumChannels);
+            entry = 0;      // the plan closes it
+        }
+    }
+
+    if (entry)
+        fclose(entry);
+
+    if (plan)
+    {
+        const long warmup = reuseStateful ? long(Sonic_WarmupSeconds * target.requiredSamplingRate) : 0;
+        for (int k=0; k < numChanges; ++k)
+            plan->addRange(changeList[k].start - warmup, changeList[k].start, changeList[k].end + warmup);
+
+        plan->finish();
+    }
+
+    free(changeList);
+    return plan;
+}
+
+
+SonicReusePlan::SonicReusePlan(FILE *_previous, long _dataOffset, long _numFrames, int _numChannels):
+    previous(_previous),
+    dataOffset(_dataOffset),
+    numFrames(_numFrames),
+    numChannels(_numChannels),
+    rangeList(0),
+    numRanges(0),
+    rangeCapacity(0),
+    cursorStart(0),
+    cursorComputeFrom(0),
+    cursorEnd(0)
+{
+}
+
+
+SonicReusePlan::~SonicReusePlan()
+{
+    if (previous)
+    {
+        fclose(previous);
+        previous = 0;
+    }
+
+    free(rangeList);
+    rangeList = 0;
+}
+
+
+void SonicReusePlan::addRange(long start, long computeFrom, long end)
+{
+    if (start < 0)
+        start = 0;
+
+    if (computeFrom < start)
+        computeFrom = start;
+
+    if (end <= computeFrom)
+        return;
+
+    if (numRanges == rangeCapacity)
+    {
+        rangeCapacity = 2*rangeCapacity + 16;
+        Range *newList = (Range *) realloc(rangeList, rangeCapacity * sizeof(Range));
+        if (!newList)
+        {
+            fprintf(stderr, "Error:  out of memory planning incremental render\n");
+            exit(1);
+        }
+
+        rangeList = newList;
+    }
+
+    rangeList[numRanges].start = start;
+    rangeList[numRanges].computeFrom = computeFrom;
+    rangeList[numRanges].end = end;
+    ++numRanges;
+}
+
+
+static int CompareRangeStart(const void *a, const void *b)
+{
+    long x = *(const long *)a;      // 'start' is the first member of a Range
+    long y = *(const long *)b;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+
+void SonicReusePlan::finish()
+{
+    // Sort the ranges and merge any that overlap.
+
+    qsort(rangeList, numRanges, sizeof(Range), CompareRangeStart);
+    int n = 0;
+    for (int k=0; k < numRanges; ++k)
+    {
+        const Range &r = rangeList[k];
+        if (n > 0 && r.start <= rangeList[n-1].end)
+        {
+            Range &last = rangeList[n-1];
+            if (r.computeFrom < last.computeFrom)
+                last.computeFrom = r.computeFrom;
+
+            if (r.end > last.end)
+                last.end = r.end;
+        }
+        else
+            rangeList[n++] = r;
+    }
+
+    numRanges = n;
+
+    // Warming up writes the old frames, so there must be old frames to write.
+    for (int k=0; k < numRanges; ++k)
+    {
+        Range &r = rangeList[k];
+        if (r.computeFrom > numFrames)
+            r.computeFrom = (r.start > numFrames) ? r.start : numFrames;
+    }
+
+    cursorStart = cursorComputeFrom = cursorEnd = 0;
+}
+
+
+void SonicReusePlan::seek(long i)
+{
+    // Find the first range that does not end before frame i.
+
+    int lo = 0;
+    int hi = numRanges;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        if (rangeList[mid].end <= i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < numRanges)
+    {
+        cursorStart = rangeList[lo].start;
+        cursorComputeFrom = rangeList[lo].computeFrom;
+        cursorEnd = rangeList[lo].end;
+    }
+    else
+        cursorStart = cursorComputeFrom = cursorEnd = SONIC_QUIET_FOREVER;
+}
+
+
+long SonicReusePlan::reusable(long i)
+{
+    if (i >= numFrames)
+        return -(SONIC_QUIET_FOREVER - i);     // past the end of the last run
+
+    seek(i);
+    if (i >= cursorStart)
+        return -(cursorEnd - i);
+
+    return ((cursorStart < numFrames) ? cursorStart : numFrames) - i;
+}
+
+
+void SonicReusePlan::readFrames(long first, long count, float *dest)
+{
+    if (first < 0 || first + count > numFrames ||
+            fseek(previous, dataOffset + long(sizeof(float)) * (1 + first*numChannels), SEEK_SET) ||
+            fread(dest, sizeof(float), count*numChannels, previous) != size_t(count*numChannels))
+    {
+        fprintf(stderr, "Error:  cannot read frames %ld..%ld of the previous render\n", first, first + count - 1);
+        exit(1);
+    }
+}
+
+
+/*--- end of file cache.cpp ---*/
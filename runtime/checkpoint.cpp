@@ -0,0 +1,480 @@
+/*============================================================================
+
+    checkpoint.cpp
+
+    Checkpoint and resume support for Sonic/C++ programs.
+
+    A program registers every variable of its program body with a
+    SonicCheckpoint object.  When run with --checkpoint, the values of
+    those variables, and which file holds each wave, are written to
+    "<program>.ckpt" at most every so many seconds: before a statement of
+    the program body starts, or inside a long wave assignment.  Running
+    the program again with --resume restores them, skips the statements
+    that were already done, and carries on.
+
+    Temp files a checkpoint refers to are not deleted until a newer
+    checkpoint no longer needs them.
+
+============================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "sonic.h"
+#include "copystr.h"
+
+
+struct SonicCheckpoint::Item
+{
+    char    kind;       // 'i'nteger, 'r'eal, 'b'oolean, 'a'rray, 'w'ave
+    char    *name;
+    void    *data;
+    size_t  numBytes;
+    SonicWave *wave;
+    Item    *next;
+};
+
+
+struct SonicFileNode
+{
+    char *filename;
+    SonicFileNode *next;
+};
+
+
+static char StateFilename [256];
+static SonicFileNode *ProtectedFiles = 0;  // needed to resume from the last checkpoint
+static SonicFileNode *DeferredFiles = 0;   // discarded, but still protected
+
+
+static bool FindFile(const SonicFileNode *list, const char *filename)
+{
+    for (; list; list = list->next)
+        if (strcmp(list->filename, filename) == 0)
+            return true;
+
+    return false;
+}
+
+
+static void AddFile(SonicFileNode * &list, const char *filename)
+{
+    SonicFileNode *node = new SonicFileNode;
+    node->filename = DDC_CopyString(filename);
+    if (!node->filename)
+    {
+        fprintf(stderr, "Error:  out of memory saving checkpoint\n");
+        exit(1);
+    }
+
+    node->next = list;
+    list = node;
+}
+
+
+static void FreeFiles(SonicFileNode * &list)
+{
+    while (list)
+    {
+        SonicFileNode *next = list->next;
+        DDC_DeleteString(list->filename);
+        delete list;
+        list = next;
+    }
+}
+
+
+static unsigned long HashBytes(unsigned long hash, const void *data, size_t numBytes)
+{
+    // 32-bit FNV-1a
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t k=0; k < numBytes; ++k)
+        hash = ((hash ^ p[k]) * 16777619UL) & 0xffffffffUL;
+
+    return hash;
+}
+
+
+SonicCheckpoint::SonicCheckpoint(const char *_programName):
+    programName(DDC_CopyString(_programName)),
+    itemList(0),
+    itemTail(0),
+    signature(2166136261UL),
+    enabled(false),
+    lastSaveTime(0),
+    resumeStep(0),
+    resumeFrame(-1),
+    resumeTime(0)
+{
+    if (!programName || strlen(programName) + 6 > sizeof(StateFilename))
+    {
+        fprintf(stderr, "Error:  cannot create checkpoint for program '%s'\n", _programName);
+        exit(1);
+    }
+
+    sprintf(StateFilename, "%s.ckpt", programName);
+}
+
+
+SonicCheckpoint::~SonicCheckpoint()
+{
+    while (itemList)
+    {
+        Item *next = itemList->next;
+        DDC_DeleteString(itemList->name);
+        delete itemList;
+        itemList = next;
+    }
+
+    itemTail = 0;
+    DDC_DeleteString(programName);
+}
+
+
+void SonicCheckpoint::addItem(char kind, const char *name, void *data, size_t numBytes, SonicWave *wave)
+{
+    Item *item = new Item;
+    item->kind = kind;
+    item->name = DDC_CopyString(name);
+    item->data = data;
+    item->numBytes = numBytes;
+    item->wave = wave;
+    item->next = 0;
+    if (!item->name)
+    {
+        fprintf(stderr, "Error:  out of memory registering variable '%s' for checkpoints\n", name);
+        exit(1);
+    }
+
+    if (itemTail)
+        itemTail->next = item;
+    else
+        itemList = item;
+
+    itemTail = item;
+
+    // The starting values tell whether a checkpoint belongs to this run:
+    // resuming with different arguments would mix two different results.
+
+    signature = HashBytes(signature, &kind, 1);
+    signature = HashBytes(signature, name, strlen(name) + 1);
+    if (wave)
+    {
+        const char *filename = wave->inFilename ? wave->inFilename : "";
+
+        signature = HashBytes(signature, filename, strlen(filename) + 1);
+    }
+    else
+        signature = HashBytes(signature, data, numBytes);
+}
+
+
+void SonicCheckpoint::addInteger(const char *name, long &value)
+{
+    addItem('i', name, &value, sizeof(long), 0);
+}
+
+
+void SonicCheckpoint::addReal(const char *name, double &value)
+{
+    addItem('r', name, &value, sizeof(double), 0);
+}
+
+
+void SonicCheckpoint::addBoolean(const char *name, int &value)
+{
+    addItem('b', name, &value, sizeof(int), 0);
+}
+
+
+void SonicCheckpoint::addArray(const char *name, void *data, size_t numBytes)
+{
+    addItem('a', name, data, numBytes, 0);
+}
+
+
+void SonicCheckpoint::addWave(SonicWave &wave)
+{
+    if (wave.isStream() && (Sonic_CheckpointSeconds > 0 || Sonic_ResumeFlag))
+    {
+        fprintf(stderr, "Error:  checkpoints are not possible because variable '%s' is a stream.\n", wave.queryVarName());
+        exit(1);
+    }
+
+    addItem('w', wave.queryVarName(), 0, 0, &wave);
+}
+
+
+void SonicCheckpoint::disallow(const char *reason)
+{
+    if (Sonic_CheckpointSeconds > 0 || Sonic_ResumeFlag)
+    {
+        fprintf(stderr, "Error:  checkpoints are not possible because %s.\n", reason);
+        exit(1);
+    }
+}
+
+
+void SonicCheckpoint::restore()
+{
+    if (Sonic_CheckpointSeconds == 0 && !Sonic_ResumeFlag)
+        return;
+
+    if (Sonic_CheckpointSeconds == 0)
+        Sonic_CheckpointSeconds = 60;
+
+    enabled = true;
+    lastSaveTime = time(0);
+
+    if (!Sonic_ResumeFlag)
+        return;
+
+    FILE *f = fopen(StateFilename, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "No checkpoint '%s' found; starting from the beginning.\n", StateFilename);
+        return;
+    }
+
+    char word [64];
+    char name [256];
+    unsigned long savedSignature = 0;
+    int tempTag = 0;
+
+    if (fscanf(f, "%63s %*d", word) != 1 || strcmp(word, "sonic-checkpoint") != 0 ||
+            fscanf(f, " program %255s", name) != 1 || strcmp(name, programName) != 0)
+    {
+        fprintf(stderr, "Error:  '%s' is not a checkpoint of program '%s'.\n", StateFilename, programName);
+        exit(1);
+    }
+
+    if (fscanf(f, " signature %lx", &savedSignature) != 1 || savedSignature != signature)
+    {
+        fprintf(stderr, "Error:  checkpoint '%s' was made with different arguments.\n", StateFilename);
+        exit(1);
+    }
+
+    if (fscanf(f, " step %d %ld %lf temptag %d", &resumeStep, &resumeFrame, &resumeTime, &tempTag) != 4)
+    {
+        fprintf(stderr, "Error:  checkpoint '%s' is damaged.\n", StateFilename);
+        exit(1);
+    }
+
+    SonicWave::NextTempTag = tempTag;
+
+    for (Item *item = itemList; item; item = item->next)
+    {
+        if (fscanf(f, " %63s %255s", word, name) != 2 || strcmp(name, item->name) != 0)
+        {
+            fprintf(stderr, "Error:  checkpoint '%s' does not match this program.\n", StateFilename);
+            exit(1);
+        }
+
+        int ok = 1;
+        switch (item->kind)
+        {
+        case 'i':   ok = fscanf(f, "%ld", (long *)item->data);      break;
+        case 'r':   ok = fscanf(f, "%lf", (double *)item->data);    break;
+        case 'b':   ok = fscanf(f, "%d", (int *)item->data);        break;
+
+        case 'a':
+        {
+            unsigned char *p = (unsigned char *) item->data;
+            for (size_t k=0; ok == 1 && k < item->numBytes; ++k)
+            {
+                unsigned x = 0;
+                ok = fscanf(f, "%2x", &x);
+                p[k] = (unsigned char) x;
+            }
+        }
+        break;
+
+        case 'w':
+            item->wave->restoreCheckpoint(f);
+            break;
+        }
+
+        if (ok != 1)
+        {
+            fprintf(stderr, "Error:  checkpoint '%s' has an invalid value for '%s'.\n", StateFilename, item->name);
+            exit(1);
+        }
+    }
+
+    fclose(f);
+    protectFiles();
+}
+
+
+bool SonicCheckpoint::reached(int step)
+{
+    if (!enabled)
+        return true;
+
+    if (step < resumeStep)
+        return false;
+
+    if (step > resumeStep && due())
+        save(step);
+
+    return true;
+}
+
+
+bool SonicCheckpoint::resumeInside(int step, long &frame, double &t)
+{
+    if (!enabled || step != resumeStep || resumeFrame < 0)
+        return false;
+
+    frame = resumeFrame;
+    t = resumeTime;
+    resumeFrame = -1;
+    return true;
+}
+
+
+void SonicCheckpoint::save(int step, long frame, double t)
+{
+    // The state is written to a new file which then replaces the old one,
+    // so that being killed part way through still leaves a good checkpoint.
+
+    char newFilename [sizeof(StateFilename) + 4];
+    sprintf(newFilename, "%s.new", StateFilename);
+
+    FILE *f = fopen(newFilename, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Warning:  cannot write checkpoint file '%s'\n", newFilename);
+        lastSaveTime = time(0);
+        return;
+    }
+
+    fprintf(f, "sonic-checkpoint 1\n");
+    fprintf(f, "program %s\n", programName);
+    fprintf(f, "signature %08lx\n", signature);
+    fprintf(f, "step %d %ld %.17g\n", step, frame, t);
+    fprintf(f, "temptag %d\n", SonicWave::NextTempTag);
+
+    for (Item *item = itemList; item; item = item->next)
+    {
+        switch (item->kind)
+        {
+        case 'i':   fprintf(f, "integer %s %ld\n", item->name, *(const long *)item->data);      break;
+        case 'r':   fprintf(f, "real %s %.17g\n", item->name, *(const double *)item->data);     break;
+        case 'b':   fprintf(f, "boolean %s %d\n", item->name, *(const int *)item->data);        break;
+
+        case 'a':
+        {
+            fprintf(f, "array %s ", item->name);
+            const unsigned char *p = (const unsigned char *) item->data;
+            for (size_t k=0; k < item->numBytes; ++k)
+                fprintf(f, "%02x", unsigned(p[k]));
+
+            fprintf(f, "\n");
+        }
+        break;
+
+        case 'w':
+            item->wave->saveCheckpoint(f);
+            break;
+        }
+    }
+
+    fprintf(f, "end\n");
+    fflush(f);
+#if defined(_WIN32)
+    _commit(_fileno(f));
+#else
+    fsync(fileno(f));
+#endif
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0)
+        ok = false;
+
+#if defined(_WIN32)
+    remove(StateFilename);      // rename() does not replace files here
+#endif
+
+    if (!ok || rename(newFilename, StateFilename) != 0)
+    {
+        fprintf(stderr, "Warning:  cannot write checkpoint file '%s'\n", StateFilename);
+        remove(newFilename);
+    }
+    else
+        protectFiles();
+
+    lastSaveTime = time(0);
+}
+
+
+void SonicCheckpoint::protectFiles()
+{
+    // Protect the files the newest checkpoint needs, and delete the
+    // files that were only kept for the one before it.
+
+    FreeFiles(ProtectedFiles);
+    for (Item *item = itemList; item; item = item->next)
+    {
+        const char *filename = item->wave ? item->wave->queryCheckpointFile() : 0;
+        if (filename)
+            AddFile(ProtectedFiles, filename);
+    }
+
+    SonicFileNode *keep = 0;
+    while (DeferredFiles)
+    {
+        SonicFileNode *node = DeferredFiles;
+        DeferredFiles = node->next;
+        if (FindFile(ProtectedFiles, node->filename))
+        {
+            node->next = keep;
+            keep = node;
+        }
+        else
+        {
+            remove(node->filename);
+            DDC_DeleteString(node->filename);
+            delete node;
+        }
+    }
+
+    DeferredFiles = keep;
+}
+
+
+void SonicCheckpoint::DiscardFile(const char *filename)
+{
+    if (!FindFile(ProtectedFiles, filename))
+        remove(filename);
+    else if (!FindFile(DeferredFiles, filename))
+        AddFile(DeferredFiles, filename);
+}
+
+
+bool SonicCheckpoint::IsProtected(const char *filename)
+{
+    // Files a checkpoint needs must not change in place.
+    return FindFile(ProtectedFiles, filename) || FindFile(DeferredFiles, filename);
+}
+
+
+void SonicCheckpoint::EraseStateFile()
+{
+    if (StateFilename[0])
+        remove(StateFilename);
+
+    FreeFiles(ProtectedFiles);
+    FreeFiles(DeferredFiles);
+}
+
+
+/*--- end of file checkpoint.cpp ---*/
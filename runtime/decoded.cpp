@@ -0,0 +1,198 @@
+/*============================================================================
+
+    decoded.cpp
+
+    Decoded input cache for Sonic/C++ programs.
+
+    Each wave assignment that reads a WAV file opens it again and converts
+    its 16-bit frames to floats in the program's channel layout.  Blocks of
+    SONIC_DECODED_BLOCK converted frames are kept here, so that the next
+    open of the same file with the same channel mix, by the same wave or
+    another one, copies them instead of decoding again.
+
+    A source is identified by a key the wave builds from the file's name,
+    size and modification time and its channel mix.  Blocks of all sources
+    share one memory budget of --input-cache megabytes; when a new block
+    does not fit, the least recently used blocks are dropped, except
+    those a wave is in the middle of reading.
+
+============================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sonic.h"
+#include "copystr.h"
+
+
+struct SonicDecodedSource::Block
+{
+    SonicDecodedSource  *source;
+    long                index;
+    float               *data;
+    int                 numPins;    // waves reading straight from 'data'; not to be dropped
+    Block               *newer;     // toward NewestBlock
+    Block               *older;     // toward OldestBlock
+};
+
+
+SonicDecodedSource *SonicDecodedSource::SourceList = 0;
+SonicDecodedSource::Block *SonicDecodedSource::NewestBlock = 0;
+SonicDecodedSource::Block *SonicDecodedSource::OldestBlock = 0;
+size_t SonicDecodedSource::NumBytes = 0;
+
+
+SonicDecodedSource::SonicDecodedSource(const char *_key, int _numChannels):
+    key(DDC_CopyString(_key)),
+    numChannels(_numChannels),
+    blockTable(0),
+    tableSize(0),
+    next(0)
+{
+    if (!key)
+    {
+        fprintf(stderr, "Error:  out of memory in decoded input cache\n");
+        exit(1);
+    }
+}
+
+
+SonicDecodedSource *SonicDecodedSource::Find(const char *key, int numChannels)
+{
+    // Sources are never freed:  there is one per input file and mix
+    // the program reads, and each costs little besides its blocks.
+
+    for (SonicDecodedSource *source = SourceList; source; source = source->next)
+        if (source->numChannels == numChannels && strcmp(source->key, key) == 0)
+            return source;
+
+    SonicDecodedSource *source = new SonicDecodedSource(key, numChannels);
+    source->next = SourceList;
+    SourceList = source;
+    return source;
+}
+
+
+const float *SonicDecodedSource::findBlock(long index)
+{
+    if (index < 0 || index >= tableSize || !blockTable[index])
+        return 0;
+
+    Block *block = blockTable[index];
+    Unlink(block);
+    LinkNewest(block);
+    return block->data;
+}
+
+
+float *SonicDecodedSource::addBlock(long index)
+{
+    // Returns memory for block 'index' to be filled in by the caller,
+    // or NULL if the block is bigger than the whole budget.
+
+    if (index < 0)
+        return 0;
+
+    if (index < tableSize && blockTable[index])
+        return blockTable[index]->data;
+
+    const size_t blockBytes = size_t(SONIC_DECODED_BLOCK) * numChannels * sizeof(float);
+    const size_t budget = size_t(Sonic_InputCacheMegabytes) * 1024 * 1024;
+    if (blockBytes > budget)
+        return 0;
+
+    Block *victim = OldestBlock;
+    while (victim && NumBytes + blockBytes > budget)
+    {
+        Block *newer = victim->newer;
+        if (victim->numPins == 0)
+            DropBlock(victim);
+
+        victim = newer;
+    }
+
+    if (NumBytes + blockBytes > budget)
+        return 0;
+
+    if (index >= tableSize)
+    {
+        long newSize = tableSize ? 2*tableSize : 64;
+        while (newSize <= index)
+            newSize *= 2;
+
+        Block **newTable = new Block * [newSize];
+        for (long k=0; k < newSize; ++k)
+            newTable[k] = (k < tableSize) ? blockTable[k] : 0;
+
+        delete[] blockTable;
+        blockTable = newTable;
+        tableSize = newSize;
+    }
+
+    Block *block = new Block;
+    block->source = this;
+    block->index = index;
+    block->data = new float [SONIC_DECODED_BLOCK * numChannels];
+    block->numPins = 0;
+    blockTable[index] = block;
+    LinkNewest(block);
+    NumBytes += blockBytes;
+    return block->data;
+}
+
+
+void SonicDecodedSource::pinBlock(long index)
+{
+    if (index >= 0 && index < tableSize && blockTable[index])
+        ++(blockTable[index]->numPins);
+}
+
+
+void SonicDecodedSource::unpinBlock(long index)
+{
+    if (index >= 0 && index < tableSize && blockTable[index] && blockTable[index]->numPins > 0)
+        --(blockTable[index]->numPins);
+}
+
+
+void SonicDecodedSource::DropBlock(Block *block)
+{
+    Unlink(block);
+    block->source->blockTable[block->index] = 0;
+    NumBytes -= size_t(SONIC_DECODED_BLOCK) * block->source->numChannels * sizeof(float);
+    delete[] block->data;
+    delete block;
+}
+
+
+void SonicDecodedSource::Unlink(Block *block)
+{
+    if (block->newer)
+        block->newer->older = block->older;
+    else
+        NewestBlock = block->older;
+
+    if (block->older)
+        block->older->newer = block->newer;
+    else
+        OldestBlock = block->newer;
+
+    block->newer = block->older = 0;
+}
+
+
+void SonicDecodedSource::LinkNewest(Block *block)
+{
+    block->newer = 0;
+    block->older = NewestBlock;
+    if (NewestBlock)
+        NewestBlock->newer = block;
+    else
+        OldestBlock = block;
+
+    NewestBlock = block;
+}
+
+
+/*--- end of file decoded.cpp ---*/
@@ -0,0 +1,1631 @@
+/*============================================================================
+
+    flac.cpp
+
+    FLAC support for Sonic/C++ programs.
+
+    SonicFlacReader decodes FLAC streams of up to 8 channels and 24 bits
+    per sample, handing samples out as 16-bit integers.  The position of
+    each FLAC frame is remembered as it is decoded, and the points of a
+    SEEKTABLE, if the file has one, let a read far ahead skip to a nearby
+    frame instead of decoding everything in between.
+
+    SonicFlacWriter encodes 16-bit samples in blocks of 4096 frames, each
+    channel with the best of the fixed predictors and Rice coded residual,
+    and stereo with the best of the four ways of pairing channels.  Blocks
+    are collected into batches which several threads encode at once (see
+    --threads); the encoded frames are then written in order.  When the
+    file is closed, STREAMINFO is filled in with the MD5 signature of the
+    samples, along with a SEEKTABLE with a point about every 10 seconds.
+
+============================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+#include "sonic.h"
+#include "ddc.h"
+#include "flac.h"
+
+
+const int  FLAC_BLOCK_SIZE          = 4096;     // audio frames per FLAC frame written
+const int  FLAC_MAX_CHANNELS        = 8;
+const int  FLAC_MAX_FIXED_ORDER     = 4;
+const int  FLAC_MAX_PARTITION_ORDER = 8;
+const int  FLAC_MAX_LPC_ORDER       = 32;
+const int  FLAC_MAX_THREADS         = 64;
+const int  FLAC_BLOCKS_PER_THREAD   = 4;        // blocks each thread encodes per batch
+const long FLAC_SEEK_SECONDS        = 10;
+const int  FLAC_READ_BUFFER         = 64 * 1024;
+
+
+static unsigned Crc8Table [256];
+static unsigned Crc16Table [256];
+static unsigned Md5Sine [64];
+static bool TablesReady = false;
+
+
+static void InitTables()
+{
+    // Called by open() of the reader and writer, before any encoding
+    // threads are started.
+
+    if (TablesReady)
+        return;
+
+    for (unsigned i=0; i < 256; ++i)
+    {
+        unsigned c8 = i;
+        unsigned c16 = i << 8;
+        for (int k=0; k < 8; ++k)
+        {
+            c8  = (c8  & 0x80)   ? ((c8  << 1) ^ 0x07)   : (c8  << 1);
+            c16 = (c16 & 0x8000) ? ((c16 << 1) ^ 0x8005) : (c16 << 1);
+        }
+        Crc8Table[i]  = c8  & 0xff;
+        Crc16Table[i] = c16 & 0xffff;
+    }
+
+    for (int i=0; i < 64; ++i)
+        Md5Sine[i] = unsigned(fabs(sin(double(i+1))) * 4294967296.0);
+
+    TablesReady = true;
+}
+
+
+static unsigned Crc8(const unsigned char *data, long length)
+{
+    unsigned crc = 0;
+    for (long i=0; i < length; ++i)
+        crc = Crc8Table[crc ^ data[i]];
+
+    return crc;
+}
+
+
+static unsigned Crc16(const unsigned char *data, long length)
+{
+    unsigned crc = 0;
+    for (long i=0; i < length; ++i)
+        crc = ((crc << 8) ^ Crc16Table[(crc >> 8) ^ data[i]]) & 0xffff;
+
+    return crc;
+}
+
+
+bool Sonic_IsFlacFilename(const char *filename)
+{
+    static const char extension[] = ".flac";
+    const size_t length = filename ? strlen(filename) : 0;
+    if (length < 5)
+        return false;
+
+    const char *tail = filename + length - 5;
+    for (int k=0; k < 5; ++k)
+        if (tolower(tail[k]) != extension[k])
+            return false;
+
+    return true;
+}
+
+
+//----------------------------------------------------------------------------
+//  Reading
+
+
+SonicFlacReader::SonicFlacReader():
+    file(0),
+    error(0),
+    numFrames(0),
+    samplingRate(0),
+    numChannels(0),
+    bitsPerSample(0),
+    maxBlockSize(0),
+    firstFrameOffset(0),
+    numSeekPoints(0),
+    seekFrame(0),
+    seekOffset(0),
+    numSlots(0),
+    slotFrame(0),
+    slotOffset(0),
+    block(0),
+    blockFirst(0),
+    blockSize(0),
+    nextFrame(0),
+    buffer(0),
+    bufferLength(0),
+    bufferPos(0),
+    bufferOffset(0),
+    bitCache(0),
+    numCachedBits(0),
+    crc8(0),
+    crc16(0)
+{
+}
+
+
+SonicFlacReader::~SonicFlacReader()
+{
+    close();
+}
+
+
+void SonicFlacReader::close()
+{
+    if (file)
+    {
+        fclose(file);
+        file = 0;
+    }
+
+    delete[] seekFrame;
+    delete[] seekOffset;
+    delete[] slotFrame;
+    delete[] slotOffset;
+    delete[] block;
+    delete[] buffer;
+
+    seekFrame = seekOffset = slotFrame = slotOffset = 0;
+    block = 0;
+    buffer = 0;
+    numSeekPoints = 0;
+    numSlots = 0;
+    blockSize = 0;
+}
+
+
+bool SonicFlacReader::fail(const char *message)
+{
+    if (!error)
+        error = message;
+
+    return false;
+}
+
+
+bool SonicFlacReader::open(const char *filename)
+{
+    close();
+    InitTables();
+    error = 0;
+
+    file = fopen(filename, "rb");
+    if (!file)
+        return fail("cannot open file");
+
+    if (!readMetadata())
+        return false;
+
+    block = new int [numChannels * maxBlockSize];
+    buffer = new unsigned char [FLAC_READ_BUFFER];
+    restartAt(0, 0);
+
+    if (numFrames == 0)
+    {
+        // STREAMINFO may leave the length unknown, so count the frames.
+        do
+        {
+            if (!decodeFrame())
+                return false;
+        }
+        while (blockSize > 0);
+
+        numFrames = nextFrame;
+        restartAt(0, 0);
+    }
+
+    // Every FLAC frame decoded is remembered as a place to start decoding
+    // again, so that going back over the file does not decode it from a
+    // distant seek point each time.
+    numSlots = numFrames / maxBlockSize + 1;
+    slotFrame = new long [numSlots];
+    slotOffset = new long [numSlots];
+    for (long k=0; k < numSlots; ++k)
+        slotFrame[k] = -1;
+
+    return true;
+}
+
+
+static unsigned long long BigEndian(const unsigned char *data, int numBytes)
+{
+    unsigned long long value = 0;
+    for (int k=0; k < numBytes; ++k)
+        value = (value << 8) | data[k];
+
+    return value;
+}
+
+
+bool SonicFlacReader::readMetadata()
+{
+    unsigned char header [4];
+    if (fread(header, 1, 4, file) != 4 || memcmp(header, "fLaC", 4) != 0)
+        return fail("not a FLAC file");
+
+    bool haveInfo = false;
+    bool last = false;
+    while (!last)
+    {
+        if (fread(header, 1, 4, file) != 4)
+            return fail("metadata is truncated");
+
+        last = (header[0] & 0x80) != 0;
+        const int type = header[0] & 0x7f;
+        long length = long(BigEndian(header+1, 3));
+
+        if (type == 0)      // STREAMINFO
+        {
+            unsigned char info [34];
+            if (length < 34 || fread(info, 1, 34, file) != 34)
+                return fail("STREAMINFO is truncated");
+
+            maxBlockSize  = int(BigEndian(info+2, 2));
+            samplingRate  = long(BigEndian(info+10, 3) >> 4);
+            numChannels   = ((info[12] >> 1) & 7) + 1;
+            bitsPerSample = (((info[12] & 1) << 4) | (info[13] >> 4)) + 1;
+            numFrames     = long(BigEndian(info+13, 5) & 0xfffffffffULL);
+            haveInfo = true;
+            length -= 34;
+        }
+        else if (type == 3 && !seekFrame)       // SEEKTABLE
+        {
+            const int maxPoints = int(length / 18);
+            seekFrame  = new long [maxPoints];
+            seekOffset = new long [maxPoints];
+            for (int k=0; k < maxPoints; ++k)
+            {
+                unsigned char point [18];
+                if (fread(point, 1, 18, file) != 18)
+                    return fail("SEEKTABLE is truncated");
+
+                const unsigned long long frame = BigEndian(point, 8);
+                if (frame != 0xffffffffffffffffULL)     // not a placeholder
+                {
+                    seekFrame[numSeekPoints]  = long(frame);
+                    seekOffset[numSeekPoints] = long(BigEndian(point+8, 8));
+                    ++numSeekPoints;
+                }
+            }
+            length -= 18L * maxPoints;
+        }
+
+        if (length > 0 && fseek(file, length, SEEK_CUR) != 0)
+            return fail("metadata is truncated");
+    }
+
+    if (!haveInfo)
+        return fail("STREAMINFO is missing");
+
+    if (bitsPerSample < 4 || bitsPerSample > 24)
+        return fail("only 4 to 24 bits per sample are supported");
+
+    if (maxBlockSize < 16 || samplingRate <= 0)
+        return fail("STREAMINFO is not valid");
+
+    firstFrameOffset = ftell(file);
+    return true;
+}
+
+
+void SonicFlacReader::restartAt(long offset, long frame)
+{
+    fseek(file, firstFrameOffset + offset, SEEK_SET);
+    bufferOffset = firstFrameOffset + offset;
+    bufferLength = bufferPos = 0;
+    bitCache = 0;
+    numCachedBits = 0;
+    nextFrame = frame;
+    blockSize = 0;
+}
+
+
+inline bool SonicFlacReader::loadByte()
+{
+    if (bufferPos >= bufferLength)
+    {
+        bufferOffset += bufferLength;
+        bufferPos = 0;
+        bufferLength = int(fread(buffer, 1, FLAC_READ_BUFFER, file));
+        if (bufferLength <= 0)
+        {
+            bufferLength = 0;
+            return false;
+        }
+    }
+
+    const unsigned b = buffer[bufferPos++];
+    crc8  = Crc8Table[crc8 ^ b];
+    crc16 = ((crc16 << 8) ^ Crc16Table[(crc16 >> 8) ^ b]) & 0xffff;
+    bitCache = (bitCache << 8) | b;
+    numCachedBits += 8;
+    return true;
+}
+
+
+inline unsigned SonicFlacReader::readBits(int n)
+{
+    // Returns the next n bits, where 0 <= n <= 32.
+
+    while (numCachedBits < n)
+    {
+        if (!loadByte())
+        {
+            fail("unexpected end of file");
+            return 0;
+        }
+    }
+
+    numCachedBits -= n;
+    return unsigned((bitCache >> numCachedBits) & ((1ULL << n) - 1));
+}
+
+
+inline int SonicFlacReader::readSigned(int n)
+{
+    if (n == 0)
+        return 0;
+
+    const unsigned bits = readBits(n) << (32 - n);
+    return int(bits) >> (32 - n);
+}
+
+
+inline unsigned SonicFlacReader::readUnary()
+{
+    // Counts 0 bits up to the next 1 bit.
+
+    unsigned count = 0;
+    for(;;)
+    {
+        while (numCachedBits > 0)
+        {
+            --numCachedBits;
+            if ((bitCache >> numCachedBits) & 1)
+                return count;
+
+            ++count;
+        }
+
+        if (!loadByte())
+        {
+            fail("unexpected end of file");
+            return 0;
+        }
+    }
+}
+
+
+bool SonicFlacReader::decodeFrame()
+{
+    // Decodes the FLAC frame at the current file position into 'block'.
+    // Leaves blockSize 0 at the end of the file.
+
+    const long frameOffset = bufferOffset + bufferPos - firstFrameOffset;
+    blockSize = 0;
+    crc8 = crc16 = 0;
+
+    if (!loadByte())
+        return true;
+
+    const unsigned sync = (readBits(8) << 8) | readBits(8);
+    if ((sync & 0xfffe) != 0xfff8)
+        return fail("lost frame sync");
+
+    const unsigned sizeCode    = readBits(4);
+    const unsigned rateCode    = readBits(4);
+    const unsigned channelCode = readBits(4);
+    const unsigned depthCode   = readBits(3);
+    readBits(1);
+
+    // Frame or sample number, coded like UTF-8.  Decoding keeps its own
+    // count of samples, so the number only has to be well formed.
+    const unsigned lead = readBits(8);
+    int extra = 0;
+    while (extra < 8 && (lead & (0x80 >> extra)))
+        ++extra;
+
+    if (extra == 1 || extra == 8)
+        return fail("bad frame number");
+
+    for (int k=1; k < extra; ++k)
+        if ((readBits(8) & 0xc0) != 0x80)
+            return fail("bad frame number");
+
+    int size;
+    switch (sizeCode)
+    {
+    case 0:     return fail("reserved block size");
+    case 1:     size = 192;                         break;
+    case 6:     size = int(readBits(8)) + 1;        break;
+    case 7:     size = int(readBits(16)) + 1;       break;
+    default:
+        size = (sizeCode < 6) ? (576 << (sizeCode - 2)) : (256 << (sizeCode - 8));
+        break;
+    }
+
+    if (rateCode == 12)
+        readBits(8);
+    else if (rateCode == 13 || rateCode == 14)
+        readBits(16);
+    else if (rateCode == 15)
+        return fail("bad sampling rate");
+
+    const unsigned headerCrc = crc8;
+    if (readBits(8) != headerCrc)
+        return fail("frame header CRC mismatch");
+
+    if (size > maxBlockSize)
+        return fail("block larger than STREAMINFO allows");
+
+    static const int depthTable[8] = { 0, 8, 12, 0, 16, 20, 24, 0 };
+    if (depthCode != 0 && depthTable[depthCode] != bitsPerSample)
+        return fail("bits per sample differ from STREAMINFO");
+
+    if (channelCode > 10)
+        return fail("reserved channel assignment");
+
+    if ((channelCode < 8 ? int(channelCode) + 1 : 2) != numChannels)
+        return fail("channels differ from STREAMINFO");
+
+    blockSize = size;
+    for (int c=0; c < numChannels; ++c)
+    {
+        // The side channel of a stereo pair needs one more bit.
+        const bool side =
+            ((channelCode == 8 || channelCode == 10) && c == 1) ||
+            (channelCode == 9 && c == 0);
+
+        if (!decodeSubframe(c, bitsPerSample + (side ? 1 : 0)))
+        {
+            blockSize = 0;
+            return false;
+        }
+    }
+
+    numCachedBits = 0;      // padding to the byte boundary
+    const unsigned frameCrc = crc16;
+    if (readBits(16) != frameCrc)
+    {
+        blockSize = 0;
+        return fail("frame CRC mismatch");
+    }
+
+    int *a = block;
+    int *b = block + maxBlockSize;
+    switch (channelCode)
+    {
+    case 8:     // left, side
+        for (int i=0; i < size; ++i)
+            b[i] = a[i] - b[i];
+        break;
+
+    case 9:     // side, right
+        for (int i=0; i < size; ++i)
+            a[i] += b[i];
+        break;
+
+    case 10:    // mid, side
+        for (int i=0; i < size; ++i)
+        {
+            const int mid = (a[i] * 2) | (b[i] & 1);
+            a[i] = (mid + b[i]) >> 1;
+            b[i] = (mid - b[i]) >> 1;
+        }
+        break;
+    }
+
+    blockFirst = nextFrame;
+    nextFrame += size;
+
+    const long slot = blockFirst / maxBlockSize;
+    if (slotFrame && slot < numSlots && slotFrame[slot] < 0)
+    {
+        slotFrame[slot] = blockFirst;
+        slotOffset[slot] = frameOffset;
+    }
+
+    return true;
+}
+
+
+bool SonicFlacReader::decodeSubframe(int channel, int bps)
+{
+    int *sample = block + channel * maxBlockSize;
+
+    if (readBits(1) != 0)
+        return fail("bad subframe header");
+
+    const unsigned type = readBits(6);
+    int wasted = 0;
+    if (readBits(1))
+        wasted = int(readUnary()) + 1;
+
+    if (wasted >= bps)
+        return fail("bad wasted bits");
+
+    bps -= wasted;
+
+    if (type == 0)          // CONSTANT
+    {
+        const int value = readSigned(bps);
+        for (int i=0; i < blockSize; ++i)
+            sample[i] = value;
+    }
+    else if (type == 1)     // VERBATIM
+    {
+        for (int i=0; i < blockSize; ++i)
+            sample[i] = readSigned(bps);
+    }
+    else if (type >= 8 && type <= 8 + FLAC_MAX_FIXED_ORDER)
+    {
+        const int order = int(type) - 8;
+        if (order > blockSize)
+            return fail("predictor order exceeds block size");
+
+        for (int i=0; i < order; ++i)
+            sample[i] = readSigned(bps);
+
+        if (!decodeResidual(sample, order))
+            return false;
+
+        int *s = sample;
+        switch (order)
+        {
+        case 1:
+            for (int i=1; i < blockSize; ++i)
+                s[i] += s[i-1];
+            break;
+
+        case 2:
+            for (int i=2; i < blockSize; ++i)
+                s[i] += 2*s[i-1] - s[i-2];
+            break;
+
+        case 3:
+            for (int i=3; i < blockSize; ++i)
+                s[i] += 3*(s[i-1] - s[i-2]) + s[i-3];
+            break;
+
+        case 4:
+            for (int i=4; i < blockSize; ++i)
+                s[i] += 4*(s[i-1] + s[i-3]) - 6*s[i-2] - s[i-4];
+            break;
+        }
+    }
+    else if (type >= 32)    // LPC
+    {
+        const int order = int(type) - 31;
+        if (order > blockSize)
+            return fail("predictor order exceeds block size");
+
+        for (int i=0; i < order; ++i)
+            sample[i] = readSigned(bps);
+
+        const int precision = int(readBits(4)) + 1;
+        if (precision == 16)
+            return fail("bad LPC precision");
+
+        const int shift = readSigned(5);
+        if (shift < 0)
+            return fail("negative LPC shift");
+
+        int coeff [FLAC_MAX_LPC_ORDER];
+        for (int j=0; j < order; ++j)
+            coeff[j] = readSigned(precision);
+
+        if (!decodeResidual(sample, order))
+            return false;
+
+        for (int i=order; i < blockSize; ++i)
+        {
+            long long sum = 0;
+            for (int j=0; j < order; ++j)
+                sum += (long long)coeff[j] * sample[i-1-j];
+
+            sample[i] += int(sum >> shift);
+        }
+    }
+    else
+        return fail("reserved subframe type");
+
+    if (error)
+        return false;
+
+    if (wasted > 0)
+    {
+        const int factor = 1 << wasted;
+        for (int i=0; i < blockSize; ++i)
+            sample[i] *= factor;
+    }
+
+    return true;
+}
+
+
+bool SonicFlacReader::decodeResidual(int *sample, int order)
+{
+    // Stores the residual of sample[order] .. sample[blockSize-1].
+
+    const unsigned method = readBits(2);
+    if (method > 1)
+        return fail("reserved residual coding");
+
+    const int paramBits = method ? 5 : 4;
+    const unsigned escape = method ? 31 : 15;
+    const int partitionOrder = int(readBits(4));
+    const int numPartitions = 1 << partitionOrder;
+    const int partitionSize = blockSize >> partitionOrder;
+    if ((partitionSize << partitionOrder) != blockSize || partitionSize < order)
+        return fail("bad residual partition");
+
+    int i = order;
+    for (int p=0; p < numPartitions; ++p)
+    {
+        const int end = (p + 1) * partitionSize;
+        const unsigned k = readBits(paramBits);
+        if (k == escape)
+        {
+            const int bits = int(readBits(5));
+            for (; i < end; ++i)
+                sample[i] = readSigned(bits);
+        }
+        else
+        {
+            for (; i < end; ++i)
+            {
+                const unsigned u = (readUnary() << k) | readBits(int(k));
+                sample[i] = int(u >> 1) ^ -int(u & 1);
+            }
+        }
+
+        if (error)
+            return false;
+    }
+
+    return true;
+}
+
+
+bool SonicFlacReader::seek(long frame)
+{
+    // Makes 'block' hold the given audio frame, decoding as few FLAC
+    // frames as possible to get there.
+
+    if (blockSize > 0 && frame >= blockFirst && frame < blockFirst + blockSize)
+        return true;
+
+    if (frame < 0 || frame >= numFrames)
+        return fail("read past the end of the file");
+
+    // Find the closest known frame start at or before 'frame'.
+    long startFrame = 0;
+    long startOffset = 0;
+
+    for (int k=0; k < numSeekPoints && seekFrame[k] <= frame; ++k)
+    {
+        startFrame = seekFrame[k];
+        startOffset = seekOffset[k];
+    }
+
+    for (long slot = frame / maxBlockSize; slot >= 0 && slot >= startFrame / maxBlockSize; --slot)
+    {
+        if (slotFrame[slot] >= 0 && slotFrame[slot] <= frame)
+        {
+            if (slotFrame[slot] > startFrame)
+            {
+                startFrame = slotFrame[slot];
+                startOffset = slotOffset[slot];
+            }
+            break;
+        }
+    }
+
+    // Decoding on from the current position may be closer still.
+    if (frame < nextFrame || startFrame > nextFrame)
+        restartAt(startOffset, startFrame);
+
+    for(;;)
+    {
+        if (!decodeFrame())
+            return false;
+
+        if (blockSize == 0)
+            return fail("file is shorter than STREAMINFO says");
+
+        if (frame < blockFirst + blockSize)
+            return true;
+    }
+}
+
+
+bool SonicFlacReader::read(long first, int count, INT16 *dest)
+{
+    // Copies 'count' interleaved audio frames starting at 'first'
+    // into 'dest', scaled to 16 bits.
+
+    const int shift = bitsPerSample - 16;
+    while (count > 0)
+    {
+        if (!seek(first))
+            return false;
+
+        const int offset = int(first - blockFirst);
+        int n = blockSize - offset;
+        if (n > count)
+            n = count;
+
+        for (int c=0; c < numChannels; ++c)
+        {
+            const int *source = block + c*maxBlockSize + offset;
+            INT16 *target = dest + c;
+            if (shift >= 0)
+            {
+                for (int k=0; k < n; ++k, target += numChannels)
+                    *target = INT16(source[k] >> shift);
+            }
+            else
+            {
+                for (int k=0; k < n; ++k, target += numChannels)
+                    *target = INT16(source[k] * (1 << -shift));
+            }
+        }
+
+        dest += n * numChannels;
+        first += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+
+//----------------------------------------------------------------------------
+//  Writing
+
+
+struct FlacBitWriter
+{
+    unsigned char       *bytes;
+    long                length;
+    long                capacity;
+    unsigned long long  accumulator;
+    int                 numBits;        // in 'accumulator' not yet stored
+};
+
+
+static void PutByte(FlacBitWriter &w, unsigned value)
+{
+    if (w.length == w.capacity)
+    {
+        long newCapacity = w.capacity ? 2 * w.capacity : 1024;
+        unsigned char *newBytes = new unsigned char [newCapacity];
+        memcpy(newBytes, w.bytes, w.length);
+        delete[] w.bytes;
+        w.bytes = newBytes;
+        w.capacity = newCapacity;
+    }
+
+    w.bytes[w.length++] = (unsigned char)value;
+}
+
+
+inline void PutBits(FlacBitWriter &w, unsigned value, int n)
+{
+    // Appends the low n bits of 'value', where 0 <= n <= 32.
+
+    w.accumulator = (w.accumulator << n) | (value & ((1ULL << n) - 1));
+    w.numBits += n;
+    while (w.numBits >= 8)
+    {
+        w.numBits -= 8;
+        PutByte(w, unsigned(w.accumulator >> w.numBits) & 0xff);
+    }
+}
+
+
+static void AlignToByte(FlacBitWriter &w)
+{
+    if (w.numBits > 0)
+        PutBits(w, 0, 8 - w.numBits);
+}
+
+
+struct FlacSubframePlan
+{
+    int     type;           // 0 = CONSTANT, 1 = VERBATIM, 8+order = FIXED
+    int     order;
+    int     method;         // residual coding:  0 = 4-bit Rice parameters, 1 = 5-bit
+    int     partitionOrder;
+    int     param [1 << FLAC_MAX_PARTITION_ORDER];
+    long    bits;           // size of the subframe
+};
+
+
+static void FixedResidual(const int *x, int n, int order, int *residual)
+{
+    switch (order)
+    {
+    case 0:
+        for (int i=0; i < n; ++i)
+            residual[i] = x[i];
+        break;
+
+    case 1:
+        for (int i=1; i < n; ++i)
+            residual[i] = x[i] - x[i-1];
+        break;
+
+    case 2:
+        for (int i=2; i < n; ++i)
+            residual[i] = x[i] - 2*x[i-1] + x[i-2];
+        break;
+
+    case 3:
+        for (int i=3; i < n; ++i)
+            residual[i] = x[i] - 3*(x[i-1] - x[i-2]) - x[i-3];
+        break;
+
+    case 4:
+        for (int i=4; i < n; ++i)
+            residual[i] = x[i] - 4*(x[i-1] + x[i-3]) + 6*x[i-2] + x[i-4];
+        break;
+    }
+}
+
+
+inline unsigned ZigZag(int r)
+{
+    return (unsigned(r) << 1) ^ unsigned(r >> 31);
+}
+
+
+static int RiceParameter(unsigned long long sum, long count, long &bits)
+{
+    // Picks the Rice parameter for 'count' residuals whose zigzag values
+    // add up to 'sum', estimating the bits it takes.
+
+    int k = 0;
+    while (k < 30 && ((unsigned long long)count << (k+1)) < sum)
+        ++k;
+
+    bits = count*(k+1) + long(sum >> k);
+    if (k > 0)
+    {
+        const long fewer = count*k + long(sum >> (k-1));
+        if (fewer < bits)
+        {
+            bits = fewer;
+            --k;
+        }
+    }
+
+    return k;
+}
+
+
+static void PlanSubframe(const int *x, int n, int bps, int *residual, FlacSubframePlan &plan)
+{
+    int i = 1;
+    while (i < n && x[i] == x[0])
+        ++i;
+
+    if (i == n)
+    {
+        plan.type = 0;
+        plan.bits = 8 + bps;
+        return;
+    }
+
+    plan.type = 1;
+    plan.bits = 8 + long(n) * bps;
+
+    for (int order=0; order <= FLAC_MAX_FIXED_ORDER && order < n; ++order)
+    {
+        FixedResidual(x, n, order, residual);
+
+        // Sum the residual over the finest partitions allowed,
+        // then merge neighbours for each coarser partition order.
+        int maxOrder = 0;
+        while (maxOrder < FLAC_MAX_PARTITION_ORDER &&
+               (n % (2 << maxOrder)) == 0 &&
+               (n >> (maxOrder + 1)) >= order)
+            ++maxOrder;
+
+        unsigned long long sum [1 << FLAC_MAX_PARTITION_ORDER];
+        const int finestSize = n >> maxOrder;
+        for (int p=0; p < (1 << maxOrder); ++p)
+        {
+            unsigned long long s = 0;
+            for (int j = (p ? p*finestSize : order); j < (p+1)*finestSize; ++j)
+                s += ZigZag(residual[j]);
+
+            sum[p] = s;
+        }
+
+        for (int partitionOrder = maxOrder; partitionOrder >= 0; --partitionOrder)
+        {
+            const int numPartitions = 1 << partitionOrder;
+            const int merge = 1 << (maxOrder - partitionOrder);
+            const long partitionSize = n >> partitionOrder;
+            int param [1 << FLAC_MAX_PARTITION_ORDER];
+            long bits = 8 + long(order)*bps + 2 + 4;
+            int maxParam = 0;
+            for (int p=0; p < numPartitions; ++p)
+            {
+                unsigned long long s = 0;
+                for (int j=0; j < merge; ++j)
+                    s += sum[p*merge + j];
+
+                long riceBits;
+                param[p] = RiceParameter(s, partitionSize - (p ? 0 : order), riceBits);
+                bits += riceBits;
+                if (param[p] > maxParam)
+                    maxParam = param[p];
+            }
+
+            const int method = (maxParam > 14) ? 1 : 0;
+            bits += long(numPartitions) * (method ? 5 : 4);
+
+            if (bits < plan.bits)
+            {
+                plan.type = 8 + order;
+                plan.order = order;
+                plan.method = method;
+                plan.partitionOrder = partitionOrder;
+                plan.bits = bits;
+                for (int p=0; p < numPartitions; ++p)
+                    plan.param[p] = param[p];
+            }
+        }
+    }
+}
+
+
+static void WriteSubframe(FlacBitWriter &w, const int *x, int n, int bps, const FlacSubframePlan &plan, int *residual)
+{
+    PutBits(w, 0, 1);
+    PutBits(w, unsigned(plan.type), 6);
+    PutBits(w, 0, 1);       // no wasted bits
+
+    if (plan.type == 0)
+    {
+        PutBits(w, unsigned(x[0]), bps);
+        return;
+    }
+
+    if (plan.type == 1)
+    {
+        for (int i=0; i < n; ++i)
+            PutBits(w, unsigned(x[i]), bps);
+
+        return;
+    }
+
+    const int order = plan.order;
+    for (int i=0; i < order; ++i)
+        PutBits(w, unsigned(x[i]), bps);
+
+    FixedResidual(x, n, order, residual);
+
+    PutBits(w, unsigned(plan.method), 2);
+    PutBits(w, unsigned(plan.partitionOrder), 4);
+    const int paramBits = plan.method ? 5 : 4;
+    const int partitionSize = n >> plan.partitionOrder;
+    int i = order;
+    for (int p=0; p < (1 << plan.partitionOrder); ++p)
+    {
+        const int k = plan.param[p];
+        const unsigned mask = (1u << k) - 1;
+        PutBits(w, unsigned(k), paramBits);
+        for (const int end = (p+1)*partitionSize; i < end; ++i)
+        {
+            const unsigned u = ZigZag(residual[i]);
+            unsigned q = u >> k;
+            while (q >= 32)
+            {
+                PutBits(w, 0, 32);
+                q -= 32;
+            }
+            PutBits(w, 1, int(q) + 1);
+            PutBits(w, u & mask, k);
+        }
+    }
+}
+
+
+struct SonicFlacWriter::Job
+{
+    const INT16     *data;          // interleaved samples of the block
+    int             numFrames;
+    long            blockNumber;
+    int             numChannels;
+    int             *work;          // room for the channels, mid, side and a residual
+    unsigned char   *bytes;         // the encoded FLAC frame
+    long            numBytes;
+    long            capacity;
+};
+
+
+static void EncodeBlock(SonicFlacWriter::Job &job)
+{
+    const int n = job.numFrames;
+    const int m = job.numChannels;
+    int *mid = job.work + m*FLAC_BLOCK_SIZE;
+    int *side = mid + FLAC_BLOCK_SIZE;
+    int *residual = side + FLAC_BLOCK_SIZE;
+
+    const int *source [FLAC_MAX_CHANNELS];
+    int bps [FLAC_MAX_CHANNELS];
+    FlacSubframePlan plan [FLAC_MAX_CHANNELS];
+    const FlacSubframePlan *use [FLAC_MAX_CHANNELS];
+
+    for (int c=0; c < m; ++c)
+    {
+        int *x = job.work + c*FLAC_BLOCK_SIZE;
+        for (int f=0; f < n; ++f)
+            x[f] = job.data[f*m + c];
+
+        source[c] = x;
+        bps[c] = 16;
+        PlanSubframe(x, n, 16, residual, plan[c]);
+        use[c] = &plan[c];
+    }
+
+    unsigned assignment = unsigned(m - 1);
+    FlacSubframePlan midPlan, sidePlan;
+    if (m == 2)
+    {
+        const int *left = source[0];
+        const int *right = source[1];
+        for (int f=0; f < n; ++f)
+        {
+            mid[f] = (left[f] + right[f]) >> 1;
+            side[f] = left[f] - right[f];
+        }
+
+        PlanSubframe(mid, n, 16, residual, midPlan);
+        PlanSubframe(side, n, 17, residual, sidePlan);
+
+        const long independent = plan[0].bits + plan[1].bits;
+        const long leftSide    = plan[0].bits + sidePlan.bits;
+        const long sideRight   = sidePlan.bits + plan[1].bits;
+        const long midSide     = midPlan.bits + sidePlan.bits;
+
+        if (midSide < independent && midSide <= leftSide && midSide <= sideRight)
+        {
+            assignment = 10;
+            source[0] = mid;    use[0] = &midPlan;
+            source[1] = side;   use[1] = &sidePlan;     bps[1] = 17;
+        }
+        else if (leftSide < independent && leftSide <= sideRight)
+        {
+            assignment = 8;
+            source[1] = side;   use[1] = &sidePlan;     bps[1] = 17;
+        }
+        else if (sideRight < independent)
+        {
+            assignment = 9;
+            source[0] = side;   use[0] = &sidePlan;     bps[0] = 17;
+        }
+    }
+
+    FlacBitWriter w;
+    w.bytes = job.bytes;
+    w.length = 0;
+    w.capacity = job.capacity;
+    w.accumulator = 0;
+    w.numBits = 0;
+
+    PutBits(w, 0xfff8, 16);                             // sync, fixed block size
+    PutBits(w, (n == FLAC_BLOCK_SIZE) ? 12 : 7, 4);     // 12 means 4096
+    PutBits(w, 0, 4);                                   // rate from STREAMINFO
+    PutBits(w, assignment, 4);
+    PutBits(w, 4, 3);                                   // 16 bits per sample
+    PutBits(w, 0, 1);
+
+    const unsigned long number = (unsigned long)job.blockNumber;
+    if (number < 0x80)
+        PutBits(w, unsigned(number), 8);
+    else
+    {
+        int extra = 1;
+        while (extra < 6 && (number >> (6*extra + 6 - extra)) != 0)
+            ++extra;
+
+        PutBits(w, ((0xff00 >> (extra + 1)) & 0xff) | unsigned(number >> (6*extra)), 8);
+        for (int k = extra-1; k >= 0; --k)
+            PutBits(w, 0x80 | unsigned((number >> (6*k)) & 0x3f), 8);
+    }
+
+    if (n != FLAC_BLOCK_SIZE)
+        PutBits(w, unsigned(n - 1), 16);
+
+    PutBits(w, Crc8(w.bytes, w.length), 8);
+
+    for (int c=0; c < m; ++c)
+        WriteSubframe(w, source[c], n, bps[c], *use[c], residual);
+
+    AlignToByte(w);
+    PutBits(w, Crc16(w.bytes, w.length), 16);
+
+    job.bytes = w.bytes;
+    job.capacity = w.capacity;
+    job.numBytes = w.length;
+}
+
+
+struct FlacThreadWork
+{
+    SonicFlacWriter::Job    *jobList;
+    int                     numJobs;
+    int                     first;
+    int                     stride;
+};
+
+
+static void EncodeJobs(const FlacThreadWork &work)
+{
+    for (int k = work.first; k < work.numJobs; k += work.stride)
+        EncodeBlock(work.jobList[k]);
+}
+
+
+#if defined(_WIN32)
+
+static DWORD WINAPI FlacThreadProc(LPVOID arg)
+{
+    EncodeJobs(*(const FlacThreadWork *)arg);
+    return 0;
+}
+
+#else
+
+static void *FlacThreadProc(void *arg)
+{
+    EncodeJobs(*(const FlacThreadWork *)arg);
+    return 0;
+}
+
+#endif
+
+
+static void RunJobs(SonicFlacWriter::Job *jobList, int numJobs, int numThreads)
+{
+    // Encodes the jobs on up to numThreads threads, this one included.
+    // If a thread cannot be started, this thread does its share.
+
+    if (numThreads > numJobs)
+        numThreads = numJobs;
+
+    FlacThreadWork work [FLAC_MAX_THREADS];
+    bool started [FLAC_MAX_THREADS];
+#if defined(_WIN32)
+    HANDLE handle [FLAC_MAX_THREADS];
+#else
+    pthread_t handle [FLAC_MAX_THREADS];
+#endif
+
+    for (int t=0; t < numThreads; ++t)
+    {
+        work[t].jobList = jobList;
+        work[t].numJobs = numJobs;
+        work[t].first = t;
+        work[t].stride = numThreads;
+        started[t] = false;
+        if (t > 0)
+        {
+#if defined(_WIN32)
+            handle[t] = CreateThread(NULL, 0, FlacThreadProc, &work[t], 0, NULL);
+            started[t] = (handle[t] != NULL);
+#else
+            started[t] = (pthread_create(&handle[t], NULL, FlacThreadProc, &work[t]) == 0);
+#endif
+        }
+    }
+
+    for (int t=0; t < numThreads; ++t)
+        if (!started[t])
+            EncodeJobs(work[t]);
+
+    for (int t=1; t < numThreads; ++t)
+    {
+        if (started[t])
+        {
+#if defined(_WIN32)
+            WaitForSingleObject(handle[t], INFINITE);
+            CloseHandle(handle[t]);
+#else
+            pthread_join(handle[t], NULL);
+#endif
+        }
+    }
+}
+
+
+static int CountProcessors()
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return int(info.dwNumberOfProcessors);
+#else
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? int(count) : 1;
+#endif
+}
+
+
+//  MD5 (RFC 1321) of the samples as little-endian 16-bit integers,
+//  which is what STREAMINFO records for 16-bit streams.
+
+static void Md5Transform(unsigned state[4], const unsigned char *chunk)
+{
+    static const int shift[4][4] =
+    {
+        { 7, 12, 17, 22 },
+        { 5,  9, 14, 20 },
+        { 4, 11, 16, 23 },
+        { 6, 10, 15, 21 }
+    };
+
+    unsigned word [16];
+    for (int j=0; j < 16; ++j)
+        word[j] = unsigned(chunk[4*j]) | (unsigned(chunk[4*j+1]) << 8) |
+                  (unsigned(chunk[4*j+2]) << 16) | (unsigned(chunk[4*j+3]) << 24);
+
+    unsigned a = state[0];
+    unsigned b = state[1];
+    unsigned c = state[2];
+    unsigned d = state[3];
+    for (int i=0; i < 64; ++i)
+    {
+        unsigned f;
+        int g;
+        switch (i / 16)
+        {
+        case 0:     f = (b & c) | (~b & d);     g = i;              break;
+        case 1:     f = (d & b) | (~d & c);     g = (5*i + 1) % 16; break;
+        case 2:     f = b ^ c ^ d;              g = (3*i + 5) % 16; break;
+        default:    f = c ^ (b | ~d);           g = (7*i) % 16;     break;
+        }
+
+        const unsigned sum = a + f + Md5Sine[i] + word[g];
+        const int s = shift[i/16][i%4];
+        a = d;
+        d = c;
+        c = b;
+        b += (sum << s) | (sum >> (32 - s));
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+
+SonicFlacWriter::SonicFlacWriter():
+    file(0),
+    error(0),
+    samplingRate(0),
+    numChannels(0),
+    numFrames(0),
+    framesWritten(0),
+    pending(0),
+    pendingData(0),
+    batchData(0),
+    numThreads(0),
+    jobList(0),
+    nextBlockNumber(0),
+    bytesWritten(0),
+    minFrameBytes(0),
+    maxFrameBytes(0),
+    numSeekPoints(0),
+    seekFrame(0),
+    seekOffset(0),
+    seekInterval(0),
+    md5Length(0)
+{
+}
+
+
+SonicFlacWriter::~SonicFlacWriter()
+{
+    close();
+}
+
+
+bool SonicFlacWriter::open(const char *filename, long _samplingRate, int _numChannels, long _numFrames)
+{
+    close();
+    InitTables();
+    error = 0;
+
+    if (_numChannels < 1 || _numChannels > FLAC_MAX_CHANNELS)
+    {
+        error = "FLAC allows 1 to 8 channels";
+        return false;
+    }
+
+    if (_samplingRate < 1 || _samplingRate >= (1L << 20))
+    {
+        error = "sampling rate cannot be stored in FLAC";
+        return false;
+    }
+
+    file = fopen(filename, "wb");
+    if (!file)
+    {
+        error = "cannot open file for write";
+        return false;
+    }
+
+    samplingRate = _samplingRate;
+    numChannels = _numChannels;
+    numFrames = _numFrames;
+    framesWritten = 0;
+    nextBlockNumber = 0;
+    bytesWritten = 0;
+    minFrameBytes = maxFrameBytes = 0;
+
+    seekInterval = FLAC_SEEK_SECONDS * samplingRate;
+    seekInterval -= seekInterval % FLAC_BLOCK_SIZE;
+    if (seekInterval < FLAC_BLOCK_SIZE)
+        seekInterval = FLAC_BLOCK_SIZE;
+
+    numSeekPoints = (numFrames > 0) ? int((numFrames - 1) / seekInterval + 1) : 0;
+    seekFrame = new long [numSeekPoints + 1];
+    seekOffset = new long [numSeekPoints + 1];
+    for (int k=0; k < numSeekPoints; ++k)
+        seekFrame[k] = -1;      // placeholder until written
+
+    numThreads = (Sonic_EncoderThreads > 0) ? Sonic_EncoderThreads : CountProcessors();
+    if (numThreads > FLAC_MAX_THREADS)
+        numThreads = FLAC_MAX_THREADS;
+
+    const int numJobs = numThreads * FLAC_BLOCKS_PER_THREAD;
+    batchData = long(numJobs) * FLAC_BLOCK_SIZE * numChannels;
+    pending = new INT16 [batchData];
+    pendingData = 0;
+
+    jobList = new Job [numJobs];
+    for (int k=0; k < numJobs; ++k)
+    {
+        jobList[k].numChannels = numChannels;
+        jobList[k].work = new int [(numChannels + 3) * FLAC_BLOCK_SIZE];
+        jobList[k].capacity = (long(FLAC_BLOCK_SIZE) * numChannels * 17) / 8 + 64;
+        jobList[k].bytes = new unsigned char [jobList[k].capacity];
+        jobList[k].numBytes = 0;
+    }
+
+    md5State[0] = 0x67452301;
+    md5State[1] = 0xefcdab89;
+    md5State[2] = 0x98badcfe;
+    md5State[3] = 0x10325476;
+    md5Length = 0;
+
+    unsigned char noDigest [16];
+    memset(noDigest, 0, sizeof(noDigest));
+    writeHeader(noDigest);
+    return error == 0;
+}
+
+
+void SonicFlacWriter::writeHeader(const unsigned char *digest)
+{
+    // Writes the metadata blocks:  placeholders when the file is opened,
+    // and the final contents when it is closed.
+
+    unsigned char info [4 + 4 + 34];
+    memcpy(info, "fLaC", 4);
+    info[4] = (numSeekPoints > 0) ? 0x00 : 0x80;    // STREAMINFO, last if no SEEKTABLE
+    info[5] = 0;
+    info[6] = 0;
+    info[7] = 34;
+
+    unsigned char *s = info + 8;
+    s[0] = s[2] = FLAC_BLOCK_SIZE >> 8;
+    s[1] = s[3] = FLAC_BLOCK_SIZE & 0xff;
+    for (int k=0; k < 3; ++k)
+    {
+        s[4+k] = (unsigned char)(minFrameBytes >> (16 - 8*k));
+        s[7+k] = (unsigned char)(maxFrameBytes >> (16 - 8*k));
+    }
+
+    const unsigned long long total = (unsigned long long)framesWritten;
+    s[10] = (unsigned char)(samplingRate >> 12);
+    s[11] = (unsigned char)(samplingRate >> 4);
+    s[12] = (unsigned char)(((samplingRate & 0xf) << 4) | ((numChannels - 1) << 1));   // 16 bits per sample:
+    s[13] = (unsigned char)((15 << 4) | ((total >> 32) & 0xf));                        // 15 split across bytes
+    for (int k=0; k < 4; ++k)
+        s[14+k] = (unsigned char)(total >> (24 - 8*k));
+
+    memcpy(s + 18, digest, 16);
+
+    if (fwrite(info, 1, sizeof(info), file) != sizeof(info))
+        error = "cannot write file";
+
+    if (numSeekPoints > 0)
+    {
+        const long length = 18L * numSeekPoints;
+        unsigned char header [4];
+        header[0] = 0x80 | 3;
+        header[1] = (unsigned char)(length >> 16);
+        header[2] = (unsigned char)(length >> 8);
+        header[3] = (unsigned char)length;
+        if (fwrite(header, 1, 4, file) != 4)
+            error = "cannot write file";
+
+        for (int k=0; k < numSeekPoints; ++k)
+        {
+            unsigned char point [18];
+            if (seekFrame[k] < 0)
+            {
+                memset(point, 0xff, 8);
+                memset(point + 8, 0, 10);
+            }
+            else
+            {
+                for (int j=0; j < 8; ++j)
+                {
+                    point[j]   = (unsigned char)((unsigned long long)seekFrame[k] >> (56 - 8*j));
+                    point[8+j] = (unsigned char)((unsigned long long)seekOffset[k] >> (56 - 8*j));
+                }
+                point[16] = (unsigned char)(FLAC_BLOCK_SIZE >> 8);
+                point[17] = (unsigned char)(FLAC_BLOCK_SIZE & 0xff);
+            }
+
+            if (fwrite(point, 1, 18, file) != 18)
+                error = "cannot write file";
+        }
+    }
+}
+
+
+bool SonicFlacWriter::write(const INT16 *data, long numData)
+{
+    if (!file)
+        return false;
+
+    while (numData > 0)
+    {
+        long n = batchData - pendingData;
+        if (n > numData)
+            n = numData;
+
+        for (long i=0; i < n; ++i)
+        {
+            const INT16 sample = data[i];
+            pending[pendingData + i] = sample;
+
+            const unsigned used = unsigned(md5Length % 64);
+            md5Block[used]   = (unsigned char)(sample & 0xff);
+            md5Block[used+1] = (unsigned char)((sample >> 8) & 0xff);
+            md5Length += 2;
+            if (used == 62)
+                Md5Transform(md5State, md5Block);
+        }
+
+        pendingData += n;
+        data += n;
+        numData -= n;
+
+        if (pendingData == batchData)
+            encodeBatch();
+    }
+
+    return error == 0;
+}
+
+
+void SonicFlacWriter::encodeBatch()
+{
+    const long frames = pendingData / numChannels;
+    const int numJobs = int((frames + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE);
+    for (int k=0; k < numJobs; ++k)
+    {
+        Job &job = jobList[k];
+        job.data = pending + long(k) * FLAC_BLOCK_SIZE * numChannels;
+        job.numFrames = int((k < numJobs - 1) ? FLAC_BLOCK_SIZE : frames - long(k) * FLAC_BLOCK_SIZE);
+        job.blockNumber = nextBlockNumber++;
+    }
+
+    RunJobs(jobList, numJobs, numThreads);
+
+    for (int k=0; k < numJobs; ++k)
+    {
+        const Job &job = jobList[k];
+        const long firstFrame = job.blockNumber * FLAC_BLOCK_SIZE;
+        const int point = int(firstFrame / seekInterval);
+        if (point < numSeekPoints && firstFrame % seekInterval == 0)
+        {
+            seekFrame[point] = firstFrame;
+            seekOffset[point] = bytesWritten;
+        }
+
+        if (fwrite(job.bytes, 1, job.numBytes, file) != size_t(job.numBytes))
+            error = "cannot write file";
+
+        const unsigned size = unsigned(job.numBytes);
+        if (minFrameBytes == 0 || size < minFrameBytes)
+            minFrameBytes = size;
+
+        if (size > maxFrameBytes)
+            maxFrameBytes = size;
+
+        bytesWritten += job.numBytes;
+    }
+
+    framesWritten += frames;
+    pendingData = 0;
+}
+
+
+bool SonicFlacWriter::close()
+{
+    if (!file)
+        return false;
+
+    if (pendingData % numChannels != 0)
+        error = "partial audio frame at end of data";
+    else if (pendingData > 0)
+        encodeBatch();
+
+    // Finish the MD5 signature:  pad with 0x80 and zeros up to the
+    // last 8 bytes of a chunk, which hold the message length in bits.
+    const unsigned long long bitLength = md5Length * 8;
+    unsigned used = unsigned(md5Length % 64);
+    md5Block[used++] = 0x80;
+    if (used > 56)
+    {
+        memset(md5Block + used, 0, 64 - used);
+        Md5Transform(md5State, md5Block);
+        used = 0;
+    }
+    memset(md5Block + used, 0, 56 - used);
+    for (int k=0; k < 8; ++k)
+        md5Block[56+k] = (unsigned char)(bitLength >> (8*k));
+
+    Md5Transform(md5State, md5Block);
+
+    unsigned char digest [16];
+    for (int k=0; k < 16; ++k)
+        digest[k] = (unsigned char)(md5State[k/4] >> (8*(k%4)));
+
+    fseek(file, 0, SEEK_SET);
+    writeHeader(digest);
+    if (fclose(file) != 0)
+        error = "cannot write file";
+
+    file = 0;
+
+    delete[] pending;
+    delete[] seekFrame;
+    delete[] seekOffset;
+    for (int k=0; k < numThreads * FLAC_BLOCKS_PER_THREAD; ++k)
+    {
+        delete[] jobList[k].work;
+        delete[] jobList[k].bytes;
+    }
+    delete[] jobList;
+
+    pending = 0;
+    seekFrame = seekOffset = 0;
+    jobList = 0;
+    numSeekPoints = 0;
+
+    return error == 0;
+}
+
+
+/*--- end of file flac.cpp ---*/
@@ -0,0 +1,129 @@
+/*============================================================================
+
+    flac.h
+
+    Reading and writing FLAC files, so that a program's inputs and outputs
+    can stay compressed.  Samples are exchanged as interleaved 16-bit
+    integers, the same as WAV data.  Implemented in flac.cpp.
+
+============================================================================*/
+#ifndef __ddc_sonic_flac_h
+#define __ddc_sonic_flac_h
+
+
+bool Sonic_IsFlacFilename(const char *filename);     // ends in ".flac"
+
+
+class SonicFlacReader
+{
+public:
+    SonicFlacReader();
+    ~SonicFlacReader();
+
+    bool open(const char *filename);
+    void close();
+
+    long queryNumFrames() const         { return numFrames; }
+    long querySamplingRate() const      { return samplingRate; }
+    int  queryNumChannels() const       { return numChannels; }
+    const char *queryError() const      { return error; }
+
+    bool read(long first, int count, INT16 *dest);
+
+private:
+    bool readMetadata();
+    bool seek(long frame);
+    void restartAt(long offset, long frame);
+    bool decodeFrame();
+    bool decodeSubframe(int channel, int bitsPerSubframe);
+    bool decodeResidual(int *sample, int predictorOrder);
+    bool fail(const char *message);
+
+    bool loadByte();
+    unsigned readBits(int n);
+    int readSigned(int n);
+    unsigned readUnary();
+
+private:
+    FILE    *file;
+    const char *error;
+
+    long    numFrames;          // audio frames (one sample per channel) in the file
+    long    samplingRate;
+    int     numChannels;
+    int     bitsPerSample;
+    int     maxBlockSize;
+    long    firstFrameOffset;   // where the first FLAC frame starts in the file
+
+    int     numSeekPoints;      // from the SEEKTABLE, if any
+    long    *seekFrame;
+    long    *seekOffset;        // relative to firstFrameOffset
+
+    long    numSlots;           // one per maxBlockSize audio frames:
+    long    *slotFrame;         // start of a FLAC frame decoded there, or -1
+    long    *slotOffset;        // relative to firstFrameOffset
+
+    int     *block;             // numChannels rows of maxBlockSize decoded samples
+    long    blockFirst;         // audio frame at the start of 'block'
+    int     blockSize;          // frames in 'block'; 0 if none
+    long    nextFrame;          // audio frame the next FLAC frame starts at
+
+    unsigned char *buffer;      // bytes read ahead from the file
+    int     bufferLength;
+    int     bufferPos;
+    long    bufferOffset;       // file offset of buffer[0]
+    unsigned long long bitCache;
+    int     numCachedBits;
+    unsigned crc8;              // of the frame header so far
+    unsigned crc16;             // of the frame so far
+};
+
+
+class SonicFlacWriter
+{
+public:
+    SonicFlacWriter();
+    ~SonicFlacWriter();
+
+    bool open(const char *filename, long _samplingRate, int _numChannels, long _numFrames);
+    bool write(const INT16 *data, long numData);
+    bool close();
+    const char *queryError() const      { return error; }
+
+    struct Job;
+
+private:
+    void encodeBatch();
+    void writeHeader(const unsigned char *digest);
+
+private:
+    FILE    *file;
+    const char *error;
+    long    samplingRate;
+    int     numChannels;
+    long    numFrames;          // promised to open(), for the seek table
+    long    framesWritten;
+
+    INT16   *pending;           // interleaved samples waiting to be encoded
+    long    pendingData;
+    long    batchData;          // capacity of 'pending'
+    int     numThreads;
+    Job     *jobList;           // one per block of a batch
+
+    long    nextBlockNumber;
+    long    bytesWritten;       // since the first frame
+    unsigned minFrameBytes;
+    unsigned maxFrameBytes;
+    int     numSeekPoints;
+    long    *seekFrame;
+    long    *seekOffset;
+    long    seekInterval;       // frames between seek points
+
+    unsigned md5State [4];
+    unsigned char md5Block [64];
+    unsigned long long md5Length;
+};
+
+
+#endif // __ddc_sonic_flac_h
+/*--- end of file flac.h ---*/
@@ -0,0 +1,282 @@
+/*============================================================================
+
+    resample.cpp
+
+    Streaming polyphase sample-rate converter used by SonicWave.
+
+    The conversion ratio outRate/inRate is reduced to L/M.  Output frame n
+    sits at source position n*M/L, whose fractional part is one of L
+    phases.  Each phase has its own row of windowed-sinc coefficients,
+    computed once when the resampler is created, so producing a frame is
+    just a dot product against the neighbouring source frames.  When L is
+    too large to tabulate every phase, the nearest two rows of a coarser
+    table are blended instead.
+
+============================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sonic.h"
+#include "resample.h"
+
+
+const int MAX_RESAMPLE_PHASES = 1024;
+
+static const double Pi = 4.0 * atan(1.0);
+
+
+static long GreatestCommonDivisor(long a, long b)
+{
+    while (b != 0)
+    {
+        long r = a % b;
+        a = b;
+        b = r;
+    }
+
+    return a;
+}
+
+
+SonicResampler::SonicResampler(
+    long _inRate,
+    long _outRate,
+    int _numChannels,
+    SonicResampleQuality _quality):
+    inRate(_inRate),
+    outRate(_outRate),
+    numChannels(_numChannels),
+    upFactor(1),
+    downFactor(1),
+    numPhases(1),
+    numTaps(0),
+    table(0),
+    coeff(0),
+    window(0),
+    windowCapacity(0),
+    windowBase(0),
+    windowFrames(0)
+{
+    if (inRate <= 0 || outRate <= 0)
+    {
+        fprintf(stderr, "Error:  cannot resample from %ld Hz to %ld Hz\n", inRate, outRate);
+        exit(1);
+    }
+
+    long g = GreatestCommonDivisor(inRate, outRate);
+    upFactor = outRate / g;
+    downFactor = inRate / g;
+    numPhases = (upFactor <= MAX_RESAMPLE_PHASES) ? int(upFactor) : MAX_RESAMPLE_PHASES;
+
+    buildTable(_quality);
+}
+
+
+SonicResampler::~SonicResampler()
+{
+    delete[] table;
+    delete[] coeff;
+    delete[] window;
+    table = coeff = window = 0;
+}
+
+
+long SonicResampler::OutputLength(long numInput, long inRate, long outRate)
+{
+    // Output frame n exists when its source position n*inRate/outRate
+    // falls before the end of the input.
+
+    if (numInput <= 0)
+        return 0;
+
+    double product = double(numInput) * double(outRate);
+    double n = floor(product / double(inRate));
+    while (n * double(inRate) < product)
+        n += 1.0;
+
+    while (n > 0 && (n - 1.0) * double(inRate) >= product)
+        n -= 1.0;
+
+    return long(n);
+}
+
+
+void SonicResampler::buildTable(SonicResampleQuality quality)
+{
+    // Cutoff is a fraction of the source Nyquist frequency; when reducing
+    // the rate it must also fall below the output Nyquist frequency.
+
+    double zeroCrossings, rolloff;
+    switch (quality)
+    {
+    case SRQ_FAST:  zeroCrossings =  8.0;  rolloff = 0.85;  break;
+    case SRQ_BEST:  zeroCrossings = 32.0;  rolloff = 0.95;  break;
+    default:        zeroCrossings = 16.0;  rolloff = 0.91;  break;
+    }
+
+    double cutoff = rolloff;
+    if (outRate < inRate)
+        cutoff *= double(outRate) / double(inRate);
+
+    int halfTaps = int(ceil(zeroCrossings / cutoff));
+    numTaps = 2 * halfTaps;
+
+    table = new float [(numPhases + 1) * numTaps];
+    coeff = new float [numTaps];
+    if (!table || !coeff)
+    {
+        fprintf(stderr, "Error:  out of memory creating resampler filter table\n");
+        exit(1);
+    }
+
+    for (int p=0; p <= numPhases; ++p)
+    {
+        double frac = double(p) / double(numPhases);
+        float *row = table + p*numTaps;
+        double sum = 0.0;
+        for (int j=0; j < numTaps; ++j)
+        {
+            // distance from the output position to source tap j
+            double x = double(j - halfTaps + 1) - frac;
+            double u = x / double(halfTaps);
+            double h = 0.0;
+            if (u > -1.0 && u < 1.0)
+            {
+                double w = 0.42 + 0.5*cos(Pi*u) + 0.08*cos(2.0*Pi*u);     // Blackman
+                double arg = Pi * cutoff * x;
+                double sinc = (arg == 0.0) ? 1.0 : sin(arg)/arg;
+                h = cutoff * sinc * w;
+            }
+
+            row[j] = float(h);
+            sum += h;
+        }
+
+        // Normalize each phase for unity gain at DC.
+        if (sum != 0.0)
+        {
+            for (int j=0; j < numTaps; ++j)
+                row[j] = float(row[j] / sum);
+        }
+    }
+}
+
+
+void SonicResampler::reset()
+{
+    windowBase = 0;
+    windowFrames = 0;
+}
+
+
+void SonicResampler::locate(long n, long &base, long &rem) const
+{
+    // Source position of output frame n is base + rem/L.
+    double product = double(n) * double(downFactor);
+    double b = floor(product / double(upFactor));
+    base = long(b);
+    rem = long(product - b*double(upFactor));
+}
+
+
+void SonicResampler::sourceRange(long firstOut, int numOut, long &lo, long &hi) const
+{
+    long base, rem;
+    locate(firstOut, base, rem);
+    lo = base - numTaps/2 + 1;
+
+    locate(firstOut + (numOut > 0 ? numOut-1 : 0), base, rem);
+    hi = base - numTaps/2 + 1 + numTaps;
+}
+
+
+float *SonicResampler::prepareWindow(long lo, long hi, long &readFirst, int &readCount)
+{
+    // Keep whatever part of the previous window is still needed, which is
+    // the tail of it when reading sequentially, and ask for the rest.
+
+    long needed = hi - lo;
+    if (needed > windowCapacity)
+    {
+        delete[] window;
+        windowCapacity = needed;
+        window = new float [windowCapacity * numChannels];
+        if (!window)
+        {
+            fprintf(stderr, "Error:  out of memory allocating resampler window\n");
+            exit(1);
+        }
+
+        windowFrames = 0;
+    }
+
+    long keep = 0;
+    if (windowFrames > 0 && lo >= windowBase && lo < windowBase + windowFrames)
+    {
+        keep = windowBase + windowFrames - lo;
+        if (keep > needed)
+            keep = needed;
+
+        if (lo > windowBase)
+        {
+            memmove(window,
+                    window + (lo - windowBase)*numChannels,
+                    keep * numChannels * sizeof(float));
+        }
+    }
+
+    windowBase = lo;
+    windowFrames = needed;
+    readFirst = lo + keep;
+    readCount = int(needed - keep);
+    return window + keep*numChannels;
+}
+
+
+void SonicResampler::render(long firstOut, int numOut, float *out)
+{
+    long base, rem;
+    locate(firstOut, base, rem);
+
+    for (int k=0; k < numOut; ++k)
+    {
+        const float *h;
+        if (numPhases == upFactor)
+            h = table + rem*numTaps;
+        else
+        {
+            double position = double(rem) * double(numPhases) / double(upFactor);
+            int p = int(position);
+            float frac = float(position - p);
+            const float *h1 = table + p*numTaps;
+            const float *h2 = h1 + numTaps;
+            for (int j=0; j < numTaps; ++j)
+                coeff[j] = h1[j] + frac*(h2[j] - h1[j]);
+
+            h = coeff;
+        }
+
+        const float *source = window + (base - numTaps/2 + 1 - windowBase)*numChannels;
+        for (int c=0; c < numChannels; ++c)
+        {
+            const float *s = source + c;
+            float sum = float(0);
+            for (int j=0; j < numTaps; ++j, s += numChannels)
+                sum += h[j] * *s;
+
+            *out++ = sum;
+        }
+
+        rem += downFactor;
+        while (rem >= upFactor)
+        {
+            rem -= upFactor;
+            ++base;
+        }
+    }
+}
+
+
+/*--- end of file resample.cpp ---*/
@@ -0,0 +1,57 @@
+/*============================================================================
+
+    resample.h
+
+    Streaming polyphase sample-rate converter used by SonicWave to read
+    WAV files whose sampling rate differs from the program's rate.
+
+============================================================================*/
+#ifndef __ddc_sonic_resample_h
+#define __ddc_sonic_resample_h
+
+
+class SonicResampler
+{
+public:
+    SonicResampler(
+        long _inRate,
+        long _outRate,
+        int _numChannels,
+        SonicResampleQuality _quality);
+
+    ~SonicResampler();
+
+    long queryInRate() const    { return inRate; }
+    long queryOutRate() const   { return outRate; }
+
+    static long OutputLength(long numInput, long inRate, long outRate);
+
+    void reset();
+    void sourceRange(long firstOut, int numOut, long &lo, long &hi) const;
+    float *prepareWindow(long lo, long hi, long &readFirst, int &readCount);
+    void render(long firstOut, int numOut, float *out);
+
+protected:
+    void buildTable(SonicResampleQuality quality);
+    void locate(long n, long &base, long &rem) const;
+
+private:
+    long    inRate;
+    long    outRate;
+    int     numChannels;
+    long    upFactor;       // L:  output rate / gcd
+    long    downFactor;     // M:  input rate / gcd
+    int     numPhases;      // rows in 'table', less the extra row at the end
+    int     numTaps;
+    float  *table;          // (numPhases+1) rows of numTaps coefficients
+    float  *coeff;          // scratch row for interpolated phases
+
+    float  *window;         // interleaved source frames starting at windowBase
+    long    windowCapacity; // frames
+    long    windowBase;
+    long    windowFrames;
+};
+
+
+#endif // __ddc_sonic_resample_h
+/*--- end of file resample.h ---*/
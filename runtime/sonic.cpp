@@ -27,11 +27,32 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define SONIC_CAN_MAP_FILES
+#endif
 
 #include "sonic.h"
 #include "riff.h"
 #include "copystr.h"
 #include "fourier.h"
+#include "resample.h"
+#include "flac.h"
 
 
 double ScanReal(const char *varname, const char *vstring)
@@ -86,6 +107,559 @@ int ScanBoolean(const char *varname, const char *vstring)
 }
 
 
+SonicResampleQuality Sonic_ResampleQuality = SRQ_OFF;
+long Sonic_CheckpointSeconds = 0;
+bool Sonic_ResumeFlag = false;
+const char *Sonic_CacheDirectory = 0;
+long Sonic_CacheLimitMegabytes = 2048;
+bool Sonic_IncrementalFlag = false;
+double Sonic_WarmupSeconds = 1.0;
+long Sonic_InputCacheMegabytes = 256;
+int Sonic_EncoderThreads = 0;
+double Sonic_PreviewFrom = -1.0;
+double Sonic_PreviewTo = -1.0;
+double Sonic_PrerollSeconds = 2.0;
+
+// "--mix=name:matrix" options, looked up by each SonicWave as it is created.
+const int MAX_MIX_OPTIONS = 64;
+static const char *MixOptions [MAX_MIX_OPTIONS];
+static int NumMixOptions = 0;
+
+
+int ScanOptions(int argc, char *argv[])
+{
+    // Remove any runtime options from the command line, leaving only the
+    // program's own arguments.  Options are recognized anywhere so that
+    // they can be added to the end of an existing command.
+
+    int keep = 1;
+    for (int k=1; k < argc; ++k)
+    {
+        const char *arg = argv[k];
+        if (strcmp(arg, "--resample") == 0)
+            Sonic_ResampleQuality = SRQ_GOOD;
+        else if (strncmp(arg, "--resample=", 11) == 0)
+        {
+            const char *value = arg + 11;
+            if (strcmp(value, "fast") == 0)
+                Sonic_ResampleQuality = SRQ_FAST;
+            else if (strcmp(value, "good") == 0)
+                Sonic_ResampleQuality = SRQ_GOOD;
+            else if (strcmp(value, "best") == 0)
+                Sonic_ResampleQuality = SRQ_BEST;
+            else if (strcmp(value, "off") == 0)
+                Sonic_ResampleQuality = SRQ_OFF;
+            else
+            {
+                fprintf(stderr, "Error:  Unknown resampling quality '%s' (use fast, good, best, or off)\n", value);
+                exit(1);
+            }
+        }
+        else if (strncmp(arg, "--mix=", 6) == 0)
+        {
+            if (NumMixOptions >= MAX_MIX_OPTIONS || !strchr(arg, ':'))
+            {
+                fprintf(stderr, "Error:  Invalid option '%s'\n", arg);
+                exit(1);
+            }
+
+            MixOptions[NumMixOptions++] = arg + 6;
+        }
+        else if (strcmp(arg, "--checkpoint") == 0)
+            Sonic_CheckpointSeconds = 60;
+        else if (strncmp(arg, "--checkpoint=", 13) == 0)
+        {
+            Sonic_CheckpointSeconds = ScanInteger("--checkpoint", arg + 13);
+            if (Sonic_CheckpointSeconds < 1)
+            {
+                fprintf(stderr, "Error:  Invalid option '%s' (need a number of seconds)\n", arg);
+                exit(1);
+            }
+        }
+        else if (strcmp(arg, "--resume") == 0)
+            Sonic_ResumeFlag = true;
+        else if (strcmp(arg, "--cache") == 0)
+            Sonic_CacheDirectory = "sonic-cache";
+        else if (strncmp(arg, "--cache=", 8) == 0 && arg[8])
+            Sonic_CacheDirectory = arg + 8;
+        else if (strncmp(arg, "--cache-limit=", 14) == 0)
+        {
+            Sonic_CacheLimitMegabytes = ScanInteger("--cache-limit", arg + 14);
+            if (Sonic_CacheLimitMegabytes < 1)
+            {
+                fprintf(stderr, "Error:  Invalid option '%s' (need a number of megabytes)\n", arg);
+                exit(1);
+            }
+        }
+        else if (strncmp(arg, "--input-cache=", 14) == 0)
+        {
+            Sonic_InputCacheMegabytes = ScanInteger("--input-cache", arg + 14);
+            if (Sonic_InputCacheMegabytes < 0)
+            {
+                fprintf(stderr, "Error:  Invalid option '%s' (need a number of megabytes)\n", arg);
+                exit(1);
+            }
+        }
+        else if (strncmp(arg, "--threads=", 10) == 0)
+        {
+            Sonic_EncoderThreads = int(ScanInteger("--threads", arg + 10));
+            if (Sonic_EncoderThreads < 1)
+            {
+                fprintf(stderr, "Error:  Invalid option '%s' (need a number of threads)\n", arg);
+                exit(1);
+            }
+        }
+        else if (strcmp(arg, "--incremental") == 0)
+            Sonic_IncrementalFlag = true;
+        else if (strncmp(arg, "--warmup=", 9) == 0)
+        {
+            Sonic_WarmupSeconds = ScanReal("--warmup", arg + 9);
+            if (Sonic_WarmupSeconds < 0)
+            {
+                fprintf(stderr, "Error:  Invalid option '%s' (need a number of seconds)\n", arg);
+                exit(1);
+            }
+        }
+        else if (strcmp(arg, "--from") == 0 || strncmp(arg, "--from=", 7) == 0 ||
+                 strcmp(arg, "--to") == 0   || strncmp(arg, "--to=", 5) == 0)
+        {
+            // Either "--from=120s" or "--from 120s"; the 's' is optional.
+            const bool from = (arg[2] == 'f');
+            const char *value = strchr(arg, '=');
+            if (value)
+                ++value;
+            else if (k+1 < argc)
+                value = argv[++k];
+            else
+            {
+                fprintf(stderr, "Error:  Option '%s' needs a number of seconds\n", arg);
+                exit(1);
+            }
+
+            const double seconds = ScanReal(from ? "--from" : "--to", value);
+            if (seconds < 0)
+            {
+                fprintf(stderr, "Error:  Invalid option '%s %s' (need a number of seconds)\n", arg, value);
+                exit(1);
+            }
+
+            if (from)
+                Sonic_PreviewFrom = seconds;
+            else
+                Sonic_PreviewTo = seconds;
+        }
+        else if (strncmp(arg, "--preroll=", 10) == 0)
+        {
+            Sonic_PrerollSeconds = ScanReal("--preroll", arg + 10);
+            if (Sonic_PrerollSeconds < 0)
+            {
+                fprintf(stderr, "Error:  Invalid option '%s' (need a number of seconds)\n", arg);
+                exit(1);
+            }
+        }
+        else
+            argv[keep++] = argv[k];
+    }
+
+    if (Sonic_IsPreview())
+    {
+        if (Sonic_PreviewTo >= 0 && Sonic_PreviewTo <= Sonic_PreviewFrom)
+        {
+            fprintf(stderr, "Error:  Nothing to render between --from=%g and --to=%g\n", Sonic_PreviewFrom, Sonic_PreviewTo);
+            exit(1);
+        }
+
+        // A preview is not the real thing, so keep it out of the cache
+        // and away from checkpoints of full renders.
+        Sonic_CacheDirectory = 0;
+        Sonic_IncrementalFlag = false;
+        Sonic_CheckpointSeconds = 0;
+        Sonic_ResumeFlag = false;
+    }
+
+    // Incremental rendering works from what the cache kept of the last run.
+    if (Sonic_IncrementalFlag && !Sonic_CacheDirectory)
+        Sonic_CacheDirectory = "sonic-cache";
+
+    argv[keep] = 0;
+    return keep;
+}
+
+
+bool Sonic_IsPreview()
+{
+    return Sonic_PreviewFrom >= 0 || Sonic_PreviewTo >= 0;
+}
+
+
+long Sonic_NaturalEnd(int numReads, const double span[])
+{
+    // Read r covers the indices i where i + offset falls inside the wave.
+    // The loop keeps going as long as some read is in range, so it ends at
+    // the first index that no read covers.
+
+    for (int r=0; r < numReads; ++r)
+        if (span[2*r] != floor(span[2*r]))
+            return -1;      // rounding toward zero makes the edges fuzzy
+
+    long end = 0;
+    for (bool grew = true; grew; )
+    {
+        grew = false;
+        for (int r=0; r < numReads; ++r)
+        {
+            const long offset = long(span[2*r]);
+            long first = -offset;
+            long past;
+            if (span[2*r+1] >= 0)
+                past = long(span[2*r+1]) - offset;
+            else if (offset < 0)
+                past = SONIC_QUIET_FOREVER;     // reading back into its own result
+            else
+                continue;   // reading ahead of its own result: never in range
+
+            if (first <= end && end < past)
+            {
+                if (past == SONIC_QUIET_FOREVER)
+                    return SONIC_QUIET_FOREVER;
+
+                end = past;
+                grew = true;
+            }
+        }
+    }
+
+    return end;
+}
+
+
+long Sonic_FeedbackLimit(int numReads, const double offset[])
+{
+    // Frame k reads long(k + offset), at least floor(-offset) frames back
+    // wherever that is a valid index (truncating toward zero can only move
+    // it closer near index 0).  Reading ahead, or at k itself, finds
+    // nothing written yet either way.
+
+    long limit = SONIC_QUIET_FOREVER;
+    for (int r=0; r < numReads; ++r)
+    {
+        if (offset[r] >= 0)
+            continue;
+
+        const double distance = floor(-offset[r]);
+        if (distance < double(limit))
+            limit = (distance < 1) ? 1 : long(distance);
+    }
+
+    return limit;
+}
+
+
+//--------------------------------------------------------------------------
+//  Channel mixing.
+//
+//  A WAV file or stream with a different number of channels than the
+//  program is mixed to 'm' channels as its blocks are decoded.  By default
+//  fewer channels are repeated (mono is copied to every channel) and more
+//  channels are averaged into the output channel they fall on modulo 'm'
+//  (stereo is averaged down to mono).  Any other mapping can be given as
+//  a matrix with one row per program channel and one column per file
+//  channel, e.g. "--mix=voice:1,0/0.7,0.7".
+
+static void BuildDefaultMatrix(int outChannels, int inChannels, float *matrix)
+{
+    for (int c=0; c < outChannels; ++c)
+    {
+        float *row = matrix + c*inChannels;
+        for (int j=0; j < inChannels; ++j)
+            row[j] = float(0);
+
+        if (inChannels <= outChannels)
+            row[c % inChannels] = float(1);
+        else
+        {
+            int count = 0;
+            for (int j=c; j < inChannels; j += outChannels)
+                ++count;
+
+            for (int j=c; j < inChannels; j += outChannels)
+                row[j] = float(1) / float(count);
+        }
+    }
+}
+
+
+static void MixFrames(
+    const short *raw,
+    int numFrames,
+    int inChannels,
+    int outChannels,
+    const float *matrix,        // NULL means the channels are copied
+    float *dest)
+{
+    const float scale = float(1.0 / 32768.0);
+    if (!matrix)
+    {
+        int numData = numFrames * outChannels;
+        for (int k=0; k < numData; ++k)
+            dest[k] = raw[k] * scale;
+
+        return;
+    }
+
+    for (int f=0; f < numFrames; ++f, raw += inChannels)
+    {
+        const float *row = matrix;
+        for (int c=0; c < outChannels; ++c, row += inChannels)
+        {
+            float sum = float(0);
+            for (int j=0; j < inChannels; ++j)
+                sum += row[j] * raw[j];
+
+            *dest++ = sum * scale;
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------
+//  Buffer pool.
+//
+//  SonicWave objects used to allocate all of their I/O buffers in the
+//  constructor, which costs tens of megabytes per wave for large values
+//  of 'm' even when a wave is never opened.  Now the buffers are acquired
+//  when a wave is opened and handed back here when it is closed, so that
+//  the next wave to be opened can reuse them without touching the heap.
+//
+//  Define SONIC_HUGE_PAGES to ask the kernel to back large buffers
+//  with huge pages (Linux only; ignored elsewhere).
+
+struct SonicBufferPoolEntry
+{
+    SonicBufferPoolEntry   *next;
+    size_t                  numBytes;
+    void                   *block;
+};
+
+const int MAX_POOLED_BUFFERS = 16;
+
+static SonicBufferPoolEntry *BufferPoolHead = 0;
+static int NumPooledBuffers = 0;
+
+
+static void *AllocateAlignedBlock(size_t numBytes)
+{
+    void *block = 0;
+
+#if defined(_MSC_VER)
+    block = _aligned_malloc(numBytes, SONIC_BUFFER_ALIGNMENT);
+#else
+    size_t alignment = SONIC_BUFFER_ALIGNMENT;
+
+#if defined(SONIC_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    const size_t hugePageSize = 2 * 1024 * 1024;
+    if (numBytes >= hugePageSize)
+        alignment = hugePageSize;
+#endif
+
+    if (posix_memalign(&block, alignment, numBytes) != 0)
+        block = 0;
+
+#if defined(SONIC_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    if (block && alignment == hugePageSize)
+        madvise(block, numBytes, MADV_HUGEPAGE);
+#endif
+#endif
+
+    return block;
+}
+
+
+static void FreeAlignedBlock(void *block)
+{
+#if defined(_MSC_VER)
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+
+void *Sonic_AcquireBuffer(size_t numBytes)
+{
+    SonicBufferPoolEntry *prev = 0;
+    for (SonicBufferPoolEntry *e = BufferPoolHead; e; prev = e, e = e->next)
+    {
+        if (e->numBytes == numBytes)
+        {
+            if (prev)
+                prev->next = e->next;
+            else
+                BufferPoolHead = e->next;
+
+            --NumPooledBuffers;
+            void *block = e->block;
+            delete e;
+            return block;
+        }
+    }
+
+    void *block = AllocateAlignedBlock(numBytes);
+    if (!block)
+    {
+        // Maybe idle buffers of other sizes are in the way...
+        Sonic_FlushBufferPool();
+        block = AllocateAlignedBlock(numBytes);
+        if (!block)
+        {
+            fprintf(stderr, "Error:  Out of memory allocating %lu byte sample buffer\n",
+                    (unsigned long) numBytes);
+
+            exit(1);
+        }
+    }
+
+    return block;
+}
+
+
+void Sonic_ReleaseBuffer(void *block, size_t numBytes)
+{
+    if (!block)
+        return;
+
+    if (NumPooledBuffers >= MAX_POOLED_BUFFERS)
+    {
+        FreeAlignedBlock(block);
+        return;
+    }
+
+    SonicBufferPoolEntry *e = new SonicBufferPoolEntry;
+    if (!e)
+    {
+        FreeAlignedBlock(block);
+        return;
+    }
+
+    e->numBytes = numBytes;
+    e->block = block;
+    e->next = BufferPoolHead;
+    BufferPoolHead = e;
+    ++NumPooledBuffers;
+}
+
+
+void Sonic_FlushBufferPool()
+{
+    while (BufferPoolHead)
+    {
+        SonicBufferPoolEntry *e = BufferPoolHead;
+        BufferPoolHead = e->next;
+        FreeAlignedBlock(e->block);
+        delete e;
+    }
+
+    NumPooledBuffers = 0;
+}
+
+
+//--------------------------------------------------------------------------
+//  Streams.
+//
+//  A wave bound to "-" reads from stdin or writes to stdout, depending on
+//  how the program uses it; "-.f32" does the same with raw floats.  A wave
+//  bound to a FIFO or character device is treated the same way.  Output
+//  streams are 16-bit WAV with the size fields set to 0xFFFFFFFF (the usual
+//  convention for WAV of unknown length), or headerless 32-bit floats if
+//  the name ends in ".f32".  Because nothing can be backpatched, 16-bit
+//  stream output is clipped rather than normalized.  Input streams may be
+//  either WAV or headerless floats; the first four bytes tell which.
+
+static bool IsStreamFilename(const char *filename, bool &rawFloat)
+{
+    rawFloat = false;
+    if (!filename || !*filename)
+        return false;
+
+    const char *ext = strrchr(filename, '.');
+    bool f32 = ext && strcmp(ext, ".f32") == 0;
+
+    if (strcmp(filename, "-") == 0 || strcmp(filename, "-.f32") == 0)
+    {
+        rawFloat = f32;
+        return true;
+    }
+
+#if defined(S_ISFIFO) && defined(S_ISCHR)
+    struct stat info;
+    if (stat(filename, &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISCHR(info.st_mode)))
+    {
+        rawFloat = f32;
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+
+static bool IsStandardStreamName(const char *filename)
+{
+    return filename && filename[0] == '-' && (filename[1] == '\0' || filename[1] == '.');
+}
+
+
+static void SetBinaryMode(FILE *file)
+{
+#if defined(_WIN32)
+    _setmode(_fileno(file), _O_BINARY);
+#else
+    (void) file;
+#endif
+}
+
+
+static void SyncFile(FILE *file)
+{
+    // Make sure data reaches the disk, not just the operating system,
+    // so that a checkpoint survives the whole machine going down.
+
+    fflush(file);
+#if defined(_WIN32)
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+}
+
+
+static int TruncateFile(FILE *file, long size)
+{
+    fflush(file);
+#if defined(_WIN32)
+    return _chsize(_fileno(file), size);
+#else
+    return ftruncate(fileno(file), off_t(size));
+#endif
+}
+
+
+static unsigned long GetLittleEndian(const unsigned char *p, int numBytes)
+{
+    unsigned long x = 0;
+    for (int k = numBytes-1; k >= 0; --k)
+        x = (x << 8) | p[k];
+
+    return x;
+}
+
+
+static void PutLittleEndian(unsigned char *p, unsigned long x, int numBytes)
+{
+    for (int k=0; k < numBytes; ++k, x >>= 8)
+        p[k] = (unsigned char)(x & 0xff);
+}
+
 
 //--------------------------------------------------------------------------
 
@@ -95,10 +669,12 @@ SonicWave::SonicWave(
     const char *_filename,
     const char *_varname,
     long _requiredSamplingRate,
-    int _requiredNumChannels):
+    int _requiredNumChannels,
+    SonicWaveUsage _usage):
     varname(DDC_CopyString(_varname)),
     inFilename(DDC_CopyString(_filename)),
     inWave(0),
+    inFlac(0),
     inFile(0),
     inNumSamples(0),
     outFilename(0),
@@ -113,17 +689,50 @@ SonicWave::SonicWave(
     outBufferPos(0),
     samplesWritten(0),
     dataIn_OutBuffer(0),
+    inWaveBuffer(0),
+    inWaveBufferSize(0),
     inBuffer(0),
     inBufferSize(_requiredNumChannels * (64*1024)),
     inBufferBaseIndex(0),
     dataIn_InBuffer(0),
-    nextReadIndex(0)
+    nextReadIndex(0),
+    streamState(SSS_NONE),
+    streamFile(0),
+    streamRawFloat(false),
+    streamFramesRead(0),
+    streamFramesLimit(LONG_MAX),
+    usage(_usage),
+    dataWritten(false),
+    mappedFile(0),
+    mappedSize(0),
+    mappedData(0),
+    mappedIsWave(false),
+    resampler(0),
+    decodedSource(0),
+    pinnedBlock(-1),
+    inWindow(0),
+    sourceNumSamples(0),
+    sourceReadIndex(0),
+    fileNumChannels(_requiredNumChannels),
+    channelMatrix(0),
+    customMatrix(0),
+    customColumns(0),
+    silenceMap(0),
+    silenceMapSize(0),
+    outFileHole(false),
+    patchBase(0),
+    patchFrames(0),
+    patchDirty(0),
+    patchPast(0),
+    cacheIdentity(0),
+    stats(0),
+    statsGeneration(0),
+    reusePlan(0),
+    fastWindow(0),
+    fastFirst(0),
+    fastFrames(0)
 {
-    outBuffer = new float [outBufferSize];
-    inBuffer = new float [inBufferSize];
-    inWaveBuffer = new short [inBufferSize];
-
-    if (!varname || !inFilename || !outBuffer || !inBuffer || !inWaveBuffer)
+    if (!varname || !inFilename)
     {
         fprintf(stderr, "Out of memory creating Sonic variable '%s'\n", _varname);
         exit(1);
@@ -138,32 +747,47 @@ SonicWave::SonicWave(
         exit(1);
     }
 
-    determineNumSamples();
-}
-
-
-SonicWave::~SonicWave()
-{
-    close();
-
-    if (outBuffer)
+    for (int k=0; k < NumMixOptions; ++k)
     {
-        delete[] outBuffer;
-        outBuffer = 0;
+        const char *spec = MixOptions[k];
+        const char *colon = strchr(spec, ':');
+        if (size_t(colon - spec) == strlen(varname) && memcmp(spec, varname, colon - spec) == 0)
+            parseChannelMatrix(colon + 1);
     }
 
-    if (inBuffer)
+    if (IsStreamFilename(inFilename, streamRawFloat))
     {
-        delete[] inBuffer;
-        inBuffer = 0;
-    }
+        // A stream's length is unknown until it ends.  Its input buffer
+        // doubles as the lookback ring, so make it hold several seconds.
 
-    if (inWaveBuffer)
-    {
-        delete[] inWaveBuffer;
-        inWaveBuffer = 0;
+        streamState = SSS_UNUSED;
+        long ringFrames = SONIC_STREAM_LOOKBACK_SECONDS * requiredSamplingRate;
+        if (ringFrames > 64*1024)
+            inBufferSize = requiredNumChannels * int(ringFrames);
     }
+    else if (usage != SWU_OUT)
+        determineNumSamples();
+}
+
 
+SonicWave::~SonicWave()
+{
+    close();
+
+    if (streamFile && streamFile != stdin && streamFile != stdout)
+        fclose(streamFile);
+
+    streamFile = 0;
+    delete resampler;
+    resampler = 0;
+    delete[] channelMatrix;
+    delete[] customMatrix;
+    channelMatrix = customMatrix = 0;
+    delete[] silenceMap;
+    silenceMap = 0;
+    DDC_DeleteString(cacheIdentity);
+    delete reusePlan;
+    reusePlan = 0;
     inBufferSize = 0;
     outBufferSize = outBufferPos = 0;
 
@@ -208,8 +832,21 @@ void SonicWave::determineNumSamples()
             return;
 
         inNumSamples = tempWave.NumSamples();
+        if (long(tempWave.SamplingRate()) != requiredSamplingRate && Sonic_ResampleQuality != SRQ_OFF)
+            inNumSamples = SonicResampler::OutputLength(inNumSamples, long(tempWave.SamplingRate()), requiredSamplingRate);
+
         tempWave.Close();
     }
+    else if (memcmp(peek,"fLaC",4) == 0)
+    {
+        SonicFlacReader tempFlac;
+        if (!tempFlac.open(inFilename))
+            return;
+
+        inNumSamples = tempFlac.queryNumFrames();
+        if (tempFlac.querySamplingRate() != requiredSamplingRate && Sonic_ResampleQuality != SRQ_OFF)
+            inNumSamples = SonicResampler::OutputLength(inNumSamples, tempFlac.querySamplingRate(), requiredSamplingRate);
+    }
     else
     {
         inNumSamples = (fsize/sizeof(float) - 1) / requiredNumChannels;
@@ -217,295 +854,2096 @@ void SonicWave::determineNumSamples()
 }
 
 
-void SonicWave::openForRead()
+void SonicWave::acquireInputBuffers(bool needWaveBuffer)
 {
-    samplesWritten = 0;
-    dataIn_OutBuffer = 0;
-    dataIn_InBuffer = 0;
-    inBufferBaseIndex = 0;
-    nextReadIndex = 0;
+    if (!inBuffer)
+        inBuffer = (float *) Sonic_AcquireBuffer(inBufferSize * sizeof(float));
 
-    if (mode != SWM_CLOSED)
+    inWindow = inBuffer;
+
+    if (needWaveBuffer && !inWaveBuffer)
+    {
+        if (inWaveBufferSize < inBufferSize)
+            inWaveBufferSize = inBufferSize;
+
+        inWaveBuffer = (short *) Sonic_AcquireBuffer(inWaveBufferSize * sizeof(short));
+    }
+}
+
+
+void SonicWave::acquireOutputBuffer()
+{
+    if (!outBuffer)
+        outBuffer = (float *) Sonic_AcquireBuffer(outBufferSize * sizeof(float));
+}
+
+
+void SonicWave::releaseBuffers()
+{
+    fastFrames = 0;
+
+    Sonic_ReleaseBuffer(outBuffer, outBufferSize * sizeof(float));
+    outBuffer = 0;
+    dataIn_OutBuffer = 0;
+
+    Sonic_ReleaseBuffer(inBuffer, inBufferSize * sizeof(float));
+    inBuffer = 0;
+    inWindow = 0;
+    dataIn_InBuffer = 0;
+
+    Sonic_ReleaseBuffer(inWaveBuffer, inWaveBufferSize * sizeof(short));
+    inWaveBuffer = 0;
+}
+
+
+void SonicWave::mapInputFile(long dataOffset, bool isWave)
+{
+    // Maps an 'in' wave's file read-only so that reads need no system
+    // calls.  If mapping is not possible, reads go through stdio as usual.
+
+#if defined(SONIC_CAN_MAP_FILES)
+    int fd = ::open(inFilename, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return;
+    }
+
+    size_t fileSize = size_t(info.st_size);
+    size_t bytesPerFrame = isWave ? sizeof(INT16) * fileNumChannels : sizeof(float) * requiredNumChannels;
+    long fileFrames = resampler ? sourceNumSamples : inNumSamples;
+    size_t neededSize = size_t(dataOffset) + size_t(fileFrames) * bytesPerFrame;
+    if (fileSize == 0 || fileSize < neededSize)
+    {
+        ::close(fd);
+        return;
+    }
+
+    void *block = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (block == MAP_FAILED)
+        return;
+
+#if defined(MADV_SEQUENTIAL)
+    madvise(block, fileSize, MADV_SEQUENTIAL);
+#endif
+
+    mappedFile = block;
+    mappedSize = fileSize;
+    mappedData = (const char *)block + dataOffset;
+    mappedIsWave = isWave;
+#else
+    (void) dataOffset;
+    (void) isWave;
+#endif
+}
+
+
+void SonicWave::unmapInputFile()
+{
+#if defined(SONIC_CAN_MAP_FILES)
+    if (mappedFile)
+        munmap(mappedFile, mappedSize);
+#endif
+
+    mappedFile = 0;
+    mappedSize = 0;
+    mappedData = 0;
+}
+
+
+void SonicWave::setChannelMatrix(int numFileChannels, const double matrix[])
+{
+    // 'matrix' has one row of 'numFileChannels' gains for each channel of
+    // the program.  It is used from the next time the wave is opened.
+
+    if (numFileChannels < 1 || numFileChannels > MAX_SONIC_CHANNELS)
+    {
+        fprintf(stderr, "Error:  Invalid channel matrix for variable '%s'\n", varname);
+        exit(1);
+    }
+
+    delete[] customMatrix;
+    stats = 0;
+    int numData = requiredNumChannels * numFileChannels;
+    customMatrix = new float [numData];
+    if (!customMatrix)
+    {
+        fprintf(stderr, "Error:  Out of memory setting channel matrix for variable '%s'\n", varname);
+        exit(1);
+    }
+
+    for (int k=0; k < numData; ++k)
+        customMatrix[k] = float(matrix[k]);
+
+    customColumns = numFileChannels;
+}
+
+
+void SonicWave::parseChannelMatrix(const char *spec)
+{
+    // Rows are separated by '/', and the gains within a row by ','.
+
+    double matrix [MAX_SONIC_CHANNELS * MAX_SONIC_CHANNELS];
+    int numData = 0;
+    int numRows = 1;
+    int numColumns = 0;
+    int columnsInRow = 0;
+    const char *p = spec;
+    for (;;)
+    {
+        char *end = 0;
+        double gain = strtod(p, &end);
+        if (end == p || numData >= MAX_SONIC_CHANNELS * MAX_SONIC_CHANNELS)
+            break;
+
+        matrix[numData++] = gain;
+        ++columnsInRow;
+        p = end;
+
+        if (*p == ',')
+        {
+            ++p;
+            continue;
+        }
+
+        if (*p != '/' && *p != '\0')
+            break;
+
+        if (numRows == 1)
+            numColumns = columnsInRow;
+        else if (columnsInRow != numColumns)
+            break;
+
+        if (*p == '\0')
+        {
+            if (numRows == requiredNumChannels)
+            {
+                setChannelMatrix(numColumns, matrix);
+                return;
+            }
+
+            break;
+        }
+
+        ++p;
+        ++numRows;
+        columnsInRow = 0;
+    }
+
+    fprintf(stderr,
+            "Error:  Invalid channel matrix '%s' for variable '%s' (need %d row%s)\n",
+            spec,
+            varname,
+            requiredNumChannels,
+            (requiredNumChannels == 1) ? "" : "s");
+
+    exit(1);
+}
+
+
+void SonicWave::setFileChannels(int numFileChannels)
+{
+    // Called when the channel count of a WAV file or stream becomes known.
+
+    if (numFileChannels < 1 || numFileChannels > MAX_SONIC_CHANNELS)
+    {
+        fprintf(stderr, "Error:  variable '%s' has an invalid number of channels (%d).\n",
+                varname,
+                numFileChannels);
+
+        exit(1);
+    }
+
+    if (customMatrix && customColumns != numFileChannels)
+    {
+        fprintf(stderr, "Error:  variable '%s' channel matrix has %d column%s, but the file has %d channel%s.\n",
+                varname,
+                customColumns,
+                (customColumns == 1) ? "" : "s",
+                numFileChannels,
+                (numFileChannels == 1) ? "" : "s");
+
+        exit(1);
+    }
+
+    fileNumChannels = numFileChannels;
+    delete[] channelMatrix;
+    channelMatrix = 0;
+
+    if (customMatrix || numFileChannels != requiredNumChannels)
+    {
+        int numData = requiredNumChannels * numFileChannels;
+        channelMatrix = new float [numData];
+        if (!channelMatrix)
+        {
+            fprintf(stderr, "Error:  Out of memory mixing channels for variable '%s'\n", varname);
+            exit(1);
+        }
+
+        if (customMatrix)
+            memcpy(channelMatrix, customMatrix, numData * sizeof(float));
+        else
+            BuildDefaultMatrix(requiredNumChannels, numFileChannels, channelMatrix);
+    }
+
+    // Raw frames are read into inWaveBuffer before mixing, so it must
+    // hold as many frames as inBuffer at the wider of the two layouts.
+    int widest = (numFileChannels > requiredNumChannels) ? numFileChannels : requiredNumChannels;
+    inWaveBufferSize = (inBufferSize / requiredNumChannels) * widest;
+}
+
+
+void SonicWave::setFileRate(long fileRate)
+{
+    // Sets inNumSamples from sourceNumSamples, the length of the file at
+    // its own rate, reading through a resampler if that is not the
+    // program's sampling rate.
+
+    if (fileRate != requiredSamplingRate && Sonic_ResampleQuality == SRQ_OFF)
+    {
+        fprintf(stderr, "Error: variable '%s' must have sampling rate = %ld (or use --resample).\n",
+                varname,
+                requiredSamplingRate);
+
+        exit(1);
+    }
+
+    inNumSamples = sourceNumSamples;
+    if (fileRate != requiredSamplingRate)
+    {
+        // Read through a resampler; the filter tables are kept
+        // for the next time this wave is opened.
+
+        if (resampler && resampler->queryInRate() != fileRate)
+        {
+            delete resampler;
+            resampler = 0;
+        }
+
+        if (!resampler)
+            resampler = new SonicResampler(fileRate, requiredSamplingRate, requiredNumChannels, Sonic_ResampleQuality);
+
+        resampler->reset();
+        inNumSamples = SonicResampler::OutputLength(sourceNumSamples, fileRate, requiredSamplingRate);
+    }
+    else if (resampler)
+    {
+        delete resampler;
+        resampler = 0;
+    }
+}
+
+
+void SonicWave::readSourceFrames(long first, int numFrames, float *dest)
+{
+    // Reads frames of a WAV or FLAC file at its own sampling rate, for the
+    // resampler or for readDecoded().  Frames before the beginning or past the end of
+    // the file are silent.
+
+    const int m = requiredNumChannels;
+    while (numFrames > 0 && first < 0)
+    {
+        for (int c=0; c < m; ++c)
+            *dest++ = float(0);
+
+        ++first;
+        --numFrames;
+    }
+
+    long available = sourceNumSamples - first;
+    if (available < 0)
+        available = 0;
+
+    int numReal = (numFrames < available) ? numFrames : int(available);
+    if (numReal > 0 && mappedData)
+    {
+        const INT16 *source = (const INT16 *)mappedData + first*fileNumChannels;
+        MixFrames(source, numReal, fileNumChannels, m, channelMatrix, dest);
+    }
+    else if (numReal > 0 && inFlac)
+    {
+        int chunkFrames = inWaveBufferSize / fileNumChannels;
+        for (int done=0; done < numReal; )
+        {
+            int n = numReal - done;
+            if (n > chunkFrames)
+                n = chunkFrames;
+
+            if (!inFlac->read(first + done, n, inWaveBuffer))
+            {
+                fprintf(stderr, "Error reading FLAC file '%s' for variable '%s':  %s\n",
+                        inFilename,
+                        varname,
+                        inFlac->queryError());
+
+                exit(1);
+            }
+
+            MixFrames(inWaveBuffer, n, fileNumChannels, m, channelMatrix, dest + done*m);
+            done += n;
+        }
+    }
+    else if (numReal > 0)
+    {
+        if (first != sourceReadIndex && inWave->SeekToSample(first) != DDC_SUCCESS)
+        {
+            fprintf(stderr, "Error seeking to sample %ld in WAV file '%s' for variable '%s'\n",
+                    first,
+                    inFilename,
+                    varname);
+
+            exit(1);
+        }
+
+        // inWaveBuffer holds only so many frames, so read in pieces.
+        int chunkFrames = inWaveBufferSize / fileNumChannels;
+        for (int done=0; done < numReal; )
+        {
+            int n = numReal - done;
+            if (n > chunkFrames)
+                n = chunkFrames;
+
+            if (inWave->ReadData(inWaveBuffer, n*fileNumChannels) != DDC_SUCCESS)
+            {
+                fprintf(stderr, "Error reading WAV file '%s' for variable '%s'\n", inFilename, varname);
+                exit(1);
+            }
+
+            MixFrames(inWaveBuffer, n, fileNumChannels, m, channelMatrix, dest + done*m);
+            done += n;
+        }
+
+        sourceReadIndex = first + numReal;
+    }
+
+    for (int k = (numReal > 0 ? numReal : 0) * m; k < numFrames*m; ++k)
+        dest[k] = float(0);
+}
+
+
+void SonicWave::readResampled()
+{
+    // Refills inBuffer with converted frames that include nextReadIndex.
+    // Source frames still in the resampler's window from the previous
+    // block are reused, so sequential reads touch each source frame once.
+    // Converting is much dearer than copying, so when the wave is being
+    // read backward, the block ends at nextReadIndex instead of starting
+    // there.
+
+    int capacity = inBufferSize / requiredNumChannels;
+    long first = nextReadIndex;
+    if (dataIn_InBuffer > 0 && nextReadIndex < inBufferBaseIndex)
+    {
+        first = nextReadIndex + 1 - capacity;
+        if (first < 0)
+            first = 0;
+    }
+
+    inBufferBaseIndex = first;
+    long framesRemaining = inNumSamples - first;
+    if (framesRemaining < 0)
+        framesRemaining = 0;
+
+    int numFrames = capacity;
+    if (numFrames > framesRemaining)
+        numFrames = int(framesRemaining);
+
+    dataIn_InBuffer = numFrames * requiredNumChannels;
+    if (numFrames <= 0)
+    {
+        eof_flag = 1;
+        return;
+    }
+
+    long lo, hi, readFirst;
+    int readCount;
+    resampler->sourceRange(first, numFrames, lo, hi);
+    float *dest = resampler->prepareWindow(lo, hi, readFirst, readCount);
+    if (readCount > 0)
+        readSourceFrames(readFirst, readCount, dest);
+
+    resampler->render(first, numFrames, inBuffer);
+}
+
+
+static bool IsTempFilename(const char *filename)
+{
+    if (!filename || !*filename)
+        return false;
+
+    const char *ext = strrchr(filename, '.');
+    return ext && strcmp(ext, ".tmp") == 0;
+}
+
+
+//--------------------------------------------------------------------------
+//  Shared temp files.
+//
+//  Copying a whole wave into another, or handing it over to another,
+//  lets both waves hold the same temp file instead of writing a new one.
+//  Each shared file counts the waves holding it beyond the first; the
+//  file goes away only when the last of them lets go.  A wave about to
+//  change its file in place (appending or patching) copies it first.
+
+struct SonicSharedFile
+{
+    char *filename;
+    int   extraHolders;
+    SonicSharedFile *next;
+};
+
+static SonicSharedFile *SharedFileList = 0;
+
+
+static SonicSharedFile *FindSharedFile(const char *filename)
+{
+    for (SonicSharedFile *sf = SharedFileList; sf; sf = sf->next)
+        if (strcmp(sf->filename, filename) == 0)
+            return sf;
+
+    return 0;
+}
+
+
+static bool IsSharedTempFile(const char *filename)
+{
+    return filename && FindSharedFile(filename) != 0;
+}
+
+
+static void ShareTempFile(const char *filename)
+{
+    SonicSharedFile *sf = FindSharedFile(filename);
+    if (!sf)
+    {
+        sf = new SonicSharedFile;
+        sf->filename = DDC_CopyString(filename);
+        if (!sf->filename)
+        {
+            fprintf(stderr, "Error:  out of memory sharing file '%s'\n", filename);
+            exit(1);
+        }
+
+        sf->extraHolders = 0;
+        sf->next = SharedFileList;
+        SharedFileList = sf;
+    }
+
+    ++(sf->extraHolders);
+}
+
+
+static void ReleaseTempFile(const char *filename)
+{
+    // A wave is done with its temp file:  delete the file unless
+    // some other wave still holds it.
+
+    for (SonicSharedFile **link = &SharedFileList; *link; link = &((*link)->next))
+    {
+        SonicSharedFile *sf = *link;
+        if (strcmp(sf->filename, filename) == 0)
+        {
+            if (--(sf->extraHolders) == 0)
+            {
+                *link = sf->next;
+                DDC_DeleteString(sf->filename);
+                delete sf;
+            }
+
+            return;
+        }
+    }
+
+    SonicCheckpoint::DiscardFile(filename);
+}
+
+
+//--------------------------------------------------------------------------
+//  Wave statistics.
+//
+//  Peak and RMS values are computed by scanning the file the first time
+//  they are asked for, and are remembered per file.  A cache entry is
+//  keyed by file name, size and modification time, so a file that has
+//  been rewritten since the scan is scanned again.  SonicWave also drops
+//  the entry explicitly whenever it writes a file, because two writes
+//  within the same second would otherwise look identical.
+
+struct SonicWaveStats
+{
+    SonicWaveStats *next;
+    char    *filename;
+    long    fileSize;
+    long    modifyTime;
+    int     numChannels;
+    bool    customMix;      // mixed with a caller's matrix; never reused
+    long    numSamples;
+    double  peak [MAX_SONIC_CHANNELS];
+    double  sumSquares [MAX_SONIC_CHANNELS];
+};
+
+static SonicWaveStats *WaveStatsCache = 0;
+static long WaveStatsGeneration = 0;    // counts statistics discarded, which waves may still point to
+
+
+static bool QueryFileIdentity(const char *filename, long &fileSize, long &modifyTime)
+{
+    struct stat info;
+    if (!filename || !*filename || stat(filename, &info) != 0)
+        return false;
+
+    fileSize = long(info.st_size);
+    modifyTime = long(info.st_mtime);
+    return true;
+}
+
+
+#if defined(__APPLE__)
+    #define SONIC_STAT_NANOS(info, field)   long((info).field##spec.tv_nsec)
+#elif defined(_WIN32)
+    #define SONIC_STAT_NANOS(info, field)   0L
+#else
+    #define SONIC_STAT_NANOS(info, field)   long((info).field.tv_nsec)
+#endif
+
+
+static bool QueryFileStamp(const char *filename, char stamp[])
+{
+    // Like QueryFileIdentity(), but good enough to tell one run's input
+    // from the next run's:  a file rewritten at the same size within the
+    // same second differs in the fractions of a second of its times, where
+    // the system keeps them, or in its status change time or which file it
+    // is on its device.  A file changed in the last few seconds has no
+    // stamp, because a change right after this one could still leave all
+    // of that the same.  'stamp' must hold 128 characters.
+
+    struct stat info;
+    if (!filename || !*filename || stat(filename, &info) != 0)
+        return false;
+
+    const long now = long(time(0));
+    if (long(info.st_mtime) + 2 >= now || long(info.st_ctime) + 2 >= now)
+        return false;
+
+    sprintf(stamp, "%ld %ld.%09ld %ld.%09ld %lu:%lu",
+        long(info.st_size),
+        long(info.st_mtime), SONIC_STAT_NANOS(info, st_mtim),
+        long(info.st_ctime), SONIC_STAT_NANOS(info, st_ctim),
+        (unsigned long)(info.st_dev), (unsigned long)(info.st_ino));
+
+    return true;
+}
+
+
+static void ForgetWaveStats(const char *filename)
+{
+    if (!filename)
+        return;
+
+    SonicWaveStats *prev = 0;
+    SonicWaveStats *s = WaveStatsCache;
+    while (s)
+    {
+        SonicWaveStats *next = s->next;
+        if (strcmp(s->filename, filename) == 0)
+        {
+            if (prev)
+                prev->next = next;
+            else
+                WaveStatsCache = next;
+
+            DDC_DeleteString(s->filename);
+            delete s;
+            ++WaveStatsGeneration;
+        }
+        else
+            prev = s;
+
+        s = next;
+    }
+}
+
+
+static void AccumulateStats(SonicWaveStats *stats, const float *data, int numFrames)
+{
+    // Accumulate each block in single precision (which the compiler can
+    // vectorize) and fold the block totals into the double sums.  The scan
+    // stays on one thread, even though the runtime now has encoder threads,
+    // because it is bound by reading the file in order.
+
+    const int m = stats->numChannels;
+    for (int c=0; c < m; ++c)
+    {
+        float blockPeak = float(0);
+        float blockSum = float(0);
+        const float *p = data + c;
+        for (int f=0; f < numFrames; ++f, p += m)
+        {
+            float x = *p;
+            float a = (x < 0) ? -x : x;
+            if (a > blockPeak)
+                blockPeak = a;
+
+            blockSum += x * x;
+        }
+
+        if (blockPeak > stats->peak[c])
+            stats->peak[c] = blockPeak;
+
+        stats->sumSquares[c] += blockSum;
+    }
+
+    stats->numSamples += numFrames;
+}
+
+
+static SonicWaveStats *ComputeWaveStats(
+    const char *filename,
+    int numChannels,
+    const float *customMatrix,      // NULL, or numChannels rows of customColumns
+    int customColumns,
+    const char *varname)
+{
+    long fileSize, modifyTime;
+    if (!QueryFileIdentity(filename, fileSize, modifyTime))
+        return 0;
+
+    for (SonicWaveStats *s = WaveStatsCache; s && !customMatrix; s = s->next)
+    {
+        if (strcmp(s->filename, filename) == 0 &&
+            s->fileSize == fileSize &&
+            s->modifyTime == modifyTime &&
+            s->numChannels == numChannels &&
+            !s->customMix)
+            return s;
+    }
+
+    ForgetWaveStats(filename);      // anything left over is stale
+
+    SonicWaveStats *stats = new SonicWaveStats;
+    if (!stats || !(stats->filename = DDC_CopyString(filename)))
+    {
+        fprintf(stderr, "Error:  Out of memory computing statistics for variable '%s'\n", varname);
+        exit(1);
+    }
+
+    stats->fileSize = fileSize;
+    stats->modifyTime = modifyTime;
+    stats->numChannels = numChannels;
+    stats->customMix = (customMatrix != 0);
+    stats->numSamples = 0;
+    for (int c=0; c < MAX_SONIC_CHANNELS; ++c)
+        stats->peak[c] = stats->sumSquares[c] = double(0);
+
+    const int blockFrames = 16 * 1024;
+    const int blockData = blockFrames * numChannels;
+    float *block = (float *) Sonic_AcquireBuffer(blockData * sizeof(float));
+
+    char peek[4] = { 0, 0, 0, 0 };
+    FILE *file = fopen(filename, "rb");
+    if (file)
+    {
+        fread(peek, 1, 4, file);
+        const bool isFlac = (memcmp(peek, "fLaC", 4) == 0);
+        if (memcmp(peek, "RIFF", 4) == 0 || isFlac)
+        {
+            fclose(file);
+            file = 0;
+
+            // Statistics are of the samples as the program sees them,
+            // after any mixing of channels.
+            WaveFile wave;
+            SonicFlacReader flac;
+            int fileChannels = 0;
+            long fileFrames = 0;
+            if (isFlac)
+            {
+                if (flac.open(filename))
+                {
+                    fileChannels = flac.queryNumChannels();
+                    fileFrames = flac.queryNumFrames();
+                }
+            }
+            else if (wave.OpenForRead(filename) == DDC_SUCCESS &&
+                     wave.BitsPerSample() == 16)
+            {
+                fileChannels = wave.NumChannels();
+                fileFrames = long(wave.NumSamples());
+            }
+
+            const float *matrix = 0;
+            float defaultMatrix [MAX_SONIC_CHANNELS * MAX_SONIC_CHANNELS];
+            if (customMatrix)
+            {
+                if (fileChannels != customColumns)
+                    fileChannels = 0;
+
+                matrix = customMatrix;
+            }
+            else if (fileChannels > 0 && fileChannels <= MAX_SONIC_CHANNELS && fileChannels != numChannels)
+            {
+                BuildDefaultMatrix(numChannels, fileChannels, defaultMatrix);
+                matrix = defaultMatrix;
+            }
+
+            if (fileChannels > 0 && fileChannels <= MAX_SONIC_CHANNELS)
+            {
+                int rawSize = blockFrames * fileChannels;
+                INT16 *raw = (INT16 *) Sonic_AcquireBuffer(rawSize * sizeof(INT16));
+                for (long done=0; done < fileFrames; done += blockFrames)
+                {
+                    long remaining = fileFrames - done;
+                    int numFrames = (remaining < blockFrames) ? int(remaining) : blockFrames;
+                    if (isFlac ? !flac.read(done, numFrames, raw) :
+                                 (wave.ReadData(raw, numFrames * fileChannels) != DDC_SUCCESS))
+                        break;
+
+                    MixFrames(raw, numFrames, fileChannels, numChannels, matrix, block);
+                    AccumulateStats(stats, block, numFrames);
+                }
+
+                Sonic_ReleaseBuffer(raw, rawSize * sizeof(INT16));
+            }
+
+            wave.Close();
+        }
+        else
+        {
+            fseek(file, long(sizeof(float)), SEEK_SET);
+            for (;;)
+            {
+                int numRead = int(fread(block, sizeof(float), blockData, file));
+                int numFrames = numRead / numChannels;
+                if (numFrames <= 0)
+                    break;
+
+                AccumulateStats(stats, block, numFrames);
+            }
+
+            fclose(file);
+        }
+    }
+
+    Sonic_ReleaseBuffer(block, blockData * sizeof(float));
+
+    stats->next = WaveStatsCache;
+    WaveStatsCache = stats;
+    return stats;
+}
+
+
+const SonicWaveStats *SonicWave::queryStats()
+{
+    // Statistics describe the data stored for this wave, which is the
+    // input file while writing is in progress.  Keep them until that data
+    // changes, rather than checking the file on every query.
+
+    if (!stats ||
+        statsGeneration != WaveStatsGeneration ||
+        !inFilename ||
+        strcmp(stats->filename, inFilename) != 0)
+    {
+        stats = ComputeWaveStats(inFilename, requiredNumChannels, customMatrix, customColumns, varname);
+        statsGeneration = WaveStatsGeneration;
+    }
+
+    return stats;
+}
+
+
+double SonicWave::queryMaxValue()
+{
+    if (mode == SWM_WRITE || mode == SWM_MODIFY)
+        return double(maxValue);    // running maximum of the data written so far
+
+    return queryPeak(-1);
+}
+
+
+double SonicWave::queryPeak(int c)
+{
+    if (c >= requiredNumChannels)
+        return double(0);
+
+    const SonicWaveStats *stats = queryStats();
+    if (!stats)
+        return double(0);
+
+    if (c >= 0)
+        return stats->peak[c];
+
+    double peak = double(0);
+    for (int k=0; k < requiredNumChannels; ++k)
+    {
+        if (stats->peak[k] > peak)
+            peak = stats->peak[k];
+    }
+
+    return peak;
+}
+
+
+double SonicWave::queryRms(int c)
+{
+    if (c >= requiredNumChannels)
+        return double(0);
+
+    const SonicWaveStats *stats = queryStats();
+    if (!stats || stats->numSamples <= 0)
+        return double(0);
+
+    if (c >= 0)
+        return sqrt(stats->sumSquares[c] / double(stats->numSamples));
+
+    double sum = double(0);
+    for (int k=0; k < requiredNumChannels; ++k)
+        sum += stats->sumSquares[k];
+
+    return sqrt(sum / (double(stats->numSamples) * requiredNumChannels));
+}
+
+
+void SonicWave::openForRead()
+{
+    fastFrames = 0;
+    samplesWritten = 0;
+    dataIn_OutBuffer = 0;
+    dataIn_InBuffer = 0;
+    inBufferBaseIndex = 0;
+    nextReadIndex = 0;
+
+    if (mode != SWM_CLOSED)
+    {
+        fprintf(stderr, "Error:  tried to open non-closed variable '%s' for read\n", varname);
+        exit(1);
+    }
+
+    if (usage == SWU_OUT && !dataWritten)
+    {
+        // Nothing has been written yet, so the wave is empty.
+        inNumSamples = 0;
+        mode = SWM_READ;
+        eof_flag = 1;
+        return;
+    }
+
+    if (streamState != SSS_NONE)
+    {
+        openStreamForRead();
+        return;
+    }
+
+    mode = SWM_UNDEFINED;
+
+    // First try to open the file as a WAV file...
+
+    inWave = new WaveFile;
+    if (!inWave)
+    {
+        fprintf(stderr, "Out of memory trying to open Sonic variable '%s' for read\n", varname);
+        exit(1);
+    }
+
+    if (!inFilename)
+    {
+        fprintf(stderr, "Error: tried to open '%s' with undefined input filename.\n", varname);
+        exit(1);
+    }
+
+    char peek[4] = { 0, 0, 0, 0 };
+    FILE *temp = fopen(inFilename, "rb");
+    if (!temp)
+    {
+        fprintf(stderr, "Error:  variable '%s' cannot open file '%s' for read\n",
+                varname,
+                inFilename);
+
+        exit(1);
+    }
+
+    fread(peek, 1, 4, temp);
+    fclose(temp);
+
+    if (memcmp(peek, "RIFF", 4) == 0)
+    {
+        DDCRET rc = inWave->OpenForRead(inFilename);
+        if (rc != DDC_SUCCESS)
+        {
+            fprintf(stderr, "Error:  variable '%s' cannot open WAV file '%s' for read\n",
+                    varname,
+                    inFilename);
+
+            exit(1);
+        }
+
+        if (inWave->BitsPerSample() != 16)
+        {
+            fprintf(stderr, "Error:  variable '%s' WAV file must be 16-bit.\n", varname);
+            exit(1);
+        }
+
+        setFileChannels(inWave->NumChannels());
+
+        maxValue = float(1);
+        sourceNumSamples = inWave->NumSamples();
+        sourceReadIndex = 0;
+        setFileRate(long(inWave->SamplingRate()));
+
+        if (usage == SWU_IN)
+            mapInputFile(inWave->CurrentFilePosition(), true);
+
+        acquireInputBuffers(!mappedData);
+        if (!resampler)
+            findDecodedSource();
+    }
+    else if (memcmp(peek, "fLaC", 4) == 0)
+    {
+        delete inWave;
+        inWave = 0;
+        inFlac = new SonicFlacReader;
+        if (!inFlac->open(inFilename))
+        {
+            fprintf(stderr, "Error:  variable '%s' cannot open FLAC file '%s' for read:  %s\n",
+                    varname,
+                    inFilename,
+                    inFlac->queryError());
+
+            exit(1);
+        }
+
+        setFileChannels(inFlac->queryNumChannels());
+
+        maxValue = float(1);
+        sourceNumSamples = inFlac->queryNumFrames();
+        sourceReadIndex = 0;
+        setFileRate(inFlac->querySamplingRate());
+
+        // All reads go through readSourceFrames(), by way of the
+        // resampler, the decoded input cache, or read() itself.
+        acquireInputBuffers(true);
+        if (!resampler)
+            findDecodedSource();
+    }
+    else
+    {
+        // Maybe the file exists, but it just isn't a WAV file.
+        // Try opening as a float file.
+
+        delete inWave;
+        inWave = 0;
+        inFile = fopen(inFilename, "rb");
+        if (!inFile)
+        {
+            fprintf(stderr, "Error:  Cannot open variable '%s' file '%s' for read\n",
+                    varname,
+                    inFilename);
+
+            exit(1);
+        }
+
+        if (fread(&maxValue, sizeof(float), 1, inFile) != 1)
+        {
+            fprintf(stderr, "Error:  Invalid file '%s' trying to open variable '%s' for read.\n",
+                    inFilename,
+                    varname);
+
+            exit(1);
+        }
+
+        if (maxValue < 1.0e-30)
+            maxValue = float(1);
+
+        long fsize = FileLength(inFile);
+        if (fsize < 0)
+        {
+            fprintf(stderr, "Error:  Unable to determine size of file '%s' for variable '%s'.\n", inFilename, varname);
+            exit(1);
+        }
+
+        inNumSamples = (fsize/sizeof(float) - 1) / requiredNumChannels;
+        delete resampler;       // float files are always at the program's rate
+        resampler = 0;
+        fileNumChannels = requiredNumChannels;      // ... and in its channels
+        if (usage == SWU_IN)
+            mapInputFile(long(sizeof(float)), false);
+
+        acquireInputBuffers(false);
+    }
+
+    mode = SWM_READ;
+    eof_flag = 0;
+}
+
+
+void SonicWave::findDecodedSource()
+{
+    // Decoded blocks of this file can be shared with any other open of it
+    // that mixes its channels the same way.  The key says which file it
+    // is (as of now) and how it is mixed.
+
+    decodedSource = 0;
+    long fileSize = 0;
+    long modifyTime = 0;
+    if (Sonic_InputCacheMegabytes <= 0 ||
+        inBufferSize < SONIC_DECODED_BLOCK * requiredNumChannels ||
+        !QueryFileIdentity(inFilename, fileSize, modifyTime))
+    {
+        return;
+    }
+
+    const int numGains = channelMatrix ? requiredNumChannels * fileNumChannels : 0;
+    char *key = new char [strlen(inFilename) + 64 + 16*numGains];
+    int length = sprintf(key, "%ld %ld %d %s", fileSize, modifyTime, fileNumChannels, inFilename);
+    for (int k=0; k < numGains; ++k)
+        length += sprintf(key + length, " %.9g", double(channelMatrix[k]));
+
+    decodedSource = SonicDecodedSource::Find(key, requiredNumChannels);
+    delete[] key;
+}
+
+
+void SonicWave::readDecoded()
+{
+    // Points inWindow at the block of decoded frames that holds
+    // nextReadIndex:  in memory already if some open of the same file
+    // decoded it, otherwise decoded now and kept for next time.  The block
+    // stays pinned in memory for as long as inWindow points into it.
+
+    decodedSource->unpinBlock(pinnedBlock);
+    pinnedBlock = -1;
+    inWindow = inBuffer;
+
+    const int m = requiredNumChannels;
+    const long index = nextReadIndex / SONIC_DECODED_BLOCK;
+    const long first = index * SONIC_DECODED_BLOCK;
+    long numFrames = inNumSamples - first;
+    if (nextReadIndex < 0 || numFrames <= 0)
+    {
+        inBufferBaseIndex = nextReadIndex;
+        dataIn_InBuffer = 0;
+        eof_flag = 1;
+        return;
+    }
+
+    if (numFrames > SONIC_DECODED_BLOCK)
+        numFrames = SONIC_DECODED_BLOCK;
+
+    inBufferBaseIndex = first;
+    dataIn_InBuffer = int(numFrames) * m;
+
+    const float *data = decodedSource->findBlock(index);
+    if (!data)
+    {
+        float *block = decodedSource->addBlock(index);
+        if (!block)
+        {
+            readSourceFrames(first, int(numFrames), inBuffer);     // no room to keep it
+            return;
+        }
+
+        readSourceFrames(first, int(numFrames), block);
+        data = block;
+    }
+
+    decodedSource->pinBlock(index);
+    pinnedBlock = index;
+    inWindow = data;
+}
+
+
+void SonicWave::openForWrite()
+{
+    fastFrames = 0;
+    samplesWritten = 0;
+    dataIn_OutBuffer = 0;
+    setCacheIdentity(0);        // whatever is written next is unknown to the cache
+    stats = 0;
+    const bool modifying = (mode == SWM_PREMODIFY);
+
+    if (mode != SWM_CLOSED && mode != SWM_PREMODIFY)
+    {
+        fprintf(stderr,
+                "Error:  Attempt to open non-closed variable '%s' for write/modify\n",
+                varname);
+
+        exit(1);
+    }
+
+    if (usage == SWU_IN)
+    {
+        fprintf(stderr, "Error:  variable '%s' is declared 'in' and cannot be written.\n", varname);
+        exit(1);
+    }
+
+    if (streamState != SSS_NONE)
+    {
+        if (modifying)
+        {
+            fprintf(stderr, "Error:  stream variable '%s' cannot be modified in place\n", varname);
+            exit(1);
+        }
+
+        openStreamForWrite(false);
+        return;
+    }
+
+    char tempFilename [256];
+    sprintf(tempFilename, "s$%d.tmp", NextTempTag++);
+    outFilename = DDC_CopyString(tempFilename);
+    if (!outFilename)
+    {
+        fprintf(stderr,
+                "Error:  Out of memory opening output file '%s' for variable '%s'\n",
+                tempFilename,
+                varname);
+
+        exit(1);
+    }
+
+    outFile = fopen(outFilename, "w+b");
+    outFileHole = false;
+    if (!outFile)
+    {
+        fprintf(stderr,
+                "Error:  Cannot open output file '%s' for variable '%s'\n",
+                outFilename,
+                varname);
+
+        exit(1);
+    }
+
+    maxValue = float(0);
+    if (fwrite(&maxValue, sizeof(float), 1, outFile) != 1)
+    {
+        fprintf(stderr,
+                "Error:  Cannot initialize output file '%s' for variable '%s'\n",
+                outFilename,
+                varname);
+
+        exit(1);
+    }
+
+    acquireOutputBuffer();
+    mode = SWM_WRITE;
+
+    // Clean up orphaned temp files...
+    // When modifying, the old data is still being read; close() removes it.
+
+    if (!modifying && IsTempFilename(inFilename))
+    {
+        ReleaseTempFile(inFilename);
+        DDC_DeleteString(inFilename);
+    }
+}
+
+
+void SonicWave::openForAppend()
+{
+    fastFrames = 0;
+    samplesWritten = 0;
+    dataIn_OutBuffer = 0;
+    setCacheIdentity(0);
+
+    if (mode != SWM_CLOSED && mode != SWM_PREMODIFY)
+    {
+        fprintf(stderr,
+                "Error:  Attempt to open non-closed variable '%s' for write/modify\n",
+                varname);
+
+        exit(1);
+    }
+
+    if (usage == SWU_OUT && !dataWritten)
+    {
+        // Appending to an 'out' wave that is still empty is just writing it.
+        openForWrite();
+        return;
+    }
+
+    if (usage == SWU_IN)
+    {
+        fprintf(stderr, "Error:  variable '%s' is declared 'in' and cannot be written.\n", varname);
+        exit(1);
+    }
+
+    if (streamState != SSS_NONE)
+    {
+        openStreamForWrite(true);
+        return;
+    }
+
+    if (!inFilename)
+    {
+        fprintf(stderr, "Cannot append to variable '%s':  filename unknown\n", varname);
+        exit(1);
+    }
+
+    if (mode == SWM_CLOSED && IsSharedTempFile(inFilename))
+        makePrivateCopy();      // another wave still holds the data
+
+    if (outFilename)
+    {
+        SonicCheckpoint::DiscardFile(outFilename);
+        DDC_DeleteString(outFilename);
+    }
+
+    outFilename = inFilename;
+    inFilename = 0;
+
+    outFile = fopen(outFilename, "r+b");
+    outFileHole = false;
+    if (!outFile)
+    {
+        openForWrite();
+        return;
+    }
+
+    maxValue = float(0);
+    if (fread(&maxValue, sizeof(float), 1, outFile) != 1)
+    {
+        fprintf(stderr,
+                "Error:  Cannot initialize append file '%s' for variable '%s'\n",
+                outFilename,
+                varname);
+
+        exit(1);
+    }
+
+    if (memcmp(&maxValue,"RIFF",4) == 0)
+    {
+        fprintf(stderr,
+                "Error:  var='%s' ... appending directly to WAV file not yet supported!\n",
+                varname);
+
+        exit(1);
+    }
+
+    if (fseek(outFile, 0, SEEK_END))
+    {
+        fprintf(stderr,
+                "Error:  Could not seek to end of file '%s' for append variable '%s'\n",
+                outFilename,
+                varname);
+
+        exit(1);
+    }
+
+    acquireOutputBuffer();
+    mode = SWM_WRITE;
+}
+
+
+
+void SonicWave::openForModify()
+{
+    openForRead();
+    mode = SWM_PREMODIFY;
+    openForWrite();
+    mode = SWM_MODIFY;
+}
+
+
+void SonicWave::makePrivateCopy()
+{
+    // Gives the wave a temp file of its own holding the same data,
+    // so that the file can be changed in place.
+
+    openForModify();
+    double sample [MAX_SONIC_CHANNELS];
+    for (long k=0; k < inNumSamples; ++k)
+    {
+        read(sample);
+        write(sample);
+    }
+
+    close();
+}
+
+
+bool SonicWave::shareFrom(SonicWave &source)
+{
+    // Makes this wave a copy of 'source' by holding the same temp file.
+    // Returns false if that cannot be done, and the caller copies the
+    // samples instead:  the source is a user's file or a stream, the two
+    // waves differ in format, or checkpoints are being kept (a checkpoint
+    // records each wave's file as its own).
+
+    if (&source == this ||
+        mode != SWM_CLOSED ||
+        source.mode != SWM_CLOSED ||
+        usage == SWU_IN ||
+        streamState != SSS_NONE ||
+        source.streamState != SSS_NONE ||
+        !source.dataWritten ||
+        !IsTempFilename(source.inFilename) ||
+        source.requiredNumChannels != requiredNumChannels ||
+        source.requiredSamplingRate != requiredSamplingRate ||
+        Sonic_CheckpointSeconds > 0 ||
+        Sonic_ResumeFlag)
+    {
+        return false;
+    }
+
+    delete reusePlan;
+    reusePlan = 0;
+
+    // This takes the place of writing the wave, so the old data goes.
+    if (IsTempFilename(inFilename))
+        ReleaseTempFile(inFilename);
+
+    DDC_DeleteString(inFilename);
+    inFilename = DDC_CopyString(source.inFilename);
+    if (!inFilename)
+    {
+        fprintf(stderr, "Error:  out of memory in variable '%s'\n", varname);
+        exit(1);
+    }
+
+    ShareTempFile(inFilename);
+    inNumSamples = source.inNumSamples;
+    maxValue = source.maxValue;
+    dataWritten = true;
+    setCacheIdentity(source.cacheIdentity);
+    return true;
+}
+
+
+bool SonicWave::takeFrom(SonicWave &source)
+{
+    // Like shareFrom(), for a source that is never used again:
+    // it is left empty, so the file has a single holder.
+
+    if (!shareFrom(source))
+        return false;
+
+    ReleaseTempFile(source.inFilename);
+    DDC_DeleteString(source.inFilename);
+    source.inFilename = DDC_CopyString("");
+    source.inNumSamples = 0;
+    source.maxValue = float(0);
+    source.dataWritten = false;
+    source.setCacheIdentity(0);
+    return true;
+}
+
+
+void SonicWave::openForPatch(long firstFrame, long pastFrame)
+{
+    // Rewrites frames firstFrame..pastFrame-1 of the wave's temp file in
+    // place, leaving the rest of it alone.  read() returns the old value
+    // of each frame just before write() replaces it.  The file grows if
+    // the range goes past its end; the gap reads as silence.
+
+    fastFrames = 0;
+    setCacheIdentity(0);
+
+    if (mode != SWM_CLOSED)
+    {
+        fprintf(stderr, "Error:  Attempt to open non-closed variable '%s' for patch\n", varname);
+        exit(1);
+    }
+
+    if (usage == SWU_IN)
+    {
+        fprintf(stderr, "Error:  variable '%s' is declared 'in' and cannot be written.\n", varname);
+        exit(1);
+    }
+
+    if (streamState != SSS_NONE)
+    {
+        fprintf(stderr, "Error:  stream variable '%s' cannot be patched in place\n", varname);
+        exit(1);
+    }
+
+    if (firstFrame < 0)
+    {
+        fprintf(stderr, "Error:  range of variable '%s' starts before the beginning (frame %ld)\n", varname, firstFrame);
+        exit(1);
+    }
+
+    if (!IsTempFilename(inFilename) ||
+        IsSharedTempFile(inFilename) ||
+        SonicCheckpoint::IsProtected(inFilename))
+    {
+        // The data is in a user's file, another wave holds it too,
+        // or a checkpoint needs it as it is:  patch a copy instead.
+        makePrivateCopy();
+    }
+
+    outFile = fopen(inFilename, "r+b");
+    if (!outFile || fread(&maxValue, sizeof(float), 1, outFile) != 1)
+    {
+        fprintf(stderr, "Error:  Cannot open file '%s' to patch variable '%s'\n", inFilename, varname);
+        exit(1);
+    }
+
+    const long fsize = FileLength(outFile);
+    inNumSamples = (fsize < 0) ? 0 : (fsize/sizeof(float) - 1) / requiredNumChannels;
+
+    outFilename = inFilename;
+    inFilename = 0;
+    outFileHole = false;
+    acquireOutputBuffer();
+    outBufferPos = 0;
+
+    samplesWritten = firstFrame;
+    patchBase = firstFrame;
+    patchFrames = 0;
+    patchDirty = 0;
+    patchPast = pastFrame;
+    mode = SWM_PATCH;
+}
+
+
+float *SonicWave::patchFrame(long i)
+{
+    // Returns where frame 'i' is kept while patching, loading the part of
+    // the range that follows it if it is not loaded yet.
+
+    if (i < patchBase || i >= patchBase + patchFrames)
+    {
+        flushPatch();
+
+        long count = outBufferSize / requiredNumChannels;
+        if (count > patchPast - i)
+            count = patchPast - i;
+        if (count < 1)
+            count = 1;
+
+        long numRead = 0;
+        if (i < inNumSamples)
+        {
+            if (fseek(outFile, sizeof(float) * (i*requiredNumChannels + 1), SEEK_SET) != 0)
+            {
+                fprintf(stderr, "Error seeking to sample %ld in file '%s' for variable '%s'\n", i, outFilename, varname);
+                exit(1);
+            }
+
+            numRead = long(fread(outBuffer, sizeof(float), count * requiredNumChannels, outFile));
+        }
+
+        memset(outBuffer + numRead, 0, (count*requiredNumChannels - numRead) * sizeof(float));
+        patchBase = i;
+        patchFrames = count;
+        patchDirty = 0;
+    }
+
+    return outBuffer + (i - patchBase) * requiredNumChannels;
+}
+
+
+void SonicWave::flushPatch()
+{
+    if (patchDirty == 0)
+        return;
+
+    const long numData = patchDirty * requiredNumChannels;
+    if (fseek(outFile, sizeof(float) * (patchBase*requiredNumChannels + 1), SEEK_SET) != 0 ||
+        long(fwrite(outBuffer, sizeof(float), numData, outFile)) != numData)
     {
-        fprintf(stderr, "Error:  tried to open non-closed variable '%s' for read\n", varname);
+        fprintf(stderr, "Error writing variable '%s' data to file '%s'.  (disk full?)\n", varname, outFilename);
         exit(1);
     }
 
-    mode = SWM_UNDEFINED;
+    if (patchBase + patchDirty > inNumSamples)
+        inNumSamples = patchBase + patchDirty;
 
-    // First try to open the file as a WAV file...
+    patchDirty = 0;
+}
 
-    inWave = new WaveFile;
-    if (!inWave)
+
+void SonicWave::disallowStream(const char *reason)
+{
+    if (streamState != SSS_NONE)
     {
-        fprintf(stderr, "Out of memory trying to open Sonic variable '%s' for read\n", varname);
+        fprintf(stderr,
+                "Error:  variable '%s' cannot be bound to stream '%s' because %s.\n",
+                varname,
+                inFilename,
+                reason);
+
         exit(1);
     }
+}
 
-    if (!inFilename)
+
+void SonicWave::openStreamForRead()
+{
+    if (streamState == SSS_WRITING)
     {
-        fprintf(stderr, "Error: tried to open '%s' with undefined input filename.\n", varname);
+        fprintf(stderr,
+                "Error:  variable '%s' is an output stream and cannot be read back.\n",
+                varname);
+
         exit(1);
     }
 
-    char peek[4] = { 0, 0, 0, 0 };
-    FILE *temp = fopen(inFilename, "rb");
-    if (!temp)
+    if (streamState != SSS_UNUSED)
     {
-        fprintf(stderr, "Error:  variable '%s' cannot open file '%s' for read\n",
+        fprintf(stderr,
+                "Error:  stream variable '%s' can only be read once.\n",
+                varname);
+
+        exit(1);
+    }
+
+    if (IsStandardStreamName(inFilename))
+    {
+        streamFile = stdin;
+        SetBinaryMode(stdin);
+    }
+    else
+        streamFile = fopen(inFilename, "rb");
+
+    if (!streamFile)
+    {
+        fprintf(stderr, "Error:  variable '%s' cannot open stream '%s' for read\n",
                 varname,
                 inFilename);
 
         exit(1);
     }
 
-    fread(peek, 1, 4, temp);
-    fclose(temp);
+    acquireInputBuffers(false);
+    readStreamHeader();
+    acquireInputBuffers(!streamRawFloat);
 
-    if (memcmp(peek, "RIFF", 4) == 0)
+    streamState = SSS_READING;
+    streamFramesRead = 0;
+    inNumSamples = LONG_MAX;    // unknown until the stream ends
+    maxValue = float(1);
+    mode = SWM_READ;
+    eof_flag = 0;
+}
+
+
+void SonicWave::readStreamHeader()
+{
+    // A stream starting with "RIFF" is 16-bit WAV; anything else is
+    // headerless 32-bit float data, and the bytes already peeked at
+    // become the first sample.
+
+    unsigned char header [16];
+    int numPeeked = int(fread(header, 1, 4, streamFile));
+    streamFramesLimit = LONG_MAX;
+
+    if (numPeeked < 4 || memcmp(header, "RIFF", 4) != 0)
     {
-        DDCRET rc = inWave->OpenForRead(inFilename);
-        if (rc != DDC_SUCCESS)
-        {
-            fprintf(stderr, "Error:  variable '%s' cannot open WAV file '%s' for read\n",
-                    varname,
-                    inFilename);
+        streamRawFloat = true;
+        fileNumChannels = requiredNumChannels;
+        memcpy(inBuffer, header, numPeeked);
+        dataIn_InBuffer = numPeeked;    // bytes of a partial frame, completed by readStreamBlock
+        return;
+    }
 
-            exit(1);
-        }
+    streamRawFloat = false;
+    dataIn_InBuffer = 0;
+    if (fread(header, 1, 8, streamFile) != 8 || memcmp(header+4, "WAVE", 4) != 0)
+    {
+        fprintf(stderr, "Error:  variable '%s' stream is not a valid WAV stream.\n", varname);
+        exit(1);
+    }
 
-        if (inWave->BitsPerSample() != 16)
+    bool foundFormat = false;
+    for (;;)
+    {
+        if (fread(header, 1, 8, streamFile) != 8)
         {
-            fprintf(stderr, "Error:  variable '%s' WAV file must be 16-bit.\n", varname);
+            fprintf(stderr, "Error:  variable '%s' WAV stream has no data chunk.\n", varname);
             exit(1);
         }
 
-        if (inWave->NumChannels() != requiredNumChannels)
+        unsigned long chunkSize = GetLittleEndian(header+4, 4);
+        if (memcmp(header, "data", 4) == 0)
         {
-            fprintf(stderr, "Error:  variable '%s' must have %d channel%s.\n",
-                    varname,
-                    requiredNumChannels,
-                    (requiredNumChannels == 1) ? "" : "s");
+            if (!foundFormat)
+            {
+                fprintf(stderr, "Error:  variable '%s' WAV stream has no format chunk.\n", varname);
+                exit(1);
+            }
 
-            exit(1);
+            // Streaming writers leave the size as 0 or 0xFFFFFFFF.
+            if (chunkSize != 0 && chunkSize != 0xFFFFFFFFUL)
+                streamFramesLimit = long(chunkSize / (2 * fileNumChannels));
+
+            return;
         }
 
-        if (long(inWave->SamplingRate()) != requiredSamplingRate)
+        if (memcmp(header, "fmt ", 4) == 0 && chunkSize >= 16)
         {
-            fprintf(stderr, "Error: variable '%s' must have sampling rate = %ld.\n",
-                    varname,
-                    requiredSamplingRate);
+            if (fread(header, 1, 16, streamFile) != 16)
+            {
+                fprintf(stderr, "Error:  variable '%s' WAV stream format chunk is truncated.\n", varname);
+                exit(1);
+            }
 
-            exit(1);
-        }
+            chunkSize -= 16;
+            foundFormat = true;
 
-        maxValue = float(1);
-        inNumSamples = inWave->NumSamples();
-    }
-    else
-    {
-        // Maybe the file exists, but it just isn't a WAV file.
-        // Try opening as a float file.
+            if (GetLittleEndian(header+14, 2) != 16)
+            {
+                fprintf(stderr, "Error:  variable '%s' WAV file must be 16-bit.\n", varname);
+                exit(1);
+            }
 
-        delete inWave;
-        inWave = 0;
-        inFile = fopen(inFilename, "rb");
-        if (!inFile)
-        {
-            fprintf(stderr, "Error:  Cannot open variable '%s' file '%s' for read\n",
-                    varname,
-                    inFilename);
+            setFileChannels(int(GetLittleEndian(header+2, 2)));
 
-            exit(1);
+            if (long(GetLittleEndian(header+4, 4)) != requiredSamplingRate)
+            {
+                fprintf(stderr, "Error: variable '%s' must have sampling rate = %ld.\n",
+                        varname,
+                        requiredSamplingRate);
+
+                exit(1);
+            }
         }
 
-        if (fread(&maxValue, sizeof(float), 1, inFile) != 1)
+        // Skip the rest of the chunk (chunks are padded to an even size).
+        for (unsigned long skip = chunkSize + (chunkSize & 1); skip > 0; --skip)
         {
-            fprintf(stderr, "Error:  Invalid file '%s' trying to open variable '%s' for read.\n",
-                    inFilename,
-                    varname);
-
-            exit(1);
+            if (fgetc(streamFile) == EOF)
+            {
+                fprintf(stderr, "Error:  variable '%s' WAV stream header is truncated.\n", varname);
+                exit(1);
+            }
         }
+    }
+}
 
-        if (maxValue < 1.0e-30)
-            maxValue = float(1);
 
-        long fsize = FileLength(inFile);
-        if (fsize < 0)
-        {
-            fprintf(stderr, "Error:  Unable to determine size of file '%s' for variable '%s'.\n", inFilename, varname);
-            exit(1);
-        }
+bool SonicWave::readStreamBlock()
+{
+    // Pulls the next block of frames into the lookback ring.
+    // Returns false when the stream has ended.
 
-        inNumSamples = (fsize/sizeof(float) - 1) / requiredNumChannels;
+    if (eof_flag || streamFramesRead >= streamFramesLimit)
+    {
+        eof_flag = 1;
+        inNumSamples = streamFramesRead;
+        return false;
     }
 
-    mode = SWM_READ;
-    eof_flag = 0;
+    const long ringFrames = inBufferSize / requiredNumChannels;
+    long frameIndex = streamFramesRead % ringFrames;
+    long numFrames = ringFrames / 4;
+    if (numFrames > 4096)
+        numFrames = 4096;
+
+    if (numFrames > ringFrames - frameIndex)
+        numFrames = ringFrames - frameIndex;
+
+    if (numFrames > streamFramesLimit - streamFramesRead)
+        numFrames = streamFramesLimit - streamFramesRead;
+
+    float *dest = inBuffer + frameIndex * requiredNumChannels;
+    int numData = int(numFrames) * requiredNumChannels;
+    int numRead = 0;
+
+    if (streamRawFloat)
+    {
+        // Bytes peeked while looking for a WAV header are waiting in the ring.
+        int numBytes = dataIn_InBuffer;
+        if (numBytes > 0 && dest != inBuffer)
+            memmove(dest, inBuffer, numBytes);
+
+        dataIn_InBuffer = 0;
+        numBytes += int(fread((char *)dest + numBytes, 1, numData*sizeof(float) - numBytes, streamFile));
+        numRead = numBytes / int(sizeof(float));
+    }
+    else if (numData > 0)
+    {
+        // Count whole frames as they were read, before mixing.
+        numRead = int(fread(inWaveBuffer, sizeof(short), numFrames * fileNumChannels, streamFile));
+        numRead = (numRead / fileNumChannels) * requiredNumChannels;
+        MixFrames(inWaveBuffer, numRead / requiredNumChannels, fileNumChannels, requiredNumChannels, channelMatrix, dest);
+    }
+
+    long framesRead = numRead / requiredNumChannels;     // a partial last frame is dropped
+    streamFramesRead += framesRead;
+    if (framesRead < numFrames)
+    {
+        eof_flag = 1;
+        inNumSamples = streamFramesRead;
+    }
+
+    return framesRead > 0;
 }
 
 
-void SonicWave::openForWrite()
+double SonicWave::fetchStream(int c, long i, int &countdown)
 {
-    samplesWritten = 0;
-    dataIn_OutBuffer = 0;
+    if (i < 0)
+    {
+        --countdown;
+        return double(0);
+    }
 
-    if (mode != SWM_CLOSED && mode != SWM_PREMODIFY)
+    while (i >= streamFramesRead)
+    {
+        if (!readStreamBlock())
+        {
+            --countdown;
+            return double(0);
+        }
+    }
+
+    const long ringFrames = inBufferSize / requiredNumChannels;
+    if (streamFramesRead - i > ringFrames)
     {
         fprintf(stderr,
-                "Error:  Attempt to open non-closed variable '%s' for write/modify\n",
-                varname);
+                "Error:  stream variable '%s' cannot look back to sample %ld (only %ld samples are kept)\n",
+                varname,
+                i,
+                ringFrames);
 
         exit(1);
     }
 
-    char tempFilename [256];
-    sprintf(tempFilename, "s$%d.tmp", NextTempTag++);
-    outFilename = DDC_CopyString(tempFilename);
-    if (!outFilename)
+    return inBuffer[(i % ringFrames) * requiredNumChannels + c];
+}
+
+
+void SonicWave::openStreamForWrite(bool append)
+{
+    if (streamState == SSS_READING || streamState == SSS_CONSUMED)
     {
         fprintf(stderr,
-                "Error:  Out of memory opening output file '%s' for variable '%s'\n",
-                tempFilename,
+                "Error:  variable '%s' is an input stream and cannot be written.\n",
                 varname);
 
         exit(1);
     }
 
-    outFile = fopen(outFilename, "w+b");
-    if (!outFile)
+    if (streamState == SSS_WRITING && !append)
     {
         fprintf(stderr,
-                "Error:  Cannot open output file '%s' for variable '%s'\n",
-                outFilename,
+                "Error:  stream variable '%s' has already been written; use '<<' to append to it.\n",
                 varname);
 
         exit(1);
     }
 
+    if (streamState == SSS_UNUSED)
+    {
+        if (IsStandardStreamName(inFilename))
+        {
+            streamFile = stdout;
+            SetBinaryMode(stdout);
+        }
+        else
+            streamFile = fopen(inFilename, "wb");
+
+        if (!streamFile)
+        {
+            fprintf(stderr, "Error:  Cannot open output stream '%s' for variable '%s'\n",
+                    inFilename,
+                    varname);
+
+            exit(1);
+        }
+
+        writeStreamHeader();
+        streamState = SSS_WRITING;
+        inNumSamples = 0;
+    }
+
+    outFile = streamFile;
     maxValue = float(0);
-    if (fwrite(&maxValue, sizeof(float), 1, outFile) != 1)
+    outBufferPos = 0;
+    acquireOutputBuffer();
+    mode = SWM_WRITE;
+}
+
+
+void SonicWave::writeStreamHeader()
+{
+    if (streamRawFloat)
+        return;
+
+    const unsigned long unknownSize = 0xFFFFFFFFUL;
+    const int blockAlign = 2 * requiredNumChannels;
+
+    unsigned char header [44];
+    memcpy(header, "RIFF", 4);
+    PutLittleEndian(header+4, unknownSize, 4);
+    memcpy(header+8, "WAVEfmt ", 8);
+    PutLittleEndian(header+16, 16, 4);
+    PutLittleEndian(header+20, 1, 2);      // PCM
+    PutLittleEndian(header+22, requiredNumChannels, 2);
+    PutLittleEndian(header+24, requiredSamplingRate, 4);
+    PutLittleEndian(header+28, requiredSamplingRate * blockAlign, 4);
+    PutLittleEndian(header+32, blockAlign, 2);
+    PutLittleEndian(header+34, 16, 2);
+    memcpy(header+36, "data", 4);
+    PutLittleEndian(header+40, unknownSize, 4);
+
+    if (fwrite(header, 1, sizeof(header), streamFile) != sizeof(header))
     {
-        fprintf(stderr,
-                "Error:  Cannot initialize output file '%s' for variable '%s'\n",
-                outFilename,
+        fprintf(stderr, "Error writing WAV header to stream '%s' for variable '%s'\n",
+                inFilename,
                 varname);
 
         exit(1);
     }
+}
 
-    mode = SWM_WRITE;
 
-    // Clean up orphaned temp files...
+void SonicWave::flushOutBuffer(int numData)
+{
+    // Writes the first 'numData' values in outBuffer.  They must stay
+    // intact, because fetch() still reads history from outBuffer.
+
+    if (streamState == SSS_NONE)
+        writeSparse(outBuffer, numData);
+    else if (streamRawFloat)
+    {
+        int numWritten = int(fwrite(outBuffer, sizeof(float), numData, outFile));
+        if (numWritten != numData)
+        {
+            fprintf(stderr, "Error writing variable '%s' data to file '%s'.  (disk full?)\n",
+                    varname,
+                    outFilename ? outFilename : inFilename);
+
+            exit(1);
+        }
+    }
+    else
+    {
+        const int chunkSize = 1024;
+        INT16 chunk [chunkSize];
+        for (int start = 0; start < numData; start += chunkSize)
+        {
+            int n = numData - start;
+            if (n > chunkSize)
+                n = chunkSize;
+
+            for (int k=0; k < n; ++k)
+            {
+                double x = 32767.0 * outBuffer[start + k];
+                if (x > 32767.0)
+                    x = 32767.0;
+                else if (x < -32767.0)
+                    x = -32767.0;
+
+                chunk[k] = INT16(x < 0 ? x - 0.5 : x + 0.5);
+            }
+
+            if (int(fwrite(chunk, sizeof(INT16), n, outFile)) != n)
+            {
+                fprintf(stderr, "Error writing variable '%s' data to stream '%s'.\n",
+                        varname,
+                        inFilename);
+
+                exit(1);
+            }
+        }
+    }
+}
 
-    if (inFilename && *inFilename)
+
+void SonicWave::writeSparse(const float *data, int numData)
+{
+    // Writes float data to a temp file, but seeks over whole pages of
+    // zeros instead of writing them.  On file systems that support it,
+    // this leaves holes that take no disk space and read back as zeros.
+
+    const int pageData = 4096 / sizeof(float);
+    long position = ftell(outFile) / long(sizeof(float));
+    int writeStart = 0;
+    bool ok = true;
+    for (int k=0; ok && k < numData; )
     {
-        const char *ext = strrchr(inFilename, '.');
-        if (ext && strcmp(ext, ".tmp") == 0)
+        int n = pageData - int(position % pageData);
+        if (n > numData - k)
+            n = numData - k;
+
+        bool zeroPage = (n == pageData);
+        for (int j=0; zeroPage && j < n; ++j)
+            if (data[k+j] != float(0))
+                zeroPage = false;
+
+        if (zeroPage)
         {
-            remove(inFilename);
-            DDC_DeleteString(inFilename);
+            int numPending = k - writeStart;
+            if (numPending > 0)
+                ok = (int(fwrite(data + writeStart, sizeof(float), numPending, outFile)) == numPending);
+
+            if (ok)
+                ok = (fseek(outFile, long(n * sizeof(float)), SEEK_CUR) == 0);
+
+            outFileHole = true;
+            writeStart = k + n;
         }
+
+        k += n;
+        position += n;
+    }
+
+    int numPending = numData - writeStart;
+    if (ok && numPending > 0)
+    {
+        ok = (int(fwrite(data + writeStart, sizeof(float), numPending, outFile)) == numPending);
+        outFileHole = false;
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Error writing variable '%s' data to file '%s'.  (disk full?)\n",
+                varname,
+                outFilename ? outFilename : inFilename);
+
+        exit(1);
     }
 }
 
 
-void SonicWave::openForAppend()
+void SonicWave::finishStream()
+{
+    if (streamFile)
+    {
+        fflush(streamFile);
+        if (streamFile != stdin && streamFile != stdout)
+            fclose(streamFile);
+
+        streamFile = 0;
+    }
+
+    if (streamState == SSS_READING)
+        streamState = SSS_CONSUMED;
+}
+
+
+void SonicWave::read(double sample[])
 {
-    samplesWritten = 0;
-    dataIn_OutBuffer = 0;
-
-    if (mode != SWM_CLOSED && mode != SWM_PREMODIFY)
+    if (mode == SWM_PATCH)
     {
-        fprintf(stderr,
-                "Error:  Attempt to open non-closed variable '%s' for write/modify\n",
-                varname);
+        const float *p = patchFrame(samplesWritten);
+        for (int c=0; c < requiredNumChannels; ++c)
+            sample[c] = double(p[c]);
 
-        exit(1);
+        return;
     }
 
-    if (!inFilename)
+    if (mode != SWM_READ && mode != SWM_MODIFY)
     {
-        fprintf(stderr, "Cannot append to variable '%s':  filename unknown\n", varname);
+        fprintf(stderr, "Error:  Attempt to read from improperly opened variable '%s'\n", varname);
         exit(1);
     }
 
-    if (outFilename)
+    if (streamState == SSS_READING)
     {
-        remove(outFilename);
-        DDC_DeleteString(outFilename);
-    }
+        int countdown = requiredNumChannels;
+        for (int c=0; c < requiredNumChannels; ++c)
+            sample[c] = fetchStream(c, nextReadIndex, countdown);
 
-    outFilename = inFilename;
-    inFilename = 0;
+        ++nextReadIndex;
+        return;
+    }
 
-    outFile = fopen(outFilename, "r+b");
-    if (!outFile)
+    if (usage == SWU_OUT && !dataWritten)
     {
-        openForWrite();
+        for (int c=0; c < requiredNumChannels; ++c)
+            sample[c] = double(0);
+
+        ++nextReadIndex;
         return;
     }
 
-    maxValue = float(0);
-    if (fread(&maxValue, sizeof(float), 1, outFile) != 1)
+    long pastLastIndex = inBufferBaseIndex + dataIn_InBuffer/requiredNumChannels;
+    if (nextReadIndex >= inBufferBaseIndex && nextReadIndex < pastLastIndex)
     {
-        fprintf(stderr,
-                "Error:  Cannot initialize append file '%s' for variable '%s'\n",
-                outFilename,
-                varname);
+        int p = requiredNumChannels * (nextReadIndex - inBufferBaseIndex);
 
-        exit(1);
+        for (int c=0; c < requiredNumChannels; ++c)
+            sample[c] = double(inWindow[p++]);
+
+        ++nextReadIndex;
+        return;
     }
 
-    if (memcmp(&maxValue,"RIFF",4) == 0)
+    fastFrames = 0;     // the window is about to be refilled
+
+    if (resampler)
     {
-        fprintf(stderr,
-                "Error:  var='%s' ... appending directly to WAV file not yet supported!\n",
-                varname);
+        readResampled();
+        int p = requiredNumChannels * (nextReadIndex - inBufferBaseIndex);
+        for (int c=0; c < requiredNumChannels; ++c)
+            sample[c] = (dataIn_InBuffer > 0) ? double(inBuffer[p+c]) : double(0);
 
-        exit(1);
+        ++nextReadIndex;
+        return;
     }
 
-    if (fseek(outFile, 0, SEEK_END))
+    if (decodedSource)
     {
-        fprintf(stderr,
-                "Error:  Could not seek to end of file '%s' for append variable '%s'\n",
-                outFilename,
-                varname);
+        readDecoded();
+        int p = requiredNumChannels * (nextReadIndex - inBufferBaseIndex);
+        for (int c=0; c < requiredNumChannels; ++c)
+            sample[c] = (dataIn_InBuffer > 0) ? double(inWindow[p+c]) : double(0);
 
-        exit(1);
+        ++nextReadIndex;
+        return;
     }
 
-    mode = SWM_WRITE;
-}
+    if (mappedData)
+    {
+        // Refill the window straight from the mapping; no read() calls.
 
+        inBufferBaseIndex = nextReadIndex;
+        long framesRemaining = inNumSamples - nextReadIndex;
+        if (framesRemaining < 0)
+            framesRemaining = 0;
 
+        dataIn_InBuffer = inBufferSize;
+        if (dataIn_InBuffer > framesRemaining * requiredNumChannels)
+            dataIn_InBuffer = int(framesRemaining * requiredNumChannels);
 
-void SonicWave::openForModify()
-{
-    openForRead();
-    mode = SWM_PREMODIFY;
-    openForWrite();
-    mode = SWM_MODIFY;
-}
+        if (mappedIsWave)
+        {
+            const INT16 *source = (const INT16 *)mappedData + nextReadIndex * fileNumChannels;
+            MixFrames(source, dataIn_InBuffer / requiredNumChannels, fileNumChannels, requiredNumChannels, channelMatrix, inBuffer);
+        }
+        else if (dataIn_InBuffer > 0)
+            memcpy(inBuffer, (const float *)mappedData + nextReadIndex * requiredNumChannels, dataIn_InBuffer * sizeof(float));
 
+        if (dataIn_InBuffer <= 0)
+            eof_flag = 1;
 
-void SonicWave::read(double sample[])
-{
-    if (mode != SWM_READ && mode != SWM_MODIFY)
-    {
-        fprintf(stderr, "Error:  Attempt to read from improperly opened variable '%s'\n", varname);
-        exit(1);
+        for (int c=0; c < requiredNumChannels; ++c)
+            sample[c] = (dataIn_InBuffer > 0) ? double(inBuffer[c]) : double(0);
+
+        ++nextReadIndex;
+        return;
     }
 
-    long pastLastIndex = inBufferBaseIndex + dataIn_InBuffer/requiredNumChannels;
-    if (nextReadIndex >= inBufferBaseIndex && nextReadIndex < pastLastIndex)
+    if (inFlac)
     {
-        int p = requiredNumChannels * (nextReadIndex - inBufferBaseIndex);
+        // Without the decoded input cache, refill the window from the
+        // decoder.  Windows are aligned to their size, so that reading
+        // backward decodes each part of the file once, as forward does.
+
+        int numFrames = inBufferSize / requiredNumChannels;
+        inBufferBaseIndex = (nextReadIndex >= 0) ? (nextReadIndex / numFrames) * numFrames : nextReadIndex;
+        long framesRemaining = inNumSamples - inBufferBaseIndex;
+        if (framesRemaining < 0 || nextReadIndex < 0)
+            framesRemaining = 0;
+
+        if (numFrames > framesRemaining)
+            numFrames = int(framesRemaining);
+
+        dataIn_InBuffer = numFrames * requiredNumChannels;
+        if (numFrames > 0)
+            readSourceFrames(inBufferBaseIndex, numFrames, inBuffer);
+        else
+            eof_flag = 1;
 
+        int p = requiredNumChannels * int(nextReadIndex - inBufferBaseIndex);
         for (int c=0; c < requiredNumChannels; ++c)
-            sample[c] = double(inBuffer[p++]);
+            sample[c] = (dataIn_InBuffer > 0) ? double(inBuffer[p+c]) : double(0);
 
         ++nextReadIndex;
         return;
@@ -527,13 +2965,12 @@ void SonicWave::read(double sample[])
                 dataIn_InBuffer = dataRemaining;
 
             if (dataIn_InBuffer > 0)
-                rc = inWave->ReadData(inWaveBuffer, dataIn_InBuffer);
+                rc = inWave->ReadData(inWaveBuffer, (dataIn_InBuffer / requiredNumChannels) * fileNumChannels);
         }
 
         if (rc == DDC_SUCCESS)
         {
-            for (int i=0; i < dataIn_InBuffer; ++i)
-                inBuffer[i] = float(inWaveBuffer[i] / 32768.0);
+            MixFrames(inWaveBuffer, dataIn_InBuffer / requiredNumChannels, fileNumChannels, requiredNumChannels, channelMatrix, inBuffer);
 
             if (requiredNumChannels > dataIn_InBuffer)
             {
@@ -603,6 +3040,24 @@ void SonicWave::read(double sample[])
 
 void SonicWave::write(const double sample[])
 {
+    if (mode == SWM_PATCH)
+    {
+        float *p = patchFrame(samplesWritten);
+        for (int c=0; c < requiredNumChannels; ++c)
+        {
+            float value = p[c] = float(sample[c]);
+            if (value < 0)
+                value = -value;
+
+            if (value > maxValue)
+                maxValue = value;
+        }
+
+        ++samplesWritten;
+        patchDirty = samplesWritten - patchBase;
+        return;
+    }
+
     if (mode != SWM_WRITE && mode != SWM_MODIFY)
     {
         fprintf(stderr, "Error:  Attempt to write to improperly opened variable '%s'\n", varname);
@@ -615,6 +3070,18 @@ void SonicWave::write(const double sample[])
         exit(1);
     }
 
+    double previous [MAX_SONIC_CHANNELS];
+    if (reusePlan && reusePlan->warmingUp(samplesWritten))
+    {
+        // Only settling filters here; the last run's result still stands.
+        float frame [MAX_SONIC_CHANNELS];
+        reusePlan->readFrames(samplesWritten, 1, frame);
+        for (int c=0; c < requiredNumChannels; ++c)
+            previous[c] = double(frame[c]);
+
+        sample = previous;
+    }
+
     for (int c=0; c < requiredNumChannels; ++c)
     {
         float value = outBuffer[outBufferPos] = float(sample[c]);
@@ -626,17 +3093,9 @@ void SonicWave::write(const double sample[])
 
         if (++outBufferPos >= outBufferSize)
         {
-            int numWritten = fwrite(outBuffer, sizeof(float), outBufferSize, outFile);
-            if (numWritten != outBufferSize)
-            {
-                fprintf(stderr, "Error writing variable '%s' data to file '%s'.  (disk full?)\n",
-                        varname,
-                        outFilename);
-
-                exit(1);
-            }
-
+            flushOutBuffer(outBufferSize);
             outBufferPos = 0;
+            fastFrames = 0;
         }
 
         if (dataIn_OutBuffer < outBufferSize)
@@ -644,6 +3103,203 @@ void SonicWave::write(const double sample[])
     }
 
     ++samplesWritten;
+    if (fastFrames > 0 && mode == SWM_WRITE)
+        ++fastFrames;
+}
+
+
+void SonicWave::writeBlock(const float frames[], long numFrames)
+{
+    // Same as calling write() for each of 'numFrames' interleaved frames.
+
+    const int m = requiredNumChannels;
+    if (mode != SWM_WRITE || !outFile || reusePlan)
+    {
+        double sample [MAX_SONIC_CHANNELS];
+        for (long f=0; f < numFrames; ++f, frames += m)
+        {
+            for (int c=0; c < m; ++c)
+                sample[c] = double(frames[c]);
+
+            write(sample);
+        }
+        return;
+    }
+
+    long numData = numFrames * m;
+    while (numData > 0)
+    {
+        int n = outBufferSize - outBufferPos;
+        if (n > numData)
+            n = int(numData);
+
+        float peak = maxValue;
+        float *p = outBuffer + outBufferPos;
+        for (int k=0; k < n; ++k)
+        {
+            float value = p[k] = frames[k];
+            if (value < 0)
+                value = -value;
+
+            if (value > peak)
+                peak = value;
+        }
+        maxValue = peak;
+
+        frames += n;
+        numData -= n;
+        outBufferPos += n;
+        if (outBufferPos >= outBufferSize)
+        {
+            flushOutBuffer(outBufferSize);
+            outBufferPos = 0;
+            fastFrames = 0;
+        }
+
+        dataIn_OutBuffer += n;
+        if (dataIn_OutBuffer > outBufferSize)
+            dataIn_OutBuffer = outBufferSize;
+    }
+
+    samplesWritten += numFrames;
+}
+
+
+void SonicWave::writeSilence(long numFrames)
+{
+    // Same as calling write() with zeros 'numFrames' times.
+
+    if (mode != SWM_WRITE && mode != SWM_MODIFY)
+    {
+        fprintf(stderr, "Error:  Attempt to write to improperly opened variable '%s'\n", varname);
+        exit(1);
+    }
+
+    if (!outFile)
+    {
+        fprintf(stderr, "Internal error:  Output file not open for variable '%s'\n", varname);
+        exit(1);
+    }
+
+    samplesWritten += numFrames;
+    long numData = numFrames * requiredNumChannels;
+    while (numData > 0)
+    {
+        int n = outBufferSize - outBufferPos;
+        if (n > numData)
+            n = int(numData);
+
+        memset(outBuffer + outBufferPos, 0, n * sizeof(float));
+        outBufferPos += n;
+        numData -= n;
+
+        dataIn_OutBuffer += n;
+        if (dataIn_OutBuffer > outBufferSize)
+            dataIn_OutBuffer = outBufferSize;
+
+        if (outBufferPos >= outBufferSize)
+        {
+            flushOutBuffer(outBufferSize);
+            outBufferPos = 0;
+            fastFrames = 0;
+        }
+    }
+}
+
+
+const unsigned char SILENCE_UNKNOWN = 0;
+const unsigned char SILENCE_QUIET   = 1;
+const unsigned char SILENCE_SOUND   = 2;
+
+
+bool SonicWave::blockIsSilent(long block)
+{
+    if (silenceMap[block] == SILENCE_UNKNOWN)
+    {
+        long first = block * SONIC_SILENCE_BLOCK;
+        long last = first + SONIC_SILENCE_BLOCK;
+        if (last > inNumSamples)
+            last = inNumSamples;
+
+        silenceMap[block] = SILENCE_QUIET;
+        for (long k = first; k < last; )
+        {
+            int countdown = 1;
+            fetch(0, k, countdown);     // makes sure that frame k is buffered
+
+            long past = inBufferBaseIndex + dataIn_InBuffer / requiredNumChannels;
+            if (past > last)
+                past = last;
+
+            if (k < inBufferBaseIndex || past <= k)
+            {
+                silenceMap[block] = SILENCE_SOUND;     // could not look; assume the worst
+                return false;
+            }
+
+            const float *p = inWindow + (k - inBufferBaseIndex) * requiredNumChannels;
+            long numData = (past - k) * requiredNumChannels;
+            for (long j=0; j < numData; ++j)
+            {
+                if (p[j] != float(0))
+                {
+                    silenceMap[block] = SILENCE_SOUND;
+                    return false;
+                }
+            }
+
+            k = past;
+        }
+    }
+
+    return silenceMap[block] == SILENCE_QUIET;
+}
+
+
+long SonicWave::quietFrames(long i, bool padded)
+{
+    // Returns the number of frames starting at 'i' that are all zero.
+    // Otherwise returns minus the number of frames before it is worth
+    // asking again.  Past the end the wave is silent forever, but the
+    // caller must decide whether that ends its loop.  Frames before the
+    // beginning are silent too, but only count as such when 'padded',
+    // i.e. when reading them does not end the caller's loop.
+
+    if (mode != SWM_READ || streamState != SSS_NONE)
+        return -SONIC_SILENCE_BLOCK;
+
+    if (i < 0)
+        return padded ? -i : i;     // silent, or ask again at the beginning
+
+    if (i >= inNumSamples)
+        return SONIC_QUIET_FOREVER;
+
+    if (!silenceMap)
+    {
+        silenceMapSize = (inNumSamples + SONIC_SILENCE_BLOCK - 1) / SONIC_SILENCE_BLOCK;
+        silenceMap = new unsigned char [silenceMapSize];
+        if (!silenceMap)
+            return -SONIC_SILENCE_BLOCK;
+
+        memset(silenceMap, SILENCE_UNKNOWN, silenceMapSize);
+    }
+
+    long block = i / SONIC_SILENCE_BLOCK;
+    if (!blockIsSilent(block))
+        return i - (block + 1) * SONIC_SILENCE_BLOCK;
+
+    // The last frame is never reported, because interpolating at it reads
+    // past the end, and that is what ends a loop without a length.
+
+    long last = inNumSamples - 1;
+    long end = (block + 1) * SONIC_SILENCE_BLOCK;
+    while (end < last && blockIsSilent(end / SONIC_SILENCE_BLOCK))
+        end += SONIC_SILENCE_BLOCK;
+
+    if (end > last)
+        end = last;
+
+    return (end > i) ? (end - i) : -1;
 }
 
 
@@ -654,17 +3310,173 @@ double SonicWave::interp(int c, double i, int &countdown)
     double y1 = fetch(c, ibase,   tempCountdown);
     double y2 = fetch(c, 1+ibase, tempCountdown);
 
-    if (tempCountdown != 2)
-        --countdown;
+    if (tempCountdown != 2)
+        --countdown;
+
+    double frac = i - double(ibase);
+    double y = y1*(1-frac) + y2*frac;
+    return y;
+}
+
+
+double SonicWave::interp(int c, double i)
+{
+    int countdown = 0;
+    return interp(c, i, countdown);
+}
+
+
+void SonicWave::fetchFrameMiss(long i, float frame[], int &countdown)
+{
+    // fetchFrame() of a frame outside the window it reads directly.
+    // Gives the same values as fetch() called for each channel in turn,
+    // but copies the whole frame at once when it is already in memory.
+    // The generated code then computes all channels in one loop.
+
+    const int m = requiredNumChannels;
+    const float *source = 0;
+    if (mode == SWM_WRITE)
+    {
+        if (i >= 0 && i < samplesWritten)
+        {
+            long numDataBack = (samplesWritten - i) * m;
+            if (numDataBack <= dataIn_OutBuffer)
+            {
+                source = outBuffer + (outBufferSize + outBufferPos - numDataBack) % outBufferSize;
+                if (streamState == SSS_NONE)
+                    findFastWindow();
+            }
+        }
+    }
+    else if ((mode == SWM_READ || mode == SWM_MODIFY) && streamState != SSS_READING)
+    {
+        if (i >= 0 && i < inNumSamples &&
+            i >= inBufferBaseIndex && i < inBufferBaseIndex + dataIn_InBuffer/m)
+        {
+            source = inWindow + m*(i - inBufferBaseIndex);
+            findFastWindow();
+        }
+    }
+
+    int c;
+    if (source)
+    {
+        for (c=0; c < m; ++c)
+            frame[c] = source[c];
+    }
+    else
+    {
+        for (c=0; c < m; ++c)
+            frame[c] = float(fetch(c, i, countdown));
+    }
+}
+
+
+void SonicWave::fetchBlock(long i, long numFrames, float frames[])
+{
+    // Same as fetchFrame() for each of 'numFrames' frames starting at i,
+    // but copying runs of them at once.  There is no countdown:  a caller
+    // working in blocks already knows where its loop ends.  A wave being
+    // written can be read back this way (see Sonic_FeedbackLimit()).
+
+    const int m = requiredNumChannels;
+    int countdown = 0;
+    const bool windowed =
+        (mode == SWM_READ || mode == SWM_MODIFY) && streamState != SSS_READING;
+
+    while (numFrames > 0)
+    {
+        long n = 1;
+        if (mode == SWM_WRITE && (i < 0 || i >= samplesWritten))
+        {
+            n = (i < 0 && -i < numFrames) ? -i : numFrames;
+            memset(frames, 0, sizeof(float) * n * m);
+        }
+        else if (mode == SWM_WRITE && (samplesWritten - i) * m <= dataIn_OutBuffer)
+        {
+            // feedback from what this wave has written recently
+            long numDataBack = (samplesWritten - i) * m;
+            int index = int((outBufferSize + outBufferPos - numDataBack) % outBufferSize);
+            n = (outBufferSize - index) / m;
+            if (n > samplesWritten - i)
+                n = samplesWritten - i;
+            if (n > numFrames)
+                n = numFrames;
+
+            memcpy(frames, outBuffer + index, sizeof(float) * n * m);
+        }
+        else if (windowed && (i < 0 || i >= inNumSamples))
+        {
+            n = (i < 0 && -i < numFrames) ? -i : numFrames;
+            memset(frames, 0, sizeof(float) * n * m);
+        }
+        else if (windowed)
+        {
+            long pastLastIndex = inBufferBaseIndex + dataIn_InBuffer/m;
+            if (i < inBufferBaseIndex || i >= pastLastIndex)
+            {
+                fetch(0, i, countdown);     // moves the window to i
+                pastLastIndex = inBufferBaseIndex + dataIn_InBuffer/m;
+            }
+
+            n = pastLastIndex - i;
+            if (n > numFrames)
+                n = numFrames;
+
+            memcpy(frames, inWindow + m*(i - inBufferBaseIndex), sizeof(float) * n * m);
+        }
+        else
+            fetchFrame(i, frames, countdown);
+
+        frames += n * m;
+        i += n;
+        numFrames -= n;
+    }
+}
+
 
-    double frac = i - double(ibase);
-    double y = y1*(1-frac) + y2*frac;
-    return y;
+void SonicWave::findFastWindow()
+{
+    // Lets fetch() read the frames around the one just fetched directly.
+    // For a wave being written, these are the frames written since the
+    // history in outBuffer last wrapped around, which stay put until it
+    // wraps again; write() adds each new one.  For a wave being read,
+    // they are the frames of the read window that are inside the wave,
+    // which stay put until read() refills it.  Opening, closing and
+    // releasing the buffers start over.
+
+    const int m = requiredNumChannels;
+    fastFrames = 0;
+    if (mode == SWM_WRITE)
+    {
+        const int numData = (outBufferPos < dataIn_OutBuffer) ? outBufferPos : dataIn_OutBuffer;
+        fastFrames = numData / m;
+        fastFirst = samplesWritten - fastFrames;
+        fastWindow = outBuffer + outBufferPos - fastFrames*m;
+    }
+    else if ((mode == SWM_READ || mode == SWM_MODIFY) && streamState != SSS_READING && inWindow)
+    {
+        long first = inBufferBaseIndex;
+        long past = inBufferBaseIndex + dataIn_InBuffer/m;
+        if (first < 0)
+            first = 0;
+        if (past > inNumSamples)
+            past = inNumSamples;
+
+        if (past > first)
+        {
+            fastFirst = first;
+            fastFrames = past - first;
+            fastWindow = inWindow + m*(first - inBufferBaseIndex);
+        }
+    }
 }
 
 
-double SonicWave::fetch(int c, long i, int &countdown)
+double SonicWave::fetchMiss(int c, long i, int &countdown)
 {
+    // fetch() of a frame outside the window it reads directly.
+
     if (mode == SWM_WRITE)
     {
         if (i >= samplesWritten || i < 0)
@@ -677,8 +3489,20 @@ double SonicWave::fetch(int c, long i, int &countdown)
         if (numDataBack <= dataIn_OutBuffer)
         {
             int index = (outBufferSize + outBufferPos - numDataBack) % outBufferSize;
+            if (streamState == SSS_NONE)
+                findFastWindow();
             return outBuffer[index + c];
         }
+        else if (streamState != SSS_NONE)
+        {
+            fprintf(stderr,
+                    "Error:  stream variable '%s' cannot look back to sample %ld (only %d samples are kept)\n",
+                    varname,
+                    i,
+                    dataIn_OutBuffer / requiredNumChannels);
+
+            exit(1);
+        }
         else
         {
             long currentPos = ftell(outFile);
@@ -694,8 +3518,10 @@ double SonicWave::fetch(int c, long i, int &countdown)
                 exit(1);
             }
 
+            // Reading past the end of a file that ends in a hole
+            // (see writeSparse) finds nothing, which means zero.
             float temp = float(0);
-            if (fread(&temp, sizeof(float), 1, outFile) != 1)
+            if (fread(&temp, sizeof(float), 1, outFile) != 1 && ferror(outFile))
             {
                 fprintf(stderr,
                         "Error:  Could not read backward sample %ld from variable '%s' file '%s'\n",
@@ -716,6 +3542,9 @@ double SonicWave::fetch(int c, long i, int &countdown)
         exit(1);
     }
 
+    if (streamState == SSS_READING)
+        return fetchStream(c, i, countdown);
+
     if (i >= inNumSamples || i < 0)
     {
         --countdown;
@@ -727,12 +3556,19 @@ double SonicWave::fetch(int c, long i, int &countdown)
     if (i >= inBufferBaseIndex && i < pastLastIndex)
     {
         int p = requiredNumChannels * (i - inBufferBaseIndex);
-        return inBuffer[p+c];
+        findFastWindow();
+        return inWindow[p+c];
     }
 
     nextReadIndex = i;
+    eof_flag = 0;       // read() must refill the window, even after reaching the end once
 
-    if (inWave)
+    if (mappedData || resampler || decodedSource || inFlac)
+    {
+        // read() below copies straight out of the mapping or the decoded
+        // input cache, or seeks the file itself; no seek needed here.
+    }
+    else if (inWave)
     {
         DDCRET rc = inWave->SeekToSample(i);
         if (rc != DDC_SUCCESS)
@@ -768,6 +3604,7 @@ double SonicWave::fetch(int c, long i, int &countdown)
 
     double sample [MAX_SONIC_CHANNELS];
     read(sample);
+    findFastWindow();
 
     return sample[c];
 }
@@ -775,18 +3612,41 @@ double SonicWave::fetch(int c, long i, int &countdown)
 
 void SonicWave::close()
 {
-    if (outFile)
+    fastFrames = 0;
+    if (outFile && streamState == SSS_WRITING)
     {
+        // The stream stays open so that later statements can append to it.
+
         if (outBufferPos > 0)
+            flushOutBuffer(outBufferPos);
+
+        fflush(outFile);
+        outFile = 0;
+        dataWritten = true;
+        mode = SWM_CLOSED;
+    }
+    else if (outFile)
+    {
+        if (mode == SWM_PATCH)
+            flushPatch();
+        else if (outBufferPos > 0)
+            flushOutBuffer(outBufferPos);
+
+        if (outFileHole)
         {
-            int numWritten = fwrite(outBuffer, sizeof(float), outBufferPos, outFile);
-            if (numWritten != outBufferPos)
+            // Give the file its full length by writing the last value.
+            float zero = float(0);
+            if (fseek(outFile, -long(sizeof(float)), SEEK_CUR) ||
+                fwrite(&zero, sizeof(float), 1, outFile) != 1)
             {
-                fprintf(stderr, "Error flushing last output buffer for variable '%s'\n",
-                        varname);
+                fprintf(stderr, "Error writing variable '%s' data to file '%s'.  (disk full?)\n",
+                        varname,
+                        outFilename);
 
                 exit(1);
             }
+
+            outFileHole = false;
         }
 
         fflush(outFile);
@@ -812,9 +3672,16 @@ void SonicWave::close()
 
         fclose(outFile);
         outFile = 0;
+        ForgetWaveStats(outFilename);
     }
 
     outBufferPos = 0;
+    releaseBuffers();
+    unmapInputFile();
+
+    delete[] silenceMap;        // the data may change before the next open
+    silenceMap = 0;
+    silenceMapSize = 0;
 
     if (inWave)
     {
@@ -823,14 +3690,29 @@ void SonicWave::close()
         inWave = 0;
     }
 
+    delete inFlac;
+    inFlac = 0;
+
+    if (decodedSource)
+    {
+        decodedSource->unpinBlock(pinnedBlock);
+        decodedSource = 0;      // its blocks stay for the next open
+    }
+
+    pinnedBlock = -1;
+    inWindow = inBuffer;
+
     if (inFile)
     {
         fclose(inFile);
         inFile = 0;
-        if (mode == SWM_MODIFY)
-            remove(inFilename);
+        if (mode == SWM_MODIFY && IsTempFilename(inFilename))
+            ReleaseTempFile(inFilename);
     }
 
+    if (streamState == SSS_READING)
+        streamState = SSS_CONSUMED;     // the lookback ring has been released
+
     if (mode == SWM_WRITE || mode == SWM_MODIFY)
     {
         // prepare to read from data just written...
@@ -840,6 +3722,15 @@ void SonicWave::close()
         outFilename = 0;
 
         inNumSamples = samplesWritten;
+        dataWritten = true;
+        stats = 0;
+    }
+    else if (mode == SWM_PATCH)
+    {
+        inFilename = outFilename;       // same file, patched
+        outFilename = 0;
+        dataWritten = true;
+        stats = 0;
     }
 
     mode = SWM_CLOSED;
@@ -849,32 +3740,72 @@ void SonicWave::close()
 
 void SonicWave::convertToWav(const char *outWaveFilename)
 {
+    if (usage == SWU_IN)
+        return;     // never written, so already in its final form
+
+    if (streamState != SSS_NONE)
+    {
+        // Stream data went out as it was written; there is nothing to convert.
+        close();
+        finishStream();
+        return;
+    }
+
     openForRead();
 
-    if (!inWave)
+    if (!inWave && !inFlac)
     {
         // Only convert to WAV file if it isn't a WAV file already.
-
+        // A filename ending in ".flac" asks for a FLAC file instead.
+
+        // A preview keeps only the frames of its window.
+        long first = 0;
+        long past = inNumSamples;
+        if (Sonic_PreviewFrom >= 0)
+            first = long(Sonic_PreviewFrom * requiredSamplingRate);
+        if (Sonic_PreviewTo >= 0 && long(Sonic_PreviewTo * requiredSamplingRate) < past)
+            past = long(Sonic_PreviewTo * requiredSamplingRate);
+        if (first > past)
+            first = past;
+
+        const bool isFlac = Sonic_IsFlacFilename(outWaveFilename);
         WaveFile outWave;
-        DDCRET rc = outWave.OpenForWrite(
-                        outWaveFilename,
-                        requiredSamplingRate,
-                        16,
-                        requiredNumChannels);
+        SonicFlacWriter outFlac;
+        bool opened;
+        if (isFlac)
+            opened = outFlac.open(outWaveFilename, requiredSamplingRate, requiredNumChannels, past - first);
+        else
+            opened = (outWave.OpenForWrite(outWaveFilename, requiredSamplingRate, 16, requiredNumChannels) == DDC_SUCCESS);
 
-        if (rc != DDC_SUCCESS)
+        if (!opened)
         {
             fprintf(stderr,
-                    "Error:  Cannot open permanent output WAV file '%s' for variable '%s'",
+                    "Error:  Cannot open permanent output %s file '%s' for variable '%s'",
+                    isFlac ? "FLAC" : "WAV",
                     outWaveFilename,
                     varname);
 
+            if (isFlac)
+                fprintf(stderr, ":  %s", outFlac.queryError());
+
+            fprintf(stderr, "\n");
+            exit(1);
+        }
+
+        if (first > 0 && fseek(inFile, sizeof(float) * (first*requiredNumChannels + 1), SEEK_SET) != 0)
+        {
+            fprintf(stderr,
+                    "Error performing seek to sample %ld in float file '%s' for variable '%s'\n",
+                    first,
+                    inFilename,
+                    varname);
+
             exit(1);
         }
 
         const double scale = 32000.0 / maxValue;
         const int bufferSize = 512;
-        int numDataRemaining = inNumSamples * requiredNumChannels;
+        long numDataRemaining = (past - first) * requiredNumChannels;
         float inBuffer [bufferSize];
         INT16 outBuffer [bufferSize];
 
@@ -882,7 +3813,7 @@ void SonicWave::convertToWav(const char *outWaveFilename)
         {
             int dataToRead = bufferSize;
             if (dataToRead > numDataRemaining)
-                dataToRead = numDataRemaining;
+                dataToRead = int(numDataRemaining);
 
             int numRead = (int) fread(inBuffer, sizeof(float), dataToRead, inFile);
             if (numRead != dataToRead)
@@ -898,11 +3829,15 @@ void SonicWave::convertToWav(const char *outWaveFilename)
             for (int i=0; i < dataToRead; ++i)
                 outBuffer[i] = INT16(inBuffer[i] * scale);
 
-            DDCRET rc = outWave.WriteData(outBuffer, dataToRead);
-            if (rc != DDC_SUCCESS)
+            bool written = isFlac ?
+                outFlac.write(outBuffer, dataToRead) :
+                (outWave.WriteData(outBuffer, dataToRead) == DDC_SUCCESS);
+
+            if (!written)
             {
                 fprintf(stderr,
-                        "Error writing to WAV file '%s' while converting variable '%s'\n",
+                        "Error writing to %s file '%s' while converting variable '%s'\n",
+                        isFlac ? "FLAC" : "WAV",
                         outWaveFilename,
                         varname);
 
@@ -912,7 +3847,21 @@ void SonicWave::convertToWav(const char *outWaveFilename)
             numDataRemaining -= dataToRead;
         }
 
-        outWave.Close();
+        if (isFlac)
+        {
+            if (!outFlac.close())
+            {
+                fprintf(stderr,
+                        "Error finishing FLAC file '%s' for variable '%s':  %s\n",
+                        outWaveFilename,
+                        varname,
+                        outFlac.queryError());
+
+                exit(1);
+            }
+        }
+        else
+            outWave.Close();
     }
 
     close();
@@ -927,6 +3876,405 @@ void SonicWave::EraseAllTempFiles()
         sprintf(filename, "s$%d.tmp", i);
         remove(filename);
     }
+
+    SonicCheckpoint::EraseStateFile();      // finished; nothing to resume
+}
+
+
+//------------------------------------------------------------------------------
+//  Render cache.
+//
+//  A wave's identity says what its data is, for use in cache keys:  either
+//  the file it was given (by name and QueryFileStamp(), and how it is read) or
+//  the key of the cached wave assignment that produced it.  Data written
+//  any other way has no identity, and nothing computed from it is cached.
+
+
+void SonicWave::setCacheIdentity(const char *identity)
+{
+    DDC_DeleteString(cacheIdentity);
+    if (identity)
+    {
+        cacheIdentity = DDC_CopyString(identity);
+        if (!cacheIdentity)
+        {
+            fprintf(stderr, "Error:  out of memory in variable '%s'\n", varname);
+            exit(1);
+        }
+    }
+}
+
+
+const char *SonicWave::queryCacheIdentity()
+{
+    if (cacheIdentity || dataWritten || streamState != SSS_NONE || !inFilename)
+        return cacheIdentity;
+
+    if (inFilename[0] == '\0')
+    {
+        setCacheIdentity("empty");
+        return cacheIdentity;
+    }
+
+    char stamp [128];
+    if (strlen(inFilename) > 512 || !QueryFileStamp(inFilename, stamp))
+        return 0;
+
+    char identity [1024];
+    int length = sprintf(identity, "file %s %d %s", stamp, int(Sonic_ResampleQuality), inFilename);
+    if (customMatrix)
+    {
+        // Only the first 32 gains fit; more channels than that are not worth caching.
+        if (customColumns * requiredNumChannels > 32)
+            return 0;
+
+        length += sprintf(identity + length, " mix");
+        for (int k=0; k < customColumns * requiredNumChannels; ++k)
+            length += sprintf(identity + length, " %.9g", double(customMatrix[k]));
+    }
+
+    setCacheIdentity(identity);
+    return cacheIdentity;
+}
+
+
+bool SonicWave::loadFromCache(SonicCacheKey &key)
+{
+    delete reusePlan;
+    reusePlan = 0;
+
+    if (!key.isValid() || mode != SWM_CLOSED || streamState != SSS_NONE || usage == SWU_IN)
+        return false;
+
+    char tempFilename [256];
+    sprintf(tempFilename, "s$%d.tmp", NextTempTag);
+    if (!SonicCacheKey::Fetch(key, tempFilename))
+    {
+        if (Sonic_IncrementalFlag)
+            reusePlan = key.planReuse(*this);
+
+        return false;
+    }
+
+    ++NextTempTag;
+    FILE *temp = fopen(tempFilename, "rb");
+    float header = float(0);
+    long fsize = temp ? FileLength(temp) : -1;
+    if (!temp || fsize < long(sizeof(float)) || fread(&header, sizeof(float), 1, temp) != 1)
+    {
+        fprintf(stderr, "Error:  cannot read cached data '%s' for variable '%s'\n", tempFilename, varname);
+        exit(1);
+    }
+
+    fclose(temp);
+
+    // This takes the place of writing the wave, so the old data goes.
+    if (IsTempFilename(inFilename))
+        ReleaseTempFile(inFilename);
+
+    DDC_DeleteString(inFilename);
+    inFilename = DDC_CopyString(tempFilename);
+    if (!inFilename)
+    {
+        fprintf(stderr, "Error:  out of memory in variable '%s'\n", varname);
+        exit(1);
+    }
+
+    ForgetWaveStats(inFilename);
+    inNumSamples = (fsize/long(sizeof(float)) - 1) / requiredNumChannels;
+    maxValue = header;
+    dataWritten = true;
+
+    char identity [32];
+    sprintf(identity, "render %s", key.queryHash());
+    setCacheIdentity(identity);
+    return true;
+}
+
+
+void SonicWave::storeInCache(SonicCacheKey &key)
+{
+    delete reusePlan;       // also lets go of the entry it was copying from
+    reusePlan = 0;
+
+    if (!key.isValid() || mode != SWM_CLOSED || streamState != SSS_NONE || !IsTempFilename(inFilename))
+        return;
+
+    SonicCacheKey::Store(key, inFilename);
+    if (Sonic_IncrementalFlag)
+        key.recordReuse(*this);
+
+    char identity [32];
+    sprintf(identity, "render %s", key.queryHash());
+    setCacheIdentity(identity);
+}
+
+
+long SonicWave::reusableFrames(long i)
+{
+    if (!reusePlan)
+        return -(SONIC_QUIET_FOREVER - i);     // compute everything
+
+    return reusePlan->reusable(i);
+}
+
+
+long SonicWave::previewFrames(long i, long end)
+{
+    // Returns how many frames starting at 'i' lie outside the preview
+    // window (widened by the pre-roll) and need not be computed, or minus
+    // the number of frames to compute before asking again.  'end' is where
+    // the caller's loop stops, or < 0 if that is not known.
+
+    if (!Sonic_IsPreview() || end < 0 || i >= end)
+        return -(SONIC_QUIET_FOREVER - i);
+
+    long first = 0;
+    if (Sonic_PreviewFrom > Sonic_PrerollSeconds)
+        first = long((Sonic_PreviewFrom - Sonic_PrerollSeconds) * requiredSamplingRate);
+
+    long past = SONIC_QUIET_FOREVER;
+    if (Sonic_PreviewTo >= 0)
+        past = long((Sonic_PreviewTo + Sonic_PrerollSeconds) * requiredSamplingRate) + 1;
+
+    if (i < first)
+        return ((first < end) ? first : end) - i;
+
+    if (i < past)
+        return -(past - i);
+
+    return end - i;
+}
+
+
+void SonicWave::skipFrames(long numFrames)
+{
+    // Leave frames outside a preview silent, passing over the old data
+    // of a wave being modified in place.
+
+    writeSilence(numFrames);
+    if (mode == SWM_MODIFY)
+    {
+        // Let fetch() move the read window, then point read() at it.
+        const long next = nextReadIndex + numFrames;
+        if (next < inNumSamples)
+        {
+            int countdown = 1;
+            fetch(0, next, countdown);
+        }
+
+        nextReadIndex = next;
+    }
+}
+
+
+void SonicWave::reuseFrames(long i, long numFrames)
+{
+    // Copy frames of the last run's result, just as if they were written.
+
+    if (!reusePlan)
+    {
+        fprintf(stderr, "Internal error:  nothing to reuse for variable '%s'\n", varname);
+        exit(1);
+    }
+
+    float frames [8 * 1024];
+    const long maxFrames = long(sizeof(frames) / sizeof(frames[0])) / requiredNumChannels;
+    double sample [MAX_SONIC_CHANNELS];
+    while (numFrames > 0)
+    {
+        const long count = (numFrames < maxFrames) ? numFrames : maxFrames;
+        reusePlan->readFrames(i, count, frames);
+        const float *p = frames;
+        for (long k=0; k < count; ++k)
+        {
+            for (int c=0; c < requiredNumChannels; ++c)
+                sample[c] = double(*p++);
+
+            write(sample);
+        }
+
+        i += count;
+        numFrames -= count;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+//  Checkpoints.
+//
+//  At a checkpoint each wave is written as one line of the state file:
+//
+//      wave <name> <C|W> <frames> <maxValue> <dataWritten> <fileBytes> <length> <filename>
+//
+//  'C' is a closed wave whose data is in <filename>.  'W' is a wave in the
+//  middle of being written; the first <frames> frames are in <filename>.
+//  Temp files can grow after a checkpoint (appending works in place), so
+//  their length is recorded and restored.
+
+
+const char *SonicWave::queryCheckpointFile() const
+{
+    if (mode == SWM_WRITE || mode == SWM_MODIFY)
+        return outFilename;
+
+    return IsTempFilename(inFilename) ? inFilename : 0;
+}
+
+
+void SonicWave::saveCheckpoint(FILE *stateFile)
+{
+    if (streamState != SSS_NONE)
+    {
+        fprintf(stderr, "Error:  stream variable '%s' cannot be checkpointed.\n", varname);
+        exit(1);
+    }
+
+    char state = 'C';
+    long frames = inNumSamples;
+    long fileBytes = 0;
+    const char *filename = inFilename ? inFilename : "";
+
+    if (mode == SWM_WRITE && outFile)
+    {
+        // Put what is still buffered into the file, then move back so that
+        // the next flush rewrites it in place as usual.
+
+        state = 'W';
+        frames = samplesWritten;
+        fileBytes = long(sizeof(float)) * (1 + frames * requiredNumChannels);
+        filename = outFilename;
+
+        long position = ftell(outFile);
+        bool hole = outFileHole;
+        if (outBufferPos > 0)
+            writeSparse(outBuffer, outBufferPos);
+
+        SyncFile(outFile);
+        fseek(outFile, position, SEEK_SET);
+        outFileHole = hole;
+    }
+    else if (mode != SWM_CLOSED && mode != SWM_READ)
+    {
+        fprintf(stderr, "Internal error:  variable '%s' cannot be checkpointed while it is being modified.\n", varname);
+        exit(1);
+    }
+    else if (IsTempFilename(inFilename))
+    {
+        FILE *temp = fopen(inFilename, "r+b");
+        if (temp)
+        {
+            fileBytes = FileLength(temp);
+            SyncFile(temp);
+            fclose(temp);
+        }
+    }
+
+    fprintf(stateFile, "wave %s %c %ld %.9g %d %ld %d %s\n",
+            varname,
+            state,
+            frames,
+            double(maxValue),
+            int(dataWritten),
+            fileBytes,
+            int(strlen(filename)),
+            filename);
+}
+
+
+void SonicWave::restoreCheckpoint(FILE *stateFile)
+{
+    // The "wave <name>" at the start of the line has already been read.
+
+    fastFrames = 0;
+    char state = 0;
+    long frames = 0;
+    double maxDouble = 0;
+    int written = 0;
+    long fileBytes = 0;
+    int length = -1;
+
+    if (fscanf(stateFile, " %c %ld %lf %d %ld %d", &state, &frames, &maxDouble, &written, &fileBytes, &length) != 6 ||
+            length < 0 ||
+            fgetc(stateFile) != ' ')
+    {
+        fprintf(stderr, "Error:  invalid checkpoint data for variable '%s'\n", varname);
+        exit(1);
+    }
+
+    char *filename = new char [length + 1];
+    if (!filename || int(fread(filename, 1, length, stateFile)) != length)
+    {
+        fprintf(stderr, "Error:  invalid checkpoint data for variable '%s'\n", varname);
+        exit(1);
+    }
+
+    filename[length] = '\0';
+
+    if (mode != SWM_CLOSED)
+    {
+        fprintf(stderr, "Internal error:  variable '%s' is open while restoring a checkpoint.\n", varname);
+        exit(1);
+    }
+
+    FILE *file = 0;
+    if (state == 'W' || IsTempFilename(filename))
+    {
+        file = fopen(filename, "r+b");
+        if (!file)
+        {
+            fprintf(stderr, "Error:  file '%s' needed to resume variable '%s' is missing.\n", filename, varname);
+            exit(1);
+        }
+
+        if (TruncateFile(file, fileBytes))
+        {
+            fprintf(stderr, "Error:  cannot restore the length of file '%s' for variable '%s'.\n", filename, varname);
+            exit(1);
+        }
+
+        ForgetWaveStats(filename);
+    }
+
+    maxValue = float(maxDouble);
+    dataWritten = (written != 0);
+    setCacheIdentity(0);
+
+    if (state == 'W')
+    {
+        // Carry on writing where the checkpoint left off.
+
+        if (fseek(file, 0, SEEK_END))
+        {
+            fprintf(stderr, "Error:  cannot seek in file '%s' for variable '%s'.\n", filename, varname);
+            exit(1);
+        }
+
+        DDC_DeleteString(outFilename);
+        outFilename = filename;
+        outFile = file;
+        outFileHole = false;
+        samplesWritten = frames;
+        dataIn_OutBuffer = 0;
+        outBufferPos = 0;
+        acquireOutputBuffer();
+        mode = SWM_WRITE;
+        return;
+    }
+
+    if (file)
+    {
+        // A later statement may have appended, changing the header too.
+
+        float header = float(maxDouble);
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(float), 1, file);
+        fclose(file);
+    }
+
+    DDC_DeleteString(inFilename);
+    inFilename = filename;
+    inNumSamples = frames;
 }
 
 
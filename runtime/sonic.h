@@ -18,11 +18,31 @@
 #ifndef __ddc_sonic_runtime
 #define __ddc_sonic_runtime
 
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
+
 class WaveFile;
+class SonicFlacReader;
+class SonicResampler;
+class SonicDecodedSource;
+class SonicCheckpoint;
+class SonicCacheKey;
+class SonicReusePlan;
+struct SonicWaveStats;
 
 
 const int MAX_SONIC_CHANNELS = 64;
 
+// Sample buffers are aligned to this many bytes so that SIMD loads
+// on interleaved frames never straddle a cache line.
+const size_t SONIC_BUFFER_ALIGNMENT = 64;
+
+void *Sonic_AcquireBuffer(size_t numBytes);
+void  Sonic_ReleaseBuffer(void *block, size_t numBytes);
+void  Sonic_FlushBufferPool();
+
 
 enum SonicWaveMode
 {
@@ -31,13 +51,111 @@ enum SonicWaveMode
     SWM_MODIFY,
     SWM_WRITE,
     SWM_READ,
-    SWM_PREMODIFY
+    SWM_PREMODIFY,
+    SWM_PATCH           // rewriting a range of frames in place
+};
+
+
+// A wave bound to "-" (stdin/stdout) or to a FIFO is a stream:  it is read
+// or written strictly front to back, with only a bounded window of history.
+enum SonicStreamState
+{
+    SSS_NONE,           // not a stream; an ordinary seekable file
+    SSS_UNUSED,         // stream not opened yet
+    SSS_READING,
+    SSS_CONSUMED,       // input stream has been read and cannot be reread
+    SSS_WRITING
+};
+
+// How a program declares a wave parameter ('in', 'out', or neither).
+enum SonicWaveUsage
+{
+    SWU_INOUT,
+    SWU_IN,             // never written; the file may be memory mapped
+    SWU_OUT             // whatever the file holds beforehand is ignored
+};
+
+// Number of seconds of an input stream kept for looking backward.
+const long SONIC_STREAM_LOOKBACK_SECONDS = 10;
+
+// Waves remember which blocks of this many frames are entirely silent.
+const long SONIC_SILENCE_BLOCK = 4096;
+
+// quietFrames() result for an index past the end of a wave.
+const long SONIC_QUIET_FOREVER = LONG_MAX;
+
+// Frames a wave assignment computes at a time when it can work on whole
+// blocks (see fetchBlock() and writeBlock()).
+const long SONIC_FRAME_BLOCK = 256;
+
+// Frames a SonicExpRamp or SonicPhaseRamp follows before it is anchored
+// to an exact value again, which keeps rounding errors from building up.
+const long SONIC_RAMP_ANCHOR = 1024;
+
+
+// How WAV files at a sampling rate other than the program's are handled.
+enum SonicResampleQuality
+{
+    SRQ_OFF,            // refuse to open them
+    SRQ_FAST,
+    SRQ_GOOD,
+    SRQ_BEST
 };
 
+extern SonicResampleQuality Sonic_ResampleQuality;
+
+// Seconds between checkpoints (0 = never), and whether to resume from one.
+extern long Sonic_CheckpointSeconds;
+extern bool Sonic_ResumeFlag;
+
+// Directory of the render cache (NULL = no caching), and its size limit.
+extern const char *Sonic_CacheDirectory;
+extern long Sonic_CacheLimitMegabytes;
+
+// Whether to re-render only what changed since the last cached run, and
+// how far before a change filters start so that they can settle.
+extern bool Sonic_IncrementalFlag;
+extern double Sonic_WarmupSeconds;
+
+// Megabytes of memory for decoded WAV input kept across opens (0 = none).
+extern long Sonic_InputCacheMegabytes;
+
+// Threads that encode FLAC output (0 = one per processor).
+extern int Sonic_EncoderThreads;
+
+// Time window to render for a preview (negative = not given), and how long
+// before it filters and recursive statements start so that they settle.
+extern double Sonic_PreviewFrom;
+extern double Sonic_PreviewTo;
+extern double Sonic_PrerollSeconds;
+bool Sonic_IsPreview();
+
+// First index i >= 0 at which every read (offset, length) pair in 'span'
+// is out of range, i.e. where a loop without a limit stops.  A length < 0
+// is the target reading itself.  Returns -1 if that cannot be told.
+long Sonic_NaturalEnd(int numReads, const double span[]);
+
+// Most frames a wave assignment can compute at once when it reads its own
+// result at each of the given offsets from i, so that every frame it reads
+// back was written before the block began.  SONIC_QUIET_FOREVER if any
+// number will do.
+long Sonic_FeedbackLimit(int numReads, const double offset[]);
+
+// What SonicWave::interp() gives for channel c at index i, from frames
+// fetched with fetchBlock() starting at frame 'first'.
+inline double Sonic_InterpBlock(const float block[], long first, double i, int c, int m)
+{
+    long ibase = long(i);
+    const float *p = block + (ibase - first)*m + c;
+    double frac = i - double(ibase);
+    return double(p[0])*(1-frac) + double(p[m])*frac;
+}
+
 
 double ScanReal(const char *varname, const char *vstring);
 long   ScanInteger(const char *varname, const char *vstring);
 int    ScanBoolean(const char *varname, const char *vstring);
+int    ScanOptions(int argc, char *argv[]);     // returns argc less the options
 
 
 class SonicWave
@@ -47,7 +165,8 @@ public:
         const char *_filename,
         const char *_varname,
         long _requiredSamplingRate,
-        int _requiredNumChannels);
+        int _requiredNumChannels,
+        SonicWaveUsage _usage = SWU_INOUT);
 
     ~SonicWave();
 
@@ -55,20 +174,84 @@ public:
     void openForWrite();
     void openForAppend();
     void openForModify();
+    void openForPatch(long firstFrame, long pastFrame);
+    bool shareFrom(SonicWave &source);     // false: copy the samples instead
+    bool takeFrom(SonicWave &source);      // ... and 'source' is left empty
 
     long queryNumSamples() const
     {
         return inNumSamples;
     }
+    bool isStream() const
+    {
+        return streamState != SSS_NONE;
+    }
+    void disallowStream(const char *reason);
+    void setChannelMatrix(int numFileChannels, const double matrix[]);
     void read(double sample[]);
     void write(const double sample[]);
-    double fetch(int c, long i, int &countdown);
+    void writeSilence(long numFrames);
+    long quietFrames(long i, bool padded = false);      // > 0: silent run from i;  < 0: -(frames not to ask about)
+    double fetch(int c, long i, int &countdown)
+    {
+        // A frame in the window the last miss found takes one check and a
+        // load, without a call.  Such frames are never outside the wave.
+        const long k = i - fastFirst;
+        if ((unsigned long)k < (unsigned long)fastFrames)
+            return fastWindow[k*requiredNumChannels + c];
+
+        return fetchMiss(c, i, countdown);
+    }
+    double fetch(int c, long i)     // ... for a loop that knows its end
+    {
+        const long k = i - fastFirst;
+        if ((unsigned long)k < (unsigned long)fastFrames)
+            return fastWindow[k*requiredNumChannels + c];
+
+        int countdown = 0;
+        return fetchMiss(c, i, countdown);
+    }
+    void fetchFrame(long i, float frame[], int &countdown)     // fetch() of every channel
+    {
+        const long k = i - fastFirst;
+        if ((unsigned long)k < (unsigned long)fastFrames)
+        {
+            const float *source = fastWindow + k*requiredNumChannels;
+            for (int c=0; c < requiredNumChannels; ++c)
+                frame[c] = source[c];
+        }
+        else
+            fetchFrameMiss(i, frame, countdown);
+    }
+    void fetchFrame(long i, float frame[])
+    {
+        int countdown = 0;
+        fetchFrame(i, frame, countdown);
+    }
+    void fetchBlock(long i, long numFrames, float frames[]);   // fetchFrame() of each frame, no countdown
+    void writeBlock(const float frames[], long numFrames);     // write() of each frame
     double interp(int c, double i, int &countdown);
-    double queryMaxValue() const
+    double interp(int c, double i);
+    double queryMaxValue();
+    double queryPeak(int c);        // c < 0 means peak over all channels
+    double queryRms(int c);         // c < 0 means RMS over all channels
+    const char *queryVarName() const
     {
-        return double(maxValue);
+        return varname;
     }
 
+    void saveCheckpoint(FILE *stateFile);
+    void restoreCheckpoint(FILE *stateFile);
+    const char *queryCheckpointFile() const;     // file a checkpoint depends on, or NULL
+
+    const char *queryCacheIdentity();   // describes the data, or NULL if unknown
+    bool loadFromCache(SonicCacheKey &key);
+    void storeInCache(SonicCacheKey &key);
+    long reusableFrames(long i);        // > 0: frames from i that are unchanged;  <= 0: -(frames to compute)
+    void reuseFrames(long i, long numFrames);
+    long previewFrames(long i, long end);   // > 0: frames from i outside the preview;  <= 0: -(frames to compute)
+    void skipFrames(long numFrames);
+
     void close();
     void convertToWav(const char *outWavFilename);      // ... but only if necessary
 
@@ -76,16 +259,51 @@ public:
 
 protected:
     void determineNumSamples();
+    const SonicWaveStats *queryStats();
+    void acquireInputBuffers(bool needWaveBuffer);
+    void acquireOutputBuffer();
+    void releaseBuffers();
+    void flushOutBuffer(int numData);
+    void writeSparse(const float *data, int numData);
+    float *patchFrame(long i);
+    void flushPatch();
+    void makePrivateCopy();
+    bool blockIsSilent(long block);
+    void mapInputFile(long dataOffset, bool isWave);
+    void unmapInputFile();
+    void setFileChannels(int numFileChannels);
+    void setFileRate(long fileRate);
+    void parseChannelMatrix(const char *spec);
+    void readSourceFrames(long first, int numFrames, float *dest);
+    void setCacheIdentity(const char *identity);
+    void readResampled();
+    void findDecodedSource();
+    void readDecoded();
+
+    void openStreamForRead();
+    void openStreamForWrite(bool append);
+    void readStreamHeader();
+    void writeStreamHeader();
+    bool readStreamBlock();
+    double fetchStream(int c, long i, int &countdown);
+    void finishStream();
+
+    double fetchMiss(int c, long i, int &countdown);
+    void fetchFrameMiss(long i, float frame[], int &countdown);
+    void findFastWindow();
 
 private:
+    friend class SonicCheckpoint;
+    friend class SonicCacheKey;
     static int NextTempTag;     // used to generate temporary filenames
 
 private:
     char *varname;  // sonic variable name for this 'wave' instance
 
-    // 'inWave' and 'inFile' are mutually exclusive (the non-NULL one is read from)
+    // 'inWave', 'inFlac' and 'inFile' are mutually exclusive (the non-NULL one is read from)
     char *inFilename;
     WaveFile *inWave;
+    SonicFlacReader *inFlac;
     FILE *inFile;
     long inNumSamples;
 
@@ -101,17 +319,263 @@ private:
     int eof_flag;
     long samplesWritten;
 
-    float *outBuffer;
+    float *outBuffer;           // allocated on first open for write
     int outBufferSize;
     int outBufferPos;
     int dataIn_OutBuffer;
 
-    short *inWaveBuffer;
-    float *inBuffer;
+    short *inWaveBuffer;        // allocated on first open of a WAV file
+    int   inWaveBufferSize;     // number of data in inWaveBuffer
+    float *inBuffer;            // allocated on first open for read
     int   inBufferSize;         // number of data (not samples) in inBuffer
     int   dataIn_InBuffer;
     long  inBufferBaseIndex;    // sample index at beginning of inBuffer
     long  nextReadIndex;
+
+    SonicStreamState streamState;
+    FILE *streamFile;           // stdin, stdout, or an open FIFO
+    bool  streamRawFloat;       // headerless 32-bit floats instead of 16-bit WAV
+    long  streamFramesRead;     // input frames pulled from the stream so far
+    long  streamFramesLimit;    // frames promised by a WAV 'data' chunk, if known
+
+    SonicWaveUsage usage;
+    bool  dataWritten;          // has been written at least once
+    void *mappedFile;           // read-only mapping of an 'in' wave, or NULL
+    size_t mappedSize;
+    const void *mappedData;     // first sample in mappedFile
+    bool  mappedIsWave;         // mapped samples are INT16 rather than float
+
+    SonicResampler *resampler;  // converts a WAV file at another rate, or NULL
+    SonicDecodedSource *decodedSource;     // memory for this WAV file's decoded frames, or NULL
+    long  pinnedBlock;          // decoded block inWindow points into, or -1
+    const float *inWindow;      // frames from inBufferBaseIndex:  inBuffer or a decoded block
+    long  sourceNumSamples;     // frames in the file itself when resampling
+    long  sourceReadIndex;      // next frame the file position is at
+
+    int   fileNumChannels;      // channels in the WAV file or stream being read
+    float *channelMatrix;       // requiredNumChannels rows by fileNumChannels, or NULL
+    float *customMatrix;        // from setChannelMatrix(), used instead of the default
+    int   customColumns;
+
+    unsigned char *silenceMap;  // SILENCE_... for each SONIC_SILENCE_BLOCK of input
+    long  silenceMapSize;
+    bool  outFileHole;          // output file ends in a hole not yet written
+
+    long  patchBase;            // frame index at the beginning of outBuffer when patching
+    long  patchFrames;          // frames of the file loaded into outBuffer
+    long  patchDirty;           // frames from patchBase that need writing back
+    long  patchPast;            // frame index where the range being patched ends
+
+    char  *cacheIdentity;       // from queryCacheIdentity(), or NULL if not known yet
+    const SonicWaveStats *stats;    // from queryStats(), or NULL if not known yet
+    long  statsGeneration;      // WaveStatsGeneration when 'stats' was found
+    SonicReusePlan *reusePlan;  // what the last run rendered that is still good, or NULL
+
+    // Frames fetch() reads directly:  fastFrames of them from fastFirst,
+    // in the read window or the history of a wave being written.  Zero
+    // whenever those might change; see findFastWindow().
+    const float *fastWindow;
+    long  fastFirst;
+    long  fastFrames;
+};
+
+
+// Identifies the result of one wave assignment for the render cache:
+// the generated code, plus the data and values it reads.  Implemented
+// in cache.cpp.
+class SonicCacheKey
+{
+public:
+    SonicCacheKey(const char *codeHash);
+    ~SonicCacheKey();
+
+    void addInteger(const char *name, long value);
+    void addReal(const char *name, double value);
+    void addBoolean(const char *name, int value);
+    void addArray(const char *name, const void *data, size_t numBytes);
+    void addWave(SonicWave &wave);
+
+    void allowReuse(bool stateful);     // result can be patched from the last run's
+    void addRead(SonicWave &wave, double offset);   // reads wave[c, i+offset]
+    void addReadAnywhere(SonicWave &wave);
+
+    bool isValid() const
+    {
+        return valid;
+    }
+    const char *queryText() const
+    {
+        return text;
+    }
+    const char *queryHash() const;
+
+    static bool Fetch(const SonicCacheKey &key, const char *filename);
+    static void Store(const SonicCacheKey &key, const char *filename);
+
+    SonicReusePlan *planReuse(SonicWave &target);
+    void recordReuse(SonicWave &target);
+
+private:
+    struct Source;
+    enum { MAX_READS = 32 };
+
+    void append(const char *s);
+    int  addSource(SonicWave &wave);
+    bool takeFingerprints();
+    void makeSlotFilename(SonicWave &target, char *path, size_t size) const;
+
+private:
+    char    *text;
+    size_t  length;
+    size_t  capacity;
+    bool    valid;              // false if caching is off or an input is unknown
+    mutable char hash [20];
+    char    codeHash [20];
+
+    bool    reuseAllowed;
+    bool    reuseStateful;      // has filter state, so needs warming up before a change
+    int     numSources;         // waves read, for incremental rendering
+    Source  *sourceList;
+    int     numReads;
+    int     readSource [MAX_READS];
+    double  readOffset [MAX_READS];
+    bool    readAnywhere [MAX_READS];
+};
+
+
+// The parts of a wave assignment's previous result that can be copied
+// instead of computed again, because nothing they depend on has changed.
+// Each range of frames to compute may begin with a warm-up stretch that
+// is evaluated only to settle filter state; the previous result is
+// written there too.  Implemented in cache.cpp.
+class SonicReusePlan
+{
+public:
+    SonicReusePlan(FILE *_previous, long _dataOffset, long _numFrames, int _numChannels);
+    ~SonicReusePlan();
+
+    void addRange(long start, long computeFrom, long end);
+    void finish();
+
+    long reusable(long i);
+    bool warmingUp(long i)
+    {
+        if (i >= cursorEnd)
+            seek(i);
+
+        return i >= cursorStart && i < cursorComputeFrom;
+    }
+    void readFrames(long first, long numFrames, float *dest);
+
+private:
+    struct Range
+    {
+        long start;
+        long computeFrom;
+        long end;
+    };
+
+    void seek(long i);
+
+private:
+    FILE    *previous;          // cache entry holding the last run's result
+    long    dataOffset;         // where its frame 0 starts
+    long    numFrames;
+    int     numChannels;
+    Range   *rangeList;
+    int     numRanges;
+    int     rangeCapacity;
+    long    cursorStart;        // range containing or following the last frame asked about
+    long    cursorComputeFrom;
+    long    cursorEnd;
+};
+
+
+// Saves the state of a running program at statement boundaries (and
+// periodically inside long wave assignments) so that after being killed
+// it can pick up where it left off when run again with --resume.
+// Implemented in checkpoint.cpp.
+class SonicCheckpoint
+{
+public:
+    SonicCheckpoint(const char *_programName);
+    ~SonicCheckpoint();
+
+    void addInteger(const char *name, long &value);
+    void addReal(const char *name, double &value);
+    void addBoolean(const char *name, int &value);
+    void addArray(const char *name, void *data, size_t numBytes);
+    void addWave(SonicWave &wave);
+    void disallow(const char *reason);
+    void restore();
+
+    bool reached(int step);     // false while skipping statements already done
+    bool resumeInside(int step, long &frame, double &t);
+    bool due() const
+    {
+        return enabled && time(0) - lastSaveTime >= Sonic_CheckpointSeconds;
+    }
+    void save(int step, long frame = -1, double t = 0);    // frame >= 0: inside a wave assignment
+
+    static void DiscardFile(const char *filename);
+    static bool IsProtected(const char *filename);
+    static void EraseStateFile();
+
+private:
+    struct Item;
+
+    void addItem(char kind, const char *name, void *data, size_t numBytes, SonicWave *wave);
+    void protectFiles();
+
+private:
+    char    *programName;
+    Item    *itemList;
+    Item    *itemTail;
+    unsigned long signature;    // hash of the arguments the program was started with
+    bool    enabled;
+    time_t  lastSaveTime;
+    int     resumeStep;         // statements before this one were done before the checkpoint
+    long    resumeFrame;        // frame to continue from inside resumeStep, or -1
+    double  resumeTime;
+};
+
+
+// WAV input converted to floats in the program's channel layout, kept in
+// blocks of SONIC_DECODED_BLOCK frames so that each open of the same file
+// with the same mix copies them instead of decoding again.  Implemented
+// in decoded.cpp.
+const long SONIC_DECODED_BLOCK = 16 * 1024;
+
+class SonicDecodedSource
+{
+public:
+    static SonicDecodedSource *Find(const char *key, int numChannels);
+
+    const float *findBlock(long index);     // NULL if not in memory
+    float *addBlock(long index);            // to be filled in;  NULL if it cannot be kept
+    void pinBlock(long index);              // keep it in memory until unpinned
+    void unpinBlock(long index);
+
+private:
+    struct Block;
+
+    SonicDecodedSource(const char *_key, int _numChannels);
+
+    static void DropBlock(Block *block);
+    static void Unlink(Block *block);
+    static void LinkNewest(Block *block);
+
+private:
+    char    *key;
+    int     numChannels;
+    Block   **blockTable;       // indexed by block number; NULL where not in memory
+    long    tableSize;
+    SonicDecodedSource *next;
+
+    static SonicDecodedSource *SourceList;
+    static Block *NewestBlock;  // most recently used
+    static Block *OldestBlock;
+    static size_t NumBytes;     // memory held by all blocks
 };
 
 
@@ -178,5 +642,165 @@ inline double Sonic_dB(double x)
     return pow(10.0, x/20.0);
 }
 
+
+// Strength-reduced forms of x^n for a small constant n, and of x % d.
+inline double Sonic_IntPower(double x, int n)
+{
+    double y = 1.0;
+    double p = x;
+    for (int k = (n < 0) ? -n : n; k; k >>= 1)
+    {
+        if (k & 1)
+            y *= p;
+        p *= p;
+    }
+    return (n < 0) ? (1.0 / y) : y;
+}
+inline double Sonic_Wrap(double x, double d)
+{
+    // Exact, like fmod():  d <= x < 2d makes x - d exact.
+    if (x >= 0.0 && x < d)
+        return x;
+    if (x >= d && x < d+d)
+        return x - d;
+    return fmod(x, d);
+}
+
+
+// exp(), dB() or b^x of an expression linear in i or t, at consecutive
+// frames:  each value is the last one times a constant ratio.  The loop
+// asks follows(i) first; when that fails, because frames were skipped or
+// the ramp is due for anchoring, it passes the exact value to anchor().
+class SonicExpRamp
+{
+public:
+    SonicExpRamp(double _ratio):
+        ratio(_ratio),
+        frame(-2),
+        numLeft(0),
+        value(0.0)
+    {}
+
+    bool follows(long i)
+    {
+        if (i == frame)
+            return true;
+
+        if (i != frame+1 || numLeft <= 0)
+            return false;
+
+        value *= ratio;
+        frame = i;
+        --numLeft;
+        return true;
+    }
+
+    double queryValue() const
+    {
+        return value;
+    }
+
+    double anchor(long i, double exact)
+    {
+        frame = i;
+        numLeft = SONIC_RAMP_ANCHOR;
+        return value = exact;
+    }
+
+private:
+    double  ratio;
+    long    frame;
+    long    numLeft;
+    double  value;
+};
+
+
+// x % d, where x is linear in i or t and d stays the same:  each value is
+// the last one plus a constant step, wrapped by compare and subtract.
+// Used the same way as SonicExpRamp.
+class SonicPhaseRamp
+{
+public:
+    SonicPhaseRamp(double _step, double _divisor):
+        step(_step),
+        divisor(_divisor),
+        span((divisor > 0.0 && fabs(step) < divisor) ? SONIC_RAMP_ANCHOR : 0),
+        frame(-2),
+        numLeft(0),
+        dividend(0.0),
+        value(0.0)
+    {}
+
+    bool follows(long i)
+    {
+        if (i == frame)
+            return true;
+
+        if (i != frame+1 || numLeft <= 0)
+            return false;
+
+        // fmod() gives the sign of the dividend, so the frame where the
+        // dividend reaches zero or changes sign is left to fmod().  So are
+        // values too close to where they wrap, so that rounding cannot
+        // move a wrap to a different frame.
+        const double nextDividend = dividend + step;
+        if (nextDividend == 0.0 || (dividend < 0.0) != (nextDividend < 0.0))
+            return false;
+
+        const double margin = 1.0e-9 * divisor;
+        double next = value + step;
+        bool close;
+        if (dividend >= 0.0)
+        {
+            if (next >= divisor)
+                next -= divisor;
+            else if (next < 0.0)
+                next += divisor;
+
+            close = (next < margin || next > divisor - margin);
+        }
+        else
+        {
+            if (next <= -divisor)
+                next += divisor;
+            else if (next > 0.0)
+                next -= divisor;
+
+            close = (next > -margin || next < margin - divisor);
+        }
+
+        if (close)
+            return false;
+
+        dividend = nextDividend;
+        value = next;
+        frame = i;
+        --numLeft;
+        return true;
+    }
+
+    double queryValue() const
+    {
+        return value;
+    }
+
+    double anchor(long i, double x)
+    {
+        frame = i;
+        numLeft = span;
+        dividend = x;
+        return value = fmod(x, divisor);
+    }
+
+private:
+    double  step;
+    double  divisor;
+    long    span;       // frames to follow after anchoring; 0 if a step can wrap more than once
+    long    frame;
+    long    numLeft;
+    double  dividend;
+    double  value;
+};
+
 #endif // __ddc_sonic_runtime
 /*--- end of file sonic.h ---*/
\ No newline at end of file
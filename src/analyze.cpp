@@ -0,0 +1,656 @@
+/*===========================================================================
+
+    analyze.cpp  -  Sonic translator
+
+    This module examines how a program uses its variables, in ways that
+    validation does not need but code generation and the run-time
+    library can take advantage of.
+
+    Stream analysis:  a wave program parameter may be bound at run time
+    to "-" or to a FIFO, which can only be read or written front to back
+    with a bounded window of history.  findStreamConflict() decides
+    whether the program body's access pattern allows that.
+
+    Preview analysis:  when only a time window of the outputs is wanted,
+    a wave needs to be computed only around that window, unless some part
+    of the program looks at all of it.  previewNeedsWholeWave() tells.
+
+    Copy analysis:  a wave copied whole into another can hand its data
+    over instead of sharing it, if nothing uses it afterward.
+    isLastUseOfWave() tells.
+
+    Fusion analysis:  a local wave written by one top-level statement and
+    read only by the next few, at or just before the frame they compute,
+    need not be stored at all if those statements run as one loop.
+    findFusionEnd() tells which statement that loop would end with.
+
+    Purity analysis:  a call to a function whose result depends only on
+    its arguments, and which changes nothing outside itself, need not be
+    repeated for every sample while its arguments stay the same.
+    isPure() tells.
+
+===========================================================================*/
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+
+#include "scan.h"
+#include "parse.h"
+
+
+class Sonic_ExpressionVisitor_WaveUse: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_WaveUse(const SonicToken &_waveName):
+        waveName(_waveName),
+        numReads(0),
+        numRandomReads(0),
+        numRecentReads(0),
+        numWholeWaveQueries(0),
+        numLengthQueries(0),
+        numOtherUses(0),
+        numOldData(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
+        {
+        case ETYPE_WAVE_EXPR:
+            if (ep->getFirstToken() == waveName)
+            {
+                ++numReads;
+                const SonicParse_Expression_WaveExpr *wp = (const SonicParse_Expression_WaveExpr *) ep;
+                if (!wp->queryIndexTerm()->isSampleOffset())
+                    ++numRandomReads;
+
+                long back;
+                if (wp->readsRecentFrame(back))
+                    ++numRecentReads;
+            }
+            break;
+
+        case ETYPE_WAVE_FIELD:
+            if (ep->getFirstToken() == waveName)
+            {
+                // 'r' and 'm' are program constants; anything else needs the whole wave.
+                const SonicToken &field = ((const SonicParse_Expression_WaveField *) ep)->queryField();
+                if (field != "r" && field != "m")
+                    ++numWholeWaveQueries;
+                if (field == "n")
+                    ++numLengthQueries;
+            }
+            break;
+
+        case ETYPE_VARIABLE:
+            if (ep->getFirstToken() == waveName)
+                ++numOtherUses;     // whole wave passed to a function
+            break;
+
+        case ETYPE_OLD_DATA:
+            ++numOldData;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    bool mentionsWave() const
+    {
+        return numReads + numWholeWaveQueries + numOtherUses > 0;
+    }
+
+public:
+    const SonicToken &waveName;
+    int numReads;
+    int numRandomReads;
+    int numRecentReads;         // at [c, i - k] for a small whole number k
+    int numWholeWaveQueries;
+    int numLengthQueries;       // 'n' only: also counted as whole wave queries
+    int numOtherUses;
+    int numOldData;
+};
+
+
+class Sonic_StatementVisitor_WaveUse: public Sonic_StatementVisitor
+{
+public:
+    Sonic_StatementVisitor_WaveUse(const SonicToken &_waveName):
+        exprUse(_waveName),
+        numWrites(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Statement *sp)
+    {
+        sp->visitExpressions(exprUse);
+        if (sp->queryType() == STMT_ASSIGNMENT)
+        {
+            const SonicParse_Lvalue *lvalue = ((const SonicParse_Statement_Assignment *) sp)->queryLvalue();
+            if (lvalue->queryIsWave() && lvalue->queryVarName() == exprUse.waveName)
+                ++numWrites;
+        }
+        else if (sp->queryType() == STMT_MULTI_ASSIGNMENT)
+        {
+            if (((const SonicParse_Statement_MultiAssignment *) sp)->writesWave(exprUse.waveName))
+                ++numWrites;
+        }
+    }
+
+    bool mentionsWave() const
+    {
+        return numWrites > 0 || exprUse.mentionsWave();
+    }
+
+public:
+    Sonic_ExpressionVisitor_WaveUse  exprUse;
+    int numWrites;
+};
+
+
+const char *SonicParse_Function::findStreamConflict(const SonicToken &waveName) const
+{
+    // Returns NULL if 'waveName' can be streamed, or the reason it cannot.
+    // A streamable wave is either read by a single top-level assignment,
+    // or written by top-level assignments that open with '=' and continue
+    // with '<<'.  Every sample index must be 'i' plus a sample-invariant
+    // offset, so that the lookback needed is bounded.
+
+    bool read = false;
+    bool written = false;
+
+    for (const SonicParse_Statement *sp = statementList; sp; sp = sp->queryNext())
+    {
+        Sonic_StatementVisitor_WaveUse  use(waveName);
+        sp->visit(use);
+        if (!use.mentionsWave())
+            continue;
+
+        if (use.exprUse.numOtherUses > 0)
+            return "it is passed to a function";
+
+        const bool multi = (sp->queryType() == STMT_MULTI_ASSIGNMENT);
+        if (sp->queryType() != STMT_ASSIGNMENT && !multi)
+            return "it is used inside a loop or conditional statement";
+
+        if (use.exprUse.numWholeWaveQueries > 0)
+            return "its length or statistics are needed";
+
+        if (use.exprUse.numRandomReads > 0)
+            return "it is read at an index other than 'i' plus an offset";
+
+        if (use.numWrites > 0)
+        {
+            if (read)
+                return "it is both read and written";
+
+            // A multi-output assignment always opens its waves with '='.
+            const SonicParse_Statement_Assignment *ap = multi ? 0 : (const SonicParse_Statement_Assignment *) sp;
+            const bool assigned = multi || ap->queryOp() == "=";
+            if (ap && ((!assigned && ap->queryOp() != "<<") || use.exprUse.numOldData > 0 || ap->queryLvalue()->querySampleStart()))
+                return "it is modified in place";
+
+            if (assigned && written)
+                return "it is assigned more than once";
+
+            written = true;
+        }
+        else
+        {
+            if (written)
+                return "it is read back after being written";
+
+            if (read)
+                return "it is read by more than one statement";
+
+            read = true;
+        }
+    }
+
+    return 0;
+}
+
+
+class Sonic_StatementVisitor_PreviewWhole: public Sonic_StatementVisitor
+{
+public:
+    Sonic_StatementVisitor_PreviewWhole(
+        const SonicParse_Function &_func,
+        const SonicToken &_waveName):
+        func(_func),
+        waveName(_waveName),
+        whole(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Statement *sp)
+    {
+        if (whole)
+            return;
+
+        Sonic_ExpressionVisitor_WaveUse  use(waveName);
+        sp->visitExpressions(use);
+        if (use.numOtherUses > 0 ||
+            use.numRandomReads > 0 ||
+            use.numWholeWaveQueries > use.numLengthQueries)
+        {
+            whole = true;
+        }
+        else if (use.numReads > 0 && sp->queryType() == STMT_ASSIGNMENT)
+        {
+            // Whatever is computed from the wave inherits its needs.
+            const SonicParse_Statement_Assignment *ap = (const SonicParse_Statement_Assignment *) sp;
+            const SonicParse_Lvalue *lvalue = ap->queryLvalue();
+            if (lvalue->queryIsWave() && lvalue->queryVarName() != waveName)
+            {
+                // Appending or patching a range moves what is read elsewhere in time.
+                if (ap->queryOp() == "<<" ||
+                    lvalue->querySampleStart() ||
+                    func.previewNeedsWholeWave(lvalue->queryVarName()))
+                {
+                    whole = true;
+                }
+            }
+        }
+        else if (use.numReads > 0 && sp->queryType() == STMT_MULTI_ASSIGNMENT)
+        {
+            const SonicParse_Statement_MultiAssignment *mp = (const SonicParse_Statement_MultiAssignment *) sp;
+            for (int k=0; k < mp->queryNumOutputs() && !whole; ++k)
+                if (func.previewNeedsWholeWave(mp->queryOutput(k)))
+                    whole = true;
+        }
+    }
+
+    bool queryWhole() const
+    {
+        return whole;
+    }
+
+private:
+    const SonicParse_Function &func;
+    const SonicToken &waveName;
+    bool whole;
+};
+
+
+bool SonicParse_Function::previewNeedsWholeWave(const SonicToken &waveName) const
+{
+    // Returns true if every sample of 'waveName' must be computed even
+    // when previewing, because it is passed to a function, read at an
+    // index that is not 'i' plus an offset, measured (other than its
+    // length, which does not change), appended or patched into another
+    // wave, or used to compute a wave that itself needs to be whole.
+    // Waves that other functions can see are always whole.
+
+    static int depth = 0;
+    if (depth > 32 || !isProgramBody)
+        return true;
+
+    const SonicParse_VarDecl *vp = findSymbol(waveName, false);
+    if (!vp || vp == prog.findGlobalVar(waveName))
+        return true;
+
+    ++depth;
+    Sonic_StatementVisitor_PreviewWhole  visitor(*this, waveName);
+    for (const SonicParse_Statement *sp = statementList; sp; sp = sp->queryNext())
+        sp->visit(visitor);
+    --depth;
+
+    return visitor.queryWhole();
+}
+
+
+bool SonicParse_Function::isLastUseOfWave(
+    const SonicParse_Statement *stmt,
+    const SonicToken &waveName) const
+{
+    // Returns true if 'stmt' is a top-level statement of the program body,
+    // 'waveName' is one of its local waves, and no statement after 'stmt'
+    // mentions that wave.
+
+    if (!isProgramBody)
+        return false;
+
+    const SonicParse_VarDecl *vp = findSymbol(waveName, false);
+    if (!vp || vp->queryIsFunctionParm() || vp == prog.findGlobalVar(waveName))
+        return false;
+
+    const SonicParse_Statement *sp = statementList;
+    while (sp && sp != stmt)
+        sp = sp->queryNext();
+
+    if (!sp)
+        return false;       // inside a loop or conditional
+
+    for (sp = sp->queryNext(); sp; sp = sp->queryNext())
+    {
+        Sonic_StatementVisitor_WaveUse  use(waveName);
+        sp->visit(use);
+        if (use.mentionsWave())
+            return false;
+    }
+
+    return true;
+}
+
+
+const SonicParse_Statement *SonicParse_Function::findFusionEnd(
+    const SonicParse_Statement *stmt,
+    const SonicToken &waveName) const
+{
+    // Returns the last top-level statement that reads 'waveName', if it is
+    // one of the function's local waves, 'stmt' is a top-level statement
+    // and the only one to write it, and the statements after 'stmt' read
+    // it only at a recent frame (see readsRecentFrame()).  Returns NULL
+    // if anything else uses the wave, or nothing reads it.
+
+    const SonicParse_VarDecl *vp = findSymbol(waveName, false);
+    if (!vp || vp->queryIsFunctionParm() || vp == prog.findGlobalVar(waveName))
+        return 0;
+
+    bool written = false;
+    const SonicParse_Statement *end = 0;
+    for (const SonicParse_Statement *sp = statementList; sp; sp = sp->queryNext())
+    {
+        Sonic_StatementVisitor_WaveUse  use(waveName);
+        sp->visit(use);
+        if (sp == stmt)
+        {
+            if (use.numWrites != 1 || use.exprUse.mentionsWave())
+                return 0;
+
+            written = true;
+        }
+        else if (use.mentionsWave())
+        {
+            if (!written ||
+                use.numWrites > 0 ||
+                sp->queryType() != STMT_ASSIGNMENT ||
+                use.exprUse.numRecentReads < use.exprUse.numReads ||
+                use.exprUse.numWholeWaveQueries > 0 ||
+                use.exprUse.numOtherUses > 0)
+            {
+                return 0;
+            }
+
+            end = sp;
+        }
+    }
+
+    return end;
+}
+
+
+//---------------------------------------------------------------------------
+//  writesWave() tells whether a function can change the contents of one
+//  of its wave parameters, either directly or by passing it along to
+//  another function that does.  It is used to enforce 'in' parameters.
+
+class Sonic_ExpressionVisitor_WavePassing: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_WavePassing(
+        const SonicToken &_waveName,
+        SonicParse_Program &_prog,
+        const SonicParse_Function *_func):
+        waveName(_waveName),
+        prog(_prog),
+        func(_func),
+        numWrites(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        if (ep->queryExpressionType() != ETYPE_FUNCTION_CALL)
+            return;
+
+        const SonicParse_Expression_FunctionCall *call = (const SonicParse_Expression_FunctionCall *) ep;
+        if (call->isIntrinsic())
+            return;
+
+        const SonicParse_Expression *arg = call->queryParmList();
+        for (int position = 0; arg; arg = arg->queryNext(), ++position)
+        {
+            if (arg->queryExpressionType() != ETYPE_VARIABLE || arg->getFirstToken() != waveName)
+                continue;
+
+            if (prog.findImportVar(call->getFirstToken(), (SonicParse_Function *) func))
+            {
+                ++numWrites;    // no way to know what C++ code does with it
+                continue;
+            }
+
+            const SonicParse_Function *called = prog.findFunction(call->getFirstToken());
+            const SonicParse_VarDecl *parm = called->queryParmList();
+            for (int k=0; parm && k < position; ++k)
+                parm = parm->queryNext();
+
+            if (parm && called->writesWave(parm->queryName()))
+                ++numWrites;
+        }
+    }
+
+public:
+    const SonicToken &waveName;
+    SonicParse_Program &prog;
+    const SonicParse_Function *func;
+    int numWrites;
+};
+
+
+class Sonic_StatementVisitor_WaveWrites: public Sonic_StatementVisitor
+{
+public:
+    Sonic_StatementVisitor_WaveWrites(
+        const SonicToken &_waveName,
+        SonicParse_Program &_prog,
+        const SonicParse_Function *_func):
+        passing(_waveName, _prog, _func)
+    {}
+
+    virtual void visitHook(const SonicParse_Statement *sp)
+    {
+        if (sp->queryType() == STMT_ASSIGNMENT)
+        {
+            const SonicParse_Lvalue *lvalue = ((const SonicParse_Statement_Assignment *) sp)->queryLvalue();
+            if (lvalue->queryVarName() == passing.waveName)
+                ++passing.numWrites;
+        }
+        else if (sp->queryType() == STMT_MULTI_ASSIGNMENT)
+        {
+            if (((const SonicParse_Statement_MultiAssignment *) sp)->writesWave(passing.waveName))
+                ++passing.numWrites;
+        }
+
+        sp->visitExpressions(passing);
+    }
+
+    int queryNumWrites() const
+    {
+        return passing.numWrites;
+    }
+
+private:
+    Sonic_ExpressionVisitor_WavePassing  passing;
+};
+
+
+bool SonicParse_Function::writesWave(const SonicToken &waveName) const
+{
+    // Recursive functions could chase each other forever;
+    // past a reasonable depth, assume the worst.
+
+    static int depth = 0;
+    if (depth > 32)
+        return true;
+
+    ++depth;
+    Sonic_StatementVisitor_WaveWrites  visitor(waveName, prog, this);
+    SonicParse_Statement::VisitList(visitor, statementList);
+    --depth;
+
+    return visitor.queryNumWrites() > 0;
+}
+
+
+//---------------------------------------------------------------------------
+//  isPure() tells whether a function only computes a value from its
+//  arguments:  no globals, waves, noise or import objects, and calls
+//  only to other such functions.
+
+class Sonic_ExpressionVisitor_Purity: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_Purity(
+        SonicParse_Program &_prog,
+        const SonicParse_Function *_func):
+        prog(_prog),
+        func(_func),
+        numImpure(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
+        {
+        case ETYPE_VARIABLE:
+        case ETYPE_ARRAY_SUBSCRIPT:
+            {
+                const SonicParse_VarDecl *var = func->findSymbol(ep->getFirstToken(), false);
+                if (!var || var->queryIsGlobal())
+                    ++numImpure;
+            }
+            break;
+
+        case ETYPE_FUNCTION_CALL:
+            {
+                const SonicParse_Expression_FunctionCall *call = (const SonicParse_Expression_FunctionCall *) ep;
+                if (call->isIntrinsic())
+                {
+                    if (call->isNoise())
+                        ++numImpure;
+                }
+                else if (call->queryFunctionType() != SFT_USER)
+                    ++numImpure;
+                else
+                {
+                    // Calling itself changes nothing the rest of it doesn't.
+                    const SonicParse_Function *called = prog.findFunction(call->getFirstToken());
+                    if (!called || (called != func && !called->isPure()))
+                        ++numImpure;
+                }
+            }
+            break;
+
+        case ETYPE_WAVE_EXPR:
+        case ETYPE_WAVE_FIELD:
+        case ETYPE_OLD_DATA:
+        case ETYPE_SINEWAVE:
+        case ETYPE_SAWTOOTH:
+        case ETYPE_FFT:
+        case ETYPE_IIR:
+            ++numImpure;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    void visitAssignment(const SonicParse_Lvalue *lvalue)
+    {
+        const SonicParse_VarDecl *var = func->findSymbol(lvalue->queryVarName(), false);
+        if (lvalue->queryIsWave() || !var || var->queryIsGlobal())
+            ++numImpure;
+    }
+
+    void visitWaveWrite()
+    {
+        ++numImpure;
+    }
+
+    int queryNumImpure() const
+    {
+        return numImpure;
+    }
+
+private:
+    SonicParse_Program &prog;
+    const SonicParse_Function *func;
+    int numImpure;
+};
+
+
+class Sonic_StatementVisitor_Purity: public Sonic_StatementVisitor
+{
+public:
+    Sonic_StatementVisitor_Purity(
+        SonicParse_Program &_prog,
+        const SonicParse_Function *_func):
+        purity(_prog, _func)
+    {}
+
+    virtual void visitHook(const SonicParse_Statement *sp)
+    {
+        if (sp->queryType() == STMT_ASSIGNMENT)
+            purity.visitAssignment(((const SonicParse_Statement_Assignment *) sp)->queryLvalue());
+        else if (sp->queryType() == STMT_MULTI_ASSIGNMENT)
+            purity.visitWaveWrite();
+
+        sp->visitExpressions(purity);
+    }
+
+    void visitInitializer(const SonicParse_Expression *init)
+    {
+        init->visit(purity);
+    }
+
+    int queryNumImpure() const
+    {
+        return purity.queryNumImpure();
+    }
+
+private:
+    Sonic_ExpressionVisitor_Purity  purity;
+};
+
+
+bool SonicParse_Function::isPure() const
+{
+    if (isProgramBody || isImport())
+        return false;
+
+    for (const SonicParse_VarDecl *parm = parmList; parm; parm = parm->queryNext())
+    {
+        SonicTypeClass tc = parm->queryType().queryTypeClass();
+        if (tc != STYPE_INTEGER && tc != STYPE_REAL && tc != STYPE_BOOLEAN)
+            return false;
+    }
+
+    for (const SonicParse_VarDecl *var = varList; var; var = var->queryNext())
+    {
+        SonicTypeClass tc = var->queryType().queryTypeClass();
+        if (tc == STYPE_WAVE || tc == STYPE_IMPORT)
+            return false;
+    }
+
+    // As in writesWave(), recursion past a reasonable depth is assumed
+    // to be up to something.
+
+    static int depth = 0;
+    if (depth > 32)
+        return false;
+
+    ++depth;
+    Sonic_StatementVisitor_Purity  visitor(prog, this);
+    for (const SonicParse_VarDecl *var = varList; var; var = var->queryNext())
+        if (var->queryInit())
+            visitor.visitInitializer(var->queryInit());
+
+    SonicParse_Statement::VisitList(visitor, statementList);
+    --depth;
+
+    return visitor.queryNumImpure() == 0;
+}
+
+
+/*--- end of file analyze.cpp ---*/
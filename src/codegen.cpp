@@ -45,7 +45,10 @@
 
 ==========================================================================*/
 #include <iostream>
+#include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "scan.h"
 #include "parse.h"
@@ -63,6 +66,36 @@ void Sonic_CodeGenContext::indent(std::ostream &o, const char *s)
 }
 
 
+int Sonic_CodeGenContext::findBlockFetch(const SonicToken &waveName, const char *index, bool interp) const
+{
+    for (int k=0; k < numBlockFetches; ++k)
+    {
+        if (*blockFetchWave[k] == waveName &&
+            blockFetchInterp[k] == interp &&
+            strcmp(blockFetchIndex[k], index) == 0)
+        {
+            return blockFetchTag[k];
+        }
+    }
+
+    return -1;
+}
+
+
+void Sonic_CodeGenContext::addBlockFetch(const SonicToken &waveName, const char *index, bool interp, int tag)
+{
+    // Anything that does not fit is simply fetched again.
+    if (numBlockFetches < MAX_BLOCK_FETCHES && strlen(index) < size_t(MAX_BLOCK_FETCH_INDEX))
+    {
+        blockFetchWave[numBlockFetches] = &waveName;
+        strcpy(blockFetchIndex[numBlockFetches], index);
+        blockFetchInterp[numBlockFetches] = interp;
+        blockFetchTag[numBlockFetches] = tag;
+        ++numBlockFetches;
+    }
+}
+
+
 //-------------------------------------------------------------------------
 
 
@@ -211,292 +244,2964 @@ void SonicParse_Statement_Return::generateCode(std::ostream &o, Sonic_CodeGenCon
 }
 
 
-void SonicParse_Statement_Assignment::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
+class Sonic_ExpressionVisitor_WaveReads: public Sonic_ExpressionVisitor
 {
-    int i;
-    SonicType ltype = lvalue->determineType(*x.prog,x.func);
+public:
+    Sonic_ExpressionVisitor_WaveReads():
+        numReads(0),
+        overflow(false)
+    {}
 
-    if (lvalue->queryIsWave())
+    virtual void visitHook(const SonicParse_Expression *ep)
     {
-        x.indent(o, "{\n");
-        x.pushIndent();
-
-        // put a comment to explain the complexity to follow
-        x.generatingComment = true;
-        x.indent(o, "//  ");
-        o << lvalue->queryVarName().queryToken() << "[c,i";
-        SonicParse_Expression *limit = lvalue->querySampleLimit();
-        if (limit)
+        if (ep->queryExpressionType() == ETYPE_WAVE_EXPR)
         {
-            o << ":";
-            limit->generateCode(o, x);
+            if (numReads < maxReads)
+                read[numReads++] = (const SonicParse_Expression_WaveExpr *) ep;
+            else
+                overflow = true;
         }
+    }
 
-        o << "] " << op.queryToken() << " ";
-        rvalue->generateCode(o, x);
-        o << ";\n\n";
-        x.generatingComment = false;
+    int queryNumReads() const
+    {
+        return overflow ? 0 : numReads;
+    }
 
-        // Obtain list of all wave variables in rvalue
-        const int maxWaveSymbols = 256;
-        const SonicToken *waveSymbol [maxWaveSymbols];
-        int numWaveSymbols = 0;
-        int numOccurrences = 0;
-        waveSymbol [numWaveSymbols++] = &lvalue->queryVarName();
+    const SonicParse_Expression_WaveExpr *queryRead(int k) const
+    {
+        return read[k];
+    }
 
-        rvalue->getWaveSymbolList(
-            waveSymbol,
-            maxWaveSymbols,
-            numWaveSymbols,
-            numOccurrences);
+private:
+    enum { maxReads = 32 };
+    const SonicParse_Expression_WaveExpr *read [maxReads];
+    int numReads;
+    bool overflow;
+};
 
-        bool modify = false;
-        for (i=1; i < numWaveSymbols && !modify; ++i)
-            if (*waveSymbol[i] == "$")
-                modify = true;
 
-        x.indent(o, LOCAL_SYMBOL_PREFIX);
-        const char *lname = lvalue->queryVarName().queryToken();
-        o << lname;
-        if (op == "=" && !modify)
-            o << ".openForWrite();\n";
-        else if (op == "<<")
-        {
-            if (modify)
-                throw SonicParseException("Cannot use append operator when '$' appears on right side", op);
+class Sonic_ExpressionVisitor_WholeNumber: public Sonic_ExpressionVisitor
+{
+    // Finds whether an expression is sure to compute a whole number:
+    // every part of it must be an integer, and not a power, which the
+    // generated code computes as a double.
 
-            o << ".openForAppend();\n";
-        }
-        else
+public:
+    Sonic_ExpressionVisitor_WholeNumber():
+        whole(true)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        if (ep->determineType() != STYPE_INTEGER)
+            whole = false;
+        else if (ep->queryExpressionType() == ETYPE_BINARY_OP &&
+                 ((const SonicParse_Expression_BinaryOp *)ep)->queryOp() == "^")
+            whole = false;
+    }
+
+    bool queryWhole() const
+    {
+        return whole;
+    }
+
+private:
+    bool whole;
+};
+
+
+void SonicParse_Statement_Assignment::generateQuietSkip(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    bool limited)
+{
+    // When every wave read on the right is silent, so is the result, and a
+    // whole run of samples can be written as silence without evaluating
+    // anything.  Each wave reports either how long it stays silent from
+    // the index being read, or how long it will not be (so the check can
+    // be skipped until then).  This is only generated for expressions that
+    // are zero whenever their inputs are; see isZeroPreserving().
+
+    // In a fused loop, the inputs of the waves computed in it are checked
+    // instead of those waves; see canSkipQuiet().
+    Sonic_ExpressionVisitor_WaveReads reads;
+    rvalue->visit(reads);
+    for (SonicParse_Statement *sp = fusedFirst; sp && sp != this; sp = sp->queryNext())
+        ((SonicParse_Statement_Assignment *)sp)->rvalue->visit(reads);
+
+    x.indent(o, "if ( i >= quietCheck )\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.indent(o, "long quiet = SONIC_QUIET_FOREVER;\n");
+    x.indent(o, "long q;\n");
+
+    x.iAllowed = true;
+    for (int k=0; k < reads.queryNumReads(); ++k)
+    {
+        const SonicParse_Expression_WaveExpr *wp = reads.queryRead(k);
+        if (findFusedWave(wp->getFirstToken()))
+            continue;
+
+        x.indent(o, "q = ");
+        o << LOCAL_SYMBOL_PREFIX << wp->getFirstToken().queryToken() << ".quietFrames ( ";
+        x.bracketer = &wp->getFirstToken();
+        wp->queryIndexTerm()->generateCode(o, x);
+        x.bracketer = 0;
+        o << (limited ? ", true );\n" : " );\n");
+        x.indent(o, "if ( q < quiet ) quiet = q;\n");
+    }
+    x.iAllowed = false;
+
+    if (limited)
+    {
+        // Past the end of every input, the rest is silence up to the limit.
+        x.indent(o, "if ( quiet > numSamples - i ) quiet = numSamples - i;\n");
+        x.indent(o, "if ( quiet > 0 )\n");
+    }
+    else
+        x.indent(o, "if ( quiet > 0 && quiet != SONIC_QUIET_FOREVER )\n");
+
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.indent(o, LOCAL_SYMBOL_PREFIX);
+    o << lvalue->queryVarName().queryToken() << ".writeSilence ( quiet );\n";
+    x.indent(o, "i += quiet - 1;\n");
+    x.indent(o, "t += double(quiet - 1) * SampleTime;\n");
+    x.indent(o, "continue;\n");
+    x.popIndent();
+    x.indent(o, "}\n");
+    x.indent(o, "quietCheck = (quiet < 0) ? (i - quiet) : (i + 1);\n");
+    x.popIndent();
+    x.indent(o, "}\n\n");
+}
+
+
+class Sonic_ExpressionVisitor_Stateful: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_Stateful():
+        found(false),
+        foundOscillator(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
         {
-            o << ".openForModify();\n";
-            modify = true;
+        case ETYPE_SINEWAVE:
+        case ETYPE_SAWTOOTH:
+            found = foundOscillator = true;
+            break;
+
+        case ETYPE_FFT:
+        case ETYPE_IIR:
+            found = true;
+            break;
+
+        default:
+            break;
         }
+    }
+
+    bool queryFound() const
+    {
+        return found;
+    }
+    bool queryFoundOscillator() const      // state that never dies away
+    {
+        return foundOscillator;
+    }
+
+private:
+    bool found;
+    bool foundOscillator;
+};
 
-        for (i=1; i < numWaveSymbols; i++)
+
+class Sonic_ExpressionVisitor_ChannelLoop: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_ChannelLoop(
+        const Sonic_CodeGenContext *_context = 0,
+        const SonicToken *_target = 0):
+        context(_context),
+        target(_target),
+        blocked(false),
+        foundNoise(false),
+        numWaveReads(0),
+        numFrameReads(0),
+        numBlockReads(0),
+        numFeedbackReads(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
         {
-            if (*waveSymbol[i] != "$")
+        case ETYPE_VECTOR:
+        case ETYPE_SINEWAVE:
+        case ETYPE_SAWTOOTH:
+        case ETYPE_FFT:
+        case ETYPE_IIR:
+            blocked = true;     // code and state for each channel number
+            break;
+
+        case ETYPE_FUNCTION_CALL:
+            if (!((const SonicParse_Expression_FunctionCall *)ep)->isIntrinsic())
+                blocked = true;
+            else if (((const SonicParse_Expression_FunctionCall *)ep)->isNoise())
+                foundNoise = true;
+            break;
+
+        case ETYPE_WAVE_EXPR:
+            ++numWaveReads;
             {
-                x.indent(o, LOCAL_SYMBOL_PREFIX);
-                o << waveSymbol[i]->queryToken();
-                o << ".openForRead();\n";
+                const SonicParse_Expression_WaveExpr *wp = (const SonicParse_Expression_WaveExpr *) ep;
+                if (context && wp->readsWholeFrame(*context))
+                    ++numFrameReads;
+
+                // runs of frames, from an input or fed back from the result
+                if (wp->readsFrameRun())
+                {
+                    ++numBlockReads;
+                    if (target && wp->getFirstToken() == *target)
+                        ++numFeedbackReads;
+                }
             }
+            break;
+
+        default:
+            break;
         }
+    }
 
-        bool implicitSelfNumSamples = false;
+    bool queryBlocked() const
+    {
+        return blocked;
+    }
+    bool queryFoundNoise() const
+    {
+        return foundNoise;
+    }
+    int queryNumWaveReads() const
+    {
+        return numWaveReads;
+    }
+    int queryNumFrameReads() const
+    {
+        return numFrameReads;
+    }
+    int queryNumBlockReads() const
+    {
+        return numBlockReads;
+    }
+    int queryNumFeedbackReads() const
+    {
+        return numFeedbackReads;
+    }
 
-        x.indent(o, "double sample [NumChannels];\n");
-        x.indent(o, "double t = double(0);\n");
-        if (limit)
-        {
-            x.indent(o, "const long numSamples = long(");
-            x.bracketer = &lvalue->queryVarName();
-            limit->generateCode(o, x);
-            x.bracketer = 0;
-            o << ");\n";
-        }
-        else if (numOccurrences == 0 && modify)
-        {
-            x.indent(o, "const long numSamples = ");
-            o << LOCAL_SYMBOL_PREFIX << lvalue->queryVarName().queryToken();
-            o << ".queryNumSamples();\n";
-            implicitSelfNumSamples = true;
-        }
+private:
+    const Sonic_CodeGenContext *context;
+    const SonicToken *target;
+    bool blocked;
+    bool foundNoise;
+    int numWaveReads;
+    int numFrameReads;
+    int numBlockReads;
+    int numFeedbackReads;
+};
 
-        const bool rvalueIsVector = (rvalue->queryExpressionType() == ETYPE_VECTOR);
-        x.insideVector = rvalueIsVector;
-        rvalue->generatePreSampleLoopCode(o, x);
-        x.insideVector = false;
 
-        if (limit || implicitSelfNumSamples)
-            x.indent(o, "for ( long i=0; i < numSamples; ++i, t += SampleTime )\n");
-        else
+class Sonic_ExpressionVisitor_LoopInvariant: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_LoopInvariant(
+        const SonicParse_Program *_prog,
+        const SonicToken &_target):
+        prog(_prog),
+        target(_target),
+        variant(false),
+        numOperands(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
         {
-            if (numOccurrences == 0)
+        case ETYPE_BUILTIN:
+            if (ep->getFirstToken() == "i" || ep->getFirstToken() == "t" ||
+                ep->getFirstToken() == "c" || ep->getFirstToken() == "n")
+                variant = true;
+            break;
+
+        case ETYPE_VECTOR:
+        case ETYPE_WAVE_EXPR:
+        case ETYPE_OLD_DATA:
+        case ETYPE_SINEWAVE:
+        case ETYPE_SAWTOOTH:
+        case ETYPE_FFT:
+        case ETYPE_IIR:
+        case ETYPE_LOCAL:
+            variant = true;
+            break;
+
+        case ETYPE_BINARY_OP:
             {
-                throw SonicParseException(
-                    "cannot determine number of samples to generate",
-                    rvalue->getFirstToken());
+                // Integer division by zero must not happen before the
+                // loop that might never have reached it.
+                const SonicToken &op = ((const SonicParse_Expression_BinaryOp *)ep)->queryOp();
+                if ((op == "/" || op == "%") && ep->determineType() == STYPE_INTEGER)
+                    variant = true;
             }
-            x.indent(o, "for ( long i=0; ; ++i, t += SampleTime )\n");
-        }
+            break;
 
-        x.indent(o, "{\n");
-        x.pushIndent();
+        case ETYPE_WAVE_FIELD:
+            ++numOperands;
+            if (ep->getFirstToken() == target || ep->getFirstToken() == "$")
+                variant = true;     // changes as the target is written
+            break;
 
-        if (numOccurrences > 0)
-        {
-            if (!limit)
-            {
-                x.indent(o, "int countdown = NumChannels");
+        case ETYPE_VARIABLE:
+        case ETYPE_ARRAY_SUBSCRIPT:
+            ++numOperands;
+            break;
 
-                if (numOccurrences > 1)
-                    o << " * " << numOccurrences;
+        case ETYPE_FUNCTION_CALL:
+            ++numOperands;
+            if (!IsPureCall(prog, ep))
+                variant = true;
+            break;
 
-                o << ";\n";
-            }
-            else
-                x.indent(o, "int countdown;\n");
+        default:
+            break;
         }
+    }
 
-        if (modify)
-        {
-            x.indent(o, LOCAL_SYMBOL_PREFIX);
-            o << lname << ".read ( sample );\n";
-        }
+    static bool IsPureCall(const SonicParse_Program *prog, const SonicParse_Expression *ep)
+    {
+        const SonicParse_Expression_FunctionCall *call = (const SonicParse_Expression_FunctionCall *) ep;
+        if (call->isIntrinsic())
+            return !call->isNoise();
 
-        const char *assignOp = op.queryToken();
-        if (op == "<<")
-            assignOp = "=";
+        if (call->queryFunctionType() != SFT_USER)
+            return false;
 
-        x.insideVector = rvalueIsVector;
-        rvalue->generatePreChannelLoopCode(o, x);
-        x.insideVector = false;
+        const SonicParse_Function *func = prog->findFunction(call->getFirstToken());
+        return func && func->isPure();
+    }
 
-        if (rvalueIsVector)
+    bool queryHoistable() const
+    {
+        // Expressions of constants alone are left for the compiler to fold.
+        return !variant && numOperands > 0;
+    }
+
+private:
+    const SonicParse_Program *prog;
+    const SonicToken &target;
+    bool variant;
+    int numOperands;
+};
+
+
+class Sonic_ExpressionVisitor_Contains: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_Contains(const SonicParse_Expression *_sought):
+        sought(_sought),
+        found(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        if (ep == sought)
+            found = true;
+    }
+
+    bool queryFound() const
+    {
+        return found;
+    }
+
+private:
+    const SonicParse_Expression *sought;
+    bool found;
+};
+
+
+class Sonic_ExpressionVisitor_Builtin: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_Builtin(const char *_name):
+        name(_name),
+        found(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        if (ep->queryExpressionType() == ETYPE_BUILTIN && ep->getFirstToken() == name)
+            found = true;
+    }
+
+    bool queryFound() const
+    {
+        return found;
+    }
+
+private:
+    const char *name;
+    bool found;
+};
+
+
+static bool MentionsBuiltin(const SonicParse_Expression *ep, const char *name)
+{
+    // Generated code only declares 'i' or 't' where it is used, so that
+    // it compiles without warnings about unused variables.
+    Sonic_ExpressionVisitor_Builtin visitor(name);
+    ep->visit(visitor);
+    return visitor.queryFound();
+}
+
+
+class Sonic_ExpressionVisitor_Hoist: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_Hoist(
+        const SonicParse_Program *_prog,
+        const SonicToken &_target,
+        SonicParse_Expression *_hoisted[],
+        int _maxHoisted):
+        prog(_prog),
+        target(_target),
+        hoisted(_hoisted),
+        maxHoisted(_maxHoisted),
+        numHoisted(0),
+        numFences(0),
+        impure(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        // Subexpressions are visited after the expressions containing them,
+        // so only the largest invariant ones are taken.
+        switch (ep->queryExpressionType())
         {
-            SonicParse_Expression_Vector *v = (SonicParse_Expression_Vector *) rvalue;
-            const int numChannels = v->queryNumChannels();
-            SonicParse_Expression *comp = v->getComponentList();
-            x.iAllowed = x.cAllowed = true;
-            x.insideVector = true;
-            for (x.channelValue=0; x.channelValue < numChannels; ++(x.channelValue))
+        case ETYPE_FUNCTION_CALL:
+            if (!Sonic_ExpressionVisitor_LoopInvariant::IsPureCall(prog, ep) &&
+                !((const SonicParse_Expression_FunctionCall *)ep)->isIntrinsic())
+                impure = true;      // may change variables the rest reads
+            break;
+
+        case ETYPE_SINEWAVE:
+        case ETYPE_SAWTOOTH:
+        case ETYPE_FFT:
+        case ETYPE_IIR:
+            fence(ep);      // parameters already computed once, in code of their own
+            break;
+
+        case ETYPE_BINARY_OP:
             {
-                x.indent(o, "sample[");
-                o << x.channelValue << "] " << assignOp << " ";
-                comp->generateCode(o, x);
-                o << ";\n";
-                comp = comp->queryNext();
+                // The right side of '&' and '|' is not always evaluated.
+                const SonicParse_Expression_BinaryOp *bp = (const SonicParse_Expression_BinaryOp *) ep;
+                if (bp->queryOp() == "&" || bp->queryOp() == "|")
+                    fence(bp->queryRight());
             }
-            x.iAllowed = x.cAllowed = false;
-            x.insideVector = false;
-            x.channelValue = -1;
+            break;
+
+        default:
+            break;
         }
-        else
+
+        switch (ep->queryExpressionType())
         {
-            const int numChannels = x.prog->queryNumChannels();
-            x.iAllowed = x.cAllowed = true;
-            for (x.channelValue=0; x.channelValue < numChannels; ++(x.channelValue))
-            {
-                x.indent(o, "sample[");
-                o << x.channelValue << "] " << assignOp << " ";
-                rvalue->generateCode(o, x);
-                o << ";\n";
-            }
-            x.iAllowed = x.cAllowed = false;
-            x.channelValue = -1;
-        }
+        case ETYPE_BINARY_OP:
+        case ETYPE_UNARY_OP:
+        case ETYPE_FUNCTION_CALL:
+        case ETYPE_WAVE_FIELD:
+            break;
 
-        if (!limit && !implicitSelfNumSamples && numOccurrences > 0)
-            x.indent(o, "if ( countdown <= 0 ) break;\n");
+        default:
+            return;
+        }
 
-        x.indent(o, LOCAL_SYMBOL_PREFIX);
-        o << lname << ".write ( sample );\n";
-        x.popIndent();
-        x.indent(o, "}\n");
+        SonicType type = ep->determineType();
+        if (type != STYPE_REAL && type != STYPE_INTEGER && type != STYPE_BOOLEAN)
+            return;
 
-        for (i=0; i < numWaveSymbols; i++)
-        {
-            if (*waveSymbol[i] != "$")
-            {
-                x.indent(o, LOCAL_SYMBOL_PREFIX);
-                o << waveSymbol[i]->queryToken();
-                o << ".close();\n";
-            }
-        }
+        if (numHoisted >= maxHoisted || inside(ep, hoisted, numHoisted) || inside(ep, fences, numFences))
+            return;
 
-        x.popIndent();
-        x.indent(o, "}\n");
+        Sonic_ExpressionVisitor_LoopInvariant invariant(prog, target);
+        ep->visit(invariant);
+        if (invariant.queryHoistable())
+            hoisted[numHoisted++] = const_cast<SonicParse_Expression *>(ep);
+    }
 
-        if (!x.func)
-            throw SonicParseException("internal error: context lacks enclosing function", op);
+    int queryNumHoisted() const
+    {
+        return impure ? 0 : numHoisted;
+    }
 
-        x.func->clearAllResetFlags();
+private:
+    void fence(const SonicParse_Expression *ep)
+    {
+        if (numFences < MaxFences)
+            fences[numFences++] = ep;
+        else
+            impure = true;      // too complicated to bother
     }
-    else if (ltype == STYPE_ARRAY)
+
+    static bool inside(
+        const SonicParse_Expression *ep,
+        const SonicParse_Expression * const list[],
+        int length)
     {
-        if (op == "<<")
-            throw SonicParseException("append operator '<<' is allowed only in wave assignments", op);
+        for (int k=0; k < length; ++k)
+        {
+            Sonic_ExpressionVisitor_Contains contains(ep);
+            list[k]->visit(contains);
+            if (contains.queryFound())
+                return true;
+        }
+        return false;
+    }
 
-        SonicType rtype = rvalue->determineType();
-        if (rtype != STYPE_ARRAY)
-            throw SonicParseException("cannot assign a non-array to an array", rvalue->getFirstToken());
+private:
+    enum { MaxFences = 64 };
 
-        // If the lvalue array is a function parameter, we can only assign to it
-        // safely if it is explicitly passed by reference using the '&' modifier.
-        // Otherwise, because the first dimension cardinality is not checked, the
-        // passed array needn't have the same size.
+    const SonicParse_Program *prog;
+    const SonicToken &target;
+    SonicParse_Expression **hoisted;
+    int maxHoisted;
+    int numHoisted;
+    const SonicParse_Expression *fences [MaxFences];
+    int numFences;
+    bool impure;
+};
 
-        SonicParse_VarDecl *lvar = x.func->findSymbol(lvalue->queryVarName(), false);
-        if (lvar && lvar->queryIsFunctionParm() && !ltype.isReference())
-            throw SonicParseException("cannot perform array assignment on non-reference function argument", lvalue->queryVarName());
 
-        int numDimensions = rtype.queryNumDimensions();
+static int GenerateHoistedValues(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    const Sonic_ExpressionVisitor_Hoist &visitor,
+    SonicParse_Expression *hoisted[])
+{
+    const int numHoisted = visitor.queryNumHoisted();
+    for (int k=0; k < numHoisted; ++k)
+    {
+        SonicType type = hoisted[k]->determineType();
+        if (type == STYPE_REAL)
+            x.indent(o, "const double ");
+        else if (type == STYPE_INTEGER)
+            x.indent(o, "const long ");
+        else
+            x.indent(o, "const int ");
+
+        o << TEMPORARY_PREFIX << x.nextTempTag << " = ";
+        hoisted[k]->generateCode(o, x);
+        o << ";\n";
+        hoisted[k]->setHoistTag(x.nextTempTag++);
+    }
+
+    return numHoisted;
+}
+
+
+int SonicParse_Statement_Assignment::generateHoistedValues(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    SonicParse_Expression *hoisted[],
+    int maxHoisted)
+{
+    // Parts of the right side that come out the same for every sample
+    // are computed once, before the loop, into temporaries.
+    Sonic_ExpressionVisitor_Hoist visitor(x.prog, lvalue->queryVarName(), hoisted, maxHoisted);
+    rvalue->visit(visitor);
+    return GenerateHoistedValues(o, x, visitor, hoisted);
+}
+
+
+bool SonicParse_Expression::generateHoisted(std::ostream &o, const Sonic_CodeGenContext &x) const
+{
+    if (hoistTag < 0 || x.generatingComment)
+        return false;
+
+    o << TEMPORARY_PREFIX << hoistTag;
+    return true;
+}
+
+
+//---------------------------------------------------------------------------
+//  Exponentials and phases of an expression linear in i or t are computed
+//  frame to frame by a SonicExpRamp or SonicPhaseRamp, set up before the
+//  loop, instead of calling exp(), pow() or fmod() every frame.
+
+static bool IsRampInvariant(const SonicParse_Expression *ep)
+{
+    return ep->isSampleInvariant() && !ep->isChannelDependent();
+}
+
+
+static bool IsRampArgument(const SonicParse_Expression *ep)
+{
+    return ep->isLinearInTime() && !ep->isSampleInvariant();
+}
+
+
+static int GenerateRampStep(std::ostream &o, Sonic_CodeGenContext &x, SonicParse_Expression *linear)
+{
+    // The expression at frames 0 and 1:  being linear, it changes by the
+    // same amount from any frame to the next.
+    const int tag = (x.nextTempTag)++;
+    x.indent(o, "double ");
+    o << TEMPORARY_PREFIX << tag << " [2];\n";
+    x.indent(o, "for ( long i=0; i < 2; ++i )\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    if (MentionsBuiltin(linear, "t"))
+        x.indent(o, "const double t = double(i) * SampleTime;\n");
+    x.indent(o, TEMPORARY_PREFIX);
+    o << tag << "[i] = ";
+    const bool isave = x.iAllowed;
+    x.iAllowed = true;
+    linear->generateCode(o, x);
+    x.iAllowed = isave;
+    o << ";\n";
+    x.popIndent();
+    x.indent(o, "}\n");
+    return tag;
+}
+
+
+bool SonicParse_Expression::generateRampHead(std::ostream &o, const Sonic_CodeGenContext &x) const
+{
+    // The caller follows with the exact value and two closing parentheses.
+    if (rampTag < 0 || x.generatingComment)
+        return false;
+
+    const char *frame = x.blockLoop ? "(i + j)" : "i";
+    o << "(" << TEMPORARY_PREFIX << rampTag << ".follows(" << frame << ") ? ";
+    o << TEMPORARY_PREFIX << rampTag << ".queryValue() : ";
+    o << TEMPORARY_PREFIX << rampTag << ".anchor(" << frame << ", ";
+    return true;
+}
+
+
+bool SonicParse_Statement_Assignment::canUseChannelLoop(const Sonic_CodeGenContext &x) const
+{
+    // Worth it only when some wave read can fetch a whole frame at once.
+    Sonic_ExpressionVisitor_ChannelLoop visitor(&x);
+    rvalue->visit(visitor);
+    return !visitor.queryBlocked() && visitor.queryNumFrameReads() > 0;
+}
+
+
+bool SonicParse_Statement_Assignment::canUseFrameBlocks(
+    const Sonic_CodeGenContext &x,
+    bool modify,
+    bool &feedback) const
+{
+    // Each frame must depend only on the same frames of the inputs, give
+    // or take a fixed offset.  Earlier frames of the result can be read
+    // back the same way, if the blocks are kept short enough that they
+    // were all written before the block began; 'feedback' is set if so.
+    if (modify || lvalue->querySampleStart() || (op != "=" && op != "<<"))
+        return false;
+
+    Sonic_ExpressionVisitor_ChannelLoop visitor(&x, &lvalue->queryVarName());
+    rvalue->visit(visitor);
+    feedback = visitor.queryNumFeedbackReads() > 0;
+    if (feedback && op != "=")
+        return false;
+
+    return !visitor.queryBlocked() && visitor.queryNumBlockReads() == visitor.queryNumWaveReads();
+}
+
+
+bool SonicParse_Statement_Assignment::generateFeedbackLimit(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    // The recurrence distance of each read of the result from itself is
+    // only known at run time, as in 'y[c,i] = x[c,i] + 0.5*y[c, i - r*delay]',
+    // but it stays the same for the whole loop.  See Sonic_FeedbackLimit().
+
+    Sonic_ExpressionVisitor_WaveReads reads;
+    rvalue->visit(reads);
+    if (reads.queryNumReads() == 0)
+        return false;   // too many to list
+
+    const SonicToken &target = lvalue->queryVarName();
+    int k, numFeedbackReads = 0;
+    bool needIndex = false;
+    for (k=0; k < reads.queryNumReads(); ++k)
+    {
+        if (reads.queryRead(k)->getFirstToken() == target)
+        {
+            ++numFeedbackReads;
+            if (MentionsBuiltin(reads.queryRead(k)->queryIndexTerm(), "i"))
+                needIndex = true;
+        }
+    }
+
+    const int numOffsets = numFeedbackReads;
+
+    x.indent(o, "long feedbackLimit;\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    if (needIndex)
+        x.indent(o, "const long i = 0;\n");
+    x.indent(o, "const double feedbackOffset[] =\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.iAllowed = true;
+    x.bracketer = &target;
+    for (k=0; k < reads.queryNumReads(); ++k)
+    {
+        const SonicParse_Expression_WaveExpr *wp = reads.queryRead(k);
+        if (wp->getFirstToken() == target)
+        {
+            // interp() also reads the frame after the index.
+            x.indent(o, "double(");
+            wp->queryIndexTerm()->generateCode(o, x);
+            o << (wp->interpolates(x) ? ") + 1" : ")");
+            o << ((--numFeedbackReads > 0) ? ",\n" : "\n");
+        }
+    }
+    x.bracketer = 0;
+    x.iAllowed = false;
+    x.popIndent();
+    x.indent(o, "};\n");
+    x.indent(o, "feedbackLimit = Sonic_FeedbackLimit ( ");
+    o << numOffsets << ", feedbackOffset );\n";
+    x.popIndent();
+    x.indent(o, "}\n");
+    return true;
+}
+
+
+bool SonicParse_Statement_Assignment::canCheckpointInside() const
+{
+    // A checkpoint part way through a wave assignment records only how far
+    // it got, so everything else the loop computes must start over from
+    // scratch at any frame:  no oscillators or filters carrying state from
+    // one sample to the next, and no reading back what is being written.
+    // (Nor old data, which the caller knows about.)
+
+    if (op != "=" || lvalue->querySampleStart() || readsTarget())
+        return false;
+
+    Sonic_ExpressionVisitor_Stateful stateful;
+    rvalue->visit(stateful);
+    return !stateful.queryFound();
+}
+
+
+class Sonic_ExpressionVisitor_CacheInputs: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_CacheInputs():
+        numNames(0),
+        uncacheable(false),
+        usesLength(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
+        {
+        case ETYPE_VARIABLE:
+        case ETYPE_ARRAY_SUBSCRIPT:
+            addName(ep->getFirstToken());
+            break;
+
+        case ETYPE_FUNCTION_CALL:
+        {
+            // User functions and imports may read or change anything, and
+            // noise is different every time.
+            const SonicParse_Expression_FunctionCall *fp = (const SonicParse_Expression_FunctionCall *) ep;
+            if (!fp->isIntrinsic() || fp->isNoise())
+                uncacheable = true;
+        }
+        break;
+
+        case ETYPE_BUILTIN:
+            if (ep->getFirstToken() == "n")
+                usesLength = true;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    int queryNumNames() const
+    {
+        return numNames;
+    }
+    const SonicToken &queryName(int k) const
+    {
+        return *name[k];
+    }
+    bool queryUncacheable() const
+    {
+        return uncacheable;
+    }
+    bool queryUsesLength() const
+    {
+        return usesLength;
+    }
+
+private:
+    void addName(const SonicToken &symbol)
+    {
+        for (int k=0; k < numNames; ++k)
+            if (*name[k] == symbol)
+                return;
+
+        if (numNames < maxNames)
+            name[numNames++] = &symbol;
+        else
+            uncacheable = true;
+    }
+
+private:
+    enum { maxNames = 64 };
+    const SonicToken *name [maxNames];
+    int numNames;
+    bool uncacheable;
+    bool usesLength;
+};
+
+
+bool SonicParse_Statement_Assignment::canCache(Sonic_CodeGenContext &x) const
+{
+    // A wave assignment can be looked up in the render cache when its
+    // result depends only on its code and on waves and variables whose
+    // values can be written into the key.  Patching a range depends on
+    // everything else in the wave as well.
+
+    if (lvalue->querySampleStart())
+        return false;
+
+    // A fused loop is cached as a whole; the waves computed in it are
+    // read by nothing else.
+    Sonic_ExpressionVisitor_CacheInputs inputs;
+    rvalue->visit(inputs);
+    for (SonicParse_Statement *sp = fusedFirst; sp && sp != this; sp = sp->queryNext())
+        ((SonicParse_Statement_Assignment *)sp)->rvalue->visit(inputs);
+    SonicParse_Expression *limit = lvalue->querySampleLimit();
+    if (limit)
+        limit->visit(inputs);
+
+    if (inputs.queryUncacheable())
+        return false;
+
+    for (int k=0; k < inputs.queryNumNames(); ++k)
+    {
+        SonicParse_VarDecl *vp = x.prog->findSymbol(inputs.queryName(k), x.func, false);
+        if (!vp)
+            return false;
+
+        const SonicType &type = vp->queryType();
+        if (type == STYPE_IMPORT)
+            return false;
+
+        if (type == STYPE_ARRAY && type.queryDimensionArray()[0] == 0)
+            return false;       // size not known to the generated code
+    }
+
+    return true;
+}
+
+
+const SonicToken *SonicParse_Statement_Assignment::queryWholeCopySource() const
+{
+    // Returns the name of the wave this assignment copies whole,
+    // as in 'a[c,i] = b[c,i]', or NULL if it does anything else.
+
+    if (op != "=" || lvalue->querySampleLimit() || rvalue->queryExpressionType() != ETYPE_WAVE_EXPR)
+        return 0;
+
+    const SonicParse_Expression_WaveExpr *wp = (const SonicParse_Expression_WaveExpr *) rvalue;
+    const SonicParse_Expression *cterm = wp->queryChannelTerm();
+    const SonicParse_Expression *iterm = wp->queryIndexTerm();
+    if (!cterm || !iterm ||
+        cterm->queryExpressionType() != ETYPE_BUILTIN || cterm->getFirstToken() != "c" ||
+        iterm->queryExpressionType() != ETYPE_BUILTIN || iterm->getFirstToken() != "i")
+    {
+        return 0;
+    }
+
+    if (wp->getFirstToken() == lvalue->queryVarName())
+        return 0;
+
+    return &wp->getFirstToken();
+}
+
+
+bool SonicParse_Statement_Assignment::canReuse(
+    const SonicToken *waveSymbol[],
+    int numWaveSymbols,
+    bool &stateful) const
+{
+    // Frames of the last run's result can be kept wherever the waves read
+    // to compute them are unchanged, as long as each frame is computed
+    // only from those (not from the target's old data or its own earlier
+    // frames).  Filters forget their past, so they can be warmed up just
+    // before a change; oscillators never do.  A fused loop recomputes all
+    // of its frames.
+
+    stateful = false;
+    if (op != "=" || fusedFirst || readsTarget())
+        return false;
+
+    for (int i=1; i < numWaveSymbols; ++i)
+        if (*waveSymbol[i] == "$")
+            return false;
+
+    SonicParse_Expression *limit = lvalue->querySampleLimit();
+    if (limit)
+    {
+        Sonic_ExpressionVisitor_CacheInputs inputs;
+        limit->visit(inputs);
+        if (inputs.queryUsesLength())
+            return false;
+    }
+
+    Sonic_ExpressionVisitor_Stateful visitor;
+    rvalue->visit(visitor);
+    stateful = visitor.queryFound();
+    return !visitor.queryFoundOscillator();
+}
+
+
+void SonicParse_Statement_Assignment::generateReuseSkip(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    bool limited)
+{
+    // Like generateQuietSkip(), but copying runs of frames that are the
+    // same as in the last run (see SonicCacheKey::planReuse()).
+
+    const char *lname = lvalue->queryVarName().queryToken();
+    x.indent(o, "if ( i >= reuseCheck )\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.indent(o, "long reuse = ");
+    o << LOCAL_SYMBOL_PREFIX << lname << ".reusableFrames ( i );\n";
+    if (limited)
+        x.indent(o, "if ( reuse > numSamples - i ) reuse = numSamples - i;\n");
+
+    x.indent(o, "if ( reuse > 0 )\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.indent(o, LOCAL_SYMBOL_PREFIX);
+    o << lname << ".reuseFrames ( i, reuse );\n";
+    x.indent(o, "i += reuse - 1;\n");
+    x.indent(o, "t += double(reuse - 1) * SampleTime;\n");
+    x.indent(o, "continue;\n");
+    x.popIndent();
+    x.indent(o, "}\n");
+    x.indent(o, "reuseCheck = i - reuse;\n");
+    x.popIndent();
+    x.indent(o, "}\n\n");
+}
+
+
+static bool CanKnowNaturalEnd(
+    const Sonic_CodeGenContext &x,
+    const Sonic_ExpressionVisitor_WaveReads &reads)
+{
+    // A loop without a limit runs until all of its reads fall outside
+    // their waves.  Where that is can be worked out before the loop
+    // starts when every read is 'i' plus an offset.
+
+    if (reads.queryNumReads() == 0)
+        return false;   // none, or too many to list
+
+    for (int k=0; k < reads.queryNumReads(); ++k)
+    {
+        const SonicParse_Expression *index = reads.queryRead(k)->queryIndexTerm();
+        if (!index->isSampleOffset() || index->isChannelDependent())
+            return false;
+
+        // interp() reads two frames, which blurs where the wave ends.
+        if (x.prog->queryInterpolateFlag() && index->determineType() != STYPE_INTEGER)
+            return false;
+    }
+
+    return true;
+}
+
+
+static bool CanCountToNaturalEnd(
+    const Sonic_CodeGenContext &x,
+    const Sonic_ExpressionVisitor_WaveReads &reads,
+    const SonicToken *target)
+{
+    // Once the natural end of a loop is known, the loop can simply run up
+    // to it, instead of counting the reads that fall outside their waves,
+    // if Sonic_NaturalEnd() is sure to find it.  For that, each read must
+    // be a whole number of frames from 'i', must not look back into the
+    // 'target' being written, and must not be of a stream, whose length
+    // is not known until it ends.
+
+    for (int k=0; k < reads.queryNumReads(); ++k)
+    {
+        const SonicParse_Expression_WaveExpr *wp = reads.queryRead(k);
+        const SonicToken &wave = wp->getFirstToken();
+        if (target && wave == *target)
+            return false;
+
+        Sonic_ExpressionVisitor_WholeNumber whole;
+        wp->queryIndexTerm()->visit(whole);
+        if (!whole.queryWhole())
+            return false;
+
+        // Only a parameter of the program can be bound to a stream, and
+        // only if nothing keeps it from being one.
+        if (x.func->queryIsProgramBody() && !x.func->findStreamConflict(wave))
+        {
+            for (const SonicParse_VarDecl *pp = x.func->queryParmList(); pp; pp = pp->queryNext())
+                if (pp->queryName() == wave)
+                    return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool SonicParse_Statement_Assignment::canKnowNaturalEnd(const Sonic_CodeGenContext &x) const
+{
+    if (rvalue->queryExpressionType() == ETYPE_VECTOR)
+        return false;
+
+    Sonic_ExpressionVisitor_WaveReads reads;
+    rvalue->visit(reads);
+    return CanKnowNaturalEnd(x, reads);
+}
+
+
+bool SonicParse_Statement_Assignment::generateNaturalEnd(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    bool modify,
+    const char *endName)
+{
+    // Skipping frames for a preview, or computing them a block at a time,
+    // must not run past the natural end of a loop without a limit, so
+    // when canKnowNaturalEnd(), generate code that works out where it is
+    // (see Sonic_NaturalEnd()) into 'endName'.  Returns false if the end
+    // cannot be known in advance.
+
+    if (!canKnowNaturalEnd(x))
+        return false;
+
+    Sonic_ExpressionVisitor_WaveReads reads;
+    rvalue->visit(reads);
+
+    int k;
+    bool needIndex = false;
+    for (k=0; k < reads.queryNumReads(); ++k)
+        if (MentionsBuiltin(reads.queryRead(k)->queryIndexTerm(), "i"))
+            needIndex = true;
+
+    x.indent(o, "long ");
+    o << endName << ";\n";
+    x.indent(o, "{\n");
+    x.pushIndent();
+    if (needIndex)
+        x.indent(o, "const long i = 0;\n");
+    x.indent(o, "const double previewSpan[] =\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.iAllowed = true;
+    for (k=0; k < reads.queryNumReads(); ++k)
+    {
+        const SonicParse_Expression_WaveExpr *wp = reads.queryRead(k);
+        const SonicToken &wave = wp->getFirstToken();
+        x.indent(o, "double(");
+        x.bracketer = &wave;
+        wp->queryIndexTerm()->generateCode(o, x);
+        x.bracketer = 0;
+        const SonicParse_Statement_Assignment *fused = x.fusedLoop ? x.fusedLoop->findFusedWave(wave) : 0;
+        if (wave == lvalue->queryVarName() && !modify)
+            o << "), -1.0";
+        else if (fused)
+            o << "), double(" << TEMPORARY_PREFIX << fused->fusedEndTag << ")";
+        else
+            o << "), double(" << LOCAL_SYMBOL_PREFIX << wave.queryToken() << ".queryNumSamples())";
+        o << ((k+1 < reads.queryNumReads()) ? ",\n" : "\n");
+    }
+    x.iAllowed = false;
+    x.popIndent();
+    x.indent(o, "};\n");
+    x.indent(o, endName);
+    o << " = Sonic_NaturalEnd ( " << reads.queryNumReads() << ", previewSpan );\n";
+    x.popIndent();
+    x.indent(o, "}\n");
+    return true;
+}
+
+
+bool SonicParse_Statement_Assignment::canCountToNaturalEnd(
+    const Sonic_CodeGenContext &x,
+    bool modify) const
+{
+    // See CanCountToNaturalEnd(); a result modified in place is read
+    // before it is written, so it has an end of its own.
+
+    Sonic_ExpressionVisitor_WaveReads reads;
+    rvalue->visit(reads);
+    return CanCountToNaturalEnd(x, reads, modify ? 0 : &lvalue->queryVarName());
+}
+
+
+void SonicParse_Statement_Assignment::generatePreviewSkip(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    const char *end)
+{
+    // Like generateQuietSkip(), but leaving silent the frames too far
+    // from a preview window to matter (see SonicWave::previewFrames()).
+
+    const char *lname = lvalue->queryVarName().queryToken();
+    x.indent(o, "if ( i >= previewCheck )\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.indent(o, "long skip = ");
+    o << LOCAL_SYMBOL_PREFIX << lname << ".previewFrames ( i, " << end << " );\n";
+    x.indent(o, "if ( skip > 0 )\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.indent(o, LOCAL_SYMBOL_PREFIX);
+    o << lname << ".skipFrames ( skip );\n";
+    x.indent(o, "i += skip - 1;\n");
+    x.indent(o, "t += double(skip - 1) * SampleTime;\n");
+    x.indent(o, "continue;\n");
+    x.popIndent();
+    x.indent(o, "}\n");
+    x.indent(o, "previewCheck = i - skip;\n");
+    x.popIndent();
+    x.indent(o, "}\n\n");
+}
+
+
+void SonicParse_Statement_Assignment::generateFrameBlock(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    const char *end,
+    const char * const check[],
+    int numChecks,
+    bool feedback,
+    bool endsLoop)
+{
+    // Frames before 'end' are computed SONIC_FRAME_BLOCK at a time:  each
+    // input is fetched a block at a time, and a loop with no calls or
+    // branches in it, which the compiler can vectorize, fills the block
+    // passed to writeBlock().  A block stops short of the next frame that
+    // the checkpoint or one of the skips above needs to look at, and is no
+    // longer than the distance back to any frame of the result it reads.
+    // Frames from 'end' on go through the rest of the loop one at a time,
+    // unless the loop itself stops at 'end' ('endsLoop').
+
+    const char *lname = lvalue->queryVarName().queryToken();
+    if (!endsLoop)
+    {
+        x.indent(o, "if ( i < ");
+        o << end << " )\n";
+        x.indent(o, "{\n");
+        x.pushIndent();
+    }
+    x.indent(o, "long span = ");
+    o << end << " - i;\n";
+    x.indent(o, "if ( span > SONIC_FRAME_BLOCK ) span = SONIC_FRAME_BLOCK;\n");
+    if (x.checkpointStatement == this)
+        x.indent(o, "if ( span > 0x10000 - (i & 0xffff) ) span = 0x10000 - (i & 0xffff);\n");
+
+    for (int k=0; k < numChecks; ++k)
+    {
+        x.indent(o, "if ( span > ");
+        o << check[k] << " - i ) span = (" << check[k] << " > i) ? (" << check[k] << " - i) : 1;\n";
+    }
+
+    if (feedback)
+        x.indent(o, "if ( span > feedbackLimit ) span = feedbackLimit;\n");
+
+    // A wave computed in this loop is silent from its end on.
+    for (SonicParse_Statement *sp = fusedFirst; sp && sp != this; sp = sp->queryNext())
+    {
+        const int endTag = ((SonicParse_Statement_Assignment *)sp)->fusedEndTag;
+        x.indent(o, "if ( i < ");
+        o << TEMPORARY_PREFIX << endTag << " && span > " << TEMPORARY_PREFIX << endTag << " - i ) span = ";
+        o << TEMPORARY_PREFIX << endTag << " - i;\n";
+    }
+
+    x.blockLoop = true;
+    if (fusedFirst)
+        generateFusedValues(o, x);
+
+    x.numBlockFetches = 0;
+    rvalue->generatePreChannelLoopCode(o, x);
+
+    const int resultTag = (x.nextTempTag)++;
+    x.indent(o, "float ");
+    o << TEMPORARY_PREFIX << resultTag << " [SONIC_FRAME_BLOCK * NumChannels];\n";
+    x.indent(o, "for ( long j=0; j < span; ++j )\n");
+    x.pushIndent();
+    x.indent(o, "for ( int c=0; c < NumChannels; ++c )\n");
+    x.pushIndent();
+    x.indent(o, TEMPORARY_PREFIX);
+    o << resultTag << "[j*NumChannels + c] = float(";
+    x.iAllowed = x.cAllowed = true;
+    rvalue->generateCode(o, x);
+    x.iAllowed = x.cAllowed = false;
+    o << ");\n";
+    x.popIndent();
+    x.popIndent();
+    x.blockLoop = false;
+
+    x.indent(o, LOCAL_SYMBOL_PREFIX);
+    o << lname << ".writeBlock ( " << TEMPORARY_PREFIX << resultTag << ", span );\n";
+    x.indent(o, "i += span - 1;\n");
+    x.indent(o, "t += double(span - 1) * SampleTime;\n");
+    if (!endsLoop)
+    {
+        x.indent(o, "continue;\n");
+        x.popIndent();
+        x.indent(o, "}\n\n");
+    }
+}
+
+
+static void HashCacheCode(unsigned long &a, unsigned long &b, const char *s)
+{
+    for (; *s; ++s)
+    {
+        const unsigned char c = (unsigned char) *s;
+        a = ((a ^ c) * 16777619UL) & 0xffffffffUL;
+        b = ((b ^ c) * 16777619UL) & 0xffffffffUL;
+        b ^= (b >> 15);
+    }
+}
+
+
+static bool IsIdentifierChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+
+static void CacheCodeHash(
+    char hash[],
+    const char *code,
+    int firstTempTag,
+    Sonic_CodeGenContext &x)
+{
+    // Hash the generated loop as it would read if it were the first
+    // statement of the program, so that editing other statements does not
+    // invalidate it:  temporaries are renumbered from t_0, and checkpoint
+    // calls (which contain the statement number) are left out.
+
+    unsigned long a = 2166136261UL;
+    unsigned long b = 0x84222325UL;
+    char buffer [64];
+
+    sprintf(buffer, "r=%ld m=%d interpolate=%d\n",
+        x.prog->querySamplingRate(),
+        x.prog->queryNumChannels(),
+        int(x.prog->queryInterpolateFlag()));
+    HashCacheCode(a, b, buffer);
+
+    const size_t prefixLength = strlen(TEMPORARY_PREFIX);
+    while (*code)
+    {
+        const char *eol = strchr(code, '\n');
+        const char *next = eol ? (eol + 1) : (code + strlen(code));
+        const char *p = strstr(code, "checkpoint.");
+        if (p && p < next)
+        {
+            code = next;
+            continue;
+        }
+
+        while (code < next)
+        {
+            if (strncmp(code, TEMPORARY_PREFIX, prefixLength) == 0 &&
+                    code[prefixLength] >= '0' && code[prefixLength] <= '9')
+            {
+                char *end;
+                const long tag = strtol(code + prefixLength, &end, 10);
+                sprintf(buffer, "%s%ld", TEMPORARY_PREFIX, (tag >= firstTempTag) ? (tag - firstTempTag) : tag);
+                HashCacheCode(a, b, buffer);
+                code = end;
+            }
+            else
+            {
+                buffer[0] = *code;
+                buffer[1] = '\0';
+                HashCacheCode(a, b, buffer);
+
+                // Skip the rest of an identifier so that "xt_1" is left alone.
+                const bool identifier = IsIdentifierChar(*code++);
+                while (identifier && code < next && IsIdentifierChar(*code))
+                {
+                    buffer[0] = *code++;
+                    HashCacheCode(a, b, buffer);
+                }
+            }
+        }
+    }
+
+    sprintf(hash, "%08lx%08lx", a, b);
+}
+
+
+void SonicParse_Statement_Assignment::generateCacheKey(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    const char *loopCode,
+    int firstTempTag,
+    const SonicToken *waveSymbol[],
+    int numWaveSymbols)
+{
+    char hash [20];
+    CacheCodeHash(hash, loopCode, firstTempTag, x);
+    x.indent(o, "SonicCacheKey cacheKey ( \"");
+    o << hash << "\" );\n";
+
+    Sonic_ExpressionVisitor_CacheInputs inputs;
+    rvalue->visit(inputs);
+    for (SonicParse_Statement *sp = fusedFirst; sp && sp != this; sp = sp->queryNext())
+        ((SonicParse_Statement_Assignment *)sp)->rvalue->visit(inputs);
+    SonicParse_Expression *limit = lvalue->querySampleLimit();
+    if (limit)
+        limit->visit(inputs);
+
+    // The target is an input too, unless it is simply replaced.
+    const SonicToken &target = lvalue->queryVarName();
+    bool targetIsInput = (op != "=") || (limit && inputs.queryUsesLength());
+    for (int i=1; i < numWaveSymbols; ++i)
+    {
+        if (*waveSymbol[i] == "$")
+            targetIsInput = true;
+        else
+        {
+            x.indent(o, "cacheKey.addWave ( ");
+            o << LOCAL_SYMBOL_PREFIX << waveSymbol[i]->queryToken() << " );\n";
+        }
+    }
+
+    if (targetIsInput)
+    {
+        x.indent(o, "cacheKey.addWave ( ");
+        o << LOCAL_SYMBOL_PREFIX << target.queryToken() << " );\n";
+    }
+
+    for (int k=0; k < inputs.queryNumNames(); ++k)
+    {
+        SonicParse_VarDecl *vp = x.prog->findSymbol(inputs.queryName(k), x.func, true);
+        const SonicType &type = vp->queryType();
+        const char *name = vp->queryName().queryToken();
+        switch (type.queryTypeClass())
+        {
+        case STYPE_INTEGER:
+            x.indent(o, "cacheKey.addInteger ( \"");
+            o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << " );\n";
+            break;
+
+        case STYPE_REAL:
+            x.indent(o, "cacheKey.addReal ( \"");
+            o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << " );\n";
+            break;
+
+        case STYPE_BOOLEAN:
+            x.indent(o, "cacheKey.addBoolean ( \"");
+            o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << " );\n";
+            break;
+
+        case STYPE_WAVE:
+            x.indent(o, "cacheKey.addWave ( ");
+            o << LOCAL_SYMBOL_PREFIX << name << " );\n";
+            break;
+
+        case STYPE_ARRAY:
+            // sizeof the whole array would be wrong for a function parameter
+            x.indent(o, "cacheKey.addArray ( \"");
+            o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << ", ";
+            o << type.queryDimensionArray()[0] << " * sizeof(" << LOCAL_SYMBOL_PREFIX << name << "[0]) );\n";
+            break;
+
+        default:
+            throw SonicParseException("internal error: cannot cache variable of this type", vp->queryName());
+        }
+    }
+
+    bool stateful;
+    if (canReuse(waveSymbol, numWaveSymbols, stateful))
+        generateReuseReads(o, x, stateful);
+}
+
+
+class Sonic_ExpressionVisitor_WaveAccess: public Sonic_ExpressionVisitor
+{
+public:
+    enum { maxAccesses = 32 };
+
+    Sonic_ExpressionVisitor_WaveAccess():
+        numAccesses(0),
+        overflow(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        if (ep->queryExpressionType() == ETYPE_WAVE_EXPR || ep->queryExpressionType() == ETYPE_WAVE_FIELD)
+        {
+            if (numAccesses < maxAccesses)
+                access[numAccesses++] = ep;
+            else
+                overflow = true;
+        }
+    }
+
+    int queryNumAccesses() const
+    {
+        return numAccesses;
+    }
+    const SonicParse_Expression *queryAccess(int k) const
+    {
+        return access[k];
+    }
+    bool queryOverflow() const
+    {
+        return overflow;
+    }
+
+private:
+    const SonicParse_Expression *access [maxAccesses];
+    int numAccesses;
+    bool overflow;
+};
+
+
+void SonicParse_Statement_Assignment::generateReuseReads(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    bool stateful)
+{
+    // Tell the cache key where each wave is read relative to the frame
+    // being computed, so that it knows which frames a change can affect.
+    // An index i+k gives its offset k by evaluating it with i = 0.
+
+    Sonic_ExpressionVisitor_WaveAccess accesses;
+    rvalue->visit(accesses);
+    const int numPerFrame = accesses.queryNumAccesses();    // the rest are in the limit
+    SonicParse_Expression *limit = lvalue->querySampleLimit();
+    if (limit)
+        limit->visit(accesses);
+
+    if (accesses.queryOverflow())
+        return;
+
+    // Reads at i+k are listed by offset; any others may be anywhere.
+    int k;
+    SonicParse_Expression *offsetIndex [Sonic_ExpressionVisitor_WaveAccess::maxAccesses];
+    bool needIndex = false;
+    for (k=0; k < accesses.queryNumAccesses(); ++k)
+    {
+        const SonicParse_Expression *ep = accesses.queryAccess(k);
+        SonicParse_Expression *index = 0;
+        if (ep->queryExpressionType() == ETYPE_WAVE_EXPR && k < numPerFrame)
+            index = ((const SonicParse_Expression_WaveExpr *) ep)->queryIndexTerm();
+
+        if (index && (!index->isSampleOffset() || index->isChannelDependent()))
+            index = 0;
+
+        offsetIndex[k] = index;
+        if (index && MentionsBuiltin(index, "i"))
+            needIndex = true;
+    }
+
+    x.indent(o, "{\n");
+    x.pushIndent();
+    if (needIndex)
+        x.indent(o, "const long i = 0;\n");
+    x.indent(o, "cacheKey.allowReuse ( ");
+    o << (stateful ? "true" : "false") << " );\n";
+
+    for (k=0; k < accesses.queryNumAccesses(); ++k)
+    {
+        const SonicToken &wave = accesses.queryAccess(k)->getFirstToken();
+        SonicParse_Expression *index = offsetIndex[k];
+        if (index)
+        {
+            x.indent(o, "cacheKey.addRead ( ");
+            o << LOCAL_SYMBOL_PREFIX << wave.queryToken() << ", double(";
+            x.iAllowed = true;
+            x.bracketer = &wave;
+            index->generateCode(o, x);
+            x.bracketer = 0;
+            x.iAllowed = false;
+            o << ") );\n";
+        }
+        else
+        {
+            x.indent(o, "cacheKey.addReadAnywhere ( ");
+            o << LOCAL_SYMBOL_PREFIX << wave.queryToken() << " );\n";
+        }
+    }
+
+    x.popIndent();
+    x.indent(o, "}\n");
+}
+
+
+void SonicParse_Statement_Assignment::generateWaveLoop(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    const SonicToken *waveSymbol[],
+    int numWaveSymbols,
+    int numOccurrences,
+    bool modify,
+    bool reuse)
+{
+    int i;
+    SonicParse_Expression *start = lvalue->querySampleStart();
+    SonicParse_Expression *limit = lvalue->querySampleLimit();
+    const bool fused = (fusedFirst != 0);
+    if (fused)
+        x.fusedLoop = this;
+
+    // Inside a statement of the program body, check now and then whether
+    // it is time for a checkpoint, and pick up from one when resuming.
+    const bool checkpointInside =
+        !modify &&
+        (x.checkpointStatement == this) &&
+        canCheckpointInside() &&
+        (!fused || canPreviewFused());
+
+    if (checkpointInside)
+    {
+        x.indent(o, "long firstFrame = 0;\n");
+        x.indent(o, "double t = double(0);\n");
+        x.indent(o, "if ( !checkpoint.resumeInside ( ");
+        o << x.checkpointStep << ", firstFrame, t ) )\n";
+        x.pushIndent();
+    }
+
+    const char *lname = lvalue->queryVarName().queryToken();
+    if (start)
+    {
+        x.bracketer = &lvalue->queryVarName();
+        x.indent(o, "const long firstSample = long(");
+        start->generateCode(o, x);
+        o << ");\n";
+        x.indent(o, "const long numSamples = long(");
+        limit->generateCode(o, x);
+        o << ");\n";
+        x.bracketer = 0;
+    }
+
+    x.indent(o, LOCAL_SYMBOL_PREFIX);
+    o << lname;
+    if (checkpointInside)
+    {
+        o << ".openForWrite();\n";
+        x.popIndent();
+    }
+    else if (start)
+    {
+        // Patch only the range, in place.
+        o << ".openForPatch ( firstSample, numSamples );\n";
+        if (op != "=")
+            modify = true;
+    }
+    else if (op == "=" && !modify)
+        o << ".openForWrite();\n";
+    else if (op == "<<")
+    {
+        if (modify)
+            throw SonicParseException("Cannot use append operator when '$' appears on right side", op);
+
+        o << ".openForAppend();\n";
+    }
+    else
+    {
+        o << ".openForModify();\n";
+        modify = true;
+    }
+
+    for (i=1; i < numWaveSymbols; i++)
+    {
+        if (*waveSymbol[i] != "$")
+        {
+            x.indent(o, LOCAL_SYMBOL_PREFIX);
+            o << waveSymbol[i]->queryToken();
+            o << ".openForRead();\n";
+        }
+    }
+
+    bool implicitSelfNumSamples = false;
+
+    const bool skipQuiet = (numOccurrences > 0 && !modify && !start && canSkipQuiet());
+
+    if (start)
+        x.indent(o, "double t = double(firstSample) * SampleTime;\n");
+    else if (!checkpointInside)
+        x.indent(o, "double t = double(0);\n");
+    if (skipQuiet)
+        x.indent(o, "long quietCheck = 0;\n");
+    if (reuse)
+        x.indent(o, "long reuseCheck = 0;\n");
+
+    if (limit && !start)    // a range's limit was needed to open the target
+    {
+        x.indent(o, "const long numSamples = long(");
+        x.bracketer = &lvalue->queryVarName();
+        limit->generateCode(o, x);
+        x.bracketer = 0;
+        o << ");\n";
+    }
+    else if (!limit && numOccurrences == 0 && modify)
+    {
+        x.indent(o, "const long numSamples = ");
+        o << LOCAL_SYMBOL_PREFIX << lvalue->queryVarName().queryToken();
+        o << ".queryNumSamples();\n";
+        implicitSelfNumSamples = true;
+    }
+
+    const bool rvalueIsVector = (rvalue->queryExpressionType() == ETYPE_VECTOR);
+    const int maxHoisted = 32;
+    SonicParse_Expression *hoisted [maxHoisted];
+    int numHoisted = fused ? generateFusedSetup(o, x, hoisted, maxHoisted) : 0;
+    numHoisted += generateHoistedValues(o, x, hoisted + numHoisted, maxHoisted - numHoisted);
+
+    x.insideVector = rvalueIsVector;
+    rvalue->generatePreSampleLoopCode(o, x);
+    x.insideVector = false;
+
+    // Without a limit, the loop ends where all of its reads fall outside
+    // their waves.  Knowing where that is before the loop starts lets it
+    // preview, compute blocks, and run without counting those reads.
+    const bool naturalEnd =
+        !limit && !implicitSelfNumSamples && numOccurrences > 0 &&
+        generateNaturalEnd(o, x, modify);
+
+    const bool counted =
+        limit || implicitSelfNumSamples ||
+        (naturalEnd && canCountToNaturalEnd(x, modify));
+
+    if (fused && !counted)
+        throw SonicParseException("internal error: fused loop has no known end", op);
+
+    // When previewing, statements of the program body compute only the
+    // frames near the window, unless the whole of their result is needed.
+    const char *previewEnd = 0;
+    if (x.func && x.func->queryIsProgramBody() && op != "<<" && !start &&
+        !x.func->previewNeedsWholeWave(lvalue->queryVarName()) &&
+        (!fused || canPreviewFused()))
+    {
+        if (limit || implicitSelfNumSamples)
+            previewEnd = "numSamples";
+        else if (naturalEnd)
+            previewEnd = "naturalEnd";
+
+        if (previewEnd)
+            x.indent(o, "long previewCheck = 0;\n");
+    }
+
+    // Frames before the end of the loop, when it is known, can be computed
+    // a block at a time if each of them depends only on the inputs.
+    const char *blockEnd = 0;
+    bool feedback = false;
+    if (!rvalueIsVector && canUseFrameBlocks(x, modify, feedback) && (!fused || canFuseFrameBlocks(x)))
+    {
+        if (limit)
+            blockEnd = "numSamples";
+        else if (previewEnd)
+            blockEnd = previewEnd;
+        else if (naturalEnd)
+            blockEnd = "naturalEnd";
+
+        if (blockEnd && feedback && !generateFeedbackLimit(o, x))
+            blockEnd = 0;
+    }
+
+    // A counted loop ends where the blocks do, so then they are all of it.
+    const bool blocksOnly = (blockEnd != 0) && counted;
+    if (!blocksOnly)
+        x.indent(o, "double sample [NumChannels];\n");
+
+    const char *firstFrame = checkpointInside ? "firstFrame" : (start ? "firstSample" : "0");
+    if (limit || implicitSelfNumSamples)
+    {
+        x.indent(o, "for ( long i=");
+        o << firstFrame << "; i < numSamples; ++i, t += SampleTime )\n";
+    }
+    else if (counted)
+    {
+        x.indent(o, "for ( long i=");
+        o << firstFrame << "; i < naturalEnd; ++i, t += SampleTime )\n";
+    }
+    else
+    {
+        if (numOccurrences == 0)
+        {
+            throw SonicParseException(
+                "cannot determine number of samples to generate",
+                rvalue->getFirstToken());
+        }
+        x.indent(o, "for ( long i=");
+        o << firstFrame << "; ; ++i, t += SampleTime )\n";
+    }
+
+    x.indent(o, "{\n");
+    x.pushIndent();
+
+    if (numOccurrences > 0 && !counted)
+    {
+        x.indent(o, "int countdown = NumChannels");
+
+        if (numOccurrences > 1)
+            o << " * " << numOccurrences;
+
+        o << ";\n";
+    }
+    x.countdown = !counted;
+
+    if (checkpointInside)
+    {
+        x.indent(o, "if ( (i & 0xffff) == 0 && checkpoint.due() )\n");
+        x.indent(o, "    checkpoint.save ( ");
+        o << x.checkpointStep << ", i, t );\n";
+    }
+
+    if (previewEnd)
+        generatePreviewSkip(o, x, previewEnd);
+
+    if (reuse)
+        generateReuseSkip(o, x, limit != 0);
+
+    if (skipQuiet)
+        generateQuietSkip(o, x, limit != 0);
+
+    if (blockEnd)
+    {
+        const char *check [3];
+        int numChecks = 0;
+        if (previewEnd)
+            check[numChecks++] = "previewCheck";
+        if (reuse)
+            check[numChecks++] = "reuseCheck";
+        if (skipQuiet)
+            check[numChecks++] = "quietCheck";
+
+        generateFrameBlock(o, x, blockEnd, check, numChecks, feedback, blocksOnly);
+    }
+
+    if (!blocksOnly)
+    {
+        if (modify)
+        {
+            x.indent(o, LOCAL_SYMBOL_PREFIX);
+            o << lname << ".read ( sample );\n";
+        }
+
+        const char *assignOp = op.queryToken();
+        if (op == "<<")
+            assignOp = "=";
+
+        if (fused)
+            generateFusedValues(o, x);
+
+        // Where each channel comes from the same frames of its inputs, all
+        // channels are computed by one loop the compiler can vectorize,
+        // instead of by a copy of the expression per channel.
+        x.channelLoop = !rvalueIsVector && canUseChannelLoop(x);
+
+        x.insideVector = rvalueIsVector;
+        rvalue->generatePreChannelLoopCode(o, x);
+        x.insideVector = false;
+
+        if (rvalueIsVector)
+        {
+            SonicParse_Expression_Vector *v = (SonicParse_Expression_Vector *) rvalue;
+            const int numChannels = v->queryNumChannels();
+            SonicParse_Expression *comp = v->getComponentList();
+            x.iAllowed = x.cAllowed = true;
+            x.insideVector = true;
+            for (x.channelValue=0; x.channelValue < numChannels; ++(x.channelValue))
+            {
+                x.indent(o, "sample[");
+                o << x.channelValue << "] " << assignOp << " ";
+                comp->generateCode(o, x);
+                o << ";\n";
+                comp = comp->queryNext();
+            }
+            x.iAllowed = x.cAllowed = false;
+            x.insideVector = false;
+            x.channelValue = -1;
+        }
+        else if (x.channelLoop)
+        {
+            x.iAllowed = x.cAllowed = true;
+            x.indent(o, "for ( int c=0; c < NumChannels; ++c )\n");
+            x.pushIndent();
+            x.indent(o, "sample[c] ");
+            o << assignOp << " ";
+            rvalue->generateCode(o, x);
+            o << ";\n";
+            x.popIndent();
+            x.iAllowed = x.cAllowed = false;
+            x.channelLoop = false;
+        }
+        else
+        {
+            const int numChannels = x.prog->queryNumChannels();
+            x.iAllowed = x.cAllowed = true;
+            for (x.channelValue=0; x.channelValue < numChannels; ++(x.channelValue))
+            {
+                x.indent(o, "sample[");
+                o << x.channelValue << "] " << assignOp << " ";
+                rvalue->generateCode(o, x);
+                o << ";\n";
+            }
+            x.iAllowed = x.cAllowed = false;
+            x.channelValue = -1;
+        }
+
+        if (!counted && numOccurrences > 0)
+            x.indent(o, "if ( countdown <= 0 ) break;\n");
+        x.countdown = true;
+
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << lname << ".write ( sample );\n";
+    }
+    x.popIndent();
+    x.indent(o, "}\n");
+
+    for (i=0; i < numHoisted; ++i)
+        hoisted[i]->setHoistTag(-1);
+
+    x.fusedLoop = 0;
+
+    for (i=0; i < numWaveSymbols; i++)
+    {
+        if (*waveSymbol[i] != "$")
+        {
+            x.indent(o, LOCAL_SYMBOL_PREFIX);
+            o << waveSymbol[i]->queryToken();
+            o << ".close();\n";
+        }
+    }
+}
+
+
+void SonicParse_Statement_Assignment::generateEcho(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    // The statement for a comment, as written if fold() kept it.
+    if (echo)
+    {
+        o << echo;
+        return;
+    }
+
+    x.generatingComment = true;
+    o << lvalue->queryVarName().queryToken();
+    if (lvalue->queryIsWave())
+    {
+        o << "[c,i";
+        SonicParse_Expression *limit = lvalue->querySampleLimit();
+        if (limit)
+        {
+            o << ":";
+            if (lvalue->querySampleStart())
+            {
+                lvalue->querySampleStart()->generateCode(o, x);
+                o << " .. ";
+            }
+            limit->generateCode(o, x);
+        }
+        o << "]";
+    }
+
+    o << " " << op.queryToken() << " ";
+    rvalue->generateCode(o, x);
+    x.generatingComment = false;
+}
+
+
+void SonicParse_Statement_Assignment::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    int i;
+    SonicType ltype = lvalue->determineType(*x.prog,x.func);
+
+    if (lvalue->queryIsWave())
+    {
+        x.indent(o, "{\n");
+        x.pushIndent();
+
+        // put a comment to explain the complexity to follow
+        x.indent(o, "//  ");
+        generateEcho(o, x);
+        o << ";\n";
+
+        if (fusedInto)
+        {
+            x.indent(o, "//  (computed in the loop for '");
+            o << fusedInto->lvalue->queryVarName().queryToken() << "' below)\n";
+            x.popIndent();
+            x.indent(o, "}\n");
+            return;
+        }
+
+        o << "\n";
+
+        // Obtain list of all wave variables in rvalue
+        const int maxWaveSymbols = 256;
+        const SonicToken *waveSymbol [maxWaveSymbols];
+        int numWaveSymbols = 0;
+        int numOccurrences = 0;
+        waveSymbol [numWaveSymbols++] = &lvalue->queryVarName();
+
+        rvalue->getWaveSymbolList(
+            waveSymbol,
+            maxWaveSymbols,
+            numWaveSymbols,
+            numOccurrences);
+
+        if (fusedFirst)
+        {
+            // The loop reads what the waves computed in it read, instead
+            // of those waves themselves.
+            int numFusedOccurrences = 0;
+            for (SonicParse_Statement *sp = fusedFirst; sp != this; sp = sp->queryNext())
+            {
+                ((SonicParse_Statement_Assignment *)sp)->rvalue->getWaveSymbolList(
+                    waveSymbol,
+                    maxWaveSymbols,
+                    numWaveSymbols,
+                    numFusedOccurrences);
+            }
+
+            int numKept = 1;
+            for (i=1; i < numWaveSymbols; ++i)
+                if (!findFusedWave(*waveSymbol[i]))
+                    waveSymbol[numKept++] = waveSymbol[i];
+
+            numWaveSymbols = numKept;
+        }
+
+        bool modify = false;
+        for (i=1; i < numWaveSymbols && !modify; ++i)
+            if (*waveSymbol[i] == "$")
+                modify = true;
+
+        const SonicToken *copySource = fusedFirst ? 0 : queryWholeCopySource();
+        if (copySource)
+        {
+            // The run-time library can usually make the copy share the
+            // source's data, or take it over if the source is done with.
+            const char *method = x.func->isLastUseOfWave(this, *copySource) ? "takeFrom" : "shareFrom";
+            x.indent(o, "if ( !");
+            o << LOCAL_SYMBOL_PREFIX << lvalue->queryVarName().queryToken() << "." << method;
+            o << " ( " << LOCAL_SYMBOL_PREFIX << copySource->queryToken() << " ) )\n";
+            x.indent(o, "{\n");
+            x.pushIndent();
+            generateWaveLoop(o, x, waveSymbol, numWaveSymbols, numOccurrences, modify, false);
+            x.popIndent();
+            x.indent(o, "}\n");
+        }
+        else if (canCache(x))
+        {
+            // Generate the loop aside, so that its code can be hashed into
+            // the key identifying its result in the render cache.
+            bool stateful;
+            const bool reuse = canReuse(waveSymbol, numWaveSymbols, stateful);
+            const int firstTempTag = x.nextTempTag;
+            std::ostringstream loop;
+            x.pushIndent();
+            generateWaveLoop(loop, x, waveSymbol, numWaveSymbols, numOccurrences, modify, reuse);
+            x.popIndent();
+
+            const std::string loopCode = loop.str();
+            generateCacheKey(o, x, loopCode.c_str(), firstTempTag, waveSymbol, numWaveSymbols);
+
+            const char *lname = lvalue->queryVarName().queryToken();
+            x.indent(o, "if ( !");
+            o << LOCAL_SYMBOL_PREFIX << lname << ".loadFromCache ( cacheKey ) )\n";
+            x.indent(o, "{\n");
+            o << loopCode;
+            x.indent(o, "    ");
+            o << LOCAL_SYMBOL_PREFIX << lname << ".storeInCache ( cacheKey );\n";
+            x.indent(o, "}\n");
+        }
+        else
+            generateWaveLoop(o, x, waveSymbol, numWaveSymbols, numOccurrences, modify, false);
+
+        x.popIndent();
+        x.indent(o, "}\n");
+
+        if (!x.func)
+            throw SonicParseException("internal error: context lacks enclosing function", op);
+
+        x.func->clearAllResetFlags();
+    }
+    else if (ltype == STYPE_ARRAY)
+    {
+        if (op == "<<")
+            throw SonicParseException("append operator '<<' is allowed only in wave assignments", op);
+
+        SonicType rtype = rvalue->determineType();
+        if (rtype != STYPE_ARRAY)
+            throw SonicParseException("cannot assign a non-array to an array", rvalue->getFirstToken());
+
+        // If the lvalue array is a function parameter, we can only assign to it
+        // safely if it is explicitly passed by reference using the '&' modifier.
+        // Otherwise, because the first dimension cardinality is not checked, the
+        // passed array needn't have the same size.
+
+        SonicParse_VarDecl *lvar = x.func->findSymbol(lvalue->queryVarName(), false);
+        if (lvar && lvar->queryIsFunctionParm() && !ltype.isReference())
+            throw SonicParseException("cannot perform array assignment on non-reference function argument", lvalue->queryVarName());
+
+        int numDimensions = rtype.queryNumDimensions();
+        x.indent(o, "{\n");
+        x.pushIndent();
+        x.indent(o, "// ");
+        generateEcho(o, x);
+        o << ";\n";
+        int tag [MAX_SONIC_ARRAY_DIMENSIONS];
+        const int *rdim = rtype.queryDimensionArray();
+        int d;
+        for (d=0; d < numDimensions; ++d)
+        {
+            tag[d] = (x.nextTempTag)++;
+            x.indent(o, "for ( int ");
+            char t[32];
+            sprintf(t, "%s%d", TEMPORARY_PREFIX, tag[d]);
+            o << t << "=0; " << t << "<" << rdim[d] << "; ++" << t << " )\n";
+            x.pushIndent();
+        }
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << lvalue->queryVarName().queryToken();
+        for (d=0; d < numDimensions; ++d)
+            o << "[" << TEMPORARY_PREFIX << tag[d] << "]";
+
+        o << " " << op.queryToken() << " ";
+        rvalue->generateCode(o, x);
+        for (d=0; d < numDimensions; ++d)
+            o << "[" << TEMPORARY_PREFIX << tag[d] << "]";
+
+        o << ";\n";
+        for (d=0; d <= numDimensions; ++d)
+            x.popIndent();
+
+        x.indent(o, "}\n");
+    }
+    else    // it must be a simple assignment which can be expressed directly in C++
+    {
+        if (op == "<<")
+            throw SonicParseException("append operator '<<' is allowed only in wave assignments", op);
+
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << lvalue->queryVarName().queryToken();
+
+        SonicParse_Expression *indexList = lvalue->queryIndexList();
+        while (indexList)
+        {
+            o << "[";
+            bool needCast = indexList->determineType() != STYPE_INTEGER;
+            if (needCast)
+                o << "int(";
+            indexList->generateCode(o,x);
+            if (needCast)
+                o << ")";
+            o << "]";
+            indexList = indexList->queryNext();
+        }
+
+        o << " " << op.queryToken() << " ";
+        rvalue->generateCode(o, x);
+        o << ";\n";
+    }
+}
+
+
+//---------------------------------------------------------------------------
+//  Multi-output assignments:  one loop computes the 'where' names, a channel
+//  at a time, into arrays of NumChannels values, and then each output into
+//  a block of frames, which is written when full.
+
+void SonicParse_Statement_MultiAssignment::visitLoopExpressions(Sonic_ExpressionVisitor &v) const
+{
+    SonicParse_Expression::VisitList(v, localList);
+    SonicParse_Expression::VisitList(v, componentList);
+}
+
+
+static void GenerateNaturalEnd(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    const Sonic_ExpressionVisitor_WaveReads &reads)
+{
+    // As SonicParse_Statement_Assignment::generateNaturalEnd(), for a loop
+    // that reads none of the waves it writes.
+
+    bool needIndex = false;
+    for (int j=0; j < reads.queryNumReads(); ++j)
+        if (MentionsBuiltin(reads.queryRead(j)->queryIndexTerm(), "i"))
+            needIndex = true;
+
+    x.indent(o, "long naturalEnd;\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    if (needIndex)
+        x.indent(o, "const long i = 0;\n");
+    x.indent(o, "const double previewSpan[] =\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    x.iAllowed = true;
+    for (int k=0; k < reads.queryNumReads(); ++k)
+    {
+        const SonicParse_Expression_WaveExpr *wp = reads.queryRead(k);
+        const SonicToken &wave = wp->getFirstToken();
+        x.indent(o, "double(");
+        x.bracketer = &wave;
+        wp->queryIndexTerm()->generateCode(o, x);
+        x.bracketer = 0;
+        o << "), double(" << LOCAL_SYMBOL_PREFIX << wave.queryToken() << ".queryNumSamples())";
+        o << ((k+1 < reads.queryNumReads()) ? ",\n" : "\n");
+    }
+    x.iAllowed = false;
+    x.popIndent();
+    x.indent(o, "};\n");
+    x.indent(o, "naturalEnd = Sonic_NaturalEnd ( ");
+    o << reads.queryNumReads() << ", previewSpan );\n";
+    x.popIndent();
+    x.indent(o, "}\n");
+}
+
+
+void SonicParse_Statement_MultiAssignment::generateValues(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    SonicParse_Expression *list,
+    int firstTag,
+    const char *offset)
+{
+    // Stores each expression in 'list', for each channel, in the
+    // temporary array numbered from 'firstTag' in the same order,
+    // after 'offset' if not NULL.
+
+    int tag = firstTag;
+    for (SonicParse_Expression *ep = list; ep; ep = ep->queryNext(), ++tag)
+    {
+        if (x.channelLoop)
+        {
+            x.indent(o, TEMPORARY_PREFIX);
+            o << tag << "[";
+            if (offset)
+                o << offset << " + ";
+            o << "c] = ";
+            ep->generateCode(o, x);
+            o << ";\n";
+        }
+        else
+        {
+            ep->generatePreChannelLoopCode(o, x);
+
+            const int numChannels = x.prog->queryNumChannels();
+            x.iAllowed = x.cAllowed = true;
+            for (x.channelValue=0; x.channelValue < numChannels; ++(x.channelValue))
+            {
+                x.indent(o, TEMPORARY_PREFIX);
+                o << tag << "[";
+                if (offset)
+                    o << offset << (x.channelValue ? " + " : "");
+                if (!offset || x.channelValue)
+                    o << x.channelValue;
+                o << "] = ";
+                ep->generateCode(o, x);
+                o << ";\n";
+            }
+            x.iAllowed = x.cAllowed = false;
+            x.channelValue = -1;
+        }
+    }
+}
+
+
+void SonicParse_Statement_MultiAssignment::generateEcho(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    // The statement for a comment, as written if fold() kept it.
+    if (echo)
+    {
+        o << echo;
+        return;
+    }
+
+    int k;
+    SonicParse_Expression *ep;
+    x.generatingComment = true;
+    o << "(";
+    for (k=0; k < numOutputs; ++k)
+        o << (k ? ", " : "") << outputName[k].queryToken();
+    o << ")[c,i";
+    if (sampleLimit)
+    {
+        o << ":";
+        sampleLimit->generateCode(o, x);
+    }
+    o << "] " << op.queryToken() << " { ";
+    for (ep = componentList; ep; ep = ep->queryNext())
+    {
+        ep->generateCode(o, x);
+        o << (ep->queryNext() ? ", " : " }");
+    }
+    ep = localList;
+    for (k=0; k < numLocals; ++k, ep = ep->queryNext())
+    {
+        o << (k ? ", " : " where ") << localName[k].queryToken() << " = ";
+        ep->generateCode(o, x);
+    }
+    x.generatingComment = false;
+}
+
+
+void SonicParse_Statement_MultiAssignment::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    int i, k;
+    SonicParse_Expression *ep;
+
+    x.indent(o, "{\n");
+    x.pushIndent();
+
+    x.indent(o, "//  ");
+    generateEcho(o, x);
+    o << ";\n\n";
+
+    // Validation made sure none of the outputs is read, and there is no '$'.
+    const int maxWaveSymbols = 256;
+    const SonicToken *waveSymbol [maxWaveSymbols];
+    int numWaveSymbols = 0;
+    int numOccurrences = 0;
+    for (ep = localList; ep; ep = ep->queryNext())
+        ep->getWaveSymbolList(waveSymbol, maxWaveSymbols, numWaveSymbols, numOccurrences);
+    for (ep = componentList; ep; ep = ep->queryNext())
+        ep->getWaveSymbolList(waveSymbol, maxWaveSymbols, numWaveSymbols, numOccurrences);
+
+    for (k=0; k < numOutputs; ++k)
+    {
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << outputName[k].queryToken() << ".openForWrite();\n";
+    }
+
+    for (i=0; i < numWaveSymbols; ++i)
+    {
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << waveSymbol[i]->queryToken() << ".openForRead();\n";
+    }
+
+    const int outputTag = x.nextTempTag;
+    x.nextTempTag += numOutputs;
+    for (k=0; k < numOutputs; ++k)
+    {
+        x.indent(o, "float ");
+        o << TEMPORARY_PREFIX << (outputTag + k) << " [SONIC_FRAME_BLOCK * NumChannels];     // ";
+        o << outputName[k].queryToken() << "\n";
+    }
+
+    localTag = x.nextTempTag;
+    x.nextTempTag += numLocals;
+    for (k=0; k < numLocals; ++k)
+    {
+        x.indent(o, "double ");
+        o << TEMPORARY_PREFIX << (localTag + k) << " [NumChannels];     // ";
+        o << localName[k].queryToken() << "\n";
+    }
+
+    x.indent(o, "long frameData = 0;     // where the frame goes in each block\n");
+    x.indent(o, "double t = double(0);\n");
+    if (sampleLimit)
+    {
+        x.indent(o, "const long numSamples = long(");
+        x.bracketer = &outputName[0];
+        sampleLimit->generateCode(o, x);
+        x.bracketer = 0;
+        o << ");\n";
+    }
+
+    x.whereScope = this;
+
+    const int maxHoisted = 32;
+    SonicParse_Expression *hoisted [maxHoisted];
+    Sonic_ExpressionVisitor_Hoist hoist(x.prog, outputName[0], hoisted, maxHoisted);
+    visitLoopExpressions(hoist);
+    const int numHoisted = GenerateHoistedValues(o, x, hoist, hoisted);
+
+    for (ep = localList; ep; ep = ep->queryNext())
+        ep->generatePreSampleLoopCode(o, x);
+    for (ep = componentList; ep; ep = ep->queryNext())
+        ep->generatePreSampleLoopCode(o, x);
+
+    // Without a preview or blocks to compute, the natural end is worth
+    // knowing only if the loop can run up to it without counting reads.
+    Sonic_ExpressionVisitor_WaveReads reads;
+    visitLoopExpressions(reads);
+    const bool naturalEnd =
+        !sampleLimit &&
+        CanKnowNaturalEnd(x, reads) &&
+        CanCountToNaturalEnd(x, reads, 0);
+
+    if (naturalEnd)
+        GenerateNaturalEnd(o, x, reads);
+
+    const bool counted = sampleLimit || naturalEnd;
+    if (sampleLimit)
+        x.indent(o, "for ( long i=0; i < numSamples; ++i, t += SampleTime )\n");
+    else if (counted)
+        x.indent(o, "for ( long i=0; i < naturalEnd; ++i, t += SampleTime )\n");
+    else
+    {
+        if (numOccurrences == 0)
+        {
+            throw SonicParseException(
+                "cannot determine number of samples to generate",
+                componentList->getFirstToken());
+        }
+        x.indent(o, "for ( long i=0; ; ++i, t += SampleTime )\n");
+    }
+
+    x.indent(o, "{\n");
+    x.pushIndent();
+
+    if (!counted)
+    {
+        x.indent(o, "int countdown = NumChannels");
+        if (numOccurrences > 1)
+            o << " * " << numOccurrences;
+        o << ";\n";
+    }
+    x.countdown = !counted;
+
+    // All of it is computed by one loop over the channels if it can be,
+    // as in SonicParse_Statement_Assignment::canUseChannelLoop().
+    Sonic_ExpressionVisitor_ChannelLoop channels(&x);
+    visitLoopExpressions(channels);
+    x.channelLoop = !channels.queryBlocked() && channels.queryNumFrameReads() > 0;
+    if (x.channelLoop)
+    {
+        for (ep = localList; ep; ep = ep->queryNext())
+            ep->generatePreChannelLoopCode(o, x);
+        for (ep = componentList; ep; ep = ep->queryNext())
+            ep->generatePreChannelLoopCode(o, x);
+
+        x.iAllowed = x.cAllowed = true;
+        x.indent(o, "for ( int c=0; c < NumChannels; ++c )\n");
         x.indent(o, "{\n");
         x.pushIndent();
-        x.indent(o, "// ");
-        x.generatingComment = true;
-        o << lvalue->queryVarName().queryToken() << " " << op.queryToken() << " ";
-        rvalue->generateCode(o, x);
-        o << ";\n";
-        x.generatingComment = false;
-        int tag [MAX_SONIC_ARRAY_DIMENSIONS];
-        const int *rdim = rtype.queryDimensionArray();
-        int d;
-        for (d=0; d < numDimensions; ++d)
+        generateValues(o, x, localList, localTag, 0);
+        generateValues(o, x, componentList, outputTag, "frameData");
+        x.popIndent();
+        x.indent(o, "}\n");
+        x.iAllowed = x.cAllowed = false;
+        x.channelLoop = false;
+    }
+    else
+    {
+        generateValues(o, x, localList, localTag, 0);
+        generateValues(o, x, componentList, outputTag, "frameData");
+    }
+
+    if (!counted)
+        x.indent(o, "if ( countdown <= 0 ) break;\n");
+    x.countdown = true;
+
+    x.indent(o, "frameData += NumChannels;\n");
+    x.indent(o, "if ( frameData == SONIC_FRAME_BLOCK * NumChannels )\n");
+    x.indent(o, "{\n");
+    x.pushIndent();
+    for (k=0; k < numOutputs; ++k)
+    {
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << outputName[k].queryToken() << ".writeBlock ( " << TEMPORARY_PREFIX << (outputTag + k) << ", SONIC_FRAME_BLOCK );\n";
+    }
+    x.indent(o, "frameData = 0;\n");
+    x.popIndent();
+    x.indent(o, "}\n");
+
+    x.popIndent();
+    x.indent(o, "}\n");
+
+    for (k=0; k < numOutputs; ++k)
+    {
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << outputName[k].queryToken() << ".writeBlock ( " << TEMPORARY_PREFIX << (outputTag + k) << ", frameData / NumChannels );\n";
+    }
+
+    for (i=0; i < numHoisted; ++i)
+        hoisted[i]->setHoistTag(-1);
+
+    x.whereScope = 0;
+
+    for (k=0; k < numOutputs; ++k)
+    {
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << outputName[k].queryToken() << ".close();\n";
+    }
+
+    for (i=0; i < numWaveSymbols; ++i)
+    {
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << waveSymbol[i]->queryToken() << ".close();\n";
+    }
+
+    x.popIndent();
+    x.indent(o, "}\n");
+
+    if (!x.func)
+        throw SonicParseException("internal error: context lacks enclosing function", op);
+
+    x.func->clearAllResetFlags();
+}
+
+
+//---------------------------------------------------------------------------
+//  Loop fusion:  a wave assigned by one top-level statement and read only
+//  by the next few, at or just before the frame they compute, is computed
+//  a frame (or a block of frames) at a time in the loop of the last of
+//  them, which keeps the frames still to be read in a small array instead
+//  of writing the whole wave out and reading it back.  See findFusionEnd().
+
+class Sonic_ExpressionVisitor_Fusible: public Sonic_ExpressionVisitor
+{
+    // Finds what keeps an expression from being computed in the loop of
+    // another statement:  calls that could change or see what the other
+    // statements do, old data, and fft(), which calls a function of the
+    // program.  Noise would come out in a different order.
+
+public:
+    Sonic_ExpressionVisitor_Fusible(const SonicParse_Program *_prog):
+        prog(_prog),
+        blocked(false),
+        foundNoise(false)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
         {
-            tag[d] = (x.nextTempTag)++;
-            x.indent(o, "for ( int ");
-            char t[32];
-            sprintf(t, "%s%d", TEMPORARY_PREFIX, tag[d]);
-            o << t << "=0; " << t << "<" << rdim[d] << "; ++" << t << " )\n";
+        case ETYPE_FUNCTION_CALL:
+            if (((const SonicParse_Expression_FunctionCall *)ep)->isNoise())
+                foundNoise = true;
+            else if (!Sonic_ExpressionVisitor_LoopInvariant::IsPureCall(prog, ep))
+                blocked = true;
+            break;
+
+        case ETYPE_OLD_DATA:
+        case ETYPE_FFT:
+            blocked = true;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    bool queryBlocked() const
+    {
+        return blocked;
+    }
+    bool queryFoundNoise() const
+    {
+        return foundNoise;
+    }
+
+private:
+    const SonicParse_Program *prog;
+    bool blocked;
+    bool foundNoise;
+};
+
+
+class Sonic_ExpressionVisitor_WaveMention: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_WaveMention(const SonicToken &_waveName):
+        waveName(_waveName),
+        found(false),
+        maxBack(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
+        {
+        case ETYPE_WAVE_EXPR:
+        case ETYPE_WAVE_FIELD:
+        case ETYPE_VARIABLE:
+            if (ep->getFirstToken() == waveName)
+            {
+                found = true;
+
+                long back;
+                if (ep->queryExpressionType() == ETYPE_WAVE_EXPR &&
+                    ((const SonicParse_Expression_WaveExpr *)ep)->readsRecentFrame(back) &&
+                    back > maxBack)
+                {
+                    maxBack = back;
+                }
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    bool queryFound() const
+    {
+        return found;
+    }
+    long queryMaxBack() const       // the farthest back of the frame being computed it is read
+    {
+        return maxBack;
+    }
+
+private:
+    const SonicToken &waveName;
+    bool found;
+    long maxBack;
+};
+
+
+bool SonicParse_Statement_Assignment::readsTarget() const
+{
+    // Whether the right side reads back the wave being assigned, as a
+    // feedback loop does.  Such reads never show up in the wave symbol
+    // list, which names the target only once, at [0].
+
+    Sonic_ExpressionVisitor_WaveMention mention(lvalue->queryVarName());
+    rvalue->visit(mention);
+    return mention.queryFound();
+}
+
+
+const SonicParse_Statement *SonicParse_Statement_Assignment::queryFusionReach(
+    const Sonic_CodeGenContext &x) const
+{
+    // If this assignment can be computed in the loop of a later statement,
+    // returns the last statement that reads its result, or else NULL.  Its
+    // length must be known before that loop starts, and the frames it
+    // computes must not depend on when that happens.
+
+    if (!lvalue->queryIsWave() || op != "=" || lvalue->querySampleStart() || lvalue->querySampleLimit())
+        return 0;
+
+    Sonic_ExpressionVisitor_Fusible fusible(x.prog);
+    rvalue->visit(fusible);
+    if (fusible.queryBlocked() || fusible.queryFoundNoise())
+        return 0;
+
+    if (!canKnowNaturalEnd(x) || !canCountToNaturalEnd(x, false))
+        return 0;
+
+    return x.func->findFusionEnd(this, lvalue->queryVarName());
+}
+
+
+bool SonicParse_Statement_Assignment::canEndFusedLoop(
+    const Sonic_CodeGenContext &x,
+    const SonicParse_Statement_Assignment *first) const
+{
+    // Whether this assignment's loop can also compute the assignments from
+    // 'first' up to this one.  It must run from the start of its result to
+    // an end known before the loop, and none of them may read its result.
+
+    if (!lvalue->queryIsWave() || (op != "=" && op != "<<") || lvalue->querySampleStart())
+        return false;
+
+    Sonic_ExpressionVisitor_Fusible fusible(x.prog);
+    rvalue->visit(fusible);
+    if (lvalue->querySampleLimit())
+        lvalue->querySampleLimit()->visit(fusible);
+
+    if (fusible.queryBlocked())
+        return false;
+
+    if (!lvalue->querySampleLimit() && !(canKnowNaturalEnd(x) && canCountToNaturalEnd(x, false)))
+        return false;
+
+    for (const SonicParse_Statement *sp = first; sp != this; sp = sp->queryNext())
+    {
+        Sonic_ExpressionVisitor_WaveMention mention(lvalue->queryVarName());
+        ((const SonicParse_Statement_Assignment *)sp)->rvalue->visit(mention);
+        if (mention.queryFound())
+            return false;
+    }
+
+    return true;
+}
+
+
+void SonicParse_Statement_Assignment::fuseLoop(SonicParse_Statement_Assignment *first)
+{
+    fusedFirst = first;
+    for (SonicParse_Statement *sp = first; sp != this; sp = sp->queryNext())
+    {
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        ap->fusedInto = this;
+
+        // Keep as many frames as the farthest read back needs.
+        Sonic_ExpressionVisitor_WaveMention mention(ap->lvalue->queryVarName());
+        for (SonicParse_Statement *rp = sp->queryNext(); rp != queryNext(); rp = rp->queryNext())
+            ((SonicParse_Statement_Assignment *)rp)->rvalue->visit(mention);
+
+        ap->fusedHistory = 1;
+        while (ap->fusedHistory <= mention.queryMaxBack())
+            ap->fusedHistory *= 2;
+    }
+}
+
+
+void SonicParse_Statement_Assignment::unfuseLoop()
+{
+    for (SonicParse_Statement *sp = fusedFirst; sp != this; sp = sp->queryNext())
+    {
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        ap->fusedInto = 0;
+        ap->fusedHistory = 1;
+    }
+
+    fusedFirst = 0;
+}
+
+
+SonicParse_Statement_Assignment *SonicParse_Statement_Assignment::findFusedWave(
+    const SonicToken &waveName) const
+{
+    // The assignment computed in this one's loop whose result is 'waveName', or NULL.
+    for (SonicParse_Statement *sp = fusedFirst; sp && sp != this; sp = sp->queryNext())
+    {
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        if (ap->lvalue->queryVarName() == waveName)
+            return ap;
+    }
+
+    return 0;
+}
+
+
+bool SonicParse_Statement_Assignment::canFuseFrameBlocks(const Sonic_CodeGenContext &x) const
+{
+    // Blocks of frames can be computed as usual if each wave computed in
+    // this loop can be too, and is read only at the frame being computed.
+    for (SonicParse_Statement *sp = fusedFirst; sp != this; sp = sp->queryNext())
+    {
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        bool feedback;
+        if (ap->fusedHistory > 1 || !ap->canUseFrameBlocks(x, false, feedback) || feedback)
+            return false;
+    }
+
+    return true;
+}
+
+
+bool SonicParse_Statement_Assignment::canPreviewFused() const
+{
+    // Frames skipped for a preview are not computed for the waves fused
+    // into this loop either, which is harmless only if those carry nothing
+    // from one frame to the next.
+    for (SonicParse_Statement *sp = fusedFirst; sp != this; sp = sp->queryNext())
+    {
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        Sonic_ExpressionVisitor_Stateful stateful;
+        ap->rvalue->visit(stateful);
+        if (ap->fusedHistory > 1 || stateful.queryFound())
+            return false;
+    }
+
+    return true;
+}
+
+
+bool SonicParse_Statement_Assignment::canSkipQuiet() const
+{
+    // Runs of silence can be skipped if the result is silent whenever
+    // everything it reads is.  When the target feeds back on itself, its
+    // own earlier frames are checked like any other input.  In a fused
+    // loop, the waves computed in it must also be silent whenever their
+    // inputs are, and be read only at the frame being computed, so that
+    // checking those inputs at that frame is enough.
+
+    if (!rvalue->isZeroPreserving())
+        return false;
+
+    Sonic_ExpressionVisitor_WaveReads reads;
+    rvalue->visit(reads);
+    for (SonicParse_Statement *sp = fusedFirst; sp && sp != this; sp = sp->queryNext())
+    {
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        if (!ap->rvalue->isZeroPreserving())
+            return false;
+
+        ap->rvalue->visit(reads);
+    }
+
+    if (reads.queryNumReads() == 0)
+        return false;       // too many to check
+
+    return !fusedFirst || canPreviewFused();
+}
+
+
+bool SonicParse_Statement_Assignment::keepsFusedFeatures(const Sonic_CodeGenContext &x) const
+{
+    // Whether this fused loop can still skip silence, and checkpoint part
+    // way through in the program body, if it could on its own.  The render
+    // cache needs nothing more:  it takes a fused loop as a whole.
+
+    if (x.func->queryIsProgramBody() && canCheckpointInside() && !canPreviewFused())
+        return false;
+
+    if (rvalue->isZeroPreserving() && !canSkipQuiet())
+        return false;
+
+    return true;
+}
+
+
+int SonicParse_Statement_Assignment::generateFusedSetup(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    SonicParse_Expression *hoisted[],
+    int maxHoisted)
+{
+    // What each wave computed in this loop needs before the loop starts,
+    // in the order they were assigned:  its hoisted values, its length,
+    // and the array of its recent frames if more than one of them is kept.
+    // Returns the number of hoisted values.
+
+    int numHoisted = 0;
+    for (SonicParse_Statement *sp = fusedFirst; sp != this; sp = sp->queryNext())
+    {
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        numHoisted += ap->generateHoistedValues(o, x, hoisted + numHoisted, maxHoisted - numHoisted);
+        ap->rvalue->generatePreSampleLoopCode(o, x);
+
+        char endName [32];
+        ap->fusedEndTag = (x.nextTempTag)++;
+        sprintf(endName, "%s%d", TEMPORARY_PREFIX, ap->fusedEndTag);
+        if (!ap->generateNaturalEnd(o, x, false, endName))
+            throw SonicParseException("internal error: length of fused wave not known", ap->op);
+
+        if (ap->fusedHistory > 1)
+        {
+            ap->fusedTag = (x.nextTempTag)++;
+            x.indent(o, "float ");
+            o << TEMPORARY_PREFIX << ap->fusedTag << " [" << ap->fusedHistory << " * NumChannels] = { 0 };\n";
+        }
+    }
+
+    return numHoisted;
+}
+
+
+void SonicParse_Statement_Assignment::generateFusedValues(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    for (SonicParse_Statement *sp = fusedFirst; sp != this; sp = sp->queryNext())
+        ((SonicParse_Statement_Assignment *)sp)->generateFusedValue(o, x);
+}
+
+
+void SonicParse_Statement_Assignment::generateFusedValue(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    // Computes frame i of this fused wave, or the block of frames from i,
+    // into t_<fusedTag>, rounded to float as if it had been written to the
+    // wave.  Past the end of the wave, it reads as silence.
+
+    const bool blockLoop = x.blockLoop;
+    if (fusedHistory == 1)
+    {
+        fusedTag = (x.nextTempTag)++;
+        x.indent(o, "float ");
+        o << TEMPORARY_PREFIX << fusedTag << (blockLoop ? " [SONIC_FRAME_BLOCK * NumChannels];\n" : " [NumChannels];\n");
+    }
+
+    char frame [64];
+    if (blockLoop)
+        strcpy(frame, "j*NumChannels + ");
+    else if (fusedHistory > 1)
+        sprintf(frame, "(i & %ld)*NumChannels + ", fusedHistory - 1);
+    else
+        frame[0] = '\0';
+
+    x.indent(o, "if ( i < ");
+    o << TEMPORARY_PREFIX << fusedEndTag << " )\n";
+    x.indent(o, "{\n");
+    x.pushIndent();
+
+    x.channelLoop = !blockLoop && canUseChannelLoop(x);
+    x.numBlockFetches = 0;      // the ones before are out of scope
+    rvalue->generatePreChannelLoopCode(o, x);
+
+    x.iAllowed = x.cAllowed = true;
+    if (blockLoop || x.channelLoop)
+    {
+        if (blockLoop)
+        {
+            x.indent(o, "for ( long j=0; j < span; ++j )\n");
             x.pushIndent();
         }
-        x.indent(o, LOCAL_SYMBOL_PREFIX);
-        o << lvalue->queryVarName().queryToken();
-        for (d=0; d < numDimensions; ++d)
-            o << "[" << TEMPORARY_PREFIX << tag[d] << "]";
 
-        o << " " << op.queryToken() << " ";
+        x.indent(o, "for ( int c=0; c < NumChannels; ++c )\n");
+        x.pushIndent();
+        x.indent(o, TEMPORARY_PREFIX);
+        o << fusedTag << "[" << frame << "c] = float(";
         rvalue->generateCode(o, x);
-        for (d=0; d < numDimensions; ++d)
-            o << "[" << TEMPORARY_PREFIX << tag[d] << "]";
+        o << ");\n";
+        x.popIndent();
+
+        if (blockLoop)
+            x.popIndent();
+    }
+    else
+    {
+        const int numChannels = x.prog->queryNumChannels();
+        for (x.channelValue=0; x.channelValue < numChannels; ++(x.channelValue))
+        {
+            x.indent(o, TEMPORARY_PREFIX);
+            o << fusedTag << "[" << frame << x.channelValue << "] = float(";
+            rvalue->generateCode(o, x);
+            o << ");\n";
+        }
+        x.channelValue = -1;
+    }
+    x.iAllowed = x.cAllowed = false;
+    x.channelLoop = false;
+
+    x.popIndent();
+    x.indent(o, "}\n");
+    x.indent(o, "else\n");
+    x.pushIndent();
+    if (blockLoop)
+    {
+        x.indent(o, "for ( long j=0; j < span; ++j )\n");
+        x.pushIndent();
+    }
+
+    x.indent(o, "for ( int c=0; c < NumChannels; ++c )\n");
+    x.pushIndent();
+    x.indent(o, TEMPORARY_PREFIX);
+    o << fusedTag << "[" << frame << "c] = 0.0f;\n";
+    x.popIndent();
+
+    if (blockLoop)
+        x.popIndent();
+
+    x.popIndent();
+}
+
+
+void SonicParse_Statement_Assignment::generateFusedRead(
+    std::ostream &o,
+    Sonic_CodeGenContext &x,
+    const SonicParse_Expression_WaveExpr *wp) const
+{
+    // A read of this fused wave, from what generateFusedValue() computed.
+    long back = 0;
+    wp->readsRecentFrame(back);
+
+    o << "double(" << TEMPORARY_PREFIX << fusedTag << "[";
+    if (x.blockLoop)
+        o << "j*NumChannels + ";
+    else if (fusedHistory > 1)
+    {
+        if (back > 0)
+            o << "((i - " << back << ") & ";
+        else
+            o << "(i & ";
+        o << (fusedHistory - 1) << ")*NumChannels + ";
+    }
+
+    wp->queryChannelTerm()->generateCode(o, x);
+    o << "])";
+}
+
+
+static bool Follows(const SonicParse_Statement *later, const SonicParse_Statement *earlier)
+{
+    for (const SonicParse_Statement *sp = earlier->queryNext(); sp; sp = sp->queryNext())
+        if (sp == later)
+            return true;
+
+    return false;
+}
+
+
+static SonicParse_Statement_Assignment *FindFusedLoopEnd(
+    const Sonic_CodeGenContext &x,
+    SonicParse_Statement_Assignment *first)
+{
+    // The last statement of the longest run from 'first' that can be one
+    // loop, or NULL.  Every statement of the run but the last must be
+    // fusible, and the last must be the last to read any of their waves.
 
-        o << ";\n";
-        for (d=0; d <= numDimensions; ++d)
-            x.popIndent();
+    const SonicParse_Statement *reach = first->queryFusionReach(x);
+    if (!reach)
+        return 0;
 
-        x.indent(o, "}\n");
-    }
-    else    // it must be a simple assignment which can be expressed directly in C++
+    SonicParse_Statement_Assignment *end = 0;
+    for (SonicParse_Statement *sp = first->queryNext(); sp && sp->queryType() == STMT_ASSIGNMENT; sp = sp->queryNext())
     {
-        if (op == "<<")
-            throw SonicParseException("append operator '<<' is allowed only in wave assignments", op);
+        SonicParse_Statement_Assignment *ap = (SonicParse_Statement_Assignment *) sp;
+        if (sp == reach && ap->canEndFusedLoop(x, first))
+            end = ap;
 
-        x.indent(o, LOCAL_SYMBOL_PREFIX);
-        o << lvalue->queryVarName().queryToken();
+        // Its own result may be read by the statements after it, too.
+        const SonicParse_Statement *further = ap->queryFusionReach(x);
+        if (!further)
+            break;
 
-        SonicParse_Expression *indexList = lvalue->queryIndexList();
-        while (indexList)
+        if (sp == reach || Follows(further, reach))
+            reach = further;
+    }
+
+    return end;
+}
+
+
+void SonicParse_Function::fuseWaveLoops(Sonic_CodeGenContext &x)
+{
+    SonicParse_Statement *sp = statementList;
+    while (sp)
+    {
+        SonicParse_Statement_Assignment *end = 0;
+        if (sp->queryType() == STMT_ASSIGNMENT)
+            end = FindFusedLoopEnd(x, (SonicParse_Statement_Assignment *) sp);
+
+        if (end)
         {
-            o << "[";
-            bool needCast = indexList->determineType() != STYPE_INTEGER;
-            if (needCast)
-                o << "int(";
-            indexList->generateCode(o,x);
-            if (needCast)
-                o << ")";
-            o << "]";
-            indexList = indexList->queryNext();
+            // Fusion gives way to skipping silence and to checkpoints.
+            end->fuseLoop((SonicParse_Statement_Assignment *) sp);
+            if (end->keepsFusedFeatures(x))
+                sp = end;
+            else
+                end->unfuseLoop();
         }
 
-        o << " " << op.queryToken() << " ";
-        rvalue->generateCode(o, x);
-        o << ";\n";
+        sp = sp->queryNext();
     }
 }
 
 
+//---------------------------------------------------------------------------
+
+
 void SonicParse_Function::generatePrototype(std::ostream &o, Sonic_CodeGenContext &x)
 {
     switch (returnType.queryTypeClass())
@@ -550,6 +3255,7 @@ void SonicParse_Function::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
     SonicParse_Function *fsave = x.func;        // in case we ever have nested functions!
     x.func = this;
+    fuseWaveLoops(x);
 
     o << "\n";
     generatePrototype(o, x);
@@ -569,8 +3275,43 @@ void SonicParse_Function::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
         o << "\n";
     }
 
-    for (SonicParse_Statement *sp = statementList; sp; sp = sp->next)
-        sp->generateCode(o, x);
+    if (isProgramBody)
+    {
+        // Each statement of the program body is a place to checkpoint,
+        // and is skipped when resuming from a later one.
+
+        generateCheckpointSetup(o, x);
+        int step = 0;
+        for (SonicParse_Statement *sp = statementList; sp; sp = sp->next)
+        {
+            x.indent(o, "if ( checkpoint.reached ( ");
+            o << ++step << " ) )\n";
+
+            const bool braces = (sp->queryType() == STMT_IF);   // keep its 'else' its own
+            if (braces)
+                x.indent(o, "{\n");
+
+            if (braces || !sp->needsBraces())
+                x.pushIndent();
+
+            x.checkpointStatement = sp;
+            x.checkpointStep = step;
+            sp->generateCode(o, x);
+            x.checkpointStatement = 0;
+            x.checkpointStep = 0;
+
+            if (braces || !sp->needsBraces())
+                x.popIndent();
+
+            if (braces)
+                x.indent(o, "}\n");
+        }
+    }
+    else
+    {
+        for (SonicParse_Statement *sp = statementList; sp; sp = sp->next)
+            sp->generateCode(o, x);
+    }
 
     x.popIndent();
     o << "}\n\n";
@@ -579,6 +3320,69 @@ void SonicParse_Function::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 }
 
 
+static void GenerateCheckpointItem(std::ostream &o, Sonic_CodeGenContext &x, SonicParse_VarDecl *vp)
+{
+    const char *name = vp->queryName().queryToken();
+    switch (vp->queryType().queryTypeClass())
+    {
+    case STYPE_INTEGER:
+        x.indent(o, "checkpoint.addInteger ( \"");
+        o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << " );\n";
+        break;
+
+    case STYPE_REAL:
+        x.indent(o, "checkpoint.addReal ( \"");
+        o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << " );\n";
+        break;
+
+    case STYPE_BOOLEAN:
+        x.indent(o, "checkpoint.addBoolean ( \"");
+        o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << " );\n";
+        break;
+
+    case STYPE_WAVE:
+        x.indent(o, "checkpoint.addWave ( ");
+        o << LOCAL_SYMBOL_PREFIX << name << " );\n";
+        break;
+
+    case STYPE_ARRAY:
+        x.indent(o, "checkpoint.addArray ( \"");
+        o << name << "\", " << LOCAL_SYMBOL_PREFIX << name << ", sizeof(" << LOCAL_SYMBOL_PREFIX << name << ") );\n";
+        break;
+
+    case STYPE_IMPORT:
+        // The state of an imported C++ object is out of our hands.
+        x.indent(o, "checkpoint.disallow ( \"variable '");
+        o << name << "' is an imported object\" );\n";
+        break;
+
+    default:
+        throw SonicParseException("internal error: cannot checkpoint variable of this type", vp->queryName());
+    }
+}
+
+
+void SonicParse_Function::generateCheckpointSetup(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    // Register everything the program body can change, so that its state
+    // can be saved to and restored from a checkpoint.
+
+    x.indent(o, "SonicCheckpoint checkpoint ( \"");
+    o << name.queryToken() << "\" );\n";
+
+    for (SonicParse_VarDecl *gp = prog.queryGlobalVars(); gp; gp = gp->queryNext())
+        GenerateCheckpointItem(o, x, gp);
+
+    for (SonicParse_VarDecl *pp = parmList; pp; pp = pp->queryNext())
+        GenerateCheckpointItem(o, x, pp);
+
+    for (SonicParse_VarDecl *vp = varList; vp; vp = vp->queryNext())
+        GenerateCheckpointItem(o, x, vp);
+
+    x.indent(o, "checkpoint.restore();\n\n");
+}
+
+
 void SonicParse_VarDecl::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
     switch (type.queryTypeClass())
@@ -774,6 +3578,9 @@ void SonicParse_Expression_Vector::generatePreChannelLoopCode(
 
 void SonicParse_Expression_BinaryBoolOp::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
+    if (generateHoisted(o, x))
+        return;
+
     bool paren = lchild->operatorPrecedence() < operatorPrecedence();
 
     if (paren)
@@ -842,6 +3649,9 @@ void SonicParse_Expression_UnaryOp::generatePreChannelLoopCode(
 
 void SonicParse_Expression_BinaryMathOp::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
+    if (generateHoisted(o, x))
+        return;
+
     bool paren = lchild->operatorPrecedence() < operatorPrecedence();
 
     if (paren)
@@ -876,31 +3686,184 @@ void SonicParse_Expression_BinaryMathOp::generateCode(std::ostream &o, Sonic_Cod
 }
 
 
+static void GenerateDouble(std::ostream &o, Sonic_CodeGenContext &x, SonicParse_Expression *ep)
+{
+    // An argument for a math function taking doubles, cast only if it
+    // needs to be:  a real is one already, and '3' can be written '3.0'.
+    if (ep->determineType() == STYPE_REAL)
+    {
+        ep->generateCode(o, x);
+    }
+    else if (ep->queryExpressionType() == ETYPE_CONSTANT && ep->determineType() == STYPE_INTEGER)
+    {
+        const char *text = ((const SonicParse_Expression_Constant *)ep)->queryValue().queryToken();
+        o << text;
+        if (!strpbrk(text, ".eE"))
+            o << ".0";
+    }
+    else
+    {
+        o << "double(";
+        ep->generateCode(o, x);
+        o << ")";
+    }
+}
+
+
 void SonicParse_Expression_Mod::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
+    if (generateHoisted(o, x))
+        return;
+
     SonicType ltype = lchild->determineType();
     SonicType rtype = rchild->determineType();
 
     if (ltype != STYPE_INTEGER || rtype != STYPE_INTEGER)
     {
-        o << "fmod(double(";
+        if (generateRampHead(o, x))
+        {
+            // The ramp wraps the dividend itself.
+            GenerateDouble(o, x, lchild);
+            o << "))";
+            return;
+        }
+
+        const bool wrap = !x.generatingComment && IsRampInvariant(rchild);
+        o << (wrap ? "Sonic_Wrap(" : "fmod(");
+        GenerateDouble(o, x, lchild);
+        o << ", ";
+        GenerateDouble(o, x, rchild);
+        o << ")";
+    }
+    else
+        SonicParse_Expression_BinaryMathOp::generateCode(o, x);
+}
+
+
+void SonicParse_Expression_Mod::generatePreSampleLoopCode(
+    std::ostream &o,
+    Sonic_CodeGenContext &x)
+{
+    SonicParse_Expression_BinaryMathOp::generatePreSampleLoopCode(o, x);
+
+    // A phase that wraps around, as in (f*t) % 1.
+    rampTag = -1;
+    if ((lchild->determineType() != STYPE_INTEGER || rchild->determineType() != STYPE_INTEGER) &&
+        IsRampArgument(lchild) && IsRampInvariant(rchild))
+    {
+        const int stepTag = GenerateRampStep(o, x, lchild);
+        rampTag = (x.nextTempTag)++;
+        x.indent(o, "SonicPhaseRamp ");
+        o << TEMPORARY_PREFIX << rampTag << " ( ";
+        o << TEMPORARY_PREFIX << stepTag << "[1] - " << TEMPORARY_PREFIX << stepTag << "[0], ";
+        GenerateDouble(o, x, rchild);
+        o << " );\n";
+    }
+}
+
+
+static bool IsIntegerConstant(const SonicParse_Expression *ep, int &value)
+{
+    // a small whole number, such as 3 or 2.0
+    if (ep->queryExpressionType() != ETYPE_CONSTANT)
+        return false;
+
+    const SonicToken &token = ((const SonicParse_Expression_Constant *)ep)->queryValue();
+    if (ep->determineType() != STYPE_INTEGER && ep->determineType() != STYPE_REAL)
+        return false;
+
+    double d = atof(token.queryToken());
+    if (d < -16.0 || d > 16.0 || d != double(int(d)))
+        return false;
+
+    value = int(d);
+    return true;
+}
+
+
+static bool IsPositiveConstant(const SonicParse_Expression *ep)
+{
+    if (ep->queryExpressionType() == ETYPE_BUILTIN)
+        return ep->getFirstToken() == "e" || ep->getFirstToken() == "pi";
+
+    if (ep->queryExpressionType() != ETYPE_CONSTANT)
+        return false;
+
+    if (ep->determineType() != STYPE_INTEGER && ep->determineType() != STYPE_REAL)
+        return false;
+
+    return atof(((const SonicParse_Expression_Constant *)ep)->queryValue().queryToken()) > 0.0;
+}
+
+
+void SonicParse_Expression_Power::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    if (generateHoisted(o, x))
+        return;
+
+    const bool ramp = generateRampHead(o, x);
+
+    int base, n;
+    if (x.generatingComment)
+    {
+        o << "pow(double(";
         lchild->generateCode(o, x);
         o << "),double(";
         rchild->generateCode(o, x);
         o << "))";
     }
+    else if (lchild->queryExpressionType() == ETYPE_BUILTIN && lchild->getFirstToken() == "e")
+    {
+        o << "exp(";
+        GenerateDouble(o, x, rchild);
+        o << ")";
+    }
+    else if (IsIntegerConstant(lchild, base) && base == 2)
+    {
+        o << "exp2(";
+        GenerateDouble(o, x, rchild);
+        o << ")";
+    }
+    else if (IsIntegerConstant(rchild, n))
+    {
+        // multiplications instead of pow()
+        o << ((n == 2) ? "Sonic_Square(" : "Sonic_IntPower(");
+        GenerateDouble(o, x, lchild);
+        if (n != 2)
+            o << ", " << n;
+        o << ")";
+    }
     else
-        SonicParse_Expression_BinaryMathOp::generateCode(o, x);
+    {
+        o << "pow(";
+        GenerateDouble(o, x, lchild);
+        o << ", ";
+        GenerateDouble(o, x, rchild);
+        o << ")";
+    }
+
+    if (ramp)
+        o << "))";
 }
 
 
-void SonicParse_Expression_Power::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
+void SonicParse_Expression_Power::generatePreSampleLoopCode(
+    std::ostream &o,
+    Sonic_CodeGenContext &x)
 {
-    o << "pow(double(";
-    lchild->generateCode(o, x);
-    o << "),double(";
-    rchild->generateCode(o, x);
-    o << "))";
+    SonicParse_Expression_BinaryMathOp::generatePreSampleLoopCode(o, x);
+
+    // An exponential ramp, as in 2^(-t/0.3).
+    rampTag = -1;
+    if (IsPositiveConstant(lchild) && IsRampArgument(rchild))
+    {
+        const int stepTag = GenerateRampStep(o, x, rchild);
+        rampTag = (x.nextTempTag)++;
+        x.indent(o, "SonicExpRamp ");
+        o << TEMPORARY_PREFIX << rampTag << " ( pow(";
+        GenerateDouble(o, x, lchild);
+        o << ", " << TEMPORARY_PREFIX << stepTag << "[1] - " << TEMPORARY_PREFIX << stepTag << "[0]) );\n";
+    }
 }
 
 
@@ -915,7 +3878,10 @@ void SonicParse_Expression_OldData::generateCode(std::ostream &o, Sonic_CodeGenC
         if (!x.iAllowed)
             throw SonicParseException("Old-data symbol cannot appear here", dollarSign);
 
-        o << "sample[" << x.channelValue << "]";
+        if (x.channelValue >= 0)
+            o << "sample[" << x.channelValue << "]";
+        else
+            o << "sample[c]";
     }
 }
 
@@ -935,6 +3901,41 @@ void SonicParse_Expression_WaveExpr::generateCode(std::ostream &o, Sonic_CodeGen
         if (!x.iAllowed)
             throw SonicParseException("wave expression not allowed here", waveName);
 
+        const SonicParse_Statement_Assignment *fused = x.fusedLoop ? x.fusedLoop->findFusedWave(waveName) : 0;
+        if (fused)
+        {
+            fused->generateFusedRead(o, x, this);
+            return;
+        }
+
+        if (x.blockLoop && frameTag >= 0 && interpolates(x))
+        {
+            const SonicToken *saveBracketer = x.bracketer;
+            x.bracketer = &waveName;
+            o << "Sonic_InterpBlock(" << TEMPORARY_PREFIX << frameTag << ", ";
+            o << TEMPORARY_PREFIX << (frameTag + 1) << ", ";
+            if (iterm->determineType() != STYPE_REAL)
+                o << "double(";
+            iterm->generateCode(o, x);
+            if (iterm->determineType() != STYPE_REAL)
+                o << ")";
+            o << ", c, NumChannels)";
+            x.bracketer = saveBracketer;
+            return;
+        }
+
+        if (x.blockLoop && frameTag >= 0)
+        {
+            o << "double(" << TEMPORARY_PREFIX << frameTag << "[j*NumChannels + c])";
+            return;
+        }
+
+        if (x.channelLoop && frameTag >= 0)
+        {
+            o << "double(" << TEMPORARY_PREFIX << frameTag << "[c])";
+            return;
+        }
+
         const SonicToken *saveBracketer = x.bracketer;
         x.bracketer = &waveName;
 
@@ -955,7 +3956,7 @@ void SonicParse_Expression_WaveExpr::generateCode(std::ostream &o, Sonic_CodeGen
             iterm->generateCode(o, x);
             if (indexType != STYPE_REAL)
                 o << ")";
-            o << ", countdown)";
+            o << (x.countdown ? ", countdown)" : ")");
         }
         else
         {
@@ -971,7 +3972,7 @@ void SonicParse_Expression_WaveExpr::generateCode(std::ostream &o, Sonic_CodeGen
             iterm->generateCode(o, x);
             if (indexType != STYPE_INTEGER)
                 o << ")";
-            o << ", countdown)";
+            o << (x.countdown ? ", countdown)" : ")");
         }
 
         x.bracketer = saveBracketer;
@@ -1002,11 +4003,142 @@ void SonicParse_Expression_WaveExpr::generatePreChannelLoopCode(
     x.iAllowed = x.cAllowed = true;
     cterm->generatePreChannelLoopCode(o, x);
     iterm->generatePreChannelLoopCode(o, x);
+
+    frameTag = -1;
+    if (x.fusedLoop && x.fusedLoop->findFusedWave(waveName))
+    {
+        // Computed in this loop; see generateFusedValue().
+    }
+    else if (x.blockLoop && readsFrameRun())
+    {
+        // The block of frames from this read's index, or for interp() the
+        // frames around each index of the block.  Other reads of the same
+        // wave from the same index share it.
+        const bool interp = interpolates(x);
+        const SonicToken *saveBracketer = x.bracketer;
+        x.bracketer = &waveName;
+        x.blockLoop = false;
+        std::ostringstream index;
+        iterm->generateCode(index, x);
+        const std::string indexCode = index.str();
+        x.bracketer = saveBracketer;
+        x.blockLoop = true;
+
+        frameTag = x.findBlockFetch(waveName, indexCode.c_str(), interp);
+        if (frameTag < 0 && interp)
+        {
+            frameTag = x.nextTempTag;
+            x.nextTempTag += 2;
+            x.indent(o, "const long ");
+            o << TEMPORARY_PREFIX << (frameTag + 1) << " = long(" << indexCode << ");\n";
+            x.indent(o, "float ");
+            o << TEMPORARY_PREFIX << frameTag << " [(SONIC_FRAME_BLOCK + 2) * NumChannels];\n";
+            x.indent(o, LOCAL_SYMBOL_PREFIX);
+            o << waveName.queryToken() << ".fetchBlock ( ";
+            o << TEMPORARY_PREFIX << (frameTag + 1) << ", span + 2, " << TEMPORARY_PREFIX << frameTag << " );\n";
+            x.addBlockFetch(waveName, indexCode.c_str(), interp, frameTag);
+        }
+        else if (frameTag < 0)
+        {
+            frameTag = (x.nextTempTag)++;
+            x.indent(o, "float ");
+            o << TEMPORARY_PREFIX << frameTag << " [SONIC_FRAME_BLOCK * NumChannels];\n";
+            x.indent(o, LOCAL_SYMBOL_PREFIX);
+            o << waveName.queryToken() << ".fetchBlock ( ";
+            if (iterm->determineType() != STYPE_INTEGER)
+                o << "long(" << indexCode << ")";
+            else
+                o << indexCode;
+            o << ", span, " << TEMPORARY_PREFIX << frameTag << " );\n";
+            x.addBlockFetch(waveName, indexCode.c_str(), interp, frameTag);
+        }
+    }
+    else if (x.channelLoop && readsWholeFrame(x))
+    {
+        // Fetch every channel of the frame before the loop over them.
+        const SonicToken *saveBracketer = x.bracketer;
+        x.bracketer = &waveName;
+        frameTag = (x.nextTempTag)++;
+        x.indent(o, "float ");
+        o << TEMPORARY_PREFIX << frameTag << " [NumChannels];\n";
+        x.indent(o, LOCAL_SYMBOL_PREFIX);
+        o << waveName.queryToken() << ".fetchFrame ( ";
+        if (iterm->determineType() != STYPE_INTEGER)
+            o << "long(";
+        iterm->generateCode(o, x);
+        if (iterm->determineType() != STYPE_INTEGER)
+            o << ")";
+        o << ", " << TEMPORARY_PREFIX << frameTag << (x.countdown ? ", countdown );\n" : " );\n");
+        x.bracketer = saveBracketer;
+    }
+
     x.iAllowed = isave;
     x.cAllowed = csave;
 }
 
 
+bool SonicParse_Expression_WaveExpr::interpolates(const Sonic_CodeGenContext &x) const
+{
+    return x.prog->queryInterpolateFlag() && iterm->determineType() != STYPE_INTEGER;
+}
+
+
+bool SonicParse_Expression_WaveExpr::readsAllChannels() const
+{
+    if (cterm->queryExpressionType() != ETYPE_BUILTIN || cterm->getFirstToken() != "c")
+        return false;
+
+    // The index is evaluated once instead of once per channel.
+    if (iterm->isChannelDependent())
+        return false;
+
+    Sonic_ExpressionVisitor_ChannelLoop visitor;
+    iterm->visit(visitor);
+    return !visitor.queryFoundNoise();
+}
+
+
+bool SonicParse_Expression_WaveExpr::readsWholeFrame(const Sonic_CodeGenContext &x) const
+{
+    return !interpolates(x) && readsAllChannels();
+}
+
+
+bool SonicParse_Expression_WaveExpr::readsFrameRun() const
+{
+    return readsAllChannels() && iterm->isSampleOffset();
+}
+
+
+bool SonicParse_Expression_WaveExpr::readsRecentFrame(long &back) const
+{
+    if (cterm->queryExpressionType() != ETYPE_BUILTIN || cterm->getFirstToken() != "c")
+        return false;
+
+    if (iterm->queryExpressionType() == ETYPE_BUILTIN && iterm->getFirstToken() == "i")
+    {
+        back = 0;
+        return true;
+    }
+
+    if (iterm->queryExpressionType() != ETYPE_BINARY_OP)
+        return false;
+
+    const SonicParse_Expression_BinaryOp *bp = (const SonicParse_Expression_BinaryOp *) iterm;
+    const SonicParse_Expression *left  = bp->queryLeft();
+    const SonicParse_Expression *right = bp->queryRight();
+    if (bp->queryOp() != "-" ||
+        left->queryExpressionType() != ETYPE_BUILTIN || left->getFirstToken() != "i" ||
+        right->queryExpressionType() != ETYPE_CONSTANT || right->determineType() != STYPE_INTEGER)
+    {
+        return false;
+    }
+
+    back = atol(right->getFirstToken().queryToken());
+    return back >= 0 && back < MAX_FUSED_HISTORY;
+}
+
+
 void SonicParse_Expression_Constant::generateCode(std::ostream &o, Sonic_CodeGenContext &)
 {
     if (type == STYPE_STRING)
@@ -1058,6 +4190,11 @@ void SonicParse_Expression_ArraySubscript::generateCode(std::ostream &o, Sonic_C
 
 void SonicParse_Expression_FunctionCall::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
+    if (generateHoisted(o, x))
+        return;
+
+    const bool ramp = generateRampHead(o, x);
+
     if (!x.generatingComment)
     {
         if (ftype == SFT_USER)
@@ -1071,19 +4208,18 @@ void SonicParse_Expression_FunctionCall::generateCode(std::ostream &o, Sonic_Cod
     o << name.queryToken() << "(";
     for (SonicParse_Expression *pp = parmList; pp; pp = pp->queryNext())
     {
-        const bool thisCast = needDoubleCast && pp->determineType() != STYPE_REAL;
-        if (thisCast)
-            o << "double(";
-
-        pp->generateCode(o, x);
-
-        if (thisCast)
-            o << ")";
+        if (needDoubleCast)
+            GenerateDouble(o, x, pp);
+        else
+            pp->generateCode(o, x);
 
         if (pp->queryNext())
             o << ", ";
     }
     o << ")";
+
+    if (ramp)
+        o << "))";
 }
 
 
@@ -1111,6 +4247,17 @@ void SonicParse_Expression_FunctionCall::generatePreSampleLoopCode(
 
     for (SonicParse_Expression *pp = parmList; pp; pp = pp->queryNext())
         pp->generatePreSampleLoopCode(o,x);
+
+    // An envelope, as in exp(-3*t) or dB(-20*t).
+    rampTag = -1;
+    if (isIntrinsic() && (name == "exp" || name == "Sonic_dB") && IsRampArgument(parmList))
+    {
+        const int stepTag = GenerateRampStep(o, x, parmList);
+        rampTag = (x.nextTempTag)++;
+        x.indent(o, "SonicExpRamp ");
+        o << TEMPORARY_PREFIX << rampTag << " ( " << name.queryToken() << "(";
+        o << TEMPORARY_PREFIX << stepTag << "[1] - " << TEMPORARY_PREFIX << stepTag << "[0]) );\n";
+    }
 }
 
 
@@ -1182,6 +4329,10 @@ void SonicParse_Expression_Builtin::generateCode(std::ostream &o, Sonic_CodeGenC
 
             if (name == "c" && x.channelValue >= 0)
                 o << x.channelValue;
+            else if (name == "i" && x.blockLoop)
+                o << "(i + j)";
+            else if (name == "t" && x.blockLoop)
+                o << "(double(i + j) * SampleTime)";    // not accumulated, so it can be vectorized
             else
                 o << name.queryToken();
         }
@@ -1198,9 +4349,30 @@ void SonicParse_Expression_Variable::generateCode(std::ostream &o, Sonic_CodeGen
 }
 
 
+void SonicParse_Expression_Local::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
+{
+    if (x.generatingComment)
+    {
+        o << name.queryToken();
+        return;
+    }
+
+    // See SonicParse_Statement_MultiAssignment::generateValues().
+    const int k = x.whereScope ? x.whereScope->findLocal(name) : -1;
+    if (k < 0)
+        throw SonicParseException("internal error: 'where' name used outside its statement", name);
+
+    o << TEMPORARY_PREFIX << x.whereScope->queryLocalTag(k);
+    if (x.channelLoop)
+        o << "[c]";
+    else
+        o << "[" << x.channelValue << "]";
+}
+
+
 SonicType SonicParse_Expression_WaveField::determineType() const
 {
-    if (field == "max")
+    if (IsStatisticField(field))
         return STYPE_REAL;
     else
         return STYPE_INTEGER;
@@ -1210,9 +4382,18 @@ SonicType SonicParse_Expression_WaveField::determineType() const
 
 void SonicParse_Expression_WaveField::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
+    if (generateHoisted(o, x))
+        return;
+
     if (x.generatingComment)
     {
         o << varName.queryToken() << "." << field.queryToken();
+        if (channel)
+        {
+            o << "[";
+            channel->generateCode(o, x);
+            o << "]";
+        }
     }
     else
     {
@@ -1227,8 +4408,22 @@ void SonicParse_Expression_WaveField::generateCode(std::ostream &o, Sonic_CodeGe
             o << LOCAL_SYMBOL_PREFIX << varName.queryToken();
             if (field == "n")
                 o << ".queryNumSamples()";
-            else if (field == "max")
+            else if (field == "max" && !channel)
                 o << ".queryMaxValue()";
+            else if (IsStatisticField(field))
+            {
+                o << (field == "rms" ? ".queryRms(" : ".queryPeak(");
+                if (channel)
+                {
+                    o << "int(";
+                    channel->generateCode(o, x);
+                    o << ")";
+                }
+                else
+                    o << "-1";
+
+                o << ")";
+            }
             else
                 throw SonicParseException("unknown wave field", field);
         }
@@ -1238,6 +4433,9 @@ void SonicParse_Expression_WaveField::generateCode(std::ostream &o, Sonic_CodeGe
 
 void SonicParse_Expression_UnaryOp::generateCode(std::ostream &o, Sonic_CodeGenContext &x)
 {
+    if (generateHoisted(o, x))
+        return;
+
     o << op.queryToken();
     if (child->operatorPrecedence() <= operatorPrecedence())
     {
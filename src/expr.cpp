@@ -155,7 +155,7 @@ public:
             if (ep->getFirstToken() == "c")
                 ++numChannelDependencies;
         }
-        else if (etype == ETYPE_OLD_DATA || etype == ETYPE_IIR)
+        else if (etype == ETYPE_OLD_DATA || etype == ETYPE_IIR || etype == ETYPE_LOCAL)
         {
             ++numChannelDependencies;
         }
@@ -182,6 +182,214 @@ bool SonicParse_Expression::isChannelDependent() const
 //------------------------------------------------------------------------------------
 
 
+class Sonic_ExpressionVisitor_SampleDependent: public Sonic_ExpressionVisitor
+{
+public:
+    Sonic_ExpressionVisitor_SampleDependent():
+        numSampleDependencies(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        switch (ep->queryExpressionType())
+        {
+        case ETYPE_BUILTIN:
+            if (ep->getFirstToken() == "i" || ep->getFirstToken() == "t")
+                ++numSampleDependencies;
+            break;
+
+        case ETYPE_WAVE_EXPR:
+        case ETYPE_OLD_DATA:
+        case ETYPE_SINEWAVE:
+        case ETYPE_SAWTOOTH:
+        case ETYPE_FFT:
+        case ETYPE_IIR:
+        case ETYPE_LOCAL:
+            ++numSampleDependencies;
+            break;
+
+        case ETYPE_FUNCTION_CALL:
+            // User and import functions may keep state; noise never repeats.
+            if (!((const SonicParse_Expression_FunctionCall *)ep)->isIntrinsic() ||
+                ((const SonicParse_Expression_FunctionCall *)ep)->isNoise())
+                ++numSampleDependencies;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    int queryNumSampleDependencies() const
+    {
+        return numSampleDependencies;
+    }
+
+private:
+    int numSampleDependencies;
+};
+
+
+bool SonicParse_Expression::isSampleInvariant() const
+{
+    Sonic_ExpressionVisitor_SampleDependent  visitor;
+    visit(visitor);
+    return visitor.queryNumSampleDependencies() == 0;
+}
+
+
+bool SonicParse_Expression::isSampleOffset() const
+{
+    if (exprType == ETYPE_BUILTIN)
+        return getFirstToken() == "i";
+
+    if (exprType == ETYPE_BINARY_OP)
+    {
+        const SonicParse_Expression_BinaryOp *bp = (const SonicParse_Expression_BinaryOp *) this;
+        const SonicParse_Expression *left  = bp->queryLeft();
+        const SonicParse_Expression *right = bp->queryRight();
+
+        if (bp->queryOp() == "+")
+        {
+            return
+                (left->isSampleOffset() && right->isSampleInvariant()) ||
+                (left->isSampleInvariant() && right->isSampleOffset());
+        }
+
+        if (bp->queryOp() == "-")
+            return left->isSampleOffset() && right->isSampleInvariant();
+    }
+
+    return false;
+}
+
+
+bool SonicParse_Expression::isLinearInTime() const
+{
+    if (isSampleInvariant())
+        return !isChannelDependent();
+
+    if (exprType == ETYPE_BUILTIN)
+        return getFirstToken() == "i" || getFirstToken() == "t";
+
+    if (exprType == ETYPE_UNARY_OP)
+    {
+        const SonicParse_Expression_UnaryOp *up = (const SonicParse_Expression_UnaryOp *) this;
+        return up->queryOp() == "-" && up->queryChild()->isLinearInTime();
+    }
+
+    if (exprType == ETYPE_BINARY_OP)
+    {
+        const SonicParse_Expression_BinaryOp *bp = (const SonicParse_Expression_BinaryOp *) this;
+        const SonicParse_Expression *left  = bp->queryLeft();
+        const SonicParse_Expression *right = bp->queryRight();
+        const bool leftScale  = left->isSampleInvariant() && !left->isChannelDependent();
+        const bool rightScale = right->isSampleInvariant() && !right->isChannelDependent();
+
+        if (bp->queryOp() == "+" || bp->queryOp() == "-")
+            return left->isLinearInTime() && right->isLinearInTime();
+
+        if (bp->queryOp() == "*")
+            return (left->isLinearInTime() && rightScale) || (leftScale && right->isLinearInTime());
+
+        // Integer division rounds.
+        if (bp->queryOp() == "/")
+            return left->isLinearInTime() && rightScale && determineType() == STYPE_REAL;
+    }
+
+    return false;
+}
+
+
+static bool IsZeroPreservingIntrinsic(const SonicToken &name)
+{
+    // single-argument intrinsics for which f(0) == 0
+    static const char * const table[] =
+    {
+        "sin", "sinh", "tan", "tanh", "asin", "atan",
+        "abs", "ceil", "floor", "sqrt", "square", "cube", "quart",
+        0
+    };
+
+    for (int k=0; table[k]; ++k)
+        if (name == table[k])
+            return true;
+
+    return false;
+}
+
+
+bool SonicParse_Expression::isZeroPreserving() const
+{
+    switch (exprType)
+    {
+    case ETYPE_WAVE_EXPR:
+        {
+            const SonicParse_Expression_WaveExpr *wp = (const SonicParse_Expression_WaveExpr *) this;
+            return
+                wp->queryIndexTerm()->isSampleOffset() &&
+                !wp->queryIndexTerm()->isChannelDependent();
+        }
+
+    case ETYPE_VECTOR:
+        {
+            const SonicParse_Expression *ep = ((const SonicParse_Expression_Vector *) this)->getComponentList();
+            for (; ep; ep = ep->queryNext())
+                if (!ep->isZeroPreserving())
+                    return false;
+
+            return true;
+        }
+
+    case ETYPE_BINARY_OP:
+        {
+            const SonicParse_Expression_BinaryOp *bp = (const SonicParse_Expression_BinaryOp *) this;
+            const SonicParse_Expression *left  = bp->queryLeft();
+            const SonicParse_Expression *right = bp->queryRight();
+
+            if (bp->queryOp() == "+" || bp->queryOp() == "-")
+                return left->isZeroPreserving() && right->isZeroPreserving();
+
+            if (bp->queryOp() == "*")
+            {
+                // Scaling by a gain is fine, but not by anything that has
+                // to be evaluated at every sample, such as an oscillator.
+                return
+                    (left->isZeroPreserving() && (right->isZeroPreserving() || right->isSampleInvariant())) ||
+                    (left->isSampleInvariant() && right->isZeroPreserving());
+            }
+
+            if (bp->queryOp() == "/")
+                return left->isZeroPreserving() && right->isSampleInvariant();
+        }
+        return false;
+
+    case ETYPE_UNARY_OP:
+        {
+            const SonicParse_Expression_UnaryOp *up = (const SonicParse_Expression_UnaryOp *) this;
+            return up->queryOp() == "-" && up->queryChild()->isZeroPreserving();
+        }
+
+    case ETYPE_FUNCTION_CALL:
+        {
+            const SonicParse_Expression_FunctionCall *fp = (const SonicParse_Expression_FunctionCall *) this;
+            const SonicParse_Expression *parm = fp->queryParmList();
+            return
+                fp->isIntrinsic() &&
+                IsZeroPreservingIntrinsic(fp->getFirstToken()) &&
+                parm && !parm->queryNext() &&
+                parm->isZeroPreserving();
+        }
+
+    default:
+        return false;
+    }
+}
+
+
+//------------------------------------------------------------------------------------
+
+
 bool SonicParse_Expression::canConvertTo(SonicType target) const
 {
     return CanConvertTo(determineType(), target);
@@ -542,10 +750,26 @@ SonicParse_Expression *SonicParse_Expression::Parse_t3(
         else if (t2 == ".")
         {
             scanner.getToken(t2);
-            if (t2 == "n" || t2 == "m" || t2 == "r" || t2 == "max")
-                expr = new SonicParse_Expression_WaveField(t, t2);
+            SonicToken field = t2;
+            if (SonicParse_Expression_WaveField::IsStatisticField(field))
+            {
+                // Statistics may be followed by a channel selector: x.rms[c]
+                SonicParse_Expression *channel = 0;
+                scanner.getToken(t2);
+                if (t2 == "[")
+                {
+                    channel = Parse_term(scanner, px);
+                    scanner.scanExpected("]");
+                }
+                else
+                    scanner.pushToken(t2);
+
+                expr = new SonicParse_Expression_WaveField(t, field, channel);
+            }
+            else if (field == "n" || field == "m" || field == "r")
+                expr = new SonicParse_Expression_WaveField(t, field, 0);
             else
-                throw SonicParseException("expected wave field after '.'", t2);
+                throw SonicParseException("expected wave field after '.'", field);
         }
         else if (t2 == "(")
         {
@@ -679,7 +903,10 @@ SonicParse_Expression *SonicParse_Expression::Parse_t3(
         else
         {
             scanner.pushToken(t2);
-            expr = new SonicParse_Expression_Variable(t);
+            if (px.insideWhereScope && !px.findVar(t, false))
+                expr = new SonicParse_Expression_Local(t);
+            else
+                expr = new SonicParse_Expression_Variable(t);
         }
     }
     else if (t == "(")
@@ -860,13 +1087,31 @@ void SonicParse_Expression_OldData::getWaveSymbolList(
 }
 
 
+SonicParse_Expression_WaveField::~SonicParse_Expression_WaveField()
+{
+    if (channel)
+    {
+        delete channel;
+        channel = 0;
+    }
+}
+
+
+bool SonicParse_Expression_WaveField::IsStatisticField(const SonicToken &field)
+{
+    return field == "max" || field == "peak" || field == "rms";
+}
+
+
 void SonicParse_Expression_WaveField::getWaveSymbolList(
     const SonicToken *waveSymbol[],
     int maxWaveSymbols,
     int &numSoFar,
-    int & /*numOccurrences*/)
+    int &numOccurrences)
 {
     Append(waveSymbol, maxWaveSymbols, numSoFar, varName);
+    if (channel)
+        channel->getWaveSymbolList(waveSymbol, maxWaveSymbols, numSoFar, numOccurrences);
 }
 
 //----------------------------------------------------------------------------
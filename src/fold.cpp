@@ -0,0 +1,647 @@
+/*===========================================================================
+
+    fold.cpp  -  Sonic translator
+
+    Constant folding and algebraic simplification.
+
+    After validation, every expression whose operands are all known at
+    translate time is replaced by a single constant, so that something
+    like '2*pi*(1+3)' costs nothing inside a wave loop.  The built-in
+    symbols pi, e, r, m and interpolate count as constants:  the
+    generated program defines them from values known now.
+
+    Operations that leave their other operand as it was, such as 'x*1',
+    'x/1', 'x+0', '0+x', 'x-0', 'x^1', 'true & x', 'false | x' and
+    '-(-x)', are replaced by that operand when its type is the same as
+    the result's.  Nothing else is thrown away:  'x*0' stays as written,
+    because x may be infinite, or a call with side effects.
+
+    Folding follows C++ semantics exactly:  integer division truncates,
+    and anything that would divide by zero, overflow, or come out
+    infinite or NaN is left for run time.
+
+    The comment that introduces each wave or array assignment in the
+    generated code still shows the statement as written:  its text is
+    kept from before folding.  Variable initializers, which run once,
+    are not folded at all.
+
+===========================================================================*/
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#include "scan.h"
+#include "parse.h"
+
+
+struct Sonic_FoldValue
+{
+    SonicTypeClass  type;       // STYPE_INTEGER, STYPE_REAL or STYPE_BOOLEAN
+    long            ivalue;     // for integer and boolean
+    double          rvalue;     // for all three
+};
+
+
+static bool QueryFoldValue(
+    const SonicParse_Expression *ep,
+    const SonicParse_Program &prog,
+    Sonic_FoldValue &v)
+{
+    const SonicToken &token = ep->getFirstToken();
+
+    if (ep->queryExpressionType() == ETYPE_CONSTANT)
+    {
+        SonicType type = ep->determineType();
+        if (type == STYPE_INTEGER)
+        {
+            char *end = 0;
+            v.type = STYPE_INTEGER;
+            v.ivalue = strtol(token.queryToken(), &end, 10);
+            v.rvalue = double(v.ivalue);
+            return end && *end == '\0';
+        }
+
+        if (type == STYPE_REAL)
+        {
+            v.type = STYPE_REAL;
+            v.rvalue = atof(token.queryToken());
+            return true;
+        }
+
+        return false;
+    }
+
+    if (ep->queryExpressionType() != ETYPE_BUILTIN)
+        return false;
+
+    // These must match the definitions SonicParse_Program::generateCode() writes.
+    if (token == "pi" || token == "e")
+    {
+        v.type = STYPE_REAL;
+        v.rvalue = (token == "pi") ? (4.0 * atan(1.0)) : exp(1.0);
+    }
+    else if (token == "r" || token == "m")
+    {
+        v.type = STYPE_INTEGER;
+        v.ivalue = (token == "r") ? prog.querySamplingRate() : prog.queryNumChannels();
+        v.rvalue = double(v.ivalue);
+    }
+    else if (token == "true" || token == "false" || token == "interpolate")
+    {
+        v.type = STYPE_BOOLEAN;
+        if (token == "interpolate")
+            v.ivalue = prog.queryInterpolateFlag() ? 1 : 0;
+        else
+            v.ivalue = (token == "true") ? 1 : 0;
+        v.rvalue = double(v.ivalue);
+    }
+    else
+        return false;
+
+    return true;
+}
+
+
+static SonicParse_Expression *MakeConstant(
+    const Sonic_FoldValue &v,
+    const SonicToken &where,
+    SonicTypeClass declared = STYPE_UNDEFINED)
+{
+    // Returns NULL if the value cannot be written as a literal.
+    // The literal is written for v.type; the constant claims
+    // to be of type 'declared', if given.
+    char text [64];
+    SonicToken token;
+
+    if (v.type == STYPE_BOOLEAN)
+    {
+        token.define(v.ivalue ? "true" : "false", where.queryLine(), where.queryColumn(), STT_BUILTIN);
+        return new SonicParse_Expression_Builtin(token);
+    }
+
+    if (v.type == STYPE_INTEGER)
+    {
+        // Keep clear of the ends of the range, where C++ would overflow.
+        if (v.ivalue < -(LONG_MAX/2) || v.ivalue > LONG_MAX/2)
+            return 0;
+
+        sprintf(text, "%ld", v.ivalue);
+    }
+    else
+    {
+        if (!(v.rvalue - v.rvalue == 0.0))
+            return 0;   // infinite or NaN
+
+        // 17 significant digits always read back as the same double.
+        sprintf(text, "%.17g", v.rvalue);
+        if (!strpbrk(text, ".eE"))
+            strcat(text, ".0");
+    }
+
+    token.define(text, where.queryLine(), where.queryColumn(), STT_CONSTANT);
+    return new SonicParse_Expression_Constant(token, (declared == STYPE_UNDEFINED) ? v.type : declared);
+}
+
+
+static bool IsFoldValue(
+    const SonicParse_Expression *ep,
+    const SonicParse_Program &prog,
+    double value)
+{
+    Sonic_FoldValue v;
+    return
+        QueryFoldValue(ep, prog, v) &&
+        v.type != STYPE_BOOLEAN &&
+        v.rvalue == value;
+}
+
+
+static bool FitsLong(double x)
+{
+    return x >= -double(LONG_MAX/2) && x <= double(LONG_MAX/2);
+}
+
+
+static bool QueryPowerOperand(
+    const SonicParse_Expression *ep,
+    const SonicParse_Program &prog,
+    Sonic_FoldValue &v)
+{
+    // As QueryFoldValue(), but also reads an integer power folded before,
+    // which is a real literal claiming the integer type:  as an operand of
+    // another power, its value is all that matters.
+    if (QueryFoldValue(ep, prog, v))
+        return true;
+
+    if (ep->queryExpressionType() != ETYPE_CONSTANT || ep->determineType() != STYPE_INTEGER)
+        return false;
+
+    char *end = 0;
+    v.type = STYPE_REAL;
+    v.rvalue = strtod(ep->getFirstToken().queryToken(), &end);
+    return end && *end == '\0';
+}
+
+
+//---------------------------------------------------------------------------
+
+
+SonicParse_Expression *SonicParse_Expression::Fold(
+    SonicParse_Expression *ep,
+    const SonicParse_Program &prog)
+{
+    if (!ep)
+        return 0;
+
+    ep->foldChildren(prog);
+
+    SonicParse_Expression *folded = ep->simplify(prog);
+    if (folded != ep)
+    {
+        // Whatever of 'ep' the result reuses, simplify() has detached.
+        folded->next = ep->next;
+        ep->next = 0;
+        delete ep;
+    }
+
+    return folded;
+}
+
+
+SonicParse_Expression *SonicParse_Expression::FoldList(
+    SonicParse_Expression *list,
+    const SonicParse_Program &prog)
+{
+    SonicParse_Expression *head = 0;
+    SonicParse_Expression **link = &head;
+    while (list)
+    {
+        SonicParse_Expression *rest = list->next;
+        list = Fold(list, prog);
+        *link = list;
+        link = &list->next;
+        list = rest;
+    }
+
+    return head;
+}
+
+
+SonicParse_Expression *SonicParse_Expression_BinaryOp::simplify(const SonicParse_Program &prog)
+{
+    Sonic_FoldValue left, right, result;
+    const bool leftKnown  = (op == "^") ? QueryPowerOperand(lchild, prog, left)  : QueryFoldValue(lchild, prog, left);
+    const bool rightKnown = (op == "^") ? QueryPowerOperand(rchild, prog, right) : QueryFoldValue(rchild, prog, right);
+    const SonicType type = determineType();
+
+    if (leftKnown && rightKnown)
+    {
+        const bool integer = (left.type == STYPE_INTEGER && right.type == STYPE_INTEGER);
+        result.type = type.queryTypeClass();
+        result.ivalue = 0;
+        result.rvalue = 0.0;
+
+        if (op == "+" || op == "-" || op == "*")
+        {
+            double x;
+            if (op == "+")
+                x = left.rvalue + right.rvalue;
+            else if (op == "-")
+                x = left.rvalue - right.rvalue;
+            else
+                x = left.rvalue * right.rvalue;
+
+            if (integer)
+            {
+                if (!FitsLong(x))
+                    return this;
+
+                if (op == "+")
+                    result.ivalue = left.ivalue + right.ivalue;
+                else if (op == "-")
+                    result.ivalue = left.ivalue - right.ivalue;
+                else
+                    result.ivalue = left.ivalue * right.ivalue;
+            }
+            result.rvalue = integer ? double(result.ivalue) : x;
+        }
+        else if (op == "/" || op == "%")
+        {
+            if (right.rvalue == 0.0)
+                return this;
+
+            if (integer)
+            {
+                result.ivalue = (op == "/") ? (left.ivalue / right.ivalue) : (left.ivalue % right.ivalue);
+                result.rvalue = double(result.ivalue);
+            }
+            else
+                result.rvalue = (op == "/") ? (left.rvalue / right.rvalue) : fmod(left.rvalue, right.rvalue);
+        }
+        else if (op == "^")
+        {
+            result.rvalue = pow(left.rvalue, right.rvalue);
+            if (type == STYPE_INTEGER)
+            {
+                // Sonic calls an integer power an integer, but the code
+                // generated for it computes a double, as in '(2^3)/3'.
+                // A real literal claiming the integer type keeps both;
+                // only another power folds it further.  One that is not
+                // a whole number, or is too big for a long, is left for
+                // run time.
+                if (!FitsLong(result.rvalue) || result.rvalue != floor(result.rvalue))
+                    return this;
+
+                result.type = STYPE_REAL;
+                SonicParse_Expression *constant = MakeConstant(result, getFirstToken(), STYPE_INTEGER);
+                return constant ? constant : this;
+            }
+        }
+        else if (op == "&" || op == "|")
+        {
+            if (op == "&")
+                result.ivalue = (left.ivalue && right.ivalue) ? 1 : 0;
+            else
+                result.ivalue = (left.ivalue || right.ivalue) ? 1 : 0;
+        }
+        else
+        {
+            // Compare integers as integers:  a double cannot hold every long.
+            int order;
+            if (integer || left.type == STYPE_BOOLEAN)
+                order = (left.ivalue < right.ivalue) ? -1 : (left.ivalue > right.ivalue);
+            else
+                order = (left.rvalue < right.rvalue) ? -1 : (left.rvalue > right.rvalue);
+
+            if (op == "==")
+                result.ivalue = (order == 0);
+            else if (op == "!=" || op == "<>")
+                result.ivalue = (order != 0);
+            else if (op == "<")
+                result.ivalue = (order < 0);
+            else if (op == "<=")
+                result.ivalue = (order <= 0);
+            else if (op == ">")
+                result.ivalue = (order > 0);
+            else if (op == ">=")
+                result.ivalue = (order >= 0);
+            else
+                return this;
+        }
+
+        if (result.type == STYPE_BOOLEAN)
+            result.rvalue = double(result.ivalue);
+
+        SonicParse_Expression *constant = MakeConstant(result, getFirstToken());
+        return constant ? constant : this;
+    }
+
+    // An operand left as it was replaces the whole, if its type is the result's.
+    SonicParse_Expression *keep = 0;
+    if (op == "+")
+    {
+        if (IsFoldValue(rchild, prog, 0.0))
+            keep = lchild;
+        else if (IsFoldValue(lchild, prog, 0.0))
+            keep = rchild;
+    }
+    else if (op == "-")
+    {
+        if (IsFoldValue(rchild, prog, 0.0))
+            keep = lchild;
+    }
+    else if (op == "*")
+    {
+        if (IsFoldValue(rchild, prog, 1.0))
+            keep = lchild;
+        else if (IsFoldValue(lchild, prog, 1.0))
+            keep = rchild;
+    }
+    else if (op == "/")
+    {
+        if (IsFoldValue(rchild, prog, 1.0))
+            keep = lchild;
+    }
+    else if (op == "^")
+    {
+        // Only a real power:  an integer one still computes a double.
+        if (type == STYPE_REAL && IsFoldValue(rchild, prog, 1.0))
+            keep = lchild;
+    }
+    else if (op == "&")
+    {
+        if (rightKnown && right.type == STYPE_BOOLEAN && right.ivalue)
+            keep = lchild;
+        else if (leftKnown && left.type == STYPE_BOOLEAN && left.ivalue)
+            keep = rchild;
+    }
+    else if (op == "|")
+    {
+        if (rightKnown && right.type == STYPE_BOOLEAN && !right.ivalue)
+            keep = lchild;
+        else if (leftKnown && left.type == STYPE_BOOLEAN && !left.ivalue)
+            keep = rchild;
+    }
+
+    if (!keep || keep->determineType() != type)
+        return this;
+
+    if (keep == lchild)
+        lchild = 0;
+    else
+        rchild = 0;
+
+    return keep;
+}
+
+
+SonicParse_Expression *SonicParse_Expression_UnaryOp::simplify(const SonicParse_Program &prog)
+{
+    Sonic_FoldValue v;
+    if (QueryFoldValue(child, prog, v))
+    {
+        if (op == "-" && v.type != STYPE_BOOLEAN)
+        {
+            v.ivalue = -v.ivalue;
+            v.rvalue = -v.rvalue;
+        }
+        else if (op == "!" && v.type == STYPE_BOOLEAN)
+        {
+            v.ivalue = !v.ivalue;
+            v.rvalue = double(v.ivalue);
+        }
+        else
+            return this;
+
+        SonicParse_Expression *constant = MakeConstant(v, getFirstToken());
+        if (!constant)
+            return this;
+
+        // Unlike a binary operator, a unary one does not own its operand.
+        delete child;
+        child = 0;
+        return constant;
+    }
+
+    // -(-x) and !(!x)
+    if (child->queryExpressionType() == ETYPE_UNARY_OP)
+    {
+        SonicParse_Expression_UnaryOp *inner = (SonicParse_Expression_UnaryOp *) child;
+        if (inner->op == op)
+        {
+            SonicParse_Expression *keep = inner->child;
+            inner->child = 0;
+            delete inner;
+            child = 0;
+            return keep;
+        }
+    }
+
+    return this;
+}
+
+
+static double Fold_Square(double x)     { return x * x; }
+static double Fold_Cube(double x)       { return x * x * x; }
+static double Fold_Quart(double x)      { double x2 = x*x; return x2*x2; }
+static double Fold_Recip(double x)      { return 1.0 / x; }
+static double Fold_dB(double x)         { return pow(10.0, x/20.0); }
+
+
+SonicParse_Expression *SonicParse_Expression_FunctionCall::simplify(const SonicParse_Program &prog)
+{
+    // Intrinsics of constants, by the C++ names validate() gave them,
+    // computed here with the same library functions.  Not noise().
+    static const struct
+    {
+        const char  *cname;
+        double      (*f1) (double);
+        double      (*f2) (double, double);
+    }
+    table[] =
+    {
+        {"sin",     sin,    0},
+        {"sinh",    sinh,   0},
+        {"cos",     cos,    0},
+        {"cosh",    cosh,   0},
+        {"tan",     tan,    0},
+        {"tanh",    tanh,   0},
+        {"acos",    acos,   0},
+        {"asin",    asin,   0},
+        {"atan",    atan,   0},
+        {"atan2",   0,      atan2},
+        {"fabs",    fabs,   0},
+        {"ceil",    ceil,   0},
+        {"floor",   floor,  0},
+        {"sqrt",    sqrt,   0},
+        {"_hypot",  0,      hypot},
+        {"Sonic_Square",    Fold_Square,    0},
+        {"Sonic_Cube",      Fold_Cube,      0},
+        {"Sonic_Quart",     Fold_Quart,     0},
+        {"Sonic_Recip",     Fold_Recip,     0},
+        {"log",     log,    0},
+        {"log10",   log10,  0},
+        {"exp",     exp,    0},
+        {"Sonic_dB",        Fold_dB,        0},
+        {0, 0, 0}
+    };
+
+    if (!isIntrinsic())
+        return this;
+
+    Sonic_FoldValue arg [2];
+    int numArgs = 0;
+    for (const SonicParse_Expression *pp = parmList; pp; pp = pp->queryNext())
+    {
+        if (numArgs == 2 || !QueryFoldValue(pp, prog, arg[numArgs]) || arg[numArgs].type == STYPE_BOOLEAN)
+            return this;
+        ++numArgs;
+    }
+
+    for (int k=0; table[k].cname; ++k)
+    {
+        if (name == table[k].cname)
+        {
+            Sonic_FoldValue result;
+            result.type = STYPE_REAL;
+            result.ivalue = 0;
+            if (table[k].f1 && numArgs == 1)
+                result.rvalue = table[k].f1(arg[0].rvalue);
+            else if (table[k].f2 && numArgs == 2)
+                result.rvalue = table[k].f2(arg[0].rvalue, arg[1].rvalue);
+            else
+                return this;
+
+            if (determineType() != STYPE_REAL)
+                return this;
+
+            SonicParse_Expression *constant = MakeConstant(result, getFirstToken());
+            return constant ? constant : this;
+        }
+    }
+
+    return this;
+}
+
+
+//---------------------------------------------------------------------------
+
+
+void SonicParse_Statement_Compound::fold(const SonicParse_Program &prog)
+{
+    for (SonicParse_Statement *sp = compound; sp; sp = sp->next)
+        sp->fold(prog);
+}
+
+
+void SonicParse_Statement_FunctionCall::fold(const SonicParse_Program &prog)
+{
+    call->foldChildren(prog);
+}
+
+
+void SonicParse_Statement_If::fold(const SonicParse_Program &prog)
+{
+    condition = SonicParse_Expression::Fold(condition, prog);
+    ifPart->fold(prog);
+    if (elsePart)
+        elsePart->fold(prog);
+}
+
+
+void SonicParse_Statement_Repeat::fold(const SonicParse_Program &prog)
+{
+    count = SonicParse_Expression::Fold(count, prog);
+    loop->fold(prog);
+}
+
+
+void SonicParse_Statement_For::fold(const SonicParse_Program &prog)
+{
+    if (init)
+        init->fold(prog);
+    condition = SonicParse_Expression::Fold(condition, prog);
+    if (update)
+        update->fold(prog);
+    loop->fold(prog);
+}
+
+
+void SonicParse_Statement_While::fold(const SonicParse_Program &prog)
+{
+    condition = SonicParse_Expression::Fold(condition, prog);
+    loop->fold(prog);
+}
+
+
+void SonicParse_Statement_Return::fold(const SonicParse_Program &prog)
+{
+    returnValue = SonicParse_Expression::Fold(returnValue, prog);
+}
+
+
+void SonicParse_Lvalue::fold(const SonicParse_Program &prog)
+{
+    sampleStart = SonicParse_Expression::Fold(sampleStart, prog);
+    sampleLimit = SonicParse_Expression::Fold(sampleLimit, prog);
+    indexList = SonicParse_Expression::FoldList(indexList, prog);
+}
+
+
+static char *CaptureEcho(
+    const SonicParse_Program &prog,
+    SonicParse_Statement_Assignment *ap,
+    SonicParse_Statement_MultiAssignment *mp)
+{
+    std::ostringstream text;
+    Sonic_CodeGenContext x(const_cast<SonicParse_Program *>(&prog));
+    if (ap)
+        ap->generateEcho(text, x);
+    else
+        mp->generateEcho(text, x);
+    return CopyString(text.str().c_str());
+}
+
+
+void SonicParse_Statement_Assignment::fold(const SonicParse_Program &prog)
+{
+    DeleteString(echo);
+    echo = CaptureEcho(prog, this, 0);
+
+    lvalue->fold(prog);
+    rvalue = SonicParse_Expression::Fold(rvalue, prog);
+}
+
+
+void SonicParse_Statement_MultiAssignment::fold(const SonicParse_Program &prog)
+{
+    DeleteString(echo);
+    echo = CaptureEcho(prog, 0, this);
+
+    sampleLimit = SonicParse_Expression::Fold(sampleLimit, prog);
+    localList = SonicParse_Expression::FoldList(localList, prog);
+    componentList = SonicParse_Expression::FoldList(componentList, prog);
+}
+
+
+void SonicParse_Function::fold(const SonicParse_Program &prog)
+{
+    for (SonicParse_Statement *sp = statementList; sp; sp = sp->next)
+        sp->fold(prog);
+}
+
+
+void SonicParse_Program::fold()
+{
+    programBody->fold(*this);
+
+    for (SonicParse_Function *fp = functionBodyList; fp; fp = fp->next)
+        fp->fold(*this);
+}
+
+
+/*--- end of file fold.cpp ---*/
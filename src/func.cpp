@@ -50,6 +50,20 @@ SonicType ParseType(SonicScanner &scanner, SonicParseContext &px)
     SonicToken t;
     scanner.getToken(t);
 
+    SonicWaveAccess access = SWA_DEFAULT;
+    if (t == "in" || t == "out" || t == "inout")
+    {
+        if (!px.insideFuncParms)
+            throw SonicParseException("only parameters may be declared 'in', 'out', or 'inout'", t);
+
+        access = (t == "in") ? SWA_IN : ((t == "out") ? SWA_OUT : SWA_INOUT);
+
+        SonicToken qualifier = t;
+        scanner.getToken(t);
+        if (t != "wave")
+            throw SonicParseException("only wave parameters may be declared 'in', 'out', or 'inout'", qualifier);
+    }
+
     bool arrayAllowed = true;
 
     if (t == "integer")
@@ -61,6 +75,7 @@ SonicType ParseType(SonicScanner &scanner, SonicParseContext &px)
     else if (t == "wave")
     {
         type = STYPE_WAVE;
+        type.setWaveAccess(access);
         arrayAllowed = false;
     }
     else
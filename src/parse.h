@@ -72,6 +72,11 @@ const char * const SONIC_RELEASE_DATE = "23 July 2017";
 class ostream;
 
 const int MAX_SONIC_CHANNELS = 64;   // should be big enough for a while!
+const long MAX_FUSED_HISTORY = 256;  // recent frames kept of a wave computed in another's loop
+const int MAX_WAVE_OUTPUTS = 16;     // waves written by one multi-output wave assignment
+const int MAX_WHERE_LOCALS = 16;     // names it defines with 'where'
+const int MAX_BLOCK_FETCHES = 16;    // blocks of wave frames shared by the reads of one block loop
+const int MAX_BLOCK_FETCH_INDEX = 80;    // length of the index code that tells them apart
 
 class SonicToken;
 class SonicParse_Expression;
@@ -90,6 +95,7 @@ public:
 
     void parse(SonicScanner &);
     void validate();
+    void fold();
     void generateCode();
 
     SonicParse_Function *queryProgramBody() const
@@ -104,6 +110,10 @@ public:
     {
         return importList;
     }
+    SonicParse_VarDecl *queryGlobalVars() const
+    {
+        return globalVars;
+    }
 
     SonicParse_VarDecl  *findSymbol(
         const SonicToken &name,
@@ -178,6 +188,15 @@ enum SonicTypeClass
 };
 
 
+enum SonicWaveAccess     // optional qualifier on wave parameters
+{
+    SWA_DEFAULT,        // no qualifier; same as 'inout'
+    SWA_IN,             // read only
+    SWA_OUT,            // initial contents ignored
+    SWA_INOUT
+};
+
+
 const int MAX_SONIC_ARRAY_DIMENSIONS = 16;
 
 
@@ -188,6 +207,7 @@ public:
         tclass(_tclass),
         name(0),
         referenceFlag(false),
+        waveAccess(SWA_DEFAULT),
         arrayElementClass(STYPE_UNDEFINED),
         numDimensions(0)
     {
@@ -198,6 +218,7 @@ public:
         tclass(STYPE_IMPORT),
         name(importName),
         referenceFlag(false),
+        waveAccess(SWA_DEFAULT),
         arrayElementClass(STYPE_UNDEFINED),
         numDimensions(0)
     {
@@ -208,6 +229,7 @@ public:
         tclass(STYPE_ARRAY),
         name(0),
         referenceFlag(false),
+        waveAccess(SWA_DEFAULT),
         arrayElementClass(_elemClass),
         numDimensions(_numDimensions)
     {
@@ -236,6 +258,14 @@ public:
     {
         return referenceFlag;
     }
+    void setWaveAccess(SonicWaveAccess _access)
+    {
+        waveAccess = _access;
+    }
+    SonicWaveAccess queryWaveAccess() const
+    {
+        return waveAccess;
+    }
     SonicTypeClass queryTypeClass() const
     {
         return tclass;
@@ -266,6 +296,7 @@ private:
     SonicTypeClass  tclass;
     const SonicToken *name;     // used for STYPE_IMPORT
     bool referenceFlag;
+    SonicWaveAccess waveAccess;     // not part of type identity
     int  numDimensions;
     int  arrayDim [MAX_SONIC_ARRAY_DIMENSIONS];
     SonicTypeClass  arrayElementClass;
@@ -289,7 +320,8 @@ enum SonicExpressionType
     ETYPE_FFT,
     ETYPE_IIR,
     ETYPE_OLD_DATA,          // '$' - represents previous value of lvalue[c,i]
-    ETYPE_ARRAY_SUBSCRIPT
+    ETYPE_ARRAY_SUBSCRIPT,
+    ETYPE_LOCAL             // name defined by 'where' in a multi-output wave assignment
 };
 
 
@@ -303,7 +335,8 @@ enum SonicStatementType
     STMT_FOR,
     STMT_REPEAT,
     STMT_COMPOUND,
-    STMT_RETURN
+    STMT_RETURN,
+    STMT_MULTI_ASSIGNMENT
 };
 
 
@@ -313,15 +346,17 @@ struct SonicParseContext
         prog(_prog),
         localVars(0),
         localParms(0),
-        insideFuncParms(false)
+        insideFuncParms(false),
+        insideWhereScope(false)
     {}
 
-    const SonicParse_VarDecl *findVar(const SonicToken &name) const;
+    const SonicParse_VarDecl *findVar(const SonicToken &name, bool forceFind = true) const;
 
     SonicParse_Program &prog;
     const SonicParse_VarDecl *localVars;
     const SonicParse_VarDecl *localParms;
     bool insideFuncParms;
+    bool insideWhereScope;      // undeclared names are 'where' locals of a multi-output assignment
 };
 
 
@@ -336,12 +371,23 @@ public:
 };
 
 
+class SonicParse_Statement;
+
+class Sonic_StatementVisitor
+{
+public:
+    virtual void visitHook(const SonicParse_Statement *) = 0;
+};
+
+
 class SonicParse_Expression
 {
 public:
     SonicParse_Expression(SonicExpressionType _exprType):
         next(0),
-        exprType(_exprType)
+        exprType(_exprType),
+        hoistTag(-1),
+        rampTag(-1)
     {}
 
     virtual ~SonicParse_Expression();
@@ -357,7 +403,22 @@ public:
     }
     static void VisitList(Sonic_ExpressionVisitor &v, SonicParse_Expression *list);
 
+    // Constant folding and algebraic simplification, after validate():
+    // Fold() returns the expression to use in place of the one given,
+    // which it may have deleted.  See fold.cpp.
+    static SonicParse_Expression *Fold(SonicParse_Expression *, const SonicParse_Program &);
+    static SonicParse_Expression *FoldList(SonicParse_Expression *, const SonicParse_Program &);
+    virtual void foldChildren(const SonicParse_Program &) {}
+    virtual SonicParse_Expression *simplify(const SonicParse_Program &)
+    {
+        return this;
+    }
+
     bool isChannelDependent() const;
+    bool isSampleInvariant() const;     // same value for every sample in a wave assignment
+    bool isSampleOffset() const;        // i, i+k, i-k, k+i, where k is sample invariant
+    bool isZeroPreserving() const;      // zero whenever every wave it reads is zero
+    bool isLinearInTime() const;        // a*i + b or a*t + b, where a and b are sample invariant
 
     bool canConvertTo(SonicType) const;
     virtual SonicType determineType() const = 0;
@@ -392,7 +453,15 @@ public:
         int & /*numOccurrences*/)
     {}
 
+    void setHoistTag(int tag)
+    {
+        hoistTag = tag;
+    }
+
 protected:
+    bool generateHoisted(std::ostream &, const Sonic_CodeGenContext &) const;
+    bool generateRampHead(std::ostream &, const Sonic_CodeGenContext &) const;
+
     static SonicParse_Expression *Parse_b1(SonicScanner &, SonicParseContext &);
     static SonicParse_Expression *Parse_b2(SonicScanner &, SonicParseContext &);
     static SonicParse_Expression *Parse_t1(SonicScanner &, SonicParseContext &);
@@ -403,6 +472,8 @@ protected:
     friend class SonicParse_Statement;
     SonicParse_Expression *next;
     SonicExpressionType exprType;
+    int hoistTag;       // temporary holding the value computed before the wave loop, or -1
+    int rampTag;        // SonicExpRamp or SonicPhaseRamp computing the value frame to frame, or -1
 };
 
 
@@ -452,6 +523,10 @@ public:
         v.visitHook(this);
         VisitList(v, exprList);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        exprList = FoldList(exprList, prog);
+    }
 
 private:
     SonicToken lbrace;
@@ -469,7 +544,8 @@ public:
         SonicParse_Expression(ETYPE_WAVE_EXPR),
         waveName(_waveName),
         cterm(_cterm),
-        iterm(_iterm)
+        iterm(_iterm),
+        frameTag(-1)
     {}
 
     virtual ~SonicParse_Expression_WaveExpr();
@@ -497,17 +573,38 @@ public:
         int &numSoFar,
         int &numOccurrences);
 
+    SonicParse_Expression *queryChannelTerm() const
+    {
+        return cterm;
+    }
+    SonicParse_Expression *queryIndexTerm() const
+    {
+        return iterm;
+    }
+    bool interpolates(const Sonic_CodeGenContext &) const;        // reads with interp()
+    bool readsWholeFrame(const Sonic_CodeGenContext &) const;     // [c, same index for every channel]
+    bool readsFrameRun() const;                                   // ... and that index is i + offset
+    bool readsRecentFrame(long &back) const;                      // [c, i - back], 0 <= back < MAX_FUSED_HISTORY
+
     virtual void visit(Sonic_ExpressionVisitor &v) const
     {
         v.visitHook(this);
         cterm->visit(v);
         iterm->visit(v);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        cterm = Fold(cterm, prog);
+        iterm = Fold(iterm, prog);
+    }
 
 private:
     SonicToken waveName;
     SonicParse_Expression *cterm;
     SonicParse_Expression *iterm;
+    int frameTag;               // inside a channel or block loop, the frames were fetched into t_<frameTag>
+
+    bool readsAllChannels() const;
 };
 
 
@@ -553,6 +650,10 @@ public:
         v.visitHook(this);
         SonicParse_Expression::VisitList(v, indexList);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        indexList = FoldList(indexList, prog);
+    }
 
 private:
     SonicToken  arrayVarName;
@@ -678,6 +779,10 @@ public:
         v.visitHook(this);
         frequencyHz->visit(v);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        frequencyHz = Fold(frequencyHz, prog);
+    }
 
 private:
     bool channelDependent;
@@ -748,6 +853,12 @@ public:
         frequencyHz->visit(v);
         phaseDeg->visit(v);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        amplitude = Fold(amplitude, prog);
+        frequencyHz = Fold(frequencyHz, prog);
+        phaseDeg = Fold(phaseDeg, prog);
+    }
 
 private:
     bool channelDependent;
@@ -827,6 +938,11 @@ public:
         input->visit(v);
         fftSize->visit(v);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        input = Fold(input, prog);
+        fftSize = Fold(fftSize, prog);
+    }
 
 private:
     SonicToken  fftToken;
@@ -904,6 +1020,12 @@ public:
         VisitList(v, yCoeffList);
         filterInput->visit(v);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        xCoeffList = FoldList(xCoeffList, prog);
+        yCoeffList = FoldList(yCoeffList, prog);
+        filterInput = Fold(filterInput, prog);
+    }
 
 private:
     SonicToken iirToken;
@@ -997,11 +1119,25 @@ public:
     {
         return ftype == SFT_INTRINSIC;
     }
+    bool isNoise() const
+    {
+        // validate() renames intrinsics after the C++ functions they call.
+        return ftype == SFT_INTRINSIC && name == "Sonic_Noise";
+    }
+    SonicParse_Expression *queryParmList() const
+    {
+        return parmList;
+    }
     virtual void visit(Sonic_ExpressionVisitor &v) const
     {
         v.visitHook(this);
         VisitList(v, parmList);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        parmList = FoldList(parmList, prog);
+    }
+    virtual SonicParse_Expression *simplify(const SonicParse_Program &);
 
 private:
     SonicToken name;
@@ -1038,6 +1174,36 @@ private:
 };
 
 
+class SonicParse_Expression_Local: public SonicParse_Expression
+{
+public:
+    SonicParse_Expression_Local(const SonicToken &_name):
+        SonicParse_Expression(ETYPE_LOCAL),
+        name(_name)
+    {}
+
+    virtual SonicType determineType() const
+    {
+        return STYPE_REAL;
+    }
+    virtual int operatorPrecedence() const
+    {
+        return 100;
+    }
+    virtual void validate(SonicParse_Program &, SonicParse_Function *) {}      // see SonicParse_Statement_MultiAssignment::validate()
+    virtual const SonicToken & getFirstToken() const
+    {
+        return name;
+    }
+    virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void generatePreSampleLoopCode(std::ostream &, Sonic_CodeGenContext &) {}
+    virtual void generatePreChannelLoopCode(std::ostream &, Sonic_CodeGenContext &) {}
+
+private:
+    SonicToken name;
+};
+
+
 class SonicParse_Expression_Variable: public SonicParse_Expression
 {
 public:
@@ -1075,18 +1241,32 @@ class SonicParse_Expression_WaveField: public SonicParse_Expression
 public:
     SonicParse_Expression_WaveField(
         const SonicToken &_varName,
-        const SonicToken &_field):
+        const SonicToken &_field,
+        SonicParse_Expression *_channel):
         SonicParse_Expression(ETYPE_WAVE_FIELD),
         varName(_varName),
-        field(_field)
+        field(_field),
+        channel(_channel)
     {}
 
+    virtual ~SonicParse_Expression_WaveField();
+
+    static bool IsStatisticField(const SonicToken &field);
+    const SonicToken &queryField() const
+    {
+        return field;
+    }
+    SonicParse_Expression *queryChannel() const
+    {
+        return channel;
+    }
+
     virtual SonicType determineType() const;
     virtual int operatorPrecedence() const
     {
         return 100;
     }
-    virtual void validate(SonicParse_Program &, SonicParse_Function *) {}
+    virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual const SonicToken & getFirstToken() const
     {
         return varName;
@@ -1101,9 +1281,22 @@ public:
         int &numSoFar,
         int &numOccurrences);
 
+    virtual void visit(Sonic_ExpressionVisitor &v) const
+    {
+        v.visitHook(this);
+        if (channel)
+            channel->visit(v);
+    }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        if (channel)
+            channel = Fold(channel, prog);
+    }
+
 private:
     SonicToken varName;
     SonicToken field;
+    SonicParse_Expression *channel;     // NULL, or channel selector for 'max', 'peak', 'rms'
 };
 
 
@@ -1126,6 +1319,14 @@ public:
     {
         return op;
     }
+    SonicParse_Expression *queryLeft() const
+    {
+        return lchild;
+    }
+    SonicParse_Expression *queryRight() const
+    {
+        return rchild;
+    }
     virtual bool groupsToRight() const = 0;
     virtual const SonicToken & getFirstToken() const
     {
@@ -1146,6 +1347,12 @@ public:
         lchild->visit(v);
         rchild->visit(v);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        lchild = Fold(lchild, prog);
+        rchild = Fold(rchild, prog);
+    }
+    virtual SonicParse_Expression *simplify(const SonicParse_Program &);
 
 protected:
     SonicToken op;
@@ -1297,6 +1504,7 @@ public:
         return 11;
     }
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void generatePreSampleLoopCode(std::ostream &, Sonic_CodeGenContext &);
 };
 
 
@@ -1319,6 +1527,7 @@ public:
         return 12;
     }
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void generatePreSampleLoopCode(std::ostream &, Sonic_CodeGenContext &);
 };
 
 
@@ -1506,6 +1715,10 @@ public:
     {
         return op;
     }
+    SonicParse_Expression *queryChild() const
+    {
+        return child;
+    }
 
     virtual int operatorPrecedence() const
     {
@@ -1530,6 +1743,11 @@ public:
         v.visitHook(this);
         child->visit(v);
     }
+    virtual void foldChildren(const SonicParse_Program &prog)
+    {
+        child = Fold(child, prog);
+    }
+    virtual SonicParse_Expression *simplify(const SonicParse_Program &);
 
 protected:
     SonicToken op;
@@ -1640,6 +1858,7 @@ private:
 
 
 class SonicParse_Statement_Assignment;
+class SonicParse_Statement_MultiAssignment;
 
 class SonicParse_Statement
 {
@@ -1659,21 +1878,35 @@ public:
 
     static SonicParse_Statement *Parse(SonicScanner &, SonicParseContext &px);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &) = 0;
+    virtual void fold(const SonicParse_Program &) {}
     virtual bool needsBraces() const
     {
         return false;
     }
 
-protected:
+    // visit() reaches this statement and all statements nested inside it;
+    // visitExpressions() reaches the expressions owned by this statement only.
+    virtual void visit(Sonic_StatementVisitor &v) const
+    {
+        v.visitHook(this);
+    }
+    static void VisitList(Sonic_StatementVisitor &v, const SonicParse_Statement *list);
+    virtual void visitExpressions(Sonic_ExpressionVisitor &) const {}
+
     SonicParse_Statement *queryNext() const
     {
         return next;
     }
 
+protected:
     static SonicParse_Statement_Assignment *ParseAssignment(
         SonicScanner &,
         SonicParseContext &);
 
+    static SonicParse_Statement *ParseMultiAssignment(
+        SonicScanner &,
+        SonicParseContext &);
+
 private:
     friend class SonicParse_Function;
     friend class SonicParse_Statement_Compound;
@@ -1703,10 +1936,16 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
     virtual bool needsBraces() const
     {
         return compound && (compound->next || compound->needsBraces());
     }
+    virtual void visit(Sonic_StatementVisitor &v) const
+    {
+        v.visitHook(this);
+        VisitList(v, compound);
+    }
 
 private:
     SonicParse_Statement *compound;
@@ -1740,6 +1979,11 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        call->visit(v);
+    }
 
 private:
     SonicParse_Expression_FunctionCall *call;
@@ -1785,6 +2029,18 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
+    virtual void visit(Sonic_StatementVisitor &v) const
+    {
+        v.visitHook(this);
+        ifPart->visit(v);
+        if (elsePart)
+            elsePart->visit(v);
+    }
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        condition->visit(v);
+    }
 
 private:
     SonicParse_Expression *condition;
@@ -1824,6 +2080,16 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
+    virtual void visit(Sonic_StatementVisitor &v) const
+    {
+        v.visitHook(this);
+        loop->visit(v);
+    }
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        count->visit(v);
+    }
 
 private:
     SonicParse_Expression *count;
@@ -1855,10 +2121,25 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
     virtual bool needsBraces() const
     {
         return true;
     }
+    virtual void visit(Sonic_StatementVisitor &v) const
+    {
+        v.visitHook(this);
+        if (init)
+            init->visit(v);
+        if (update)
+            update->visit(v);
+        loop->visit(v);
+    }
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        if (condition)
+            condition->visit(v);
+    }
 
 private:
     SonicParse_Statement   *init;
@@ -1899,6 +2180,16 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
+    virtual void visit(Sonic_StatementVisitor &v) const
+    {
+        v.visitHook(this);
+        loop->visit(v);
+    }
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        condition->visit(v);
+    }
 
 private:
     SonicParse_Expression *condition;
@@ -1935,6 +2226,12 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        if (returnValue)
+            returnValue->visit(v);
+    }
 
 private:
     SonicToken returnToken;
@@ -1948,16 +2245,24 @@ public:
     SonicParse_Lvalue(
         const SonicToken &_varName,
         bool _isWave,
+        SonicParse_Expression *_sampleStart,
         SonicParse_Expression *_sampleLimit,
         SonicParse_Expression *_indexList):
         varName(_varName),
         isWave(_isWave),
+        sampleStart(_sampleStart),
         sampleLimit(_sampleLimit),
         indexList(_indexList)
     {}
 
     virtual ~SonicParse_Lvalue()
     {
+        if (sampleStart)
+        {
+            delete sampleStart;
+            sampleStart = 0;
+        }
+
         if (sampleLimit)
         {
             delete sampleLimit;
@@ -1979,6 +2284,10 @@ public:
     {
         return isWave;
     }
+    SonicParse_Expression *querySampleStart() const     // NULL unless "i: start .. end"
+    {
+        return sampleStart;
+    }
     SonicParse_Expression *querySampleLimit() const
     {
         return sampleLimit;
@@ -1988,11 +2297,13 @@ public:
         return indexList;
     }
     void validate(SonicParse_Program &, SonicParse_Function *);
+    void fold(const SonicParse_Program &);
     SonicType determineType(SonicParse_Program &, SonicParse_Function *) const;
 
 private:
     SonicToken varName;
     bool isWave;
+    SonicParse_Expression *sampleStart;
     SonicParse_Expression *sampleLimit;
     SonicParse_Expression *indexList;
 };
@@ -2007,11 +2318,19 @@ public:
         SonicParse_Expression *_rvalue):
         op(_op),
         lvalue(_lvalue),
-        rvalue(_rvalue)
+        rvalue(_rvalue),
+        fusedFirst(0),
+        fusedInto(0),
+        fusedTag(-1),
+        fusedEndTag(-1),
+        fusedHistory(1),
+        echo(0)
     {}
 
     virtual ~SonicParse_Statement_Assignment()
     {
+        DeleteString(echo);
+
         if (lvalue)
         {
             delete lvalue;
@@ -2031,17 +2350,185 @@ public:
     }
     virtual void validate(SonicParse_Program &, SonicParse_Function *);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
+    void generateEcho(std::ostream &, Sonic_CodeGenContext &);
+    void generateQuietSkip(std::ostream &, Sonic_CodeGenContext &, bool limited);
+    bool canCheckpointInside() const;
+    bool canSkipQuiet() const;
+    bool readsTarget() const;
+    bool canUseChannelLoop(const Sonic_CodeGenContext &) const;
+    bool canUseFrameBlocks(const Sonic_CodeGenContext &, bool modify, bool &feedback) const;
+    int  generateHoistedValues(std::ostream &, Sonic_CodeGenContext &, SonicParse_Expression *hoisted[], int maxHoisted);
+    bool canCache(Sonic_CodeGenContext &) const;
+    bool canReuse(const SonicToken *waveSymbol[], int numWaveSymbols, bool &stateful) const;
+    const SonicToken *queryWholeCopySource() const;
+    void generateReuseSkip(std::ostream &, Sonic_CodeGenContext &, bool limited);
+    void generateReuseReads(std::ostream &, Sonic_CodeGenContext &, bool stateful);
+    bool canKnowNaturalEnd(const Sonic_CodeGenContext &) const;
+    bool generateNaturalEnd(
+        std::ostream &,
+        Sonic_CodeGenContext &,
+        bool modify,
+        const char *endName = "naturalEnd");
+    bool canCountToNaturalEnd(const Sonic_CodeGenContext &, bool modify) const;
+    bool generateFeedbackLimit(std::ostream &, Sonic_CodeGenContext &);
+    void generateFrameBlock(
+        std::ostream &,
+        Sonic_CodeGenContext &,
+        const char *end,
+        const char * const check[],
+        int numChecks,
+        bool feedback,
+        bool endsLoop);
+    void generatePreviewSkip(std::ostream &, Sonic_CodeGenContext &, const char *end);
+
+    void generateCacheKey(
+        std::ostream &,
+        Sonic_CodeGenContext &,
+        const char *loopCode,
+        int firstTempTag,
+        const SonicToken *waveSymbol[],
+        int numWaveSymbols);
+
+    void generateWaveLoop(
+        std::ostream &,
+        Sonic_CodeGenContext &,
+        const SonicToken *waveSymbol[],
+        int numWaveSymbols,
+        int numOccurrences,
+        bool modify,
+        bool reuse);
+
+    // Loop fusion:  see SonicParse_Function::fuseWaveLoops().
+    const SonicParse_Statement *queryFusionReach(const Sonic_CodeGenContext &) const;
+    bool canEndFusedLoop(const Sonic_CodeGenContext &, const SonicParse_Statement_Assignment *first) const;
+    void fuseLoop(SonicParse_Statement_Assignment *first);
+    SonicParse_Statement_Assignment *findFusedWave(const SonicToken &waveName) const;
+    bool canFuseFrameBlocks(const Sonic_CodeGenContext &) const;
+    bool canPreviewFused() const;
+    bool keepsFusedFeatures(const Sonic_CodeGenContext &) const;
+    void unfuseLoop();
+    int  generateFusedSetup(std::ostream &, Sonic_CodeGenContext &, SonicParse_Expression *hoisted[], int maxHoisted);
+    void generateFusedValues(std::ostream &, Sonic_CodeGenContext &);
+    void generateFusedValue(std::ostream &, Sonic_CodeGenContext &);
+    void generateFusedRead(std::ostream &, Sonic_CodeGenContext &, const SonicParse_Expression_WaveExpr *) const;
+
     virtual bool needsBraces() const
     {
         return
             lvalue->queryIsWave() ||
             rvalue->determineType() == STYPE_ARRAY;
     }
+    const SonicToken &queryOp() const
+    {
+        return op;
+    }
+    SonicParse_Lvalue *queryLvalue() const
+    {
+        return lvalue;
+    }
+    SonicParse_Expression *queryRvalue() const
+    {
+        return rvalue;
+    }
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        if (lvalue->querySampleStart())
+            lvalue->querySampleStart()->visit(v);
+        if (lvalue->querySampleLimit())
+            lvalue->querySampleLimit()->visit(v);
+        SonicParse_Expression::VisitList(v, lvalue->queryIndexList());
+        rvalue->visit(v);
+    }
 
 private:
     SonicToken op;
     SonicParse_Lvalue *lvalue;
     SonicParse_Expression *rvalue;
+
+    // A wave assignment whose result is read only by the next few
+    // statements, near the frame they compute, is computed in the loop of
+    // the last of them instead of being written out and read back.
+    SonicParse_Statement_Assignment *fusedFirst;    // the first such assignment computed in this one's loop, or NULL
+    SonicParse_Statement_Assignment *fusedInto;     // the later assignment whose loop computes this one, or NULL
+    int   fusedTag;             // in that loop, its recent frames are in t_<fusedTag>
+    int   fusedEndTag;          // ... and its length in t_<fusedEndTag>
+    long  fusedHistory;         // frames kept in t_<fusedTag>:  a power of two
+
+    char *echo;                 // the statement as written, for comments; see fold()
+};
+
+
+class SonicParse_Statement_MultiAssignment: public SonicParse_Statement
+{
+    // (a, b, ...)[c,i] = { expr_a, expr_b, ... } where name = expr, ... ;
+    // One loop writes every output wave, each from its own expression.
+    // The names after 'where' are real values computed in order, once per
+    // channel of each frame, before the expressions that use them.
+
+public:
+    SonicParse_Statement_MultiAssignment(
+        const SonicToken &_op,
+        int _numOutputs,
+        const SonicToken _outputName[],
+        SonicParse_Expression *_sampleLimit,
+        SonicParse_Expression *_componentList,
+        int _numLocals,
+        const SonicToken _localName[],
+        SonicParse_Expression *_localList);
+
+    virtual ~SonicParse_Statement_MultiAssignment();
+
+    virtual SonicStatementType queryType() const
+    {
+        return STMT_MULTI_ASSIGNMENT;
+    }
+    virtual void validate(SonicParse_Program &, SonicParse_Function *);
+    virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
+    virtual void fold(const SonicParse_Program &);
+    virtual bool needsBraces() const
+    {
+        return true;
+    }
+    virtual void visitExpressions(Sonic_ExpressionVisitor &v) const
+    {
+        if (sampleLimit)
+            sampleLimit->visit(v);
+        SonicParse_Expression::VisitList(v, localList);
+        SonicParse_Expression::VisitList(v, componentList);
+    }
+
+    int queryNumOutputs() const
+    {
+        return numOutputs;
+    }
+    const SonicToken &queryOutput(int k) const
+    {
+        return outputName[k];
+    }
+    bool writesWave(const SonicToken &waveName) const;
+    void generateEcho(std::ostream &, Sonic_CodeGenContext &);
+    int  findLocal(const SonicToken &name) const;      // index of a 'where' name, or -1
+    int  queryLocalTag(int k) const                     // t_<tag>[c] holds it in the loop
+    {
+        return localTag + k;
+    }
+
+private:
+    void visitLoopExpressions(Sonic_ExpressionVisitor &) const;    // the 'where' values, then the components
+    void generateValues(std::ostream &, Sonic_CodeGenContext &, SonicParse_Expression *list, int firstTag, const char *offset);
+
+private:
+    SonicToken op;
+    int   numOutputs;
+    SonicToken outputName [MAX_WAVE_OUTPUTS];
+    SonicParse_Expression *sampleLimit;         // after 'i:', or NULL
+    SonicParse_Expression *componentList;       // one per output, in the same order
+    int   numLocals;
+    SonicToken localName [MAX_WHERE_LOCALS];
+    SonicParse_Expression *localList;           // the value of each name, in the same order
+    int   localTag;
+    char *echo;                                 // the statement as written, for comments; see fold()
 };
 
 
@@ -2069,6 +2556,7 @@ public:
         return isProgramBody;
     }
     void validate();
+    void fold(const SonicParse_Program &);
     SonicType queryReturnType() const
     {
         return returnType;
@@ -2080,6 +2568,17 @@ public:
     {
         return parmList;
     }
+    SonicParse_Statement *queryStatementList() const
+    {
+        return statementList;
+    }
+    const char *findStreamConflict(const SonicToken &waveName) const;
+    bool writesWave(const SonicToken &waveName) const;
+    bool isPure() const;     // result depends only on the arguments; no side effects
+    bool previewNeedsWholeWave(const SonicToken &waveName) const;
+    bool isLastUseOfWave(const SonicParse_Statement *, const SonicToken &waveName) const;
+    const SonicParse_Statement *findFusionEnd(const SonicParse_Statement *, const SonicToken &waveName) const;
+    void fuseWaveLoops(Sonic_CodeGenContext &);
     virtual void generateCode(std::ostream &, Sonic_CodeGenContext &);
     void generatePrototype(std::ostream &, Sonic_CodeGenContext &);
     int numParameters() const;
@@ -2096,6 +2595,8 @@ public:
 private:
     friend class SonicParse_Program;
 
+    void generateCheckpointSetup(std::ostream &, Sonic_CodeGenContext &);
+
     bool isProgramBody;
     SonicToken name;
     SonicParse_Function *next;   // for linked list of functions
@@ -2127,7 +2628,15 @@ struct Sonic_CodeGenContext
         channelValue(-1),
         prog(_prog),
         func(0),
-        insideVector(false)
+        insideVector(false),
+        channelLoop(false),
+        blockLoop(false),
+        countdown(true),
+        checkpointStatement(0),
+        checkpointStep(0),
+        fusedLoop(0),
+        whereScope(0),
+        numBlockFetches(0)
     {}
 
     void indent(std::ostream &, const char *s = "");
@@ -2139,6 +2648,8 @@ struct Sonic_CodeGenContext
     {
         indentLevel -= SPACES_PER_INDENT;
     }
+    int  findBlockFetch(const SonicToken &waveName, const char *index, bool interp) const;
+    void addBlockFetch(const SonicToken &waveName, const char *index, bool interp, int tag);
 
 public:
     int     indentLevel;                // number of spaces to indent output C++ code
@@ -2152,6 +2663,21 @@ public:
     SonicParse_Program *prog;
     SonicParse_Function *func;
     bool    insideVector;
+    bool    channelLoop;                // one loop over 'c' computes all channels
+    bool    blockLoop;                  // ... for each frame 'i + j' of a block
+    bool    countdown;                  // reads outside their waves count down to the end of the loop
+    const SonicParse_Statement *checkpointStatement;   // program body statement being generated
+    int     checkpointStep;             // ... and its number, counting from 1
+    const SonicParse_Statement_Assignment *fusedLoop;  // wave assignment whose loop also computes others, or NULL
+    const SonicParse_Statement_MultiAssignment *whereScope;   // multi-output assignment whose 'where' names are in use, or NULL
+
+    // Blocks fetched so far for the block loop being generated, so that
+    // reads of the same wave from the same index share one.
+    int     numBlockFetches;
+    const SonicToken *blockFetchWave [MAX_BLOCK_FETCHES];
+    char    blockFetchIndex [MAX_BLOCK_FETCHES] [MAX_BLOCK_FETCH_INDEX];
+    bool    blockFetchInterp [MAX_BLOCK_FETCHES];
+    int     blockFetchTag [MAX_BLOCK_FETCHES];
 };
 
 
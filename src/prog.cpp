@@ -352,6 +352,8 @@ void SonicParse_Program::validate()
 
         vp->validate(*this, 0);
     }
+
+    fold();
 }
 
 
@@ -463,16 +465,20 @@ void SonicParse_Program::genMain(std::ostream &o, Sonic_CodeGenContext &x)
 
     int numProgramParms = programBody->numParameters();
 
+    o << "    argc = ScanOptions ( argc, argv );\n";
     o << "    if ( argc != " << (1 + numProgramParms) << " )\n";
     o << "    {\n";
-    o << "        cerr << \"Use:  " << programBody->queryName().queryToken();
+    o << "        std::cerr << \"Use:  " << programBody->queryName().queryToken();
+    o << " [--resample[=fast|good|best]] [--mix=wave:matrix] [--checkpoint[=seconds]] [--resume]";
+    o << " [--cache[=directory]] [--cache-limit=megabytes] [--input-cache=megabytes] [--threads=N] [--incremental] [--warmup=seconds]";
+    o << " [--from=seconds] [--to=seconds] [--preroll=seconds]";
 
     for (SonicParse_VarDecl *pp = programBody->queryParmList(); pp; pp = pp->queryNext())
     {
         o << " " << pp->queryName().queryToken();
     }
 
-    o << "\" << endl << endl;\n";
+    o << "\" << std::endl << std::endl;\n";
     o << "        return 1;\n";
     o << "    }\n\n";
 
@@ -518,7 +524,22 @@ void SonicParse_Program::genMain(std::ostream &o, Sonic_CodeGenContext &x)
         case STYPE_WAVE:
             o << " ( argv[" << argc << "], ";
             o << '"' << pname << '"';
-            o << ", SamplingRate, NumChannels );\n";
+            o << ", SamplingRate, NumChannels";
+            if (pp->queryType().queryWaveAccess() == SWA_IN)
+                o << ", SWU_IN";
+            else if (pp->queryType().queryWaveAccess() == SWA_OUT)
+                o << ", SWU_OUT";
+            o << " );\n";
+
+            // Whether a wave is bound to a stream is only known at run time,
+            // so pass along the reason, if any, that it must not be.
+            const char *conflict = programBody->findStreamConflict(pp->queryName());
+            if (conflict)
+            {
+                x.indent(o, LOCAL_SYMBOL_PREFIX);
+                o << pname << ".disallowStream ( \"" << conflict << "\" );\n";
+            }
+            break;
         }
     }
 
@@ -539,12 +560,13 @@ void SonicParse_Program::genMain(std::ostream &o, Sonic_CodeGenContext &x)
     o << " );\n\n";
 
     // generate code to convert all float files to permanent WAV files...
+    // 'in' waves are never written, so there is nothing to convert.
 
     argc = 0;
     for (SonicParse_VarDecl *pp = programBody->queryParmList(); pp; pp = pp->queryNext())
     {
         ++argc;
-        if (pp->queryType() == STYPE_WAVE)
+        if (pp->queryType() == STYPE_WAVE && pp->queryType().queryWaveAccess() != SWA_IN)
         {
             o << "    " << LOCAL_SYMBOL_PREFIX << pp->queryName().queryToken();
             o << ".convertToWav ( argv[" << argc << "] );\n";
@@ -589,7 +611,7 @@ const SonicToken & SonicParse_Program::GetCurrentProgramName()
 
 //-----------------------------------------------------------------------------
 
-const SonicParse_VarDecl *SonicParseContext::findVar(const SonicToken &name) const
+const SonicParse_VarDecl *SonicParseContext::findVar(const SonicToken &name, bool forceFind) const
 {
     // First search local variables and parameters...
 
@@ -609,7 +631,7 @@ const SonicParse_VarDecl *SonicParseContext::findVar(const SonicToken &name) con
 
     const SonicParse_VarDecl *vp = prog.findGlobalVar(name);
 
-    if (!vp)
+    if (!vp && forceFind)
         throw SonicParseException("undefined symbol", name);
 
     return vp;
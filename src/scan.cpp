@@ -287,6 +287,13 @@ bool SonicScanner::getToken(SonicToken &t, bool forceGet)
 
             if (tc.c == '.')
             {
+                // "1..5" is a range, not a malformed number.
+                SonicTokenChar dot = get();
+                SonicTokenChar after = peek();
+                pushChar(dot);
+                if (after.c == '.')
+                    break;
+
                 if (++dotCount > 1)
                 {
                     t.define(s, tline, column, STT_CONSTANT);
@@ -328,6 +335,14 @@ bool SonicScanner::getToken(SonicToken &t, bool forceGet)
                 get();
             }
         }
+        else if (tc.c == '.')
+        {
+            if (tc2.c == '.')
+            {
+                accept(s, sizeof(s), index, tc2.c);
+                get();
+            }
+        }
         else if (strchr("+-*/%=>!", tc.c))
         {
             if (tc2.c == '=')
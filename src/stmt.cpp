@@ -39,6 +39,7 @@ SonicParse_Statement_Assignment *SonicParse_Statement::ParseAssignment(
     scanner.getToken(t2);
 
     bool isWaveLvalue = false;
+    SonicParse_Expression *sampleStart = 0;
     SonicParse_Expression *sampleLimit = 0;
     SonicParse_Expression *indexList=0, *indexTail=0;
     if (t2 == "[")
@@ -74,7 +75,19 @@ SonicParse_Statement_Assignment *SonicParse_Statement::ParseAssignment(
 
             scanner.getToken(t2);
             if (t2 == ":")
+            {
                 sampleLimit = SonicParse_Expression::Parse_term(scanner, px);
+
+                // "i: start .. end" patches only that range of the wave.
+                scanner.getToken(t2);
+                if (t2 == "..")
+                {
+                    sampleStart = sampleLimit;
+                    sampleLimit = SonicParse_Expression::Parse_term(scanner, px);
+                }
+                else
+                    scanner.pushToken(t2);
+            }
             else
                 scanner.pushToken(t2);
 
@@ -99,6 +112,7 @@ SonicParse_Statement_Assignment *SonicParse_Statement::ParseAssignment(
     SonicParse_Lvalue *lvalue = new SonicParse_Lvalue(
         t,
         isWaveLvalue,
+        sampleStart,
         sampleLimit,
         indexList);
 
@@ -106,6 +120,136 @@ SonicParse_Statement_Assignment *SonicParse_Statement::ParseAssignment(
 }
 
 
+SonicParse_Statement *SonicParse_Statement::ParseMultiAssignment(
+    SonicScanner &scanner,
+    SonicParseContext &px)
+{
+    // (name, ... , name)[c,i] = { b0, ... , b0 } where name = b0, ... , name = b0
+    // The opening '(' has already been scanned.
+
+    SonicToken t;
+    int numOutputs = 0;
+    SonicToken outputName [MAX_WAVE_OUTPUTS];
+    for (;;)
+    {
+        scanner.getToken(t);
+        if (t.queryTokenType() != STT_IDENTIFIER)
+            throw SonicParseException("expected wave variable name", t);
+
+        const SonicParse_VarDecl *decl = px.findVar(t);
+        if (decl->queryType() != STYPE_WAVE)
+            throw SonicParseException("only wave variables can be assigned together", t);
+
+        if (numOutputs == MAX_WAVE_OUTPUTS)
+            throw SonicParseException("too many waves assigned together", t);
+
+        outputName[numOutputs++] = t;
+        scanner.getToken(t);
+        if (t == ")")
+            break;
+        else if (t != ",")
+            throw SonicParseException("expected ',' or ')'", t);
+    }
+
+    SonicParse_Expression *sampleLimit = 0;
+    scanner.scanExpected("[");
+    scanner.scanExpected("c");
+    scanner.scanExpected(",");
+    scanner.scanExpected("i");
+    scanner.getToken(t);
+    if (t == ":")
+        sampleLimit = SonicParse_Expression::Parse_term(scanner, px);
+    else
+        scanner.pushToken(t);
+    scanner.scanExpected("]");
+
+    SonicToken op;
+    scanner.getToken(op);
+    if (op != "=")
+        throw SonicParseException("waves assigned together must use '='", op);
+
+    // Names not declared anywhere are taken to be defined after 'where'.
+    px.insideWhereScope = true;
+
+    int numComponents = 0;
+    SonicParse_Expression *componentList=0, *componentTail=0;
+    scanner.scanExpected("{");
+    for (;;)
+    {
+        SonicParse_Expression *component = SonicParse_Expression::Parse_b0(scanner, px);
+        if (componentTail)
+            componentTail = componentTail->next = component;
+        else
+            componentList = componentTail = component;
+
+        ++numComponents;
+        scanner.getToken(t);
+        if (t == "}")
+            break;
+        else if (t != ",")
+            throw SonicParseException("expected ',' or '}'", t);
+    }
+
+    if (numComponents != numOutputs)
+        throw SonicParseException("need one expression for each wave assigned", t);
+
+    int numLocals = 0;
+    SonicToken localName [MAX_WHERE_LOCALS];
+    SonicParse_Expression *localList=0, *localTail=0;
+    scanner.getToken(t);
+    if (t == "where")
+    {
+        for (;;)
+        {
+            scanner.getToken(t);
+            if (t.queryTokenType() != STT_IDENTIFIER)
+                throw SonicParseException("expected name after 'where'", t);
+
+            if (numLocals == MAX_WHERE_LOCALS)
+                throw SonicParseException("too many names after 'where'", t);
+
+            localName[numLocals++] = t;
+            scanner.scanExpected("=");
+            SonicParse_Expression *value = SonicParse_Expression::Parse_b0(scanner, px);
+            if (localTail)
+                localTail = localTail->next = value;
+            else
+                localList = localTail = value;
+
+            scanner.getToken(t);
+            if (t != ",")
+            {
+                scanner.pushToken(t);
+                break;
+            }
+        }
+    }
+    else
+        scanner.pushToken(t);
+
+    px.insideWhereScope = false;
+
+    return new SonicParse_Statement_MultiAssignment(
+        op,
+        numOutputs,
+        outputName,
+        sampleLimit,
+        componentList,
+        numLocals,
+        localName,
+        localList);
+}
+
+
+
+void SonicParse_Statement::VisitList(
+    Sonic_StatementVisitor &v,
+    const SonicParse_Statement *list)
+{
+    for (const SonicParse_Statement *sp = list; sp; sp = sp->next)
+        sp->visit(v);
+}
+
 
 SonicParse_Statement *SonicParse_Statement::Parse(
     SonicScanner &scanner,
@@ -192,6 +336,11 @@ SonicParse_Statement *SonicParse_Statement::Parse(
     {
         stmt = new SonicParse_Statement_Compound(0);
     }
+    else if (t == "(")
+    {
+        stmt = SonicParse_Statement::ParseMultiAssignment(scanner, px);
+        scanner.scanExpected(";");
+    }
     else if (t.queryTokenType() == STT_IDENTIFIER)
     {
         // Get one more token to see if this is a wave expression,
@@ -233,6 +382,77 @@ SonicParse_Statement *SonicParse_Statement::Parse(
 }
 
 
+SonicParse_Statement_MultiAssignment::SonicParse_Statement_MultiAssignment(
+    const SonicToken &_op,
+    int _numOutputs,
+    const SonicToken _outputName[],
+    SonicParse_Expression *_sampleLimit,
+    SonicParse_Expression *_componentList,
+    int _numLocals,
+    const SonicToken _localName[],
+    SonicParse_Expression *_localList):
+    op(_op),
+    numOutputs(_numOutputs),
+    sampleLimit(_sampleLimit),
+    componentList(_componentList),
+    numLocals(_numLocals),
+    localList(_localList),
+    localTag(-1),
+    echo(0)
+{
+    int k;
+    for (k=0; k < numOutputs; ++k)
+        outputName[k] = _outputName[k];
+
+    for (k=0; k < numLocals; ++k)
+        localName[k] = _localName[k];
+}
+
+
+SonicParse_Statement_MultiAssignment::~SonicParse_Statement_MultiAssignment()
+{
+    DeleteString(echo);
+
+    if (sampleLimit)
+    {
+        delete sampleLimit;
+        sampleLimit = 0;
+    }
+
+    if (componentList)
+    {
+        delete componentList;
+        componentList = 0;
+    }
+
+    if (localList)
+    {
+        delete localList;
+        localList = 0;
+    }
+}
+
+
+bool SonicParse_Statement_MultiAssignment::writesWave(const SonicToken &waveName) const
+{
+    for (int k=0; k < numOutputs; ++k)
+        if (outputName[k] == waveName)
+            return true;
+
+    return false;
+}
+
+
+int SonicParse_Statement_MultiAssignment::findLocal(const SonicToken &name) const
+{
+    for (int k=0; k < numLocals; ++k)
+        if (localName[k] == name)
+            return k;
+
+    return -1;
+}
+
+
 SonicParse_Statement_For::~SonicParse_Statement_For()
 {
     if (init)
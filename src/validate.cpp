@@ -164,6 +164,10 @@ void SonicParse_Statement_Assignment::validate(
     lvalue->validate(program, func);
     rvalue->validate(program, func);
 
+    SonicParse_VarDecl *ldecl = program.findSymbol(lvalue->queryVarName(), func, true);
+    if (ldecl->queryType() == STYPE_WAVE && ldecl->queryType().queryWaveAccess() == SWA_IN)
+        throw SonicParseException("cannot assign to 'in' wave parameter", lvalue->queryVarName());
+
     SonicType ltype = lvalue->determineType(program, func);
     if (!rvalue->canConvertTo(ltype))
         throw SonicParseException("cannot convert expression to type on left side of '='", rvalue->getFirstToken());
@@ -181,6 +185,165 @@ void SonicParse_Statement_Assignment::validate(
         if (op != "=")
             throw SonicParseException("assignment operator not allowed for boolean on left", op);
     }
+
+    if (lvalue->querySampleStart())
+    {
+        // A range is patched in place, so the frames after the one being
+        // written still hold the old data; only '$' may look at them.
+
+        if (op == "<<")
+            throw SonicParseException("cannot append to a range of a wave", op);
+
+        const int maxWaveSymbols = 256;
+        const SonicToken *waveSymbol [maxWaveSymbols];
+        int numWaveSymbols = 0;
+        int numOccurrences = 0;
+        rvalue->getWaveSymbolList(waveSymbol, maxWaveSymbols, numWaveSymbols, numOccurrences);
+        for (int k=0; k < numWaveSymbols; ++k)
+        {
+            if (*waveSymbol[k] == lvalue->queryVarName())
+                throw SonicParseException("cannot read a wave while patching a range of it (use '$' for its old value)", *waveSymbol[k]);
+        }
+    }
+}
+
+
+class Sonic_ExpressionVisitor_MultiAssignment: public Sonic_ExpressionVisitor
+{
+    // Finds what a multi-output assignment's expressions may not use:
+    // a 'where' name not yet defined, '$', or any of the waves assigned.
+
+public:
+    Sonic_ExpressionVisitor_MultiAssignment(
+        const SonicParse_Statement_MultiAssignment &_stmt,
+        const SonicToken *_localName,
+        int _numDefined):
+        stmt(_stmt),
+        localName(_localName),
+        numDefined(_numDefined),
+        problem(0),
+        where(0)
+    {}
+
+    virtual void visitHook(const SonicParse_Expression *ep)
+    {
+        if (problem)
+            return;
+
+        const SonicToken &name = ep->getFirstToken();
+        switch (ep->queryExpressionType())
+        {
+        case ETYPE_LOCAL:
+            {
+                bool defined = false;
+                for (int k=0; k < numDefined && !defined; ++k)
+                    if (localName[k] == name)
+                        defined = true;
+
+                if (!defined)
+                    fail("undefined symbol", name);
+            }
+            break;
+
+        case ETYPE_OLD_DATA:
+            fail("cannot use '$' when assigning several waves", name);
+            break;
+
+        case ETYPE_WAVE_EXPR:
+        case ETYPE_WAVE_FIELD:
+        case ETYPE_VARIABLE:
+            if (stmt.writesWave(name))
+                fail("cannot use a wave while assigning it together with others", name);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    const char *queryProblem() const
+    {
+        return problem;
+    }
+    const SonicToken &queryWhere() const
+    {
+        return *where;
+    }
+
+private:
+    void fail(const char *_problem, const SonicToken &_where)
+    {
+        problem = _problem;
+        where = &_where;
+    }
+
+private:
+    const SonicParse_Statement_MultiAssignment &stmt;
+    const SonicToken *localName;
+    int numDefined;
+    const char *problem;
+    const SonicToken *where;
+};
+
+
+void SonicParse_Statement_MultiAssignment::validate(
+    SonicParse_Program &program,
+    SonicParse_Function *func)
+{
+    int k;
+    for (k=0; k < numOutputs; ++k)
+    {
+        SonicParse_VarDecl *decl = program.findSymbol(outputName[k], func, true);
+        if (decl->queryType() != STYPE_WAVE)
+            throw SonicParseException("only wave variables can be assigned together", outputName[k]);
+
+        if (decl->queryType().queryWaveAccess() == SWA_IN)
+            throw SonicParseException("cannot assign to 'in' wave parameter", outputName[k]);
+
+        for (int j=0; j < k; ++j)
+            if (outputName[j] == outputName[k])
+                throw SonicParseException("wave assigned twice in the same statement", outputName[k]);
+    }
+
+    if (sampleLimit)
+    {
+        sampleLimit->validate(program, func);
+        SonicType sltype = sampleLimit->determineType();
+        if (sltype != STYPE_REAL && sltype != STYPE_INTEGER)
+            throw SonicParseException("sample limit expression must have numeric type", sampleLimit->getFirstToken());
+    }
+
+    // Each name after 'where' can use the names before it.
+    SonicParse_Expression *ep = localList;
+    for (k=0; k < numLocals; ++k, ep = ep->queryNext())
+    {
+        if (program.findSymbol(localName[k], func, false))
+            throw SonicParseException("name after 'where' is already defined", localName[k]);
+
+        if (findLocal(localName[k]) < k)
+            throw SonicParseException("name defined twice after 'where'", localName[k]);
+
+        ep->validate(program, func);
+        if (!ep->canConvertTo(STYPE_REAL))
+            throw SonicParseException("value of name after 'where' must have numeric type", ep->getFirstToken());
+
+        Sonic_ExpressionVisitor_MultiAssignment visitor(*this, localName, k);
+        ep->visit(visitor);
+        if (visitor.queryProblem())
+            throw SonicParseException(visitor.queryProblem(), visitor.queryWhere());
+    }
+
+    for (ep = componentList; ep; ep = ep->queryNext())
+    {
+        ep->validate(program, func);
+        if (!ep->canConvertTo(STYPE_REAL))
+            throw SonicParseException("expression assigned to wave must have numeric type", ep->getFirstToken());
+
+        Sonic_ExpressionVisitor_MultiAssignment visitor(*this, localName, numLocals);
+        ep->visit(visitor);
+        if (visitor.queryProblem())
+            throw SonicParseException(visitor.queryProblem(), visitor.queryWhere());
+    }
 }
 
 
@@ -389,6 +552,23 @@ void SonicParse_Expression_WaveExpr::validate(
 }
 
 
+void SonicParse_Expression_WaveField::validate(
+    SonicParse_Program &program,
+    SonicParse_Function *func)
+{
+    SonicParse_VarDecl *decl = program.findSymbol(varName, func, true);
+    if (decl->queryType() != STYPE_WAVE)
+        throw SonicParseException("field reference requires a wave variable", varName);
+
+    if (channel)
+    {
+        channel->validate(program, func);
+        if (!channel->canConvertTo(STYPE_INTEGER))
+            throw SonicParseException("channel selector must be of numeric type", channel->getFirstToken());
+    }
+}
+
+
 void SonicParse_Expression_FunctionCall::validate(
     SonicParse_Program &program,
     SonicParse_Function *func)
@@ -440,6 +620,17 @@ void SonicParse_Expression_FunctionCall::validate(
 
                 ep->validate(program, func);
 
+                SonicType etype = ep->determineType();
+                if (etype == STYPE_WAVE &&
+                    etype.queryWaveAccess() == SWA_IN &&
+                    vp->queryType().queryWaveAccess() != SWA_IN &&
+                    called->writesWave(vp->queryName()))
+                {
+                    throw SonicParseException(
+                        "cannot pass 'in' wave to a function that writes it",
+                        ep->getFirstToken());
+                }
+
                 if (vp->queryType().isReference())
                 {
                     SonicExpressionType epExprType = ep->queryExpressionType();
@@ -557,6 +748,14 @@ void SonicParse_Lvalue::validate(
     SonicType type = decl->queryType();
     if (isWave)
     {
+        if (sampleStart)
+        {
+            sampleStart->validate(prog, func);
+            SonicType sstype = sampleStart->determineType();
+            if (sstype != STYPE_REAL && sstype != STYPE_INTEGER)
+                throw SonicParseException("sample range start must have numeric type", sampleStart->getFirstToken());
+        }
+
         if (sampleLimit)
         {
             sampleLimit->validate(prog, func);
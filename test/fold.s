@@ -0,0 +1,14 @@
+// Constant folding of integer powers:  see fold.expect.
+
+program fold ( y: wave )
+{
+    var big=0: integer;
+    var p=0: integer;
+    var q=0: real;
+
+    big = 2^63;         // too big for a long:  left for run time
+    p = 3 ^ 2 ^ 2;      // the inner power folds, then the outer one
+    p = 2 ^ -1;         // not a whole number:  left for run time
+    q = (2^3)/3;        // still divides as real numbers
+    y[c,i:r] = 0.5 * y[c,i] ^ (2 ^ 2);
+}
@@ -0,0 +1,63 @@
+/*============================================================================
+
+    ramp.cpp
+
+    Checks that SonicPhaseRamp follows x % d frame to frame with the same
+    values fmod() gives, including the frames where x crosses zero.
+
+============================================================================*/
+#include <stdio.h>
+#include <math.h>
+
+#include "sonic.h"
+
+static int NumFailures = 0;
+
+
+static double Dividend(double offset, double slope, long i)
+{
+    return offset + slope*double(i);
+}
+
+
+static void CheckPhase(const char *name, double offset, double slope, double divisor, long numFrames)
+{
+    // Use the ramp the way generated code does:  follow it when possible,
+    // otherwise anchor it to the exact value.
+    SonicPhaseRamp ramp (
+        Dividend(offset, slope, 1) - Dividend(offset, slope, 0),
+        divisor );
+
+    for (long i=0; i < numFrames; ++i)
+    {
+        const double x = Dividend(offset, slope, i);
+        const double exact = fmod(x, divisor);
+        const double value = ramp.follows(i) ? ramp.queryValue() : ramp.anchor(i, x);
+        if (fabs(value - exact) > 1.0e-9 * divisor)
+        {
+            printf("FAIL %s:  i=%ld, ramp=%0.17g, fmod=%0.17g\n", name, i, value, exact);
+            ++NumFailures;
+            return;
+        }
+    }
+
+    printf("pass %s\n", name);
+}
+
+
+int main()
+{
+    const double SampleTime = 1.0 / 44100.0;
+
+    CheckPhase("(100 - i) % 7.5", 100.0, -1.0, 7.5, 1000);
+    CheckPhase("(i - 100) % 7.5", -100.0, 1.0, 7.5, 1000);
+    CheckPhase("(t*50 - 0.01) % 0.3", -0.01, 50.0*SampleTime, 0.3, 44100);
+    CheckPhase("(0.01 - t*50) % 0.3", 0.01, -50.0*SampleTime, 0.3, 44100);
+    CheckPhase("(2.5 - i*0.25) % 1", 2.5, -0.25, 1.0, 100);
+    CheckPhase("(i*0.25 - 2.5) % 1", -2.5, 0.25, 1.0, 100);
+
+    return (NumFailures == 0) ? 0 : 1;
+}
+
+
+/*--- end of file ramp.cpp ---*/
@@ -0,0 +1,41 @@
+# Translates SOURCE with the Sonic translator SONIC and checks the C++ code
+# it generates against EXPECT.  Each line of EXPECT starting with '+' must
+# appear in the generated code, and each line starting with '-' must not.
+
+get_filename_component(name ${SOURCE} NAME_WE)
+set(workdir ${CMAKE_CURRENT_BINARY_DIR}/translate_${name})
+file(MAKE_DIRECTORY ${workdir})
+configure_file(${SOURCE} ${workdir}/${name}.s COPYONLY)
+
+execute_process(
+    COMMAND ${SONIC} ${name}.s
+    WORKING_DIRECTORY ${workdir}
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Translating ${name}.s failed:\n${output}")
+endif()
+
+file(READ ${workdir}/${name}.cpp code)
+file(STRINGS ${EXPECT} lines)
+set(failed FALSE)
+foreach(line ${lines})
+    string(SUBSTRING "${line}" 0 1 sign)
+    string(SUBSTRING "${line}" 1 -1 text)
+    if(sign STREQUAL "+" OR sign STREQUAL "-")
+        string(FIND "${code}" "${text}" where)
+        if(sign STREQUAL "+" AND where EQUAL -1)
+            message(SEND_ERROR "missing from ${name}.cpp:  ${text}")
+            set(failed TRUE)
+        elseif(sign STREQUAL "-" AND NOT where EQUAL -1)
+            message(SEND_ERROR "unexpected in ${name}.cpp:  ${text}")
+            set(failed TRUE)
+        endif()
+    endif()
+endforeach()
+
+if(failed)
+    message(FATAL_ERROR "${name}.cpp does not match ${EXPECT}")
+endif()